@@ -10,6 +10,19 @@ VIS_HIDDEN		= 2
 VIS_PROTECTED		= 3
 VIS_STATIC		= 100
 
+# CPU features of function variants, named "<function>.<feature>[.<feature>]"
+# in patch (see X86_FEATURE_* in patcher/include/x86_64.h)
+CPU_FEATURES		= {
+	"sse4_2":	1 << 0,
+	"avx":		1 << 1,
+	"avx2":		1 << 2,
+	"fma":		1 << 3,
+	"bmi2":		1 << 4,
+	"avx512f":	1 << 5,
+	"avx512bw":	1 << 6,
+	"avx512vl":	1 << 7,
+}
+
 class RAW(object):
 	pass
 
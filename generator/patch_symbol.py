@@ -273,6 +273,17 @@ def get_symbol(kind, visibility, **kw):
 	cl = cl_map[(visibility, kind)]
 	return cl(**kw)
 
+def variant_features(name):
+	# Function variant is named "<function>.<feature>[.<feature>]"
+	parts = name.split(".")
+	if len(parts) < 2 or not all(p in CPU_FEATURES for p in parts[1:]):
+		return None
+
+	features = 0
+	for p in parts[1:]:
+		features |= CPU_FEATURES[p]
+	return parts[0], features
+
 def read_patch(elf):
 	di = debuginfo.get_debug_info(elf)
 
@@ -300,6 +311,9 @@ def read_patch(elf):
 			continue
 		if IGNORED_SYM_RE.match(elf_sym.name):
 			continue
+		# Variants are bound to their functions in resolve()
+		if variant_features(elf_sym.name):
+			continue
 
 		if elf_sym.entry.st_shndx == STR.SHN_UNDEF:
 			assert elf_sym.name not in undef_sym_names
@@ -653,9 +667,28 @@ class DefSymTab(object):
 		return sec_idx_set.pop()
 		
 
+def read_variants(patch_elf):
+	variants = collections.defaultdict(list)
+
+	for sym in get_symtab(patch_elf).iter_symbols():
+		if sym.entry.st_info.type != STR.STT_FUNC:
+			continue
+		if sym.entry.st_shndx == STR.SHN_UNDEF:
+			continue
+
+		variant = variant_features(sym.name)
+		if not variant:
+			continue
+
+		name, features = variant
+		variants[name].append((sym.entry.st_value, features))
+
+	return variants
+
 def resolve(target_elf, patch_elf):
 	patch_syms = read_patch(patch_elf)
 	target_symtab = DefSymTab(target_elf)
+	variants = read_variants(patch_elf)
 	bp = binpatch_pb2.BinPatch()
 
 	for sym in patch_syms:
@@ -668,7 +701,7 @@ def resolve(target_elf, patch_elf):
 				print("{} is not defined in target, skipping".format(sym))
 				continue
 
-			bp.func_jumps.add(
+			fj = bp.func_jumps.add(
 				name		= sym.target_name,
 				func_value	= addr,
 				func_size	= target_symtab.get_size(addr),
@@ -676,6 +709,14 @@ def resolve(target_elf, patch_elf):
 				patch_value	= sym.elf_sym.entry.st_value,
 			)
 
+			for value, features in variants.get(sym.elf_sym.name, []):
+				print("{}: variant at {:#x} for CPU features {:#x}".format(
+					sym, value, features))
+				fj.variants.add(
+					patch_value	= value,
+					features	= features,
+				)
+
 		elif sym.kind == SYM_REF:
 			assert sym.elf_sym.tab == ELF_TAB_DYN
 
@@ -0,0 +1,72 @@
+#ifndef NSB_LIBRARY_INCL
+#define NSB_LIBRARY_INCL
+
+#include <sys/types.h>
+
+/*
+ * nsb library API.
+ *
+ * Session is a process to be patched. Operations on one session have to be
+ * serialized by the caller, while sessions of different processes can be
+ * used from different threads concurrently. There is no global state besides the
+ * cache of parsed ELF files, which is shared by all the open sessions.
+ *
+ * Functions return 0 on success and non-zero (negative errno where known)
+ * on failure.
+ */
+
+struct nsb_session;
+struct nsb_patch;
+
+/* Session flags */
+#define NSB_DRY_RUN		(1 << 0)	/* Don't change the process */
+#define NSB_NO_PLUGIN		(1 << 1)	/* Don't inject service plugin */
+#define NSB_REWRITE_CALLS	(1 << 2)	/* Retarget direct calls */
+#define NSB_REDIRECT_GOT	(1 << 3)	/* Set PLT slots of all objects */
+#define NSB_REDIRECT_POINTERS	(1 << 4)	/* Set function pointers in data */
+#define NSB_IN_PLACE		(1 << 5)	/* Copy small bodies in place */
+#define NSB_RELAX_GOT		(1 << 6)	/* Access resolved symbols directly */
+#define NSB_MAP_SERVICE		(1 << 7)	/* Map plugin without dlopen */
+#define NSB_PRECOMPUTE		(1 << 8)	/* Plan before stopping process */
+
+int nsb_open(pid_t pid, unsigned int flags, struct nsb_session **session);
+void nsb_close(struct nsb_session *session);
+
+/*
+ * Patch belongs to the session and is released by nsb_close().
+ */
+int nsb_load_patch(struct nsb_session *session, const char *path,
+		   struct nsb_patch **patch);
+const char *nsb_patch_build_id(const struct nsb_patch *patch);
+
+/*
+ * Computes apply plan without stopping the process. Next nsb_apply() for the
+ * patch executes the plan, so the process is stopped only to validate and
+ * write it.
+ */
+int nsb_plan(struct nsb_session *session, struct nsb_patch *patch);
+
+int nsb_apply(struct nsb_session *session, struct nsb_patch *patch);
+int nsb_revert(struct nsb_session *session, struct nsb_patch *patch);
+
+/*
+ * Applies and reverts sets of patches in one process stop. Either all the
+ * changes are made, or none.
+ */
+int nsb_apply_set(struct nsb_session *session,
+		  struct nsb_patch * const *apply, int nr_apply,
+		  struct nsb_patch * const *revert, int nr_revert);
+
+/*
+ * Returns 1 if patch is applied, 0 if it's not.
+ */
+int nsb_check(struct nsb_session *session, struct nsb_patch *patch);
+
+/*
+ * Sets calling thread messages and log descriptors and log level (0-4).
+ * Negative descriptor means process default: messages go to stdout, and log
+ * is discarded. Pass a descriptor of /dev/null as msgfd to silence messages.
+ */
+void nsb_set_log(int msgfd, int logfd, unsigned int loglevel);
+
+#endif /* NSB_LIBRARY_INCL */
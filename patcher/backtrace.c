@@ -1,6 +1,7 @@
 /* Inspired by libunwind: ./tests/test-ptrace.c */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <errno.h>
 #include <libunwind-ptrace.h>
 
@@ -8,6 +9,7 @@
 #include "include/xmalloc.h"
 #include "include/backtrace.h"
 #include "include/context.h"
+#include "include/x86_64.h"
 
 #define MAX_DEPTH	64
 
@@ -70,6 +72,102 @@ void destroy_backtrace(struct backtrace_s *bt)
 	free(bt);
 }
 
+/*
+ * Timed calls (canary and probe) have the return address replaced with the
+ * return hook, which has no unwind info. When read from the stack, the hook
+ * is replaced with the address, saved in its frames table, and is added to
+ * the backtrace: calls in progress return via its code.
+ */
+struct bt_hooks {
+	const uint64_t		*hooks;
+	size_t			nr_hooks;
+	uint64_t		passed[MAX_DEPTH];
+	int			nr_passed;
+};
+
+static __thread struct bt_hooks *bt_hooks;
+
+static bool bt_hook(const struct bt_hooks *bh, uint64_t addr)
+{
+	size_t i;
+
+	for (i = 0; i < bh->nr_hooks; i++)
+		if (bh->hooks[i] == addr)
+			return true;
+	return false;
+}
+
+static void bt_pass_hook(struct bt_hooks *bh, uint64_t hook)
+{
+	int i;
+
+	for (i = 0; i < bh->nr_passed; i++)
+		if (bh->passed[i] == hook)
+			return;
+
+	if (bh->nr_passed < ARRAY_SIZE(bh->passed))
+		bh->passed[bh->nr_passed++] = hook;
+}
+
+static int bt_access_mem(unw_addr_space_t as, unw_word_t addr,
+			 unw_word_t *valp, int write, void *arg)
+{
+	struct bt_hooks *bh = bt_hooks;
+	unw_word_t frame, sp;
+	size_t nr = 0;
+	int ret;
+
+	ret = _UPT_access_mem(as, addr, valp, write, arg);
+	if (ret || write || !bh)
+		return ret;
+
+	/* Call can be timed by several hooks (tail calls) */
+	while (bt_hook(bh, *valp) && (nr++ < bh->nr_hooks)) {
+		frame = x86_64_timer_frame(*valp, addr);
+
+		ret = _UPT_access_mem(as, frame +
+				      offsetof(struct x86_64_timer_frame, sp),
+				      &sp, 0, arg);
+		if (ret)
+			return ret;
+
+		if (sp != addr) {
+			pr_warn("no timed call frame for %#lx at %#lx\n",
+					*valp, addr);
+			return -UNW_EINVAL;
+		}
+
+		bt_pass_hook(bh, *valp);
+
+		ret = _UPT_access_mem(as, frame +
+				      offsetof(struct x86_64_timer_frame, ret),
+				      valp, 0, arg);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int bt_add_passed_hooks(struct backtrace_s *bt)
+{
+	struct bt_hooks *bh = bt_hooks;
+	struct backtrace_frame_s *bf;
+
+	if (!bh)
+		return 0;
+
+	while (bh->nr_passed) {
+		bf = create_frame(bh->passed[--bh->nr_passed], 0, 0,
+				  "timer hook");
+		if (!bf)
+			return -ENOMEM;
+
+		list_add_tail(&bf->list, &bt->calls);
+		bt->depth++;
+	}
+	return 0;
+}
+
 static int do_backtrace(unw_cursor_t *c, struct backtrace_s *bt)
 {
 	unw_word_t ip, sp, off;
@@ -132,6 +230,10 @@ static int do_backtrace(unw_cursor_t *c, struct backtrace_s *bt)
 
 		list_add_tail(&bf->list, &bt->calls);
 		bt->depth++;
+
+		ret = bt_add_passed_hooks(bt);
+		if (ret)
+			goto free_backtrace;
 	}
 	return 0;
 
@@ -140,13 +242,19 @@ free_backtrace:
 	return ret;
 }
 
-int pid_backtrace(pid_t pid, struct backtrace_s **backtrace)
+int pid_backtrace(pid_t pid, const uint64_t *hooks, size_t nr_hooks,
+		  struct backtrace_s **backtrace)
 {
 	int err = -EFAULT;
 	void *ui;
-	static unw_addr_space_t as;
+	unw_addr_space_t as;
+	unw_accessors_t accessors = _UPT_accessors;
 	unw_cursor_t c;
 	struct backtrace_s *bt;
+	struct bt_hooks bh = {
+		.hooks = hooks,
+		.nr_hooks = nr_hooks,
+	};
 
 	bt = xzalloc(sizeof(*bt));
 	if (!bt)
@@ -154,7 +262,9 @@ int pid_backtrace(pid_t pid, struct backtrace_s **backtrace)
 
 	INIT_LIST_HEAD(&bt->calls);
 
-	as = unw_create_addr_space (&_UPT_accessors, 0);
+	accessors.access_mem = bt_access_mem;
+
+	as = unw_create_addr_space (&accessors, 0);
 	if (!as) {
 		pr_err("unw_create_addr_space() failed\n");
 		goto free_bt;
@@ -173,7 +283,9 @@ int pid_backtrace(pid_t pid, struct backtrace_s **backtrace)
 	}
 
 
+	bt_hooks = nr_hooks ? &bh : NULL;
 	err = do_backtrace(&c, bt);
+	bt_hooks = NULL;
 	if (err)
 		goto destroy_ui;
 
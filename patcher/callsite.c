@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+
+#include "include/callsite.h"
+#include "include/context.h"
+#include "include/process.h"
+#include "include/dl_map.h"
+#include "include/elf.h"
+#include "include/x86_64.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/*
+ * Direct calls to patched functions are found in the target ELF file, not in
+ * the process: file always contains original call targets, so the same sites
+ * are found on apply and on revert, and nothing has to be stored in the
+ * process.
+ * Each "call rel32" opcode, pointing to a patched function, is only a
+ * candidate. It's accepted, if linear sweep from the start of the containing
+ * function reaches it on instruction boundary.
+ */
+struct call_scan {
+	const struct patch_info_s	*pi;
+	const struct elf_func		*funcs;
+	size_t				nr_funcs;
+	size_t				nr_sites;
+};
+
+#define CALL_REL32_SIZE		5
+
+static const struct elf_func *call_scan_func(const struct call_scan *cs,
+					     uint64_t addr)
+{
+	const struct elf_func *fn;
+	size_t lo = 0, hi = cs->nr_funcs, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cs->funcs[mid].value <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+
+	fn = &cs->funcs[lo - 1];
+	if (addr + CALL_REL32_SIZE > fn->value + fn->size)
+		return NULL;
+	return fn;
+}
+
+static int call_site_confirmed(const struct call_scan *cs, uint64_t sec_addr,
+			       const uint8_t *code, size_t size, uint64_t addr)
+{
+	const struct elf_func *fn;
+	struct x86_insn insn;
+	uint64_t ip, end;
+	int len;
+
+	fn = call_scan_func(cs, addr);
+	if (!fn || (fn->value < sec_addr))
+		return 0;
+
+	end = fn->value + fn->size;
+	if (end > sec_addr + size)
+		end = sec_addr + size;
+
+	for (ip = fn->value; ip <= addr; ip += len) {
+		len = x86_insn_decode(code + (ip - sec_addr), end - ip, &insn);
+		if (len < 0)
+			return 0;
+		if (ip + insn.opcode_off == addr)
+			return !insn.map && (insn.opcode == X86_CALL_REL32);
+	}
+	return 0;
+}
+
+/* Calls in the beginning of patched functions are overwritten by jumps */
+static int call_site_overwritten(const struct patch_info_s *pi, uint64_t addr)
+{
+	int i;
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		const struct func_jump_s *fj = pi->func_jumps[i];
+
+		if ((addr < fj->func_value + sizeof(fj->func_jump)) &&
+		    (addr + CALL_REL32_SIZE > fj->func_value))
+			return 1;
+	}
+	return 0;
+}
+
+static struct func_jump_s *call_site_func_jump(const struct patch_info_s *pi,
+					       uint64_t dest)
+{
+	int i;
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		if (pi->func_jumps[i]->func_value == dest)
+			return pi->func_jumps[i];
+	}
+	return NULL;
+}
+
+static int scan_exec_section(uint64_t addr, const uint8_t *code, size_t size,
+			     void *data)
+{
+	struct call_scan *cs = data;
+	struct func_jump_s *fj;
+	const uint8_t *op;
+	size_t off = 0;
+
+	while (off + CALL_REL32_SIZE <= size) {
+		uint64_t site;
+		int32_t rel;
+
+		op = memchr(code + off, X86_CALL_REL32,
+			    size - CALL_REL32_SIZE + 1 - off);
+		if (!op)
+			break;
+
+		off = op - code + 1;
+		site = addr + (op - code);
+		memcpy(&rel, op + 1, sizeof(rel));
+
+		fj = call_site_func_jump(cs->pi, site + CALL_REL32_SIZE + rel);
+		if (!fj)
+			continue;
+
+		if (call_site_overwritten(cs->pi, site))
+			continue;
+
+		if (!call_site_confirmed(cs, addr, code, size, site))
+			continue;
+
+		if (xrealloc_safe(&fj->call_sites,
+				  sizeof(*fj->call_sites) * (fj->nr_call_sites + 1)))
+			return -ENOMEM;
+
+		fj->call_sites[fj->nr_call_sites++] = site;
+		cs->nr_sites++;
+	}
+	return 0;
+}
+
+int patch_collect_call_sites(struct patch_s *p)
+{
+	struct elf_info_s *ei = p->target_dlm->ei;
+	struct elf_func *funcs = NULL;
+	struct call_scan cs = {
+		.pi = &p->pi,
+	};
+	ssize_t nr;
+	int err;
+
+	if (p->call_sites_collected)
+		return 0;
+
+	nr = elf_functions(ei, &funcs);
+	if (nr < 0) {
+		if (nr != -ENOENT)
+			return nr;
+		/* No function bounds: calls can't be found reliably */
+		nr = 0;
+	}
+
+	cs.funcs = funcs;
+	cs.nr_funcs = nr;
+
+	err = nr ? elf_iterate_exec_sections(ei, scan_exec_section, &cs) : 0;
+	free(funcs);
+	if (err)
+		return err;
+
+	pr_debug("  Found %lu direct calls to patched functions in %s\n",
+			cs.nr_sites, elf_path(ei));
+
+	p->call_sites_collected = 1;
+	return 0;
+}
+
+/*
+ * Call site is changed only if it still calls "from": sites of stacked
+ * patches point to the top most one, and sites could be left untouched.
+ * Returns the number of changed sites.
+ */
+int retarget_call_sites(struct process_ctx_s *ctx, const struct patch_s *p,
+			const struct func_jump_s *fj,
+			uint64_t from, uint64_t to)
+{
+	uint64_t base = dlm_load_base(p->target_dlm);
+	int i, err, nr = 0;
+
+	for (i = 0; i < fj->nr_call_sites; i++) {
+		uint64_t call = base + fj->call_sites[i];
+		uint64_t next_ip = call + CALL_REL32_SIZE;
+		uint8_t bytes[8];
+		int32_t rel;
+
+		/* Process is written by words */
+		err = process_read_data(ctx, call + 1, bytes, sizeof(bytes));
+		if (err)
+			return err;
+
+		memcpy(&rel, bytes, sizeof(rel));
+		if (next_ip + rel != from)
+			continue;
+
+		err = x86_rel32_offset(next_ip, to, &rel);
+		if (err)
+			return err;
+
+		pr_info("      call: %#lx ---> %#lx\n", call, to);
+		nr++;
+
+		if (ctx->dry_run)
+			continue;
+
+		memcpy(bytes, &rel, sizeof(rel));
+		err = process_write_data(ctx, call + 1, bytes, sizeof(bytes));
+		if (err)
+			return err;
+	}
+	return nr;
+}
+
+static int add_slot(uint64_t **slots, size_t *nr_slots, uint64_t slot)
+{
+	if (xrealloc_safe(slots, sizeof(**slots) * (*nr_slots + 1)))
+		return -ENOMEM;
+
+	(*slots)[(*nr_slots)++] = slot;
+	return 0;
+}
+
+/*
+ * PLT slots of all the loaded objects, bound to patched functions, are
+ * redirected to the new functions. Slots are found by relocation symbol
+ * name, and only the ones, which hold the expected address, are changed:
+ * symbol could be bound to another object, or not bound yet (lazy binding).
+ * GLOB_DAT slots are left untouched: they are also used to take function
+ * address, and the old one could be already stored and compared with.
+ */
+struct got_scan {
+	const struct patch_info_s	*pi;
+	const struct dl_map		*dlm;
+	size_t				nr_slots;
+};
+
+static int collect_got_slot(const struct elf_dyn_reloc *r, void *data)
+{
+	struct got_scan *gs = data;
+	const struct patch_info_s *pi = gs->pi;
+	struct func_jump_s *fj;
+	int i, err;
+
+	if ((r->type != R_X86_64_JUMP_SLOT) || !r->name)
+		return 0;
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		fj = pi->func_jumps[i];
+
+		if (strcmp(fj->name, r->name))
+			continue;
+
+		err = add_slot(&fj->got_slots, &fj->nr_got_slots,
+			       dlm_load_base(gs->dlm) + r->offset);
+		if (err)
+			return err;
+
+		gs->nr_slots++;
+		break;
+	}
+	return 0;
+}
+
+int patch_collect_got_slots(struct process_ctx_s *ctx, struct patch_s *p)
+{
+	struct got_scan gs = {
+		.pi = &p->pi,
+	};
+	const struct dl_map *dlm;
+	int err;
+
+	if (p->got_slots_collected)
+		return 0;
+
+	list_for_each_entry(dlm, &ctx->dl_maps, list) {
+		if (!dlm->exec_vma)
+			continue;
+
+		gs.dlm = dlm;
+		err = elf_iterate_dyn_relocs(dlm->ei, collect_got_slot, &gs);
+		if (err) {
+			pr_err("failed to collect PLT slots of %s\n", dlm->path);
+			return err;
+		}
+	}
+
+	pr_debug("  Found %lu PLT slots for patched functions\n", gs.nr_slots);
+
+	p->got_slots_collected = 1;
+	return 0;
+}
+
+/*
+ * Function pointers in target data (vtables, callback tables, init arrays,
+ * etc) are found by the target dynamic relocations: R_X86_64_RELATIVE with
+ * the function value as addend, or R_X86_64_64 against the function symbol.
+ * Code, taking function address, still gets the old one: pointers,
+ * compared with such addresses, won't match anymore.
+ */
+struct ptr_scan {
+	const struct patch_info_s	*pi;
+	uint64_t			base;
+	size_t				nr_ptrs;
+};
+
+static int collect_data_pointer(const struct elf_dyn_reloc *r, void *data)
+{
+	struct ptr_scan *ps = data;
+	struct func_jump_s *fj;
+	uint64_t value;
+	int err;
+
+	switch (r->type) {
+		case R_X86_64_RELATIVE:
+			value = r->addend;
+			break;
+		case R_X86_64_64:
+			if (!r->defined)
+				return 0;
+			value = r->value + r->addend;
+			break;
+		default:
+			return 0;
+	}
+
+	fj = call_site_func_jump(ps->pi, value);
+	if (!fj)
+		return 0;
+
+	err = add_slot(&fj->data_ptrs, &fj->nr_data_ptrs, ps->base + r->offset);
+	if (err)
+		return err;
+
+	ps->nr_ptrs++;
+	return 0;
+}
+
+int patch_collect_data_pointers(struct patch_s *p)
+{
+	struct ptr_scan ps = {
+		.pi = &p->pi,
+		.base = dlm_load_base(p->target_dlm),
+	};
+	int err;
+
+	if (p->data_ptrs_collected)
+		return 0;
+
+	/* Position dependent executable has no relocations for pointers */
+	if (elf_type_dyn(p->target_dlm->ei)) {
+		err = elf_iterate_dyn_relocs(p->target_dlm->ei,
+					     collect_data_pointer, &ps);
+		if (err) {
+			pr_err("failed to collect function pointers of %s\n",
+					p->target_dlm->path);
+			return err;
+		}
+	}
+
+	pr_debug("  Found %lu pointers to patched functions\n", ps.nr_ptrs);
+
+	p->data_ptrs_collected = 1;
+	return 0;
+}
+
+static int retarget_slots(struct process_ctx_s *ctx,
+			  const uint64_t *slots, size_t nr_slots,
+			  uint64_t from, uint64_t to, const char *what)
+{
+	int i, err, nr = 0;
+
+	for (i = 0; i < nr_slots; i++) {
+		uint64_t value;
+
+		err = process_read_data(ctx, slots[i], &value, sizeof(value));
+		if (err)
+			return err;
+
+		if (value != from)
+			continue;
+
+		pr_info("      %s: %#lx ---> %#lx\n", what, slots[i], to);
+		nr++;
+
+		if (ctx->dry_run)
+			continue;
+
+		err = process_write_data(ctx, slots[i], &to, sizeof(to));
+		if (err)
+			return err;
+	}
+	return nr;
+}
+
+int retarget_got_slots(struct process_ctx_s *ctx, const struct func_jump_s *fj,
+		       uint64_t from, uint64_t to)
+{
+	return retarget_slots(ctx, fj->got_slots, fj->nr_got_slots,
+			      from, to, "got ");
+}
+
+int retarget_data_pointers(struct process_ctx_s *ctx,
+			   const struct func_jump_s *fj,
+			   uint64_t from, uint64_t to)
+{
+	return retarget_slots(ctx, fj->data_ptrs, fj->nr_data_ptrs,
+			      from, to, "ptr ");
+}
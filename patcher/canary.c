@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/user.h>
+
+#include "include/canary.h"
+#include "include/context.h"
+#include "include/process.h"
+#include "include/dl_map.h"
+#include "include/vma.h"
+#include "include/inplace.h"
+#include "include/x86_64.h"
+#include "include/compiler.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/*
+ * In canary mode function jumps lead to per function thunks, instead of the
+ * new functions. Thunk loads function descriptor and enters the dispatcher,
+ * which sends the configured share of calls to the new function and the rest
+ * to the copy of the old one (the old body can't be used, its entry is
+ * overwritten by the jump). Calls (and cycles, if timing is on) are counted
+ * per path in shared memory, so they can be read and the share can be
+ * changed with "nsb canary" without stopping the process. The code is
+ * private to the process and is written with ptrace.
+ */
+
+#define X86_LEA_R11		"\x4c\x8d\x1d"
+#define X86_JMP_REL32		0xe9
+#define X86_INT3		0xcc
+
+static void canary_path(char *path, size_t size, pid_t pid, const char *bid)
+{
+	snprintf(path, size, "/dev/shm/nsb-canary-%d-%s", pid, bid);
+}
+
+static uint32_t canary_ratio(int percent)
+{
+	return (uint64_t)percent * CANARY_RATIO_MAX / 100;
+}
+
+static uint64_t canary_thunk(uint64_t code, int idx)
+{
+	return code + CANARY_THUNKS_OFFSET + idx * CANARY_THUNK_SIZE;
+}
+
+static uint64_t canary_desc(uint64_t code, int idx)
+{
+	return code + CANARY_DESCS_OFFSET + idx * sizeof(struct canary_desc);
+}
+
+static int canary_retarget(struct patch_s *p, uint64_t code)
+{
+	const struct patch_info_s *pi = &p->pi;
+	ssize_t size;
+	int i;
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		struct func_jump_s *fj = pi->func_jumps[i];
+
+		size = x86_jmpq_instruction(fj->func_jump, sizeof(fj->func_jump),
+					    fj->func_addr, canary_thunk(code, i));
+		if (size < 0)
+			return size;
+	}
+	return 0;
+}
+
+static void canary_write_thunk(uint8_t *thunk, uint64_t addr,
+			       uint64_t desc, uint64_t dispatch)
+{
+	int32_t rel;
+
+	memset(thunk, X86_INT3, CANARY_THUNK_SIZE);
+
+	/* lea desc(%rip),%r11 */
+	memcpy(thunk, X86_LEA_R11, 3);
+	rel = desc - (addr + 7);
+	memcpy(thunk + 3, &rel, sizeof(rel));
+
+	/* jmp dispatch */
+	thunk[7] = X86_JMP_REL32;
+	rel = dispatch - (addr + 12);
+	memcpy(thunk + 8, &rel, sizeof(rel));
+}
+
+/*
+ * Old function copy is taken from the process: the function must not be
+ * patched yet (neither by jump, nor in place).
+ */
+static int canary_copy_func(const struct process_ctx_s *ctx,
+			    const struct func_jump_s *fj,
+			    uint8_t *code, uint64_t addr)
+{
+	int err;
+
+	if (fj->func_size < sizeof(fj->code)) {
+		pr_err("function \"%s\" is too small for canary\n", fj->name);
+		return -ENOTSUP;
+	}
+
+	err = process_read_data(ctx, fj->func_addr, code, fj->func_size);
+	if (err)
+		return err;
+
+	if (memcmp(code, fj->code, sizeof(fj->code))) {
+		pr_err("function \"%s\" is already patched\n", fj->name);
+		return -EBUSY;
+	}
+
+	err = relocate_code(fj->name, code, fj->func_size, fj->func_addr, addr);
+	if (err) {
+		pr_err("failed to copy function \"%s\": %d\n", fj->name, err);
+		return err;
+	}
+	return 0;
+}
+
+static int canary_build(const struct process_ctx_s *ctx,
+			const struct patch_s *p, struct canary_shm *shm,
+			uint8_t *buf, uint64_t addr, int percent)
+{
+	const struct patch_info_s *pi = &p->pi;
+	uint64_t code = addr + CANARY_CODE_OFFSET;
+	uint64_t copy = CANARY_THUNKS_OFFSET + pi->n_func_jumps * CANARY_THUNK_SIZE;
+	int i, err;
+
+	BUILD_BUG_ON(sizeof(struct canary_func) != 128);
+	BUILD_BUG_ON(offsetof(struct canary_shm, funcs) != 128);
+	BUILD_BUG_ON(CANARY_SHM_SIZE % PAGE_SIZE);
+	BUILD_BUG_ON(X86_64_CANARY_SIZE > CANARY_DESCS_OFFSET);
+	BUILD_BUG_ON(CANARY_DESCS_OFFSET + CANARY_MAX_FUNCS *
+		     sizeof(struct canary_desc) > CANARY_THUNKS_OFFSET);
+
+	shm->magic = CANARY_MAGIC;
+	shm->nr_funcs = pi->n_func_jumps;
+	shm->code = code;
+
+	x86_64_canary(buf);
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		const struct func_jump_s *fj = pi->func_jumps[i];
+		struct canary_func *cf = &shm->funcs[i];
+		struct canary_desc *cd;
+		uint64_t thunk = canary_thunk(code, i);
+		uint64_t desc = canary_desc(code, i);
+
+		err = canary_copy_func(ctx, fj, buf + copy, code + copy);
+		if (err)
+			return err;
+
+		cd = (void *)(buf + desc - code);
+		cd->target[0] = code + copy;
+		cd->target[1] = fj->patch_addr;
+		cd->func = addr + offsetof(struct canary_shm, funcs[i]);
+
+		cf->ratio = canary_ratio(percent);
+		cf->timing = ctx->opts.canary_timing;
+		strncpy(cf->name, fj->name, sizeof(cf->name) - 1);
+
+		canary_write_thunk(buf + thunk - code, thunk, desc,
+				   code + X86_64_CANARY_DISPATCH);
+
+		pr_info("  - Function \"%s\":\n", fj->name);
+		pr_info("      thunk: %#lx, old copy: %#lx, new: %#lx\n",
+				thunk, cd->target[0], cd->target[1]);
+
+		copy += round_up(fj->func_size, 16);
+	}
+	return 0;
+}
+
+static size_t canary_size(const struct patch_s *p)
+{
+	const struct patch_info_s *pi = &p->pi;
+	size_t size = CANARY_THUNKS_OFFSET;
+	int i;
+
+	size += pi->n_func_jumps * CANARY_THUNK_SIZE;
+	for (i = 0; i < pi->n_func_jumps; i++)
+		size += round_up(pi->func_jumps[i]->func_size, 16);
+
+	return CANARY_CODE_OFFSET + round_up(size, PAGE_SIZE);
+}
+
+int canary_setup(struct process_ctx_s *ctx, struct patch_s *p, int percent)
+{
+	const struct dl_map *target_dlm = p->target_dlm;
+	char path[PATH_MAX];
+	size_t size = canary_size(p);
+	struct canary_shm *shm;
+	uint8_t *buf;
+	int64_t addr;
+	int fd = -1, err;
+
+	pr_info("= Setup canary dispatch (%d%% to new functions%s):\n", percent,
+			ctx->opts.canary_timing ? ", timed" : "");
+
+	if (ctx->plan) {
+		pr_err("canary can't be used with apply plan\n");
+		return -ENOTSUP;
+	}
+
+	if (p->pi.n_func_jumps > CANARY_MAX_FUNCS) {
+		pr_err("too many functions for canary: %ld (max %d)\n",
+				p->pi.n_func_jumps, CANARY_MAX_FUNCS);
+		return -E2BIG;
+	}
+
+	addr = process_find_place_for_elf(ctx, dl_map_jump_hint(target_dlm), size);
+	if (addr < 0) {
+		pr_err("failed to find place for canary of size %#lx\n", size);
+		return addr;
+	}
+
+	if (dl_map_check_jump_range(target_dlm, addr) ||
+	    dl_map_check_jump_range(target_dlm, addr + size)) {
+		pr_err("canary place %#lx-%#lx is out of jump range\n",
+				addr, addr + size);
+		return -ERANGE;
+	}
+
+	shm = xzalloc(CANARY_SHM_SIZE);
+	if (!shm)
+		return -ENOMEM;
+
+	err = -ENOMEM;
+	buf = xzalloc(size - CANARY_CODE_OFFSET);
+	if (!buf)
+		goto free_shm;
+
+	err = canary_build(ctx, p, shm, buf, addr, percent);
+	if (err)
+		goto free_buf;
+
+	canary_path(path, sizeof(path), ctx->pid, p->pi.patch_bid);
+	pr_info("  shared memory: %s\n", path);
+
+	if (!ctx->dry_run) {
+		fd = process_create_shm(ctx, path, CANARY_SHM_SIZE);
+		if (fd < 0) {
+			err = fd;
+			goto free_buf;
+		}
+
+		if (write(fd, shm, CANARY_SHM_SIZE) != CANARY_SHM_SIZE) {
+			pr_perror("failed to write %s", path);
+			err = -EIO;
+			goto unlink;
+		}
+	}
+
+	err = process_mmap_shm(ctx, path, fd, addr, CANARY_SHM_SIZE,
+			       CANARY_CODE_OFFSET, size);
+	if (err) {
+		pr_err("failed to map canary into process %d\n", ctx->pid);
+		goto unlink;
+	}
+
+	if (!ctx->dry_run) {
+		err = process_write_data(ctx, addr + CANARY_CODE_OFFSET, buf,
+					 size - CANARY_CODE_OFFSET);
+		if (err) {
+			pr_err("failed to write canary code\n");
+			goto unlink;
+		}
+	}
+
+	p->canary_code = addr + CANARY_CODE_OFFSET;
+	p->canary_end = addr + size;
+
+	err = canary_retarget(p, p->canary_code);
+	goto close_fd;
+
+unlink:
+	if (!ctx->dry_run)
+		unlink(path);
+close_fd:
+	if (fd >= 0)
+		close(fd);
+free_buf:
+	free(buf);
+free_shm:
+	free(shm);
+	return err;
+}
+
+/*
+ * Canary code is found by shared memory name: patch can be applied by
+ * another nsb run. The code is the anonymous mapping at the fixed offset
+ * from the counters.
+ */
+int canary_find(const struct process_ctx_s *ctx, struct patch_s *p)
+{
+	const struct vma_area *vma, *code;
+	char path[PATH_MAX];
+
+	canary_path(path, sizeof(path), ctx->pid, p->pi.patch_bid);
+
+	list_for_each_entry(vma, &ctx->vmas, list) {
+		if (!vma->path || strcmp(vma->path, path))
+			continue;
+		if (vma_offset(vma) != 0)
+			continue;
+
+		code = find_vma(&ctx->vmas, vma_start(vma) + CANARY_CODE_OFFSET);
+		if (!code || code->path ||
+		    (vma_start(code) != vma_start(vma) + CANARY_CODE_OFFSET) ||
+		    !(vma_prot(code) & PROT_EXEC)) {
+			pr_err("no canary code for %s\n", path);
+			return -EINVAL;
+		}
+
+		pr_info("  canary: %#lx-%#lx\n", vma_start(code), vma_end(code));
+		p->canary_code = vma_start(code);
+		p->canary_end = vma_end(code);
+		return canary_retarget(p, p->canary_code);
+	}
+	return 0;
+}
+
+/*
+ * Calls, timed by the dispatcher, return via its code: it has to be out of
+ * the stacks, as well as old function copies.
+ */
+int canary_check_stack(const struct process_ctx_s *ctx, const struct patch_s *p)
+{
+	if (!p->canary_code)
+		return 0;
+
+	return process_check_range(ctx, p->canary_code, p->canary_end);
+}
+
+int canary_unload(struct process_ctx_s *ctx, const struct patch_s *p)
+{
+	uint64_t start = p->canary_code - CANARY_CODE_OFFSET;
+	char path[PATH_MAX];
+	int err;
+
+	if (!p->canary_code)
+		return 0;
+
+	canary_path(path, sizeof(path), ctx->pid, p->pi.patch_bid);
+	pr_info("= Unloading canary %s:\n", path);
+
+	err = process_munmap_shm(ctx, path, start, p->canary_end - start);
+	if (!err && !ctx->dry_run && unlink(path))
+		pr_warn("failed to remove %s: %d\n", path, errno);
+	return err;
+}
+
+static void canary_print(const struct canary_shm *shm)
+{
+	uint32_t i;
+
+	for (i = 0; i < shm->nr_funcs; i++) {
+		const struct canary_func *cf = &shm->funcs[i];
+		int path;
+
+		pr_msg("  %.*s: %u%% to new\n", (int)sizeof(cf->name),
+				cf->name,
+				(unsigned)((uint64_t)cf->ratio * 100 /
+					   CANARY_RATIO_MAX));
+		for (path = 1; path >= 0; path--)
+			pr_msg("    %s: %lu calls, %lu cycles per call "
+			       "(%lu timed)\n", path ? "new" : "old",
+					cf->calls[path],
+					cf->timed[path] ?
+					cf->cycles[path] / cf->timed[path] : 0,
+					cf->timed[path]);
+	}
+}
+
+/*
+ * Prints the counters and sets the share of calls, going to the new
+ * functions (if percent is not negative). Process is not stopped.
+ */
+int canary_control(const struct process_ctx_s *ctx, int percent)
+{
+	char path[PATH_MAX];
+	struct canary_shm *shm;
+	struct stat st;
+	uint32_t i;
+	int fd, err = 0;
+
+	canary_path(path, sizeof(path), ctx->pid, PI(ctx)->patch_bid);
+
+	fd = open(path, O_RDWR | O_NOFOLLOW);
+	if (fd < 0) {
+		pr_perror("failed to open %s (patch is not applied with canary?)",
+				path);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) || (st.st_size < CANARY_SHM_SIZE)) {
+		pr_err("%s is not a canary shared memory\n", path);
+		err = -EINVAL;
+		goto close_fd;
+	}
+
+	shm = mmap(NULL, CANARY_SHM_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		pr_perror("failed to map %s", path);
+		err = -errno;
+		goto close_fd;
+	}
+
+	if ((shm->magic != CANARY_MAGIC) || (shm->nr_funcs > CANARY_MAX_FUNCS)) {
+		pr_err("%s is not a canary shared memory\n", path);
+		err = -EINVAL;
+		goto unmap;
+	}
+
+	if (percent >= 0) {
+		for (i = 0; i < shm->nr_funcs; i++)
+			shm->funcs[i].ratio = canary_ratio(percent);
+	}
+
+	pr_msg("Canary %s:\n", path);
+	canary_print(shm);
+
+unmap:
+	munmap(shm, CANARY_SHM_SIZE);
+close_fd:
+	close(fd);
+	return err;
+}
@@ -0,0 +1,702 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <protobuf/daemon.pb-c.h>
+
+#include "include/daemon.h"
+#include "include/options.h"
+#include "include/elf.h"
+#include "include/list.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+#include "common/scm.h"
+
+#define DAEMON_MESSAGE_SIZE_MAX		(256 * 1024)
+
+/* Client has to send its request in time, or it's dropped */
+#define DAEMON_REQUEST_TIMEOUT		10
+
+/*
+ * Requests for one process are serialized: a request waits until the
+ * process is not busy. Requests for different processes run concurrently,
+ * but no more than "jobs" at once. Requests for all the processes ("patch
+ * --all") wait for all the others and exclude them.
+ */
+struct daemon_pid_s {
+	struct list_head	list;
+	pid_t			pid;
+};
+
+static struct daemon_s {
+	int			(*run)(struct options *o);
+	sem_t			jobs;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	busy;
+	int			all_busy;
+	int			nr_active;
+	volatile sig_atomic_t	stop;
+} daemon_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.busy = LIST_HEAD_INIT(daemon_state.busy),
+};
+
+struct daemon_conn_s {
+	int			sock;
+	int			msgfd;
+	int			logfd;
+	DaemonRequest		*req;
+};
+
+static int daemon_pid_busy(pid_t pid)
+{
+	struct daemon_pid_s *dp;
+
+	list_for_each_entry(dp, &daemon_state.busy, list) {
+		if (dp->pid == pid)
+			return 1;
+	}
+	return 0;
+}
+
+static void daemon_pid_lock(struct daemon_pid_s *dp)
+{
+	pthread_mutex_lock(&daemon_state.lock);
+	while (daemon_state.all_busy || daemon_pid_busy(dp->pid))
+		pthread_cond_wait(&daemon_state.cond, &daemon_state.lock);
+	list_add_tail(&dp->list, &daemon_state.busy);
+	pthread_mutex_unlock(&daemon_state.lock);
+}
+
+static void daemon_pid_unlock(struct daemon_pid_s *dp)
+{
+	pthread_mutex_lock(&daemon_state.lock);
+	list_del(&dp->list);
+	pthread_cond_broadcast(&daemon_state.cond);
+	pthread_mutex_unlock(&daemon_state.lock);
+}
+
+static void daemon_all_lock(void)
+{
+	pthread_mutex_lock(&daemon_state.lock);
+	while (daemon_state.all_busy || !list_empty(&daemon_state.busy))
+		pthread_cond_wait(&daemon_state.cond, &daemon_state.lock);
+	daemon_state.all_busy = 1;
+	pthread_mutex_unlock(&daemon_state.lock);
+}
+
+static void daemon_all_unlock(void)
+{
+	pthread_mutex_lock(&daemon_state.lock);
+	daemon_state.all_busy = 0;
+	pthread_cond_broadcast(&daemon_state.cond);
+	pthread_mutex_unlock(&daemon_state.lock);
+}
+
+static void daemon_request_options(const DaemonRequest *req,
+				   struct options *o)
+{
+	size_t i;
+
+	o->command = req->command;
+	o->pid = req->pid;
+	for (i = 0; i < req->n_patches; i++)
+		o->patch_paths[o->nr_patch_paths++] = req->patches[i];
+	o->patch_path = o->nr_patch_paths ? o->patch_paths[0] : NULL;
+	for (i = 0; i < req->n_reverts; i++)
+		o->revert_paths[o->nr_revert_paths++] = req->reverts[i];
+	o->plan_path = req->plan;
+	o->dry_run = req->dry_run;
+	o->no_plugin = req->no_plugin;
+	o->all = req->all;
+	o->jobs = req->jobs;
+	o->max_frozen = req->max_frozen;
+	o->verbosity = req->verbosity;
+	o->resident = req->resident;
+	o->map_service = req->map_service;
+	o->rewrite_calls = req->rewrite_calls;
+	o->redirect_got = req->redirect_got;
+	o->redirect_pointers = req->redirect_pointers;
+	o->in_place = req->in_place;
+	o->relax_got = req->relax_got;
+	o->canary = req->canary;
+	o->canary_ratio = req->canary_ratio;
+	o->canary_timing = req->canary_timing;
+	o->precompute = req->precompute;
+}
+
+static int daemon_execute(const DaemonRequest *req)
+{
+	struct daemon_pid_s dp = {
+		.pid = req->pid,
+	};
+	struct options o = { };
+	int ret;
+
+	if ((req->n_patches > MAX_PATCH_FILES) ||
+	    (req->n_reverts > MAX_PATCH_FILES)) {
+		pr_msg("Error: too many patch files\n");
+		return 1;
+	}
+
+	daemon_request_options(req, &o);
+
+	if (o.all)
+		daemon_all_lock();
+	else if (dp.pid)
+		daemon_pid_lock(&dp);
+	sem_wait(&daemon_state.jobs);
+
+	ret = daemon_state.run(&o);
+
+	sem_post(&daemon_state.jobs);
+	if (o.all)
+		daemon_all_unlock();
+	else if (dp.pid)
+		daemon_pid_unlock(&dp);
+	return ret;
+}
+
+static int daemon_send_response(int sock, int ret)
+{
+	DaemonResponse resp = DAEMON_RESPONSE__INIT;
+	uint8_t buf[16];
+	size_t size;
+
+	resp.ret = ret;
+
+	size = daemon_response__pack(&resp, buf);
+	if (send(sock, buf, size, MSG_NOSIGNAL) != size) {
+		pr_perror("failed to send response");
+		return -errno;
+	}
+	return 0;
+}
+
+static void daemon_conn_destroy(struct daemon_conn_s *dc)
+{
+	if (dc->req)
+		daemon_request__free_unpacked(dc->req, NULL);
+	if (dc->logfd >= 0)
+		close(dc->logfd);
+	if (dc->msgfd >= 0)
+		close(dc->msgfd);
+	close(dc->sock);
+	free(dc);
+}
+
+static int daemon_check_peer(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		pr_perror("failed to get peer credentials");
+		return -errno;
+	}
+
+	if (cred.uid && (cred.uid != geteuid())) {
+		pr_err("request from uid %d is rejected\n", cred.uid);
+		return -EPERM;
+	}
+	return 0;
+}
+
+/*
+ * Request is a DaemonRequest packet, followed by client message and log
+ * descriptors.
+ */
+static int daemon_recv_request(struct daemon_conn_s *dc)
+{
+	uint8_t *buf;
+	ssize_t size;
+	int err = 0;
+
+	buf = xmalloc(DAEMON_MESSAGE_SIZE_MAX);
+	if (!buf)
+		return -ENOMEM;
+
+	size = recv(dc->sock, buf, DAEMON_MESSAGE_SIZE_MAX, 0);
+	if (size < 0) {
+		pr_perror("failed to receive request");
+		err = -errno;
+		goto free_buf;
+	}
+
+	dc->req = daemon_request__unpack(NULL, size, buf);
+	if (!dc->req) {
+		pr_err("failed to unpack request\n");
+		err = -EINVAL;
+		goto free_buf;
+	}
+
+	dc->msgfd = recv_fd(dc->sock);
+	if (dc->msgfd < 0) {
+		pr_perror("failed to receive client message descriptor");
+		err = -errno;
+		goto free_buf;
+	}
+
+	dc->logfd = recv_fd(dc->sock);
+	if (dc->logfd < 0) {
+		pr_perror("failed to receive client log descriptor");
+		err = -errno;
+	}
+
+free_buf:
+	free(buf);
+	return err;
+}
+
+static void *daemon_worker(void *data)
+{
+	struct daemon_conn_s *dc = data;
+	struct log_thread_s lt = { };
+	int ret;
+
+	/* Bad request affects only the client */
+	if (daemon_recv_request(dc))
+		goto destroy_conn;
+
+	pr_info("= Request \"%s\" for process %d\n",
+			dc->req->command, dc->req->pid);
+
+	lt.msgfd = dc->msgfd;
+	lt.logfd = dc->logfd;
+	lt.loglevel = dc->req->verbosity;
+	log_set_thread(&lt);
+
+	ret = daemon_execute(dc->req);
+
+	(void)daemon_send_response(dc->sock, ret);
+
+destroy_conn:
+	daemon_conn_destroy(dc);
+
+	pthread_mutex_lock(&daemon_state.lock);
+	daemon_state.nr_active--;
+	pthread_cond_broadcast(&daemon_state.cond);
+	pthread_mutex_unlock(&daemon_state.lock);
+	return NULL;
+}
+
+static int daemon_start_worker(struct daemon_conn_s *dc)
+{
+	sigset_t blocked, old;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	/* Stop signals must interrupt accept in the main thread */
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &blocked, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, daemon_worker, dc);
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return err;
+}
+
+static int daemon_accept(int listen_sock)
+{
+	struct timeval timeout = {
+		.tv_sec = DAEMON_REQUEST_TIMEOUT,
+	};
+	struct daemon_conn_s *dc;
+	int sock, err;
+
+	sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		if ((errno == EINTR) || (errno == ECONNABORTED))
+			return 0;
+		pr_perror("failed to accept connection");
+		return -errno;
+	}
+
+	err = daemon_check_peer(sock);
+	if (err) {
+		close(sock);
+		return 0;
+	}
+
+	/* Request is received by worker, and stuck client can't hold it */
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,
+		       &timeout, sizeof(timeout))) {
+		pr_perror("failed to set request timeout");
+		close(sock);
+		return 0;
+	}
+
+	dc = xzalloc(sizeof(*dc));
+	if (!dc) {
+		close(sock);
+		return -ENOMEM;
+	}
+	dc->sock = sock;
+	dc->msgfd = -1;
+	dc->logfd = -1;
+
+	pthread_mutex_lock(&daemon_state.lock);
+	daemon_state.nr_active++;
+	pthread_mutex_unlock(&daemon_state.lock);
+
+	err = daemon_start_worker(dc);
+	if (!err)
+		return 0;
+
+	pr_err("failed to create request thread: %s\n", strerror(err));
+
+	pthread_mutex_lock(&daemon_state.lock);
+	daemon_state.nr_active--;
+	pthread_mutex_unlock(&daemon_state.lock);
+
+	(void)daemon_send_response(sock, -err);
+	daemon_conn_destroy(dc);
+	return 0;
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	mode_t mask;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		pr_err("socket path is too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		pr_perror("failed to create socket");
+		return -errno;
+	}
+
+	/* Only the daemon owner can connect */
+	(void)unlink(path);
+	mask = umask(0077);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_perror("failed to bind socket to %s", path);
+		umask(mask);
+		goto close_sock;
+	}
+	umask(mask);
+
+	if (listen(sock, SOMAXCONN)) {
+		pr_perror("failed to listen socket %s", path);
+		goto unlink_sock;
+	}
+	return sock;
+
+unlink_sock:
+	(void)unlink(path);
+close_sock:
+	close(sock);
+	return -errno;
+}
+
+static void daemon_sigstop(int signo)
+{
+	daemon_state.stop = 1;
+}
+
+static int daemon_signals(void)
+{
+	struct sigaction sa = {
+		.sa_handler = daemon_sigstop,
+	};
+
+	/* Accept has to be interrupted, so no SA_RESTART */
+	if (sigaction(SIGTERM, &sa, NULL) || sigaction(SIGINT, &sa, NULL)) {
+		pr_perror("failed to set signal handler");
+		return -errno;
+	}
+
+	/* Clients can go away while their request is being processed */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		pr_perror("failed to ignore SIGPIPE");
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Daemon keeps parsed ELF files (with symbol indexes) in the cache between
+ * the requests, so repeated requests don't pay for reading and parsing them
+ * again.
+ */
+int daemon_serve(const char *path, int jobs, int (*run)(struct options *o))
+{
+	int sock, err;
+
+	if (elf_library_status())
+		return -1;
+
+	err = daemon_signals();
+	if (err)
+		return err;
+
+	if (sem_init(&daemon_state.jobs, 0, jobs)) {
+		pr_perror("failed to initialize jobs limit");
+		return -errno;
+	}
+	daemon_state.run = run;
+
+	sock = daemon_listen(path);
+	if (sock < 0) {
+		err = sock;
+		goto destroy_sem;
+	}
+
+	elf_cache_init();
+
+	pr_msg("Listening on %s\n", path);
+
+	while (!daemon_state.stop) {
+		err = daemon_accept(sock);
+		if (err)
+			break;
+	}
+
+	pr_msg("Stopping, waiting for %d requests\n", daemon_state.nr_active);
+
+	close(sock);
+	(void)unlink(path);
+
+	/* Processes must not be left stopped or half patched */
+	pthread_mutex_lock(&daemon_state.lock);
+	while (daemon_state.nr_active)
+		pthread_cond_wait(&daemon_state.cond, &daemon_state.lock);
+	pthread_mutex_unlock(&daemon_state.lock);
+
+	elf_cache_fini();
+
+destroy_sem:
+	sem_destroy(&daemon_state.jobs);
+	return err;
+}
+
+static int daemon_connect(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		pr_err("socket path is too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		pr_perror("failed to create socket");
+		return -errno;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_perror("failed to connect to daemon socket %s", path);
+		close(sock);
+		return -errno;
+	}
+	return sock;
+}
+
+/*
+ * Daemon has another working directory, so all the paths are made absolute.
+ */
+static char *daemon_abs_path(const char *path)
+{
+	char cwd[PATH_MAX], *abs;
+
+	if (path[0] == '/')
+		return xstrdup(path);
+
+	if (!getcwd(cwd, sizeof(cwd))) {
+		pr_perror("failed to get current directory");
+		return NULL;
+	}
+
+	if (asprintf(&abs, "%s/%s", cwd, path) < 0)
+		return NULL;
+	return abs;
+}
+
+static void daemon_free_request(DaemonRequest *req)
+{
+	size_t i;
+
+	for (i = 0; i < req->n_patches; i++)
+		free(req->patches[i]);
+	for (i = 0; i < req->n_reverts; i++)
+		free(req->reverts[i]);
+	free(req->plan);
+}
+
+static int daemon_fill_paths(char **paths, size_t *nr_paths,
+			     const char * const *opt_paths, int nr_opt_paths)
+{
+	int i;
+
+	for (i = 0; i < nr_opt_paths; i++) {
+		paths[i] = daemon_abs_path(opt_paths[i]);
+		if (!paths[i])
+			return -ENOMEM;
+		(*nr_paths)++;
+	}
+	return 0;
+}
+
+static int daemon_send_request(int sock, const struct options *o)
+{
+	DaemonRequest req = DAEMON_REQUEST__INIT;
+	char *patches[MAX_PATCH_FILES], *reverts[MAX_PATCH_FILES];
+	uint8_t *buf = NULL;
+	size_t size;
+	int err;
+
+	req.command = (char *)o->command;
+	req.has_pid = !!o->pid;
+	req.pid = o->pid;
+	req.patches = patches;
+	req.reverts = reverts;
+	req.has_dry_run = req.dry_run = o->dry_run;
+	req.has_no_plugin = req.no_plugin = o->no_plugin;
+	req.has_all = req.all = o->all;
+	req.has_resident = req.resident = o->resident;
+	req.has_map_service = req.map_service = o->map_service;
+	req.has_rewrite_calls = req.rewrite_calls = o->rewrite_calls;
+	req.has_redirect_got = req.redirect_got = o->redirect_got;
+	req.has_redirect_pointers = req.redirect_pointers = o->redirect_pointers;
+	req.has_in_place = req.in_place = o->in_place;
+	req.has_relax_got = req.relax_got = o->relax_got;
+	req.has_canary = req.canary = o->canary;
+	req.has_canary_ratio = !!o->canary;
+	req.canary_ratio = o->canary_ratio;
+	req.has_canary_timing = req.canary_timing = o->canary_timing;
+	req.has_precompute = req.precompute = o->precompute;
+	req.has_jobs = !!o->jobs;
+	req.jobs = o->jobs;
+	req.has_max_frozen = !!o->max_frozen;
+	req.max_frozen = o->max_frozen;
+	req.has_verbosity = 1;
+	req.verbosity = o->verbosity;
+
+	err = -ENOMEM;
+	if (daemon_fill_paths(patches, &req.n_patches,
+			      o->patch_paths, o->nr_patch_paths))
+		goto free_request;
+
+	if (daemon_fill_paths(reverts, &req.n_reverts,
+			      o->revert_paths, o->nr_revert_paths))
+		goto free_request;
+
+	if (o->plan_path) {
+		req.plan = daemon_abs_path(o->plan_path);
+		if (!req.plan)
+			goto free_request;
+	}
+
+	size = daemon_request__get_packed_size(&req);
+	if (size > DAEMON_MESSAGE_SIZE_MAX) {
+		pr_err("request is too big: %zu\n", size);
+		err = -E2BIG;
+		goto free_request;
+	}
+
+	buf = xmalloc(size);
+	if (!buf)
+		goto free_request;
+
+	daemon_request__pack(&req, buf);
+
+	if (send(sock, buf, size, 0) != size) {
+		pr_perror("failed to send request");
+		err = -errno;
+		goto free_request;
+	}
+
+	if ((send_fd(sock, STDOUT_FILENO) < 0) ||
+	    (send_fd(sock, log_get_fd()) < 0)) {
+		pr_perror("failed to send descriptors");
+		err = -errno;
+		goto free_request;
+	}
+	err = 0;
+
+free_request:
+	free(buf);
+	daemon_free_request(&req);
+	return err;
+}
+
+static int daemon_recv_response(int sock)
+{
+	DaemonResponse *resp;
+	uint8_t buf[64];
+	ssize_t size;
+	int ret;
+
+	size = recv(sock, buf, sizeof(buf), 0);
+	if (size < 0) {
+		pr_perror("failed to receive response");
+		return -errno;
+	}
+	if (!size) {
+		pr_err("daemon closed connection\n");
+		return -ECONNRESET;
+	}
+
+	resp = daemon_response__unpack(NULL, size, buf);
+	if (!resp) {
+		pr_err("failed to unpack response\n");
+		return -EINVAL;
+	}
+
+	ret = resp->ret;
+	daemon_response__free_unpacked(resp, NULL);
+	return ret;
+}
+
+/*
+ * Sends the command to the daemon and returns its result. Daemon writes
+ * command output directly to the client descriptors.
+ */
+int daemon_request(const char *path, const struct options *o)
+{
+	int sock, ret;
+
+	sock = daemon_connect(path);
+	if (sock < 0)
+		return sock;
+
+	ret = daemon_send_request(sock, o);
+	if (!ret)
+		ret = daemon_recv_response(sock);
+
+	close(sock);
+	return ret;
+}
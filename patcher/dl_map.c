@@ -61,6 +61,17 @@ struct dl_map *alloc_dl_map(struct elf_info_s *ei, const char *path)
 	return dlm;
 }
 
+void free_dl_maps(struct list_head *head)
+{
+	struct dl_map *dlm, *tmp;
+
+	list_for_each_entry_safe(dlm, tmp, head, list) {
+		list_del(&dlm->list);
+		elf_put_info(dlm->ei);
+		free(dlm);
+	}
+}
+
 static int print_dl_vma(struct vma_area *vma, void *data)
 {
 	print_vma(vma);
@@ -78,7 +89,7 @@ static int create_dl_map_by_vma(const struct vma_area *vma, struct dl_map **dl_m
 	struct dl_map *dlm;
 	int err;
 
-	err = elf_create_info(vma->map_file, &ei);
+	err = elf_get_info(vma->map_file, &ei);
 	if (err)
 		return err;
 
@@ -91,7 +102,7 @@ static int create_dl_map_by_vma(const struct vma_area *vma, struct dl_map **dl_m
 	return 0;
 
 destroy_ei:
-	elf_destroy_info(ei);
+	elf_put_info(ei);
 	return err;
 }
 
@@ -252,8 +263,9 @@ int iterate_dl_maps(const struct list_head *head, void *data,
 }
 
 struct sym_info {
-	const char	*name;
-	uint64_t	value;
+	const char		*name;
+	uint64_t		value;
+	const struct dl_map	*dlm;
 };
 
 static int dlm_find_sym(const struct dl_map *dlm, void *data)
@@ -266,6 +278,7 @@ static int dlm_find_sym(const struct dl_map *dlm, void *data)
 		return value;
 
 	si->value = dl_map_start(dlm) + value;
+	si->dlm = dlm;
 	return 1;
 }
 
@@ -282,7 +295,8 @@ int64_t dl_map_symbol_value(const struct dl_map *dlm, const char *name)
 	return ret < 0 ? ret : -ENOENT;
 }
 
-int64_t dl_get_symbol_value(const struct list_head *dl_maps, const char *name)
+int64_t dl_find_symbol(const struct list_head *dl_maps, const char *name,
+		       const struct dl_map **dlm)
 {
 	struct sym_info si = {
 		.name = name,
@@ -294,9 +308,16 @@ int64_t dl_get_symbol_value(const struct list_head *dl_maps, const char *name)
 		return ret;
 	if (!ret)
 		return -ENOENT;
+	if (dlm)
+		*dlm = si.dlm;
 	return si.value;
 }
 
+int64_t dl_get_symbol_value(const struct list_head *dl_maps, const char *name)
+{
+	return dl_find_symbol(dl_maps, name, NULL);
+}
+
 int iterate_dl_vmas(const struct dl_map *dlm, void *data,
 		    int (*actor)(struct vma_area *vma, void *data))
 {
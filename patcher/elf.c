@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <gelf.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "include/elf.h"
 #include "include/context.h"
@@ -47,6 +48,40 @@ struct elf_info_s {
 	char			*soname;
 	struct list_head	needed;
 	char			*bid;
+
+	/* Cache members */
+	struct list_head	cache;
+	int			cached;
+	int			users;
+	dev_t			dev;
+	ino_t			ino;
+	off_t			size;
+	struct timespec		ctime;
+	struct elf_dsym_s	*dsyms;
+	size_t			nr_dsyms;
+};
+
+struct elf_dsym_s {
+	const char		*name;
+	size_t			idx;
+};
+
+#define ELF_CACHE_BUCKETS	256
+
+/*
+ * ELF cache is shared between the threads, patching different processes.
+ * Cached ELF infos are immutable: all the lazily initialized members are set
+ * when info is added to the cache.
+ * Cache can live long (in daemon), so infos are counted and an info is
+ * evicted, once its file was changed.
+ */
+static struct elf_cache_s {
+	pthread_mutex_t		lock;
+	int			users;
+	int			enabled;
+	struct list_head	buckets[ELF_CACHE_BUCKETS];
+} elf_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
 struct elf_data_s {
@@ -138,11 +173,6 @@ static int __elf_get_soname(struct elf_info_s *ei, char **soname);
 static int elf_collect_needed(struct elf_info_s *ei);
 static char *elf_get_bid(struct elf_info_s *ei);
 
-int elf_info_fd(const struct elf_info_s *ei)
-{
-	return ei->fd;
-}
-
 int elf_library_status(void)
 {
 	if (elf_version(EV_CURRENT) == EV_NONE) {
@@ -342,6 +372,8 @@ static struct elf_info_s *elf_alloc_info(Elf *e, const char *path, int fd)
 
 	INIT_LIST_HEAD(&ei->needed);
 
+	INIT_LIST_HEAD(&ei->cache);
+
 	ei->e = e;
 	ei->fd = fd;
 
@@ -354,9 +386,15 @@ free_ei:
 
 void elf_destroy_info(struct elf_info_s *ei)
 {
+	free(ei->dsyms);
+	free(ei->dynamic);
+	free(ei->dynsym);
+	free(ei->rela_plt);
+	free(ei->rela_dyn);
 	free(ei->soname);
 	(void)elf_end(ei->e);
-	close(ei->fd);
+	if (ei->fd >= 0)
+		close(ei->fd);
 	free(ei);
 }
 
@@ -600,6 +638,149 @@ char *elf_build_id(const char *path)
 	return bid;
 }
 
+#define ELF_PEEK_MAX_SIZE	(64 << 10)
+
+static void *elf_peek_read(int fd, off_t offset, size_t size)
+{
+	void *buf;
+
+	if (!size || (size > ELF_PEEK_MAX_SIZE))
+		return NULL;
+
+	buf = xmalloc(size);
+	if (!buf)
+		return NULL;
+
+	if (pread(fd, buf, size, offset) != size) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static char *elf_peek_note_bid(int fd, const Elf64_Phdr *phdr)
+{
+	uint8_t *notes, *n;
+	char *bid = NULL;
+
+	notes = elf_peek_read(fd, phdr->p_offset, phdr->p_filesz);
+	if (!notes)
+		return NULL;
+
+	n = notes;
+	while (n + sizeof(Elf64_Nhdr) <= notes + phdr->p_filesz) {
+		Elf64_Nhdr *nhdr = (Elf64_Nhdr *)n;
+		uint8_t *name = n + sizeof(*nhdr);
+		uint8_t *desc = name + round_up(nhdr->n_namesz, 4);
+		size_t i;
+
+		if (desc + nhdr->n_descsz > notes + phdr->p_filesz)
+			break;
+
+		if ((nhdr->n_type == NT_GNU_BUILD_ID) &&
+		    (nhdr->n_namesz == sizeof(ELF_NOTE_GNU)) &&
+		    !memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU))) {
+			bid = xmalloc(nhdr->n_descsz * 2 + 1);
+			if (!bid)
+				break;
+			for (i = 0; i < nhdr->n_descsz; i++)
+				sprintf(bid + i * 2, "%02x", desc[i]);
+			bid[nhdr->n_descsz * 2] = '\0';
+			break;
+		}
+		n = desc + round_up(nhdr->n_descsz, 4);
+	}
+
+	free(notes);
+	return bid;
+}
+
+static char *elf_peek_bid(int fd, const Elf64_Ehdr *ehdr)
+{
+	Elf64_Phdr *phdrs;
+	char *bid = NULL;
+	int i;
+
+	if (ehdr->e_phentsize != sizeof(*phdrs))
+		return NULL;
+
+	phdrs = elf_peek_read(fd, ehdr->e_phoff, ehdr->e_phnum * sizeof(*phdrs));
+	if (!phdrs)
+		return NULL;
+
+	for (i = 0; !bid && (i < ehdr->e_phnum); i++) {
+		if (phdrs[i].p_type == PT_NOTE)
+			bid = elf_peek_note_bid(fd, &phdrs[i]);
+	}
+
+	free(phdrs);
+	return bid;
+}
+
+static int elf_peek_section(int fd, const Elf64_Ehdr *ehdr, const char *sname)
+{
+	Elf64_Shdr *shdrs;
+	char *names = NULL;
+	size_t names_size;
+	int i, ret = 0;
+
+	if ((ehdr->e_shentsize != sizeof(*shdrs)) ||
+	    (ehdr->e_shstrndx >= ehdr->e_shnum))
+		return 0;
+
+	shdrs = elf_peek_read(fd, ehdr->e_shoff, ehdr->e_shnum * sizeof(*shdrs));
+	if (!shdrs)
+		return 0;
+
+	names_size = shdrs[ehdr->e_shstrndx].sh_size;
+	names = elf_peek_read(fd, shdrs[ehdr->e_shstrndx].sh_offset, names_size);
+	if (!names)
+		goto free_shdrs;
+
+	for (i = 0; !ret && (i < ehdr->e_shnum); i++) {
+		size_t off = shdrs[i].sh_name;
+
+		if ((off < names_size) &&
+		    (strnlen(names + off, names_size - off) < names_size - off))
+			ret = !strcmp(names + off, sname);
+	}
+
+	free(names);
+free_shdrs:
+	free(shdrs);
+	return ret;
+}
+
+/*
+ * Reads Build ID and checks for patch section without libelf: only ELF
+ * headers, program notes and section names are read. This is used to scan
+ * all the files, mapped in the system.
+ * Returns -ENOEXEC, if the file is not a 64-bit ELF.
+ */
+int elf_peek(const char *path, char **bid, int *patch)
+{
+	Elf64_Ehdr ehdr;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	if ((pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+	    (ehdr.e_ident[EI_CLASS] != ELFCLASS64)) {
+		err = -ENOEXEC;
+		goto close_fd;
+	}
+
+	*bid = elf_peek_bid(fd, &ehdr);
+	*patch = elf_peek_section(fd, &ehdr, VZPATCH_SECTION);
+
+close_fd:
+	close(fd);
+	return err;
+}
+
 static int sect_nr_ent(struct elf_info_s *ei, Elf_Scn *scn)
 {
 	GElf_Shdr shdr;
@@ -961,9 +1142,87 @@ static int compare_sym_name(struct elf_info_s *ei,
 	return !strcmp(name, symname);
 }
 
+static int compare_dsyms(const void *a, const void *b)
+{
+	const struct elf_dsym_s *da = a, *db = b;
+	int ret;
+
+	ret = strcmp(da->name, db->name);
+	if (ret)
+		return ret;
+	/* Keep symbols table order for the same names */
+	return (da->idx > db->idx) - (da->idx < db->idx);
+}
+
+/*
+ * Sorted table of named dynamic symbols. It makes symbol lookup logarithmic,
+ * which matters, when the same library is searched for each process.
+ */
+static int elf_create_dsyms(struct elf_info_s *ei)
+{
+	elf_scn_t *escn;
+	GElf_Sym sym;
+	size_t i;
+	int err;
+
+	escn = elf_set_dynsym_scn(ei);
+	if (!escn)
+		return -ENOENT;
+
+	ei->dsyms = xmalloc(sizeof(*ei->dsyms) * escn->nr_ent);
+	if (!ei->dsyms)
+		return -ENOMEM;
+
+	for (i = 0; i < escn->nr_ent; i++) {
+		struct elf_dsym_s *ds = &ei->dsyms[ei->nr_dsyms];
+
+		if (gelf_getsym(escn->data, i, &sym) != &sym)
+			return -ENOENT;
+
+		if (!sym.st_name || !sym.st_size)
+			continue;
+
+		err = dynsym_name(&sym, ei, (char **)&ds->name);
+		if (err)
+			return err;
+
+		ds->idx = i;
+		ei->nr_dsyms++;
+	}
+
+	qsort(ei->dsyms, ei->nr_dsyms, sizeof(*ei->dsyms), compare_dsyms);
+	return 0;
+}
+
+static int elf_lookup_dsym(struct elf_info_s *ei, const char *symname,
+			   GElf_Sym *sym)
+{
+	size_t lo = 0, hi = ei->nr_dsyms;
+
+	/* Lower bound: the first symbol in the table wins, like in find_sym() */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp(ei->dsyms[mid].name, symname) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == ei->nr_dsyms || strcmp(ei->dsyms[lo].name, symname))
+		return -ENOENT;
+
+	if (gelf_getsym(ei->dynsym->data, ei->dsyms[lo].idx, sym) != sym)
+		return -ENOENT;
+
+	return 1;
+}
+
 static int elf_find_dsym_by_name(struct elf_info_s *ei, const char *symname,
 				 GElf_Sym *sym)
 {
+	if (ei->dsyms)
+		return elf_lookup_dsym(ei, symname, sym);
 	return find_dyn_sym(ei, sym, compare_sym_name, symname);
 }
 
@@ -1212,6 +1471,384 @@ int64_t elf_dyn_sym_value(struct elf_info_s *ei, const char *name)
 	return sym.st_value;
 }
 
+static int elf_sym_versym(struct elf_info_s *ei, size_t ndx, GElf_Versym *vs)
+{
+	Elf_Scn *versym_scn;
+	Elf_Data *versym_data;
+
+	versym_scn = elf_get_section_by_name(ei, ".gnu.version");
+	if (!versym_scn)
+		return -ENOENT;
+
+	versym_data = elf_getdata(versym_scn, NULL);
+	if (!versym_data)
+		return -ENOENT;
+
+	if (!gelf_getversym(versym_data, ndx, vs))
+		return -ENOENT;
+	return 0;
+}
+
+/*
+ * Returns the version, required for the dynamic symbol by its index (from
+ * ".gnu.version_r"), or NULL if the symbol is not versioned.
+ */
+static const char *elf_sym_version_r(struct elf_info_s *ei, size_t ndx)
+{
+	Elf_Scn *verneed_scn;
+	Elf_Data *verneed_data;
+	GElf_Shdr shdr;
+	GElf_Versym vs;
+	GElf_Verneed vn;
+	GElf_Vernaux vna;
+	size_t offset, aux;
+	int i, j;
+
+	verneed_scn = elf_get_section_by_name(ei, ".gnu.version_r");
+	if (!verneed_scn)
+		return NULL;
+
+	verneed_data = elf_getdata(verneed_scn, NULL);
+	if (!verneed_data)
+		return NULL;
+
+	if (elf_sym_versym(ei, ndx, &vs))
+		return NULL;
+
+	/* Local and global (unversioned) symbols */
+	vs &= 0x7fff;
+	if (vs <= 1)
+		return NULL;
+
+	if (gelf_getshdr(verneed_scn, &shdr) != &shdr)
+		return NULL;
+
+	for (i = 0, offset = 0; i < shdr.sh_info; i++, offset += vn.vn_next) {
+		if (!gelf_getverneed(verneed_data, offset, &vn))
+			return NULL;
+
+		for (j = 0, aux = offset + vn.vn_aux; j < vn.vn_cnt;
+		     j++, aux += vna.vna_next) {
+			if (!gelf_getvernaux(verneed_data, aux, &vna))
+				return NULL;
+			if (vna.vna_other == vs)
+				return elf_strptr(ei->e, shdr.sh_link, vna.vna_name);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns the version, required for the symbol (from ".gnu.version_r"), or
+ * NULL if the symbol is not versioned.
+ */
+const char *elf_es_version(struct elf_info_s *ei, const struct extern_symbol *es)
+{
+	return elf_sym_version_r(ei, es_r_sym(es));
+}
+
+/*
+ * Returns the version name, defined by ".gnu.version_d" under the index, or
+ * NULL if there is no such definition.
+ */
+static const char *elf_sym_version_d(struct elf_info_s *ei, GElf_Versym vs)
+{
+	Elf_Scn *verdef_scn;
+	Elf_Data *verdef_data;
+	GElf_Shdr shdr;
+	GElf_Verdef vd;
+	GElf_Verdaux vda;
+	size_t offset;
+	int i;
+
+	verdef_scn = elf_get_section_by_name(ei, ".gnu.version_d");
+	if (!verdef_scn)
+		return NULL;
+
+	verdef_data = elf_getdata(verdef_scn, NULL);
+	if (!verdef_data)
+		return NULL;
+
+	if (gelf_getshdr(verdef_scn, &shdr) != &shdr)
+		return NULL;
+
+	for (i = 0, offset = 0; i < shdr.sh_info; i++, offset += vd.vd_next) {
+		if (!gelf_getverdef(verdef_data, offset, &vd))
+			return NULL;
+
+		if (vd.vd_ndx != vs)
+			continue;
+
+		if (!gelf_getverdaux(verdef_data, offset + vd.vd_aux, &vda))
+			return NULL;
+		return elf_strptr(ei->e, shdr.sh_link, vda.vda_name);
+	}
+	return NULL;
+}
+
+/*
+ * Finds defined dynamic symbol like dynamic linker does: if version is
+ * required, the symbol must have it (objects without versions satisfy any
+ * requirement). Otherwise the default version wins, and hidden ones are
+ * skipped.
+ */
+static int elf_find_dsym_version(struct elf_info_s *ei, const char *name,
+				 const char *version, GElf_Sym *sym)
+{
+	elf_scn_t *escn;
+	GElf_Versym vs;
+	const char *sname, *vname;
+	size_t i;
+	int err;
+
+	escn = elf_set_dynsym_scn(ei);
+	if (!escn)
+		return -ENOENT;
+
+	for (i = 0; i < escn->nr_ent; i++) {
+		if (gelf_getsym(escn->data, i, sym) != sym)
+			return -ENOENT;
+
+		if (!sym->st_name || (sym->st_shndx == SHN_UNDEF))
+			continue;
+
+		err = dynsym_name(sym, ei, (char **)&sname);
+		if (err)
+			return err;
+
+		if (strcmp(sname, name))
+			continue;
+
+		if (elf_sym_versym(ei, i, &vs))
+			return 1;
+
+		if (!version) {
+			if (!(vs & 0x8000))
+				return 1;
+			continue;
+		}
+
+		/* Base and global definitions */
+		if ((vs & 0x7fff) <= 1)
+			continue;
+
+		vname = elf_sym_version_d(ei, vs & 0x7fff);
+		if (vname && !strcmp(vname, version))
+			return 1;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Like elf_dyn_sym_value(), but honours the symbol version. Indirect function
+ * flag is returned for the found symbol.
+ */
+int64_t elf_dyn_sym_value_version(struct elf_info_s *ei, const char *name,
+				  const char *version, bool *ifunc)
+{
+	GElf_Sym sym;
+	int err;
+
+	err = elf_find_dsym_version(ei, name, version, &sym);
+	if (err < 0)
+		return (err != -ENOENT) ? err : 0;
+
+	*ifunc = GELF_ST_TYPE(sym.st_info) == STT_GNU_IFUNC;
+	return sym.st_value;
+}
+
+int elf_dyn_sym_ifunc(struct elf_info_s *ei, const char *name)
+{
+	GElf_Sym sym;
+	int err;
+
+	err = elf_find_dsym_by_name(ei, name, &sym);
+	if (err < 0)
+		return (err != -ENOENT) ? err : 0;
+
+	return GELF_ST_TYPE(sym.st_info) == STT_GNU_IFUNC;
+}
+
+ssize_t elf_load_segments(struct elf_info_s *ei, struct elf_segment **segments)
+{
+	struct elf_segment *segs = NULL;
+	ssize_t nr = 0;
+	size_t pnum;
+	GElf_Phdr phdr;
+	int i;
+
+	if (elf_getphdrnum(ei->e, &pnum)) {
+		pr_err("elf_getphdrnum() failed: %s\n", elf_errmsg(-1));
+		return -EINVAL;
+	}
+
+	for (i = 0; i < pnum; i++) {
+		struct elf_segment *es;
+
+		if (gelf_getphdr(ei->e, i, &phdr) != &phdr) {
+			pr_err("gelf_getphdr() failed: %s\n", elf_errmsg(-1));
+			goto err;
+		}
+
+		if (phdr.p_type == PT_TLS) {
+			pr_err("%s has TLS segment\n", ei->path);
+			free(segs);
+			return -ENOTSUP;
+		}
+
+		if (phdr.p_type != PT_LOAD)
+			continue;
+
+		if (xrealloc_safe(&segs, sizeof(*segs) * (nr + 1))) {
+			free(segs);
+			return -ENOMEM;
+		}
+
+		es = &segs[nr++];
+		es->vaddr = phdr.p_vaddr;
+		es->offset = phdr.p_offset;
+		es->filesz = phdr.p_filesz;
+		es->memsz = phdr.p_memsz;
+		es->prot = 0;
+		if (phdr.p_flags & PF_R)
+			es->prot |= PROT_READ;
+		if (phdr.p_flags & PF_W)
+			es->prot |= PROT_WRITE;
+		if (phdr.p_flags & PF_X)
+			es->prot |= PROT_EXEC;
+	}
+
+	if (!nr) {
+		pr_err("ELF file %s doesn't have PT_LOAD segments\n", ei->path);
+		return -EINVAL;
+	}
+
+	*segments = segs;
+	return nr;
+
+err:
+	free(segs);
+	return -EINVAL;
+}
+
+static int collect_init_info(struct elf_info_s *ei, const GElf_Dyn *d, void *data)
+{
+	struct elf_init_info *ii = data;
+
+	switch (d->d_tag) {
+		case DT_INIT:
+			ii->init = DYN_PTR(d);
+			break;
+		case DT_INIT_ARRAY:
+			ii->init_array = DYN_PTR(d);
+			break;
+		case DT_INIT_ARRAYSZ:
+			ii->nr_init_array = DYN_VAL(d) / sizeof(uint64_t);
+			break;
+		case DT_FINI:
+			ii->fini = DYN_PTR(d);
+			break;
+		case DT_FINI_ARRAY:
+			ii->fini_array = DYN_PTR(d);
+			break;
+		case DT_FINI_ARRAYSZ:
+			ii->nr_fini_array = DYN_VAL(d) / sizeof(uint64_t);
+			break;
+	}
+	return 0;
+}
+
+int elf_init_info(struct elf_info_s *ei, struct elf_init_info *ii)
+{
+	Elf_Scn *scn;
+	GElf_Shdr shdr;
+
+	memset(ii, 0, sizeof(*ii));
+
+	scn = elf_get_section_by_name(ei, ".eh_frame");
+	if (scn && (gelf_getshdr(scn, &shdr) == &shdr))
+		ii->eh_frame = shdr.sh_addr;
+
+	return iter_dyn_sym(ei, collect_init_info, ii);
+}
+
+struct dyn_reloc_iter {
+	int	(*actor)(const struct elf_dyn_reloc *r, void *data);
+	void	*data;
+};
+
+static int iter_dyn_reloc(struct elf_info_s *ei, const GElf_Rela *rela, void *data)
+{
+	struct dyn_reloc_iter *it = data;
+	struct elf_dyn_reloc r = {
+		.offset = rela->r_offset,
+		.type = GELF_R_TYPE(rela->r_info),
+		.addend = rela->r_addend,
+	};
+	elf_scn_t *escn;
+	GElf_Sym sym;
+	int err;
+
+	if (GELF_R_SYM(rela->r_info)) {
+		escn = elf_set_dynsym_scn(ei);
+		if (!escn)
+			return -EINVAL;
+
+		if (gelf_getsym(escn->data, GELF_R_SYM(rela->r_info), &sym) != &sym)
+			return -ENOENT;
+
+		err = dynsym_name(&sym, ei, (char **)&r.name);
+		if (err)
+			return err;
+
+		r.value = sym.st_value;
+		r.defined = sym.st_shndx != SHN_UNDEF;
+		if (!r.defined)
+			r.version = elf_sym_version_r(ei, GELF_R_SYM(rela->r_info));
+		r.weak = GELF_ST_BIND(sym.st_info) == STB_WEAK;
+		r.ifunc = GELF_ST_TYPE(sym.st_info) == STT_GNU_IFUNC;
+	}
+
+	return it->actor(&r, it->data);
+}
+
+/*
+ * Calls actor for all the dynamic relocations, including the ones without
+ * symbol (R_X86_64_RELATIVE).
+ */
+int elf_iterate_dyn_relocs(struct elf_info_s *ei,
+			   int (*actor)(const struct elf_dyn_reloc *r, void *data),
+			   void *data)
+{
+	struct dyn_reloc_iter it = {
+		.actor = actor,
+		.data = data,
+	};
+	elf_scn_t *escn;
+	int err;
+
+	if (elf_has_section(ei, ".rela.dyn")) {
+		escn = elf_set_rela_dyn_scn(ei);
+		if (!escn)
+			return -EINVAL;
+
+		err = iter_rela(ei, escn, iter_dyn_reloc, &it);
+		if (err)
+			return err;
+	}
+
+	if (elf_has_section(ei, ".rela.plt")) {
+		escn = elf_set_rela_plt_scn(ei);
+		if (!escn)
+			return -EINVAL;
+
+		err = iter_rela(ei, escn, iter_dyn_reloc, &it);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
 int64_t elf_section_virt_base(const struct elf_info_s *ei, uint16_t ndx)
 {
 	Elf_Scn *scn;
@@ -1229,6 +1866,173 @@ int64_t elf_section_virt_base(const struct elf_info_s *ei, uint16_t ndx)
 	return shdr.sh_addr - shdr.sh_offset;
 }
 
+static Elf_Scn *elf_get_section_by_type(struct elf_info_s *ei, uint32_t type)
+{
+	Elf_Scn *scn = NULL;
+	GElf_Shdr shdr;
+
+	while ((scn = elf_nextscn(ei->e, scn)) != NULL) {
+		if (gelf_getshdr(scn, &shdr) != &shdr)
+			return NULL;
+		if (shdr.sh_type == type)
+			return scn;
+	}
+	return NULL;
+}
+
+static int compare_funcs(const void *a, const void *b)
+{
+	const struct elf_func *fa = a, *fb = b;
+
+	if (fa->value < fb->value)
+		return -1;
+	return fa->value > fb->value;
+}
+
+/*
+ * Collects bounds of all the defined functions, sorted by address.
+ * Static symbol table is used, if present, because dynamic one has only
+ * exported functions.
+ */
+ssize_t elf_functions(struct elf_info_s *ei, struct elf_func **funcs)
+{
+	struct elf_func *fn = NULL;
+	ssize_t nr = 0;
+	Elf_Scn *scn;
+	Elf_Data *data;
+	GElf_Shdr shdr;
+	GElf_Sym sym;
+	int i;
+
+	scn = elf_get_section_by_type(ei, SHT_SYMTAB);
+	if (!scn)
+		scn = elf_get_section_by_type(ei, SHT_DYNSYM);
+	if (!scn)
+		return -ENOENT;
+
+	if (gelf_getshdr(scn, &shdr) != &shdr) {
+		pr_err("getshdr() failed: %s\n", elf_errmsg(-1));
+		return -EINVAL;
+	}
+
+	data = elf_getdata(scn, NULL);
+	if (!data) {
+		pr_err("symbol table of %s doesn't have data\n", ei->path);
+		return -ENODATA;
+	}
+
+	for (i = 0; i < shdr.sh_size / shdr.sh_entsize; i++) {
+		if (gelf_getsym(data, i, &sym) != &sym) {
+			pr_err("gelf_getsym() failed: %s\n", elf_errmsg(-1));
+			free(fn);
+			return -EINVAL;
+		}
+
+		if (GELF_ST_TYPE(sym.st_info) != STT_FUNC)
+			continue;
+		if ((sym.st_shndx == SHN_UNDEF) || !sym.st_size)
+			continue;
+
+		if (xrealloc_safe(&fn, sizeof(*fn) * (nr + 1))) {
+			free(fn);
+			return -ENOMEM;
+		}
+		fn[nr].value = sym.st_value;
+		fn[nr].size = sym.st_size;
+		nr++;
+	}
+
+	if (nr)
+		qsort(fn, nr, sizeof(*fn), compare_funcs);
+
+	*funcs = fn;
+	return nr;
+}
+
+/*
+ * Finds defined function by name: in symbol table, if ELF is not stripped,
+ * or in dynamic symbol table otherwise.
+ */
+int elf_find_function(struct elf_info_s *ei, const char *name,
+		      struct elf_func *fn)
+{
+	Elf_Scn *scn;
+	Elf_Data *data;
+	GElf_Shdr shdr;
+	GElf_Sym sym;
+	const char *sname;
+	int i;
+
+	scn = elf_get_section_by_type(ei, SHT_SYMTAB);
+	if (!scn)
+		scn = elf_get_section_by_type(ei, SHT_DYNSYM);
+	if (!scn)
+		return 0;
+
+	if (gelf_getshdr(scn, &shdr) != &shdr) {
+		pr_err("getshdr() failed: %s\n", elf_errmsg(-1));
+		return -EINVAL;
+	}
+
+	data = elf_getdata(scn, NULL);
+	if (!data) {
+		pr_err("symbol table of %s doesn't have data\n", ei->path);
+		return -ENODATA;
+	}
+
+	for (i = 0; i < shdr.sh_size / shdr.sh_entsize; i++) {
+		if (gelf_getsym(data, i, &sym) != &sym) {
+			pr_err("gelf_getsym() failed: %s\n", elf_errmsg(-1));
+			return -EINVAL;
+		}
+
+		if (GELF_ST_TYPE(sym.st_info) != STT_FUNC)
+			continue;
+		if ((sym.st_shndx == SHN_UNDEF) || !sym.st_size)
+			continue;
+
+		sname = elf_strptr(ei->e, shdr.sh_link, sym.st_name);
+		if (!sname || strcmp(sname, name))
+			continue;
+
+		fn->value = sym.st_value;
+		fn->size = sym.st_size;
+		return 1;
+	}
+	return 0;
+}
+
+int elf_iterate_exec_sections(struct elf_info_s *ei,
+			      int (*actor)(uint64_t addr, const uint8_t *code,
+					   size_t size, void *data),
+			      void *data)
+{
+	Elf_Scn *scn = NULL;
+	Elf_Data *d;
+	GElf_Shdr shdr;
+	int err;
+
+	while ((scn = elf_nextscn(ei->e, scn)) != NULL) {
+		if (gelf_getshdr(scn, &shdr) != &shdr) {
+			pr_err("getshdr() failed: %s\n", elf_errmsg(-1));
+			return -EINVAL;
+		}
+
+		if ((shdr.sh_type != SHT_PROGBITS) ||
+		    !(shdr.sh_flags & SHF_EXECINSTR))
+			continue;
+
+		d = elf_getdata(scn, NULL);
+		if (!d || !d->d_buf)
+			continue;
+
+		err = actor(shdr.sh_addr, d->d_buf, d->d_size, data);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
 int elf_reloc_sym(struct extern_symbol *es, uint64_t address)
 {
 	switch (es_r_type(es)) {
@@ -1326,3 +2130,223 @@ free_data:
 	free(data);
 	return err;
 }
+
+static struct list_head *elf_cache_bucket(dev_t dev, ino_t ino)
+{
+	return &elf_cache.buckets[(dev ^ ino) % ELF_CACHE_BUCKETS];
+}
+
+static struct elf_info_s *elf_cache_lookup(dev_t dev, ino_t ino)
+{
+	struct elf_info_s *ei;
+
+	list_for_each_entry(ei, elf_cache_bucket(dev, ino), cache) {
+		if ((ei->dev == dev) && (ei->ino == ino))
+			return ei;
+	}
+	return NULL;
+}
+
+static int elf_cache_stale(const struct elf_info_s *ei, const struct stat *st)
+{
+	return (ei->size != st->st_size) ||
+	       (ei->ctime.tv_sec != st->st_ctim.tv_sec) ||
+	       (ei->ctime.tv_nsec != st->st_ctim.tv_nsec);
+}
+
+static void elf_cache_evict(struct elf_info_s *ei)
+{
+	list_del_init(&ei->cache);
+	if (!ei->users)
+		elf_destroy_info(ei);
+}
+
+static int elf_cache_warm(struct elf_info_s *ei)
+{
+	Elf_Scn *scn = NULL;
+
+	/* Make libelf load all the data now, instead of doing it on demand */
+	while ((scn = elf_nextscn(ei->e, scn)) != NULL)
+		(void)elf_getdata(scn, NULL);
+
+	if (elf_has_section(ei, ".dynamic")) {
+		if (!elf_set_dynamic_scn(ei))
+			return -EINVAL;
+		(void)elf_get_strtab_scn(ei);
+	}
+
+	if (elf_has_section(ei, ".rela.plt") && !elf_set_rela_plt_scn(ei))
+		return -EINVAL;
+
+	if (elf_has_section(ei, ".rela.dyn") && !elf_set_rela_dyn_scn(ei))
+		return -EINVAL;
+
+	if (elf_has_section(ei, ".dynsym")) {
+		int err;
+
+		err = elf_create_dsyms(ei);
+		if (err)
+			return err;
+	}
+
+	/* Cache can hold a lot of files, so it doesn't keep them open */
+	if (elf_cntl(ei->e, ELF_C_FDREAD)) {
+		pr_err("failed to read ELF %s: %s\n", ei->path, elf_errmsg(-1));
+		return -EIO;
+	}
+	close(ei->fd);
+	ei->fd = -1;
+	return 0;
+}
+
+static int elf_cache_add(const char *path, const struct stat *st,
+			 struct elf_info_s **elf_info)
+{
+	struct elf_info_s *ei;
+	int err;
+
+	err = elf_create_info(path, &ei);
+	if (err)
+		return err;
+
+	err = elf_cache_warm(ei);
+	if (err) {
+		pr_err("failed to cache ELF %s\n", path);
+		elf_destroy_info(ei);
+		return err;
+	}
+
+	ei->cached = 1;
+	ei->dev = st->st_dev;
+	ei->ino = st->st_ino;
+	ei->size = st->st_size;
+	ei->ctime = st->st_ctim;
+	list_add(&ei->cache, elf_cache_bucket(ei->dev, ei->ino));
+
+	*elf_info = ei;
+	return 0;
+}
+
+/*
+ * Returns ELF info for the file. If cache is enabled, the info is shared
+ * by file device and inode, and must be released with elf_put_info().
+ */
+int elf_get_info(const char *path, struct elf_info_s **elf_info)
+{
+	struct elf_info_s *ei;
+	struct stat st;
+	int err = 0;
+
+	if (!elf_cache.enabled)
+		return elf_create_info(path, elf_info);
+
+	if (stat(path, &st)) {
+		pr_perror("failed to stat %s", path);
+		return -errno;
+	}
+
+	pthread_mutex_lock(&elf_cache.lock);
+	ei = elf_cache_lookup(st.st_dev, st.st_ino);
+	if (ei && elf_cache_stale(ei, &st)) {
+		pr_debug("  ELF %s was changed, evicting\n", ei->path);
+		elf_cache_evict(ei);
+		ei = NULL;
+	}
+	if (!ei)
+		err = elf_cache_add(path, &st, &ei);
+	if (!err) {
+		ei->users++;
+		*elf_info = ei;
+	}
+	pthread_mutex_unlock(&elf_cache.lock);
+
+	return err;
+}
+
+/*
+ * Returns a new descriptor of the ELF file, which has to be closed by the
+ * caller. Cached infos don't keep the files open, so the file is opened
+ * again and has to be the same.
+ */
+int elf_info_open(const struct elf_info_s *ei)
+{
+	struct stat st;
+	int fd;
+
+	if (ei->fd >= 0) {
+		fd = fcntl(ei->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			pr_perror("failed to duplicate %s descriptor", ei->path);
+			return -errno;
+		}
+		return fd;
+	}
+
+	fd = open(ei->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_perror("failed to open %s", ei->path);
+		return -errno;
+	}
+
+	if (fstat(fd, &st)) {
+		pr_perror("failed to stat %s", ei->path);
+		close(fd);
+		return -errno;
+	}
+
+	if ((st.st_dev != ei->dev) || (st.st_ino != ei->ino) ||
+	    elf_cache_stale(ei, &st)) {
+		pr_err("ELF %s was changed\n", ei->path);
+		close(fd);
+		return -ESTALE;
+	}
+	return fd;
+}
+
+void elf_put_info(struct elf_info_s *ei)
+{
+	if (!ei->cached) {
+		elf_destroy_info(ei);
+		return;
+	}
+
+	pthread_mutex_lock(&elf_cache.lock);
+	if (!--ei->users && list_empty(&ei->cache))
+		elf_destroy_info(ei);
+	pthread_mutex_unlock(&elf_cache.lock);
+}
+
+/*
+ * Cache is enabled until the last user calls elf_cache_fini().
+ */
+void elf_cache_init(void)
+{
+	int i;
+
+	pthread_mutex_lock(&elf_cache.lock);
+	if (!elf_cache.users++) {
+		for (i = 0; i < ELF_CACHE_BUCKETS; i++)
+			INIT_LIST_HEAD(&elf_cache.buckets[i]);
+		elf_cache.enabled = 1;
+	}
+	pthread_mutex_unlock(&elf_cache.lock);
+}
+
+void elf_cache_fini(void)
+{
+	struct elf_info_s *ei, *tmp;
+	int i;
+
+	pthread_mutex_lock(&elf_cache.lock);
+	if (!elf_cache.users || --elf_cache.users)
+		goto unlock;
+
+	elf_cache.enabled = 0;
+	for (i = 0; i < ELF_CACHE_BUCKETS; i++) {
+		list_for_each_entry_safe(ei, tmp, &elf_cache.buckets[i], cache)
+			elf_cache_evict(ei);
+	}
+
+unlock:
+	pthread_mutex_unlock(&elf_cache.lock);
+}
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "include/fleet.h"
+#include "include/patch.h"
+#include "include/process.h"
+#include "include/context.h"
+#include "include/elf.h"
+#include "include/protobuf.h"
+#include "include/image.h"
+#include "include/util.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+struct fleet_pid_s {
+	pid_t			pid;
+	int			result;
+};
+
+/*
+ * Fleet is a set of processes, mapping the patch target ELF. They are
+ * patched by a pool of workers, and each worker has its own process context.
+ * Parsed ELF files are shared via ELF cache.
+ */
+struct fleet_s {
+	const char		*patchfile;
+	char			*target_bid;
+	int			dry_run;
+	int			no_plugin;
+	const struct patch_opts	*opts;
+
+	struct log_thread_s	log;
+	sem_t			freeze_limit;
+
+	pthread_mutex_t		lock;
+	struct fleet_pid_s	*pids;
+	int			nr_pids;
+	int			next;
+};
+
+static int fleet_target_bid(struct fleet_s *f)
+{
+	struct patch_info_s pi = { };
+	struct elf_info_s *ei;
+	int err;
+
+	err = elf_get_info(f->patchfile, &ei);
+	if (err)
+		return err;
+
+	err = elf_info_binpatch(&pi, ei);
+	if (!err) {
+		f->target_bid = pi.target_bid;
+		pi.target_bid = NULL;
+		free_protobuf_binpatch(&pi);
+	}
+
+	elf_put_info(ei);
+	return err;
+}
+
+static int fleet_add_pid(const char *dentry, void *data)
+{
+	struct fleet_s *f = data;
+	char *end;
+	pid_t pid;
+	int ret;
+
+	pid = strtol(dentry, &end, 10);
+	if (*end || (pid <= 0) || (pid == getpid()))
+		return 0;
+
+	ret = process_maps_bid(pid, f->target_bid);
+	if (ret <= 0) {
+		/* Process could have already exited */
+		if (ret < 0)
+			pr_debug("failed to scan process %d mappings\n", pid);
+		return 0;
+	}
+
+	if (xrealloc_safe(&f->pids, sizeof(*f->pids) * (f->nr_pids + 1)))
+		return -ENOMEM;
+
+	f->pids[f->nr_pids].pid = pid;
+	f->pids[f->nr_pids].result = 0;
+	f->nr_pids++;
+	return 0;
+}
+
+static int fleet_collect_pids(struct fleet_s *f)
+{
+	int err;
+
+	pr_info("= Searching processes with Build ID %s\n", f->target_bid);
+
+	err = iterate_dir_name("/proc", fleet_add_pid, f);
+	if (err)
+		return err;
+
+	pr_info("  Found %d processes\n", f->nr_pids);
+	return 0;
+}
+
+static struct fleet_pid_s *fleet_next_pid(struct fleet_s *f)
+{
+	struct fleet_pid_s *fp = NULL;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->next < f->nr_pids)
+		fp = &f->pids[f->next++];
+	pthread_mutex_unlock(&f->lock);
+
+	return fp;
+}
+
+static void *fleet_worker(void *data)
+{
+	struct fleet_s *f = data;
+	struct fleet_pid_s *fp;
+
+	log_set_thread(&f->log);
+
+	while ((fp = fleet_next_pid(f)) != NULL)
+		fp->result = patch_process_limited(fp->pid, f->patchfile,
+						   f->dry_run, f->no_plugin,
+						   f->opts, &f->freeze_limit);
+	return NULL;
+}
+
+static int fleet_run(struct fleet_s *f, int jobs)
+{
+	pthread_t *workers;
+	int i, err;
+
+	if (jobs > f->nr_pids)
+		jobs = f->nr_pids;
+
+	workers = xmalloc(sizeof(*workers) * jobs);
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&workers[i], NULL, fleet_worker, f);
+		if (err) {
+			pr_err("failed to create worker: %s\n", strerror(err));
+			break;
+		}
+	}
+
+	if (!i) {
+		free(workers);
+		return -err;
+	}
+
+	/* Started workers will patch all the processes anyway */
+	while (i--)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	return 0;
+}
+
+static int fleet_summary(const struct fleet_s *f)
+{
+	int i, failed = 0;
+
+	pr_msg("Fleet summary:\n");
+	for (i = 0; i < f->nr_pids; i++) {
+		const struct fleet_pid_s *fp = &f->pids[i];
+
+		if (!fp->result) {
+			pr_msg("  %d: patched\n", fp->pid);
+			continue;
+		}
+
+		if (fp->result < 0)
+			pr_msg("  %d: failed: %s\n", fp->pid, strerror(-fp->result));
+		else
+			pr_msg("  %d: failed: error %d\n", fp->pid, fp->result);
+		failed++;
+	}
+	pr_msg("Patched %d of %d processes\n", f->nr_pids - failed, f->nr_pids);
+
+	return failed ? 1 : 0;
+}
+
+int patch_fleet(const char *patchfile, int jobs, int max_frozen,
+		int dry_run, int no_plugin, const struct patch_opts *opts)
+{
+	struct fleet_s f = {
+		.patchfile = patchfile,
+		.dry_run = dry_run,
+		.no_plugin = no_plugin,
+		.opts = opts,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	int err;
+
+	if (elf_library_status())
+		return -1;
+
+	log_get_thread(&f.log);
+
+	if (sem_init(&f.freeze_limit, 0, max_frozen)) {
+		pr_perror("failed to initialize freeze limit");
+		return -errno;
+	}
+
+	elf_cache_init();
+	image_cache_init();
+
+	err = fleet_target_bid(&f);
+	if (err)
+		goto fini_cache;
+
+	err = fleet_collect_pids(&f);
+	if (err)
+		goto fini_cache;
+
+	if (!f.nr_pids) {
+		pr_msg("No processes with Build ID %s found\n", f.target_bid);
+		goto fini_cache;
+	}
+
+	err = fleet_run(&f, jobs);
+	if (!err)
+		err = fleet_summary(&f);
+
+fini_cache:
+	image_cache_fini();
+	elf_cache_fini();
+	sem_destroy(&f.freeze_limit);
+	free(f.pids);
+	return err;
+}
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "include/image.h"
+#include "include/plan.h"
+#include "include/vma.h"
+#include "include/util.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/*
+ * Patch image is a copy of the patch file, which already contains all the
+ * planned writes to the patch mappings (relocations and static references).
+ * Processes with the same layout get the same plan, so they can map the image
+ * instead of the patch file and share relocated pages. Image is a valid ELF
+ * with the same layout as the patch, so mapped image is found as an applied
+ * patch and can be reverted as usual.
+ *
+ * Image is a read-only file in /dev/shm, owned by nsb user: target processes
+ * of any user can open it, but can't change it.
+ */
+#define IMAGE_PATH_FMT		"/dev/shm/nsb-image-%s-%lx"
+
+struct patch_image_s {
+	struct list_head	list;
+	uint64_t		maps_digest;
+	char			*patch_bid;
+	char			*path;
+	int			fd;
+	struct apply_plan_s	*plan;
+};
+
+static struct image_cache_s {
+	pthread_mutex_t		lock;
+	int			users;
+	int			enabled;
+	struct list_head	images;
+} image_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.images = LIST_HEAD_INIT(image_cache.images),
+};
+
+static void image_destroy(struct patch_image_s *pimg)
+{
+	if (pimg->plan)
+		plan_destroy(pimg->plan);
+	if (pimg->fd >= 0)
+		close(pimg->fd);
+	if (pimg->path && unlink(pimg->path))
+		pr_perror("failed to remove patch image %s", pimg->path);
+	free(pimg->path);
+	free(pimg->patch_bid);
+	free(pimg);
+}
+
+static int image_copy_file(struct patch_image_s *pimg, const char *path)
+{
+	struct stat st;
+	uint8_t *buf;
+	ssize_t ret;
+	int err = 0;
+
+	if (stat(path, &st)) {
+		pr_perror("failed to stat %s", path);
+		return -errno;
+	}
+
+	buf = xmalloc(st.st_size);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = read_file(path, buf, 0, st.st_size);
+	if (ret != st.st_size) {
+		if (ret >= 0)
+			pr_err("failed to read %s: short read\n", path);
+		err = (ret < 0) ? ret : -EIO;
+		goto free_buf;
+	}
+
+	if (pwrite(pimg->fd, buf, st.st_size, 0) != st.st_size) {
+		pr_perror("failed to write patch image");
+		err = -errno;
+	}
+
+free_buf:
+	free(buf);
+	return err;
+}
+
+/*
+ * Image has the layout of the patch file, so the mappings are the same.
+ */
+static int image_add_vmas(struct patch_image_s *pimg,
+			  const struct apply_plan_s *plan)
+{
+	const struct vma_area *vma;
+	int err;
+
+	err = image_copy_file(pimg, plan->patch_path);
+	if (err)
+		return err;
+
+	list_for_each_entry(vma, &plan->vmas, list) {
+		err = plan_add_vma(pimg->plan, vma);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static off_t image_write_offset(const struct apply_plan_s *iplan,
+				const struct plan_write_s *pw)
+{
+	const struct vma_area *vma;
+
+	list_for_each_entry(vma, &iplan->vmas, list) {
+		if (pw->addr < vma_start(vma))
+			continue;
+		if (pw->addr + pw->size > vma_end(vma))
+			continue;
+		return vma_offset(vma) + pw->addr - vma_start(vma);
+	}
+	return -ENOENT;
+}
+
+/*
+ * Writes into patch mappings are done to the image. All the others (if any)
+ * are still done to the process.
+ */
+static int image_add_writes(struct patch_image_s *pimg,
+			    const struct apply_plan_s *plan)
+{
+	const struct plan_write_s *pw;
+	off_t offset;
+	int err;
+
+	list_for_each_entry(pw, &plan->writes, list) {
+		offset = image_write_offset(pimg->plan, pw);
+		if (offset < 0) {
+			err = plan_record_write(pimg->plan, pw->addr,
+						pw->data, pw->size);
+			if (err)
+				return err;
+			continue;
+		}
+
+		if (pwrite(pimg->fd, pw->data, pw->size, offset) != pw->size) {
+			pr_perror("failed to write patch image");
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+static int image_add_jumps(struct patch_image_s *pimg,
+			   const struct apply_plan_s *plan)
+{
+	const struct plan_jump_s *pj;
+	int err;
+
+	list_for_each_entry(pj, &plan->jumps, list) {
+		err = plan_add_jump(pimg->plan, pj->name, pj->addr,
+				    pj->code, pj->jump);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int image_create_plan(struct patch_image_s *pimg,
+			     const struct apply_plan_s *plan)
+{
+	int err;
+
+	pimg->plan = plan_create(NULL, NULL);
+	if (!pimg->plan)
+		return -ENOMEM;
+
+	pimg->plan->patch_path = xstrdup(pimg->path);
+	pimg->plan->target_bid = xstrdup(plan->target_bid);
+	pimg->plan->patch_bid = xstrdup(plan->patch_bid);
+	if (!pimg->plan->patch_path || !pimg->plan->target_bid ||
+	    !pimg->plan->patch_bid)
+		return -ENOMEM;
+
+	pimg->plan->maps_digest = plan->maps_digest;
+
+	err = image_add_vmas(pimg, plan);
+	if (err)
+		return err;
+
+	err = image_add_writes(pimg, plan);
+	if (err)
+		return err;
+
+	return image_add_jumps(pimg, plan);
+}
+
+static int image_create(const struct apply_plan_s *plan,
+			struct patch_image_s **image)
+{
+	struct patch_image_s *pimg;
+	int err = -ENOMEM;
+
+	pimg = xzalloc(sizeof(*pimg));
+	if (!pimg)
+		return -ENOMEM;
+
+	pimg->fd = -1;
+	pimg->maps_digest = plan->maps_digest;
+	pimg->patch_bid = xstrdup(plan->patch_bid);
+	if (!pimg->patch_bid)
+		goto destroy_image;
+
+	if (asprintf(&pimg->path, IMAGE_PATH_FMT, plan->patch_bid,
+		     plan->maps_digest) < 0) {
+		pimg->path = NULL;
+		goto destroy_image;
+	}
+
+	/* Stale image could be left by a killed nsb */
+	if (unlink(pimg->path) && (errno != ENOENT)) {
+		pr_perror("failed to remove stale patch image %s", pimg->path);
+		err = -errno;
+		goto free_path;
+	}
+
+	pimg->fd = open(pimg->path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW |
+				    O_CLOEXEC, 0444);
+	if (pimg->fd < 0) {
+		pr_perror("failed to create patch image %s", pimg->path);
+		err = -errno;
+		goto free_path;
+	}
+
+	err = image_create_plan(pimg, plan);
+	if (err)
+		goto destroy_image;
+
+	/* Image is shared by processes and must never change */
+	close(pimg->fd);
+	pimg->fd = -1;
+
+	*image = pimg;
+	return 0;
+
+free_path:
+	free(pimg->path);
+	pimg->path = NULL;
+
+destroy_image:
+	image_destroy(pimg);
+	return err;
+}
+
+static struct patch_image_s *image_cache_lookup(uint64_t maps_digest,
+						const char *patch_bid)
+{
+	struct patch_image_s *pimg;
+
+	list_for_each_entry(pimg, &image_cache.images, list) {
+		if ((pimg->maps_digest == maps_digest) &&
+		    !strcmp(pimg->patch_bid, patch_bid))
+			return pimg;
+	}
+	return NULL;
+}
+
+/*
+ * Returns image plan for processes with the layout, if any. The plan belongs
+ * to the cache.
+ */
+const struct apply_plan_s *image_cache_find(uint64_t maps_digest,
+					    const char *patch_bid)
+{
+	struct patch_image_s *pimg;
+
+	if (!image_cache.enabled)
+		return NULL;
+
+	pthread_mutex_lock(&image_cache.lock);
+	pimg = image_cache_lookup(maps_digest, patch_bid);
+	pthread_mutex_unlock(&image_cache.lock);
+
+	return pimg ? pimg->plan : NULL;
+}
+
+/*
+ * Creates an image from the plan. If an image for the layout was created in
+ * the meantime by another process, the plan is used as is.
+ */
+const struct apply_plan_s *image_cache_add(const struct apply_plan_s *plan)
+{
+	struct patch_image_s *pimg = NULL;
+
+	if (!image_cache.enabled)
+		return NULL;
+
+	pthread_mutex_lock(&image_cache.lock);
+	if (!image_cache_lookup(plan->maps_digest, plan->patch_bid)) {
+		pr_info("= Creating patch image for layout %#lx\n",
+				plan->maps_digest);
+
+		if (!image_create(plan, &pimg))
+			list_add_tail(&pimg->list, &image_cache.images);
+	}
+	pthread_mutex_unlock(&image_cache.lock);
+
+	return pimg ? pimg->plan : NULL;
+}
+
+/*
+ * Images are used by all the concurrent users of the cache, so they are
+ * destroyed by the last one.
+ */
+void image_cache_init(void)
+{
+	pthread_mutex_lock(&image_cache.lock);
+	image_cache.users++;
+	image_cache.enabled = 1;
+	pthread_mutex_unlock(&image_cache.lock);
+}
+
+void image_cache_fini(void)
+{
+	struct patch_image_s *pimg, *tmp;
+
+	pthread_mutex_lock(&image_cache.lock);
+	if (!image_cache.users || --image_cache.users)
+		goto unlock;
+
+	image_cache.enabled = 0;
+	list_for_each_entry_safe(pimg, tmp, &image_cache.images, list) {
+		list_del(&pimg->list);
+		image_destroy(pimg);
+	}
+
+unlock:
+	pthread_mutex_unlock(&image_cache.lock);
+}
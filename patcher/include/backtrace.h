@@ -1,8 +1,12 @@
 #ifndef __PATCHER_BACKTRACE_H__
 #define __PATCHER_BACKTRACE_H__
 
+#include <stdint.h>
+#include <sys/types.h>
+
 struct backtrace_s;
-int pid_backtrace(pid_t pid, struct backtrace_s **backtrace);
+int pid_backtrace(pid_t pid, const uint64_t *hooks, size_t nr_hooks,
+		  struct backtrace_s **backtrace);
 void destroy_backtrace(struct backtrace_s *bt);
 
 struct func_jump_s;
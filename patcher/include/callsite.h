@@ -0,0 +1,24 @@
+#ifndef __PATCHER_CALLSITE_H__
+#define __PATCHER_CALLSITE_H__
+
+#include <stdint.h>
+
+struct patch_s;
+int patch_collect_call_sites(struct patch_s *p);
+
+struct process_ctx_s;
+struct func_jump_s;
+int retarget_call_sites(struct process_ctx_s *ctx, const struct patch_s *p,
+			const struct func_jump_s *fj,
+			uint64_t from, uint64_t to);
+
+int patch_collect_got_slots(struct process_ctx_s *ctx, struct patch_s *p);
+int retarget_got_slots(struct process_ctx_s *ctx, const struct func_jump_s *fj,
+		       uint64_t from, uint64_t to);
+
+int patch_collect_data_pointers(struct patch_s *p);
+int retarget_data_pointers(struct process_ctx_s *ctx,
+			   const struct func_jump_s *fj,
+			   uint64_t from, uint64_t to);
+
+#endif /* __PATCHER_CALLSITE_H__ */
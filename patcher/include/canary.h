@@ -0,0 +1,62 @@
+#ifndef __PATCHER_CANARY_H__
+#define __PATCHER_CANARY_H__
+
+#include <stdint.h>
+
+#include "x86_64.h"
+
+/*
+ * Canary memory layout. Only the counters are shared: nsb reads them and
+ * changes the share of calls at any time. Frames table of timed calls and
+ * the code (dispatcher, function descriptors, thunks and old function
+ * copies) are private to the process and follow the counters.
+ */
+#define CANARY_MAX_FUNCS	127
+
+#define CANARY_MAGIC		0x5952414e4143534eUL	/* "NSCANARY" */
+
+/* Path 0 is the old function copy, path 1 is the new function */
+struct canary_func {
+	uint32_t		ratio;		/* of 65536 calls go to path 1 */
+	uint32_t		timing;
+	uint64_t		calls[2];
+	uint64_t		cycles[2];
+	uint64_t		timed[2];
+	char			name[72];
+};
+
+struct canary_shm {
+	uint64_t		magic;
+	uint32_t		nr_funcs;
+	uint32_t		pad;
+	uint64_t		code;
+	uint8_t			reserved[104];
+	struct canary_func	funcs[CANARY_MAX_FUNCS];
+};
+
+#define CANARY_SHM_SIZE		sizeof(struct canary_shm)
+#define CANARY_CODE_OFFSET	(CANARY_SHM_SIZE + X86_64_TIMER_FRAMES_SIZE)
+
+/* Function descriptor, loaded by the thunk */
+struct canary_desc {
+	uint64_t		target[2];
+	uint64_t		func;		/* struct canary_func address */
+};
+
+/* Code part: dispatcher, descriptors, thunks and old function copies */
+#define CANARY_DESCS_OFFSET	0x140
+#define CANARY_THUNKS_OFFSET	0xd40
+#define CANARY_THUNK_SIZE	16
+
+#define CANARY_RATIO_MAX	65536
+
+struct process_ctx_s;
+struct patch_s;
+int canary_setup(struct process_ctx_s *ctx, struct patch_s *p, int percent);
+int canary_find(const struct process_ctx_s *ctx, struct patch_s *p);
+int canary_check_stack(const struct process_ctx_s *ctx,
+		       const struct patch_s *p);
+int canary_unload(struct process_ctx_s *ctx, const struct patch_s *p);
+int canary_control(const struct process_ctx_s *ctx, int percent);
+
+#endif /* __PATCHER_CANARY_H__ */
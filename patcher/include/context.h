@@ -4,8 +4,10 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <semaphore.h>
 
 #include "list.h"
+#include "patch.h"
 #include "service.h"
 #include "vma.h"
 
@@ -20,6 +22,11 @@ struct marked_sym_s {
 	int64_t			addr;
 };
 
+struct func_variant_s {
+	uint64_t		patch_value;
+	uint64_t		features;
+};
+
 struct func_jump_s {
 	char			*name;
 	uint64_t		func_value;
@@ -29,6 +36,28 @@ struct func_jump_s {
 	uint64_t		func_addr;
 	uint8_t			code[8];
 	uint8_t			func_jump[8];
+
+	/* New function variants (the first one is baseline) */
+	struct func_variant_s	*variants;
+	size_t			n_variants;
+
+	/* New body, if it can be copied over the old one (inplace > 0) */
+	uint64_t		patch_addr;
+	uint32_t		patch_size;
+	uint8_t			*inplace_code;
+	int			inplace;
+
+	/* Direct calls in target ELF (addresses of call instructions) */
+	uint64_t		*call_sites;
+	size_t			nr_call_sites;
+
+	/* PLT slots in process, bound to the function */
+	uint64_t		*got_slots;
+	size_t			nr_got_slots;
+
+	/* Function pointers in target data */
+	uint64_t		*data_ptrs;
+	size_t			nr_data_ptrs;
 };
 
 struct patch_info_s {
@@ -48,13 +77,41 @@ struct patch_info_s {
 	struct static_sym_s	**static_syms;
 };
 
+/*
+ * Redirections, made by applied patch, are recorded in its mapping (ELF header
+ * padding), so that revert restores only them.
+ */
+#define PATCH_REDIRECT_CALLS		(1 << 0)
+#define PATCH_REDIRECT_GOT		(1 << 1)
+#define PATCH_REDIRECT_POINTERS		(1 << 2)
+#define PATCH_REDIRECT_ALL		(PATCH_REDIRECT_CALLS |		\
+					 PATCH_REDIRECT_GOT |		\
+					 PATCH_REDIRECT_POINTERS)
+#define PATCH_RETIRED			(1 << 6)	/* reverted, but mapped */
+#define PATCH_REDIRECT_RECORDED		(1 << 7)
+
 struct patch_s {
 	struct patch_info_s	pi;
+	const char		*path;
+	struct elf_info_s	*ei;
 	const struct dl_map	*target_dlm;
 	struct list_head	rela_plt;
 	struct list_head	rela_dyn;
 	const struct dl_map	*patch_dlm;
 	struct list_head	list;
+	int			call_sites_collected;
+	int			got_slots_collected;
+	int			data_ptrs_collected;
+	unsigned		redirects;
+
+	/* Canary dispatch code, if function jumps lead to it */
+	uint64_t		canary_code;
+	uint64_t		canary_end;
+
+	/* Transaction members */
+	struct list_head	txn;
+	uint64_t		stack_start;
+	uint64_t		stack_end;
 };
 
 struct ctx_dep {
@@ -69,10 +126,9 @@ typedef	int (*check_backtrace_t)(const struct process_ctx_s *ctx,
 
 struct process_ctx_s {
 	pid_t			pid;
-	const char		*patchfile;
 	int			dry_run;
+	struct patch_opts	opts;
 
-	struct elf_info_s	*patch_ei;
 	check_backtrace_t	check_backtrace;
 
 	struct parasite_ctl	*ctl;
@@ -81,9 +137,21 @@ struct process_ctx_s {
 	struct list_head	dl_maps;
 	struct list_head	applied_patches;
 	struct vma_area		remote_vma;
+	int			trampoline;
 	struct list_head	needed_list;
 	struct list_head	threads;
 	struct patch_s		*patch;
+	struct apply_plan_s	*plan;
+	struct list_head	txn_apply;
+	struct list_head	txn_revert;
+	sem_t			*freeze_limit;
+	int			frozen;
+	pid_t			*parked;
+	int			nr_parked;
+	struct service_reloc	*relocs;
+	size_t			nr_relocs;
+	uint64_t		loader_start;
+	uint64_t		loader_end;
 };
 
 #define P(ctx)			ctx->patch
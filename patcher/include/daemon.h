@@ -0,0 +1,11 @@
+#ifndef __PATCHER_DAEMON_H__
+#define __PATCHER_DAEMON_H__
+
+#define NSBD_SOCKET_PATH	"/var/run/nsbd.sock"
+
+struct options;
+
+int daemon_serve(const char *path, int jobs, int (*run)(struct options *o));
+int daemon_request(const char *path, const struct options *o);
+
+#endif /* __PATCHER_DAEMON_H__ */
@@ -26,6 +26,8 @@ const struct dl_map *find_dl_map_by_addr(const struct list_head *dl_maps,
 					 unsigned long addr);
 
 int64_t dl_get_symbol_value(const struct list_head *dl_maps, const char *name);
+int64_t dl_find_symbol(const struct list_head *dl_maps, const char *name,
+		       const struct dl_map **dlm);
 int64_t dl_map_symbol_value(const struct dl_map *dlm, const char *name);
 
 uint64_t dl_map_start(const struct dl_map *dlm);
@@ -34,6 +36,7 @@ uint64_t dl_map_end(const struct dl_map *dlm);
 uint64_t dlm_load_base(const struct dl_map *dlm);
 
 struct dl_map *alloc_dl_map(struct elf_info_s *ei, const char *path);
+void free_dl_maps(struct list_head *head);
 
 int iterate_dl_vmas(const struct dl_map *dlm, void *data,
 		    int (*actor)(struct vma_area *vma, void *data));
@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "list.h"
 
@@ -18,10 +19,15 @@ int unload_elf(struct process_ctx_s *ctx, const struct dl_map *dlm);
 struct elf_info_s;
 int elf_create_info(const char *path, struct elf_info_s **elf_info);
 void elf_destroy_info(struct elf_info_s *ei);
+int elf_get_info(const char *path, struct elf_info_s **elf_info);
+void elf_put_info(struct elf_info_s *ei);
+void elf_cache_init(void);
+void elf_cache_fini(void);
 struct patch_info_s;
 int elf_info_binpatch(struct patch_info_s *pi, struct elf_info_s *ei);
 
 char *elf_build_id(const char *path);
+int elf_peek(const char *path, char **bid, int *patch);
 const char *elf_path(struct elf_info_s *ei);
 const char *elf_bid(struct elf_info_s *ei);
 int elf_type_dyn(const struct elf_info_s *ei);
@@ -70,13 +76,69 @@ const char *es_binding(const struct extern_symbol *es);
 const char *es_relocation(const struct extern_symbol *es);
 
 int64_t elf_dyn_sym_value(struct elf_info_s *ei, const char *name);
+const char *elf_es_version(struct elf_info_s *ei, const struct extern_symbol *es);
+int64_t elf_dyn_sym_value_version(struct elf_info_s *ei, const char *name,
+				  const char *version, bool *ifunc);
 
 int elf_reloc_sym(struct extern_symbol *es, uint64_t address);
 
+int elf_dyn_sym_ifunc(struct elf_info_s *ei, const char *name);
+
+struct elf_segment {
+	uint64_t		vaddr;
+	uint64_t		offset;
+	uint64_t		filesz;
+	uint64_t		memsz;
+	int			prot;
+};
+
+ssize_t elf_load_segments(struct elf_info_s *ei, struct elf_segment **segments);
+
+struct elf_init_info {
+	uint64_t		init;
+	uint64_t		init_array;
+	size_t			nr_init_array;
+	uint64_t		fini;
+	uint64_t		fini_array;
+	size_t			nr_fini_array;
+	uint64_t		eh_frame;
+};
+
+int elf_init_info(struct elf_info_s *ei, struct elf_init_info *ii);
+
+struct elf_dyn_reloc {
+	uint64_t		offset;
+	uint32_t		type;
+	int64_t			addend;
+	const char		*name;
+	const char		*version;	/* required, if undefined */
+	uint64_t		value;
+	bool			defined;
+	bool			weak;
+	bool			ifunc;
+};
+
+int elf_iterate_dyn_relocs(struct elf_info_s *ei,
+			   int (*actor)(const struct elf_dyn_reloc *r, void *data),
+			   void *data);
+
 int elf_contains_sym(struct elf_info_s *ei, const char *symname);
 
 int64_t elf_section_virt_base(const struct elf_info_s *ei, uint16_t ndx);
 
-int elf_info_fd(const struct elf_info_s *ei);
+int elf_info_open(const struct elf_info_s *ei);
+
+struct elf_func {
+	uint64_t		value;
+	uint64_t		size;
+};
+
+ssize_t elf_functions(struct elf_info_s *ei, struct elf_func **funcs);
+int elf_find_function(struct elf_info_s *ei, const char *name,
+		      struct elf_func *fn);
+int elf_iterate_exec_sections(struct elf_info_s *ei,
+			      int (*actor)(uint64_t addr, const uint8_t *code,
+					   size_t size, void *data),
+			      void *data);
 
 #endif /* __PATCHER_ELF_H__ */
@@ -0,0 +1,8 @@
+#ifndef __PATCHER_FLEET_H__
+#define __PATCHER_FLEET_H__
+
+struct patch_opts;
+int patch_fleet(const char *patchfile, int jobs, int max_frozen,
+		int dry_run, int no_plugin, const struct patch_opts *opts);
+
+#endif /* __PATCHER_FLEET_H__ */
@@ -0,0 +1,15 @@
+#ifndef __PATCHER_IMAGE_H__
+#define __PATCHER_IMAGE_H__
+
+#include <stdint.h>
+
+struct apply_plan_s;
+
+void image_cache_init(void);
+void image_cache_fini(void);
+
+const struct apply_plan_s *image_cache_find(uint64_t maps_digest,
+					    const char *patch_bid);
+const struct apply_plan_s *image_cache_add(const struct apply_plan_s *plan);
+
+#endif /* __PATCHER_IMAGE_H__ */
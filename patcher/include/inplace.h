@@ -0,0 +1,23 @@
+#ifndef __PATCHER_INPLACE_H__
+#define __PATCHER_INPLACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct process_ctx_s;
+struct func_jump_s;
+int func_inplace_code(const struct process_ctx_s *ctx, struct func_jump_s *fj);
+int func_inplace_applied(const struct process_ctx_s *ctx,
+			 struct func_jump_s *fj);
+int write_func_inplace(const struct process_ctx_s *ctx,
+		       const struct func_jump_s *fj);
+
+int relocate_code(const char *name, uint8_t *code, size_t size,
+		  uint64_t from, uint64_t to);
+int code_refers_range(const char *name, const uint8_t *code, size_t size,
+		      uint64_t addr, uint64_t start, uint64_t end);
+
+int process_write_code(const struct process_ctx_s *ctx, uint64_t addr,
+		       const uint8_t *code, size_t size);
+
+#endif /* __PATCHER_INPLACE_H__ */
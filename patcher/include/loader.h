@@ -0,0 +1,24 @@
+#ifndef __PATCHER_LOADER_H__
+#define __PATCHER_LOADER_H__
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "elf.h"
+
+struct dl_map;
+struct elf_image {
+	char			*path;
+	struct dl_map		*dlm;
+	uint64_t		base;
+	size_t			size;
+	struct elf_init_info	ii;
+	uint64_t		eh_frame;
+};
+
+struct process_ctx_s;
+struct service;
+int load_service_elf(struct process_ctx_s *ctx, struct service *service);
+int unload_service_elf(struct process_ctx_s *ctx, struct service *service);
+
+#endif /* __PATCHER_LOADER_H__ */
@@ -18,7 +18,15 @@ extern void print_on_level(unsigned int loglevel, const char *format, ...)
 	__attribute__ ((__format__ (__printf__, 2, 3)));
 extern void __print_on_level(unsigned int loglevel, const char *format, va_list params);
 
+struct log_thread_s {
+	int		msgfd;
+	int		logfd;
+	unsigned int	loglevel;
+};
+
 extern int log_get_fd(void);
+extern void log_get_thread(struct log_thread_s *lt);
+extern void log_set_thread(const struct log_thread_s *lt);
 extern int log_init(const char *output);
 extern void log_fini(void);
 extern void log_set_loglevel(unsigned int level);
@@ -0,0 +1,40 @@
+#ifndef __PATCHER_OPTIONS_H__
+#define __PATCHER_OPTIONS_H__
+
+#include <sys/types.h>
+
+#define MAX_PATCH_FILES		64
+
+struct options {
+	const char	*command;
+	pid_t		 pid;
+	const char	*patch_path;
+	const char	*patch_paths[MAX_PATCH_FILES];
+	int		nr_patch_paths;
+	const char	*revert_paths[MAX_PATCH_FILES];
+	int		nr_revert_paths;
+	const char	*plan_path;
+	const char	*socket_path;
+	int		verbosity;
+	int		(*handler)(const struct options *o);
+	int		dry_run;
+	int		no_plugin;
+	int		all;
+	int		jobs;
+	int		max_frozen;
+	int		resident;
+	int		map_service;
+	int		rewrite_calls;
+	int		redirect_got;
+	int		redirect_pointers;
+	int		in_place;
+	int		relax_got;
+	int		canary;
+	int		canary_ratio;
+	int		canary_timing;
+	int		precompute;
+	const char	*probe_action;
+	const char	*probe_func;
+};
+
+#endif /* __PATCHER_OPTIONS_H__ */
@@ -2,16 +2,101 @@
 #define __PATCHER_PATCH_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <semaphore.h>
 
 #define VZPATCH_SECTION		"vzpatch"
 
 struct backtrace_s;
 struct process_ctx_s;
 
-int patch_process(pid_t pid, const char *patchfile, int dry_run, int no_plugin);
+/*
+ * Patching options of one call. NULL options mean defaults (all off).
+ */
+struct patch_opts {
+	/*
+	 * Direct calls to patched functions in target are retargeted to the
+	 * new functions, saving a jump per call. Function jumps are written
+	 * anyway: they are still used by indirect calls and calls from other
+	 * objects.
+	 */
+	bool			rewrite_calls;
+	/*
+	 * PLT slots of all the loaded objects, bound to patched functions, are
+	 * set to the new functions. Unlike direct calls rewriting, text pages
+	 * are not touched (except for the function jumps).
+	 */
+	bool			redirect_got;
+	/*
+	 * Function pointers in target data, found by its relocations, are set
+	 * to the new functions.
+	 */
+	bool			redirect_pointers;
+	/*
+	 * New function body is copied over the old one, if it fits and has
+	 * neither calls, nor indirect jumps. Otherwise the function jump is
+	 * written as usual.
+	 */
+	bool			in_place;
+	/*
+	 * Patch references to resolved symbols via GOT and PLT are replaced
+	 * with direct RIP-relative ones, when the symbols are in reach.
+	 */
+	bool			relax_got;
+	/*
+	 * Service is mapped by nsb loader instead of dlopen: loader lock is
+	 * not taken, and no dynamic linker state is changed. Dlopen is still
+	 * used, when the service can't be mapped this way.
+	 */
+	bool			map_service;
+	/*
+	 * Function jumps lead to canary dispatch, sending canary_ratio percent
+	 * of calls to the new functions and the rest to the copies of the old
+	 * ones. With canary_timing the calls are also timed: their return
+	 * address is replaced with the dispatcher return hook.
+	 */
+	bool			canary;
+	int			canary_ratio;
+	bool			canary_timing;
+	/*
+	 * Apply plan is computed before the process is stopped, and the stop
+	 * is only needed to validate and execute it. Service plugin is not
+	 * used.
+	 */
+	bool			precompute;
+};
+
+int patch_process(pid_t pid, const char *patchfile, int dry_run, int no_plugin,
+		  const struct patch_opts *opts);
+int patch_process_limited(pid_t pid, const char *patchfile, int dry_run,
+			  int no_plugin, const struct patch_opts *opts,
+			  sem_t *freeze_limit);
+int resident_patch_process(pid_t pid, const char *patchfile, int dry_run,
+			   const struct patch_opts *opts);
+int stage_process(pid_t pid, const char *patchfile, int dry_run, int no_plugin,
+		  const struct patch_opts *opts);
+int commit_process(pid_t pid, const char *patchfile, int dry_run,
+		   const struct patch_opts *opts);
+int plan_process(pid_t pid, const char *patchfile, const char *planfile);
+int apply_plan_process(pid_t pid, const char *patchfile, const char *planfile,
+		       int dry_run);
+
+struct apply_plan_s;
+int compute_plan_process(pid_t pid, const char *patchfile,
+			 struct apply_plan_s **plan);
+int execute_plan_process(pid_t pid, const char *patchfile,
+			 const struct apply_plan_s *plan, int dry_run);
 int check_process(pid_t pid, const char *patchfile);
+int canary_process(pid_t pid, const char *patchfile, int percent);
+int probe_attach_process(pid_t pid, const char *func, int dry_run);
+int probe_detach_process(pid_t pid, const char *func, int dry_run);
+int probe_report_process(pid_t pid, const char *func);
 int list_process_patches(pid_t pid);
 int unpatch_process(pid_t pid, const char *patchfile, int dry_run);
+int patch_process_set(pid_t pid, const char * const *apply, int nr_apply,
+		      const char * const *revert, int nr_revert,
+		      int dry_run, int no_plugin,
+		      const struct patch_opts *opts);
 
 struct dl_map;
 struct patch_s;
@@ -19,5 +104,6 @@ int create_patch_by_dlm(struct process_ctx_s *ctx, const struct dl_map *dlm,
 			struct patch_s **patch);
 
 struct patch_s *find_patch_by_bid(struct process_ctx_s *ctx, const char *bid);
+int patch_staged(struct process_ctx_s *ctx, const struct patch_s *p);
 
 #endif /* __PATCHER_PATCH_H__ */
@@ -0,0 +1,75 @@
+#ifndef __PATCHER_PLAN_H__
+#define __PATCHER_PLAN_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+
+struct plan_write_s {
+	struct list_head	list;
+	uint64_t		addr;
+	size_t			size;
+	uint8_t			*data;
+};
+
+struct plan_jump_s {
+	struct list_head	list;
+	char			*name;
+	uint64_t		addr;
+	uint8_t			code[8];
+	uint8_t			jump[8];
+};
+
+/*
+ * Apply plan is a list of all the changes, which have to be done to the
+ * process to apply a patch. It's computed while the process is running and
+ * thus the only thing to do after stopping it is to make sure, that process
+ * address space wasn't changed and execute the plan.
+ */
+struct apply_plan_s {
+	char			*target_bid;
+	char			*patch_bid;
+	char			*patch_path;
+	uint64_t		maps_digest;
+	struct list_head	vmas;
+	struct list_head	writes;
+	struct list_head	jumps;
+	int			recording;
+};
+
+struct process_ctx_s;
+struct patch_s;
+struct dl_map;
+
+struct apply_plan_s *plan_create(const struct patch_s *p, const char *patch_path);
+void plan_destroy(struct apply_plan_s *plan);
+
+int plan_recording(const struct apply_plan_s *plan);
+int plan_record_write(struct apply_plan_s *plan, uint64_t addr,
+		      const void *data, size_t size);
+int plan_record_dl_map(struct apply_plan_s *plan, const struct dl_map *dlm);
+int plan_record_jumps(const struct process_ctx_s *ctx,
+		      struct apply_plan_s *plan, const struct patch_s *p);
+
+struct vma_area;
+int plan_add_vma(struct apply_plan_s *plan, const struct vma_area *vma);
+int plan_add_jump(struct apply_plan_s *plan, const char *name,
+		  uint64_t addr, const uint8_t *code, const uint8_t *jump);
+
+uint64_t plan_maps_digest(const struct list_head *vmas);
+
+int plan_validate(struct process_ctx_s *ctx, const struct apply_plan_s *plan);
+int plan_execute(struct process_ctx_s *ctx, const struct apply_plan_s *plan);
+
+int plan_stage(struct process_ctx_s *ctx, struct apply_plan_s *plan);
+void plan_unstage(struct process_ctx_s *ctx, const struct apply_plan_s *plan);
+int plan_validate_staged(struct process_ctx_s *ctx,
+			 const struct apply_plan_s *plan);
+int plan_commit(struct process_ctx_s *ctx, const struct apply_plan_s *plan);
+
+void plan_print(const struct apply_plan_s *plan);
+int plan_save(const struct apply_plan_s *plan, const char *path);
+int plan_load(const char *path, struct apply_plan_s **plan);
+
+#endif /* __PATCHER_PLAN_H__ */
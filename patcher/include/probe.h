@@ -0,0 +1,66 @@
+#ifndef __PATCHER_PROBE_H__
+#define __PATCHER_PROBE_H__
+
+#include <stdint.h>
+
+#include "x86_64.h"
+
+/*
+ * Probe memory layout. Only the header and the rings are shared: they are
+ * read by nsb while the process runs. Frames table of timed calls, probe
+ * code with displaced function prologue and saved function entry are
+ * private to the process and follow the shared part.
+ */
+#define PROBE_NR_RINGS		64
+#define PROBE_RING_SIZE		1024
+
+#define PROBE_MAGIC		0x45424f525042534eUL	/* "NSBPROBE" */
+
+struct probe_header {
+	uint64_t		magic;
+	uint32_t		nr_rings;
+	uint32_t		ring_size;
+	uint64_t		func;
+	uint8_t			reserved[40];
+	char			name[64];
+	char			object[128];
+};
+
+struct probe_record {
+	uint64_t		entry;
+	uint64_t		exit;
+};
+
+/* Threads are spread over the rings by thread pointer */
+struct probe_ring {
+	uint64_t		head;
+	uint64_t		calls;
+	uint64_t		untimed;	/* frames table was full */
+	uint64_t		pad[5];
+	struct probe_record	records[PROBE_RING_SIZE];
+};
+
+struct probe_shm {
+	struct probe_header	hdr;
+	struct probe_ring	rings[PROBE_NR_RINGS];
+};
+
+#define PROBE_SHM_SIZE		0x102000
+#define PROBE_CODE_OFFSET	(PROBE_SHM_SIZE + X86_64_TIMER_FRAMES_SIZE)
+
+/* Function entry, restored on detach, is kept at the end of code page */
+#define PROBE_SAVED_OFFSET	0xf00
+
+struct probe_saved {
+	uint64_t		magic;
+	uint64_t		func;
+	uint8_t			orig[8];	/* function entry before probe */
+	uint8_t			jump[8];	/* function entry with probe */
+};
+
+struct process_ctx_s;
+int probe_attach(struct process_ctx_s *ctx, const char *name);
+int probe_detach(struct process_ctx_s *ctx, const char *name);
+int probe_report(const struct process_ctx_s *ctx, const char *name);
+
+#endif /* __PATCHER_PROBE_H__ */
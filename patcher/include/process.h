@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <fcntl.h>
+#include <sys/types.h>
+#include <stdbool.h>
 
 struct process_ctx_s;
 
@@ -24,13 +26,34 @@ int process_open_file(struct process_ctx_s *ctx, const char *path,
 int process_close_file(struct process_ctx_s *ctx, int fd);
 
 int process_suspend(struct process_ctx_s *ctx, const char *target_bid);
+int process_park_threads(struct process_ctx_s *ctx,
+			 const uint64_t *ranges, size_t nr_ranges);
+void process_release_threads(struct process_ctx_s *ctx);
+int process_check_range(const struct process_ctx_s *ctx,
+			uint64_t start, uint64_t end);
+ssize_t process_timer_hooks(const struct process_ctx_s *ctx, uint64_t **hooks);
+int process_get_elf_range(pid_t pid, const char *bid,
+			  uint64_t *start, uint64_t *end);
+int process_get_loader_range(pid_t pid, uint64_t *start, uint64_t *end);
+int process_maps_bid(pid_t pid, const char *bid);
 
 struct dl_map;
 int process_mmap_dl_map(struct process_ctx_s *ctx, const struct dl_map *dlm);
 int process_munmap_dl_map(struct process_ctx_s *ctx, const struct dl_map *dlm);
+int process_mmap_file(struct process_ctx_s *ctx, const struct dl_map *dlm,
+		      int fd);
 
-int64_t process_exec_code(struct process_ctx_s *ctx, uint64_t addr,
-			  void *code, size_t code_size);
+int process_create_shm(const struct process_ctx_s *ctx, const char *path,
+		       size_t size);
+int process_mmap_shm(struct process_ctx_s *ctx, const char *path, int fd,
+		     uint64_t addr, size_t shm_size, size_t code_off,
+		     size_t size);
+int process_munmap_shm(struct process_ctx_s *ctx, const char *path,
+		       uint64_t addr, size_t size);
+
+int64_t process_call(struct process_ctx_s *ctx, uint64_t func,
+		     uint64_t arg0, uint64_t arg1, uint64_t arg2,
+		     uint64_t arg3, uint64_t arg4, uint64_t arg5);
 
 int process_inject_service(struct process_ctx_s *ctx);
 int process_shutdown_service(struct process_ctx_s *ctx);
@@ -42,10 +65,15 @@ int process_find_target_dlm(struct process_ctx_s *ctx);
 
 int64_t process_find_place_for_elf(struct process_ctx_s *ctx,
 				   uint64_t hint, size_t size);
+int process_reserve_dl_map(struct process_ctx_s *ctx, const struct dl_map *dlm);
 
 void process_print_mmap(const struct vma_area *vma);
 void process_print_munmap(const struct vma_area *vma);
 
 int process_send_fd(struct process_ctx_s *ctx, int fd);
 
+int process_write_reloc(struct process_ctx_s *ctx, const struct dl_map *dlm,
+			uint64_t addr, uint64_t value, uint32_t size);
+int process_apply_relocs(struct process_ctx_s *ctx);
+
 #endif
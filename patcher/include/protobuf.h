@@ -3,5 +3,6 @@
 
 int unpack_protobuf_binpatch(struct patch_info_s *binpatch,
 			     const void *data, size_t size);
+void free_protobuf_binpatch(struct patch_info_s *binpatch);
 
 #endif
@@ -0,0 +1,7 @@
+#ifndef __PATCHER_RELAX_H__
+#define __PATCHER_RELAX_H__
+
+struct process_ctx_s;
+int relax_got_refs(struct process_ctx_s *ctx);
+
+#endif /* __PATCHER_RELAX_H__ */
@@ -5,5 +5,6 @@ struct process_ctx_s;
 int collect_relocations(struct process_ctx_s *ctx);
 int resolve_relocations(struct process_ctx_s *ctx);
 int apply_relocations(struct process_ctx_s *ctx);
+int apply_irelative_relocations(struct process_ctx_s *ctx);
 
 #endif
@@ -0,0 +1,6 @@
+#ifndef __PATCHER_SCAN_H__
+#define __PATCHER_SCAN_H__
+
+int scan_processes(const char *patchfile, int jobs);
+
+#endif /* __PATCHER_SCAN_H__ */
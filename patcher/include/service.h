@@ -6,18 +6,43 @@
 #include "list.h"
 
 struct vma_area;
+struct elf_image;
+
+struct service_reloc {
+	uint64_t		addr;
+	uint64_t		value;
+	uint32_t		size;
+	int			prot;
+};
+
+struct service_sym {
+	const char		*name;
+	const char		*version;
+	bool			stop;
+	int			ret;
+	int			idx;
+	uint64_t		value;
+};
 
 struct service {
 	const char		*name;
 	pid_t			pid;
 	uint64_t		handle;
-	struct dl_map		*dlm;
+	const struct dl_map	*dlm;
 	int			sock;
 	uint64_t		runner;
 	bool			loaded;
+	int			agent_sock;
+	bool			resident;
+	bool			preloaded;
+	int			shm_fd;
+	void			*shm;
+	size_t			shm_size;
+	struct elf_image	*image;
 };
 
 struct process_ctx_s;
+int service_discover(struct process_ctx_s *ctx, struct service *service);
 int service_start(struct process_ctx_s *ctx, struct service *plugin);
 int service_stop(struct process_ctx_s *ctx, struct service *plugin);
 
@@ -33,4 +58,40 @@ ssize_t service_needed_array(struct process_ctx_s *ctx, const struct service *se
 int service_transfer_fd(struct process_ctx_s *ctx, struct service *service,
 			int fd);
 
+int service_apply_relocs(struct process_ctx_s *ctx, const struct service *service,
+			 const struct service_reloc *relocs, size_t nr_relocs);
+int service_resolve_syms(struct process_ctx_s *ctx, const struct service *service,
+			 int stop_idx, struct service_sym *syms, size_t nr_syms);
+
+int service_start_agent(struct process_ctx_s *ctx, struct service *service);
+
+int service_agent_connect(struct service *service, pid_t pid);
+void service_agent_disconnect(struct service *service);
+int service_agent_mmap(struct service *service,
+		       const struct list_head *vmas, int fd);
+int service_agent_munmap(struct service *service,
+			 const struct list_head *vmas);
+ssize_t service_agent_needed_array(struct service *service,
+				   uint64_t **needed_array);
+
+struct service_batch;
+struct service_batch *service_batch_create(void);
+void service_batch_destroy(struct service_batch *b);
+int service_batch_add(struct service_batch *b, unsigned cmd, size_t size,
+		      int fd, void **payload);
+int service_batch_add_mmap(struct service_batch *b,
+			   const struct list_head *vmas, int fd);
+int service_batch_add_munmap(struct service_batch *b,
+			     const struct list_head *vmas);
+int service_batch_add_write(struct service_batch *b, uint64_t addr,
+			    const void *data, size_t size, int prot);
+int service_batch_submit(struct service *service, struct service_batch *b);
+int service_batch_result(const struct service_batch *b, int idx,
+			 const void **data, size_t *size);
+
+ssize_t service_agent_park(const struct service *service,
+			   const uint64_t *ranges, size_t nr_ranges,
+			   unsigned timeout_ms, pid_t **tids);
+int service_agent_release(const struct service *service);
+
 #endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include "list.h"
 
 struct vma_area {
@@ -13,6 +14,8 @@ struct vma_area {
 	int                     flags;
 	int                     prot;
 	off_t                   offset;
+	dev_t			dev;
+	ino_t			ino;
 
 	char			*path;
 	char			*map_file;
@@ -65,6 +68,7 @@ uint64_t vma_func_addr(const struct vma_area *vma, uint64_t addr);
 const struct vma_area *first_vma(const struct list_head *vmas);
 const struct vma_area *last_vma(const struct list_head *vmas);
 const struct vma_area *next_vma(const struct vma_area *vma);
+const struct vma_area *find_vma(const struct list_head *vmas, uint64_t addr);
 
 int iter_map_files(pid_t pid,
 		   int (*actor)(pid_t pid, const struct vma_area *vma,
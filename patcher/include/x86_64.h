@@ -1,27 +1,137 @@
 #ifndef __PATCHER_X86_64_H__
 #define __PATCHER_X86_64_H__
 
-/*
- * Maximum size of call command
- */
-#define X86_64_CALL_MAX_SIZE	102
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
 
 uint64_t x86_jump_min_address(uint64_t address);
 uint64_t x86_jump_max_address(uint64_t address);
 
 int x86_jmpq_instruction(unsigned char *buf, size_t size,
 			 uint64_t cur_pos, uint64_t tgt_pos);
+int x86_rel32_offset(uint64_t next_ip, uint64_t tgt_pos, int32_t *rel);
+
+#define X86_MAX_INSN_SIZE		15
+
+#define X86_CALL_REL32			0xe8
+
+/*
+ * Decoded instruction layout. Map is 0 for one byte opcodes, 1 for 0x0f,
+ * 2 for 0x0f38 and 3 for 0x0f3a (VEX and EVEX maps are the same).
+ * Offsets are counted from the instruction start.
+ */
+struct x86_insn {
+	uint8_t		length;
+	uint8_t		map;
+	uint8_t		opcode;
+	uint8_t		opcode_off;
+	uint8_t		modrm_off;
+	uint8_t		disp_off;
+	uint8_t		disp_size;
+	uint8_t		imm_off;
+	uint8_t		imm_size;
+	bool		rip_rel;
+};
+
+int x86_insn_decode(const uint8_t *code, size_t size, struct x86_insn *insn);
+
+/*
+ * CPU features, required by function variants in patch (see
+ * generator/consts.py for the names, used in variant symbols).
+ */
+#define X86_FEATURE_SSE4_2		(1UL << 0)
+#define X86_FEATURE_AVX			(1UL << 1)
+#define X86_FEATURE_AVX2		(1UL << 2)
+#define X86_FEATURE_FMA			(1UL << 3)
+#define X86_FEATURE_BMI2		(1UL << 4)
+#define X86_FEATURE_AVX512F		(1UL << 5)
+#define X86_FEATURE_AVX512BW		(1UL << 6)
+#define X86_FEATURE_AVX512VL		(1UL << 7)
+
+uint64_t x86_cpu_features(void);
+uint64_t x86_tsc_khz(void);
+
+/*
+ * Trampoline is installed once into the remote page. Functions and syscalls
+ * are executed by setting registers only: target (function address or
+ * syscall number) goes to rax and arguments to rdi, rsi, rdx, rcx, r8, r9.
+ * Batch entry executes r13 commands from the table at r12 and stops at the
+ * first failed syscall.
+ */
+#define X86_64_TRAMPOLINE_CALL		0x00
+#define X86_64_TRAMPOLINE_SYSCALL	0x08
+#define X86_64_TRAMPOLINE_BATCH		0x10
+#define X86_64_TRAMPOLINE_SIZE		0x80
+
+#define X86_64_BATCH_CALL		0
+#define X86_64_BATCH_SYSCALL		1
+
+/*
+ * Low byte of flags is the number (starting from 1) of the argument, which
+ * is replaced with the result, saved by the previous command with
+ * X86_64_BATCH_SAVE flag.
+ */
+#define X86_64_BATCH_SAVE		0x100
+
+struct x86_64_batch_cmd {
+	uint64_t	target;
+	uint32_t	type;
+	uint32_t	flags;
+	uint64_t	args[6];
+	int64_t		ret;
+	uint64_t	pad;
+};
+
+const void *x86_64_trampoline(size_t *size);
+
+/*
+ * Timed calls share the timer code: entry saves the return address and TSC
+ * in the frame, found by stack pointer, and replaces the return address with
+ * the return hook (at the code start). The hook restores it and calls the
+ * accounting code, which follows the timer code, with frame data in rsi,
+ * cycles in rdx and entry TSC in rax. Frames table is right before the code.
+ * Entry is called with rax, rdx, rcx, rsi and rdi pushed, and data in rsi;
+ * eax is not zero, if the call is not timed.
+ */
+#define X86_64_TIMER_NR_FRAMES		1024
+#define X86_64_TIMER_FRAMES_SIZE	0x8000
+#define X86_64_TIMER_HOOK		0x00
+#define X86_64_TIMER_ENTER		0x60
+#define X86_64_TIMER_SIZE		0xd0
+
+struct x86_64_timer_frame {
+	uint64_t	sp;		/* return address slot */
+	uint64_t	ret;
+	uint64_t	tsc;
+	uint64_t	data;
+};
+
+bool x86_64_timer_hook(const uint8_t *code);
+uint64_t x86_64_timer_frame(uint64_t hook, uint64_t sp);
+
+/*
+ * Canary dispatcher is entered from function thunk with r11 pointing to the
+ * function descriptor (struct canary_desc). It counts the call in the shared
+ * function counters, chooses the path by low bits of TSC and jumps to the
+ * path target. If timing is on, the call is timed with the path in the low
+ * bit of the counters address.
+ */
+#define X86_64_CANARY_DISPATCH		0xf0
+#define X86_64_CANARY_SIZE		0x130
+
+void x86_64_canary(uint8_t *code);
+
+/*
+ * Probe entry is jumped to from the probed function entry. It counts the
+ * call in the ring, chosen by the thread pointer, and times it with the ring
+ * address as the timer data. Accounting puts entry and exit TSC to the ring.
+ * The displaced function prologue follows the probe code.
+ * Ring layout (struct probe_ring) is hardcoded.
+ */
+#define X86_64_PROBE_ENTRY		0x100
+#define X86_64_PROBE_SIZE		0x143
 
-ssize_t x86_64_call(uint64_t call, uint64_t where,
-		    uint64_t arg0, uint64_t arg1, uint64_t arg2,
-		    uint64_t arg3, uint64_t arg4, uint64_t arg5,
-		    void **code);
-
-ssize_t x86_64_dlopen(uint64_t dlopen_addr, uint64_t name_addr,
-		      uint64_t where,
-		      void **code);
-ssize_t x86_64_dlclose(uint64_t dlopen_addr, uint64_t handle,
-		       uint64_t where,
-		       void **code);
+void x86_64_probe(uint8_t *code, int64_t rings_off);
 
 #endif
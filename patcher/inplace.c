@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "include/inplace.h"
+#include "include/context.h"
+#include "include/process.h"
+#include "include/x86_64.h"
+#include "include/compiler.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/*
+ * New function body is copied over the old one, if it fits. The body is read
+ * from the patch mapping, where it's already relocated, and relative
+ * references outside the body are fixed for the new location. So the patch
+ * mapping stays in place: the body still uses its data, GOT and PLT.
+ * Only leaf functions without indirect jumps and stack frame are replaced: a
+ * call would leave the body on the stack, unwound with the old function
+ * unwind info, jump tables point to the body in the patch, and stack pointer
+ * changes don't match the old unwind info either (signal handlers and
+ * profilers unwind leaf functions too).
+ */
+
+#define X86_JMP_REL32		0xe9
+#define X86_JMP_REL8		0xeb
+
+static bool insn_is_branch_out(const struct x86_insn *insn, const uint8_t *code)
+{
+	uint8_t reg;
+
+	if (insn->map)
+		return false;
+
+	if (insn->opcode == X86_CALL_REL32)
+		return true;
+
+	if (insn->opcode != 0xff)
+		return false;
+
+	/* Indirect call or jump */
+	reg = (code[insn->modrm_off] >> 3) & 0x07;
+	return (reg >= 2) && (reg <= 5);
+}
+
+static uint8_t insn_rex(const struct x86_insn *insn, const uint8_t *code)
+{
+	uint8_t prefix;
+
+	if (!insn->opcode_off)
+		return 0;
+
+	prefix = code[insn->opcode_off - 1];
+	return ((prefix & 0xf0) == 0x40) ? prefix : 0;
+}
+
+/*
+ * Push and pop (including flags), enter and leave, and stack pointer
+ * adjustment by immediate.
+ */
+static bool insn_changes_frame(const struct x86_insn *insn, const uint8_t *code)
+{
+	uint8_t modrm, reg;
+
+	if (insn->map)
+		return false;
+
+	switch (insn->opcode) {
+	case 0x50 ... 0x5f:	/* push/pop reg */
+	case 0x68:		/* push imm32 */
+	case 0x6a:		/* push imm8 */
+	case 0x9c:		/* pushf */
+	case 0x9d:		/* popf */
+	case 0xc8:		/* enter */
+	case 0xc9:		/* leave */
+		return true;
+	case 0x8f:		/* pop r/m */
+		return ((code[insn->modrm_off] >> 3) & 0x07) == 0;
+	case 0xff:		/* push r/m */
+		return ((code[insn->modrm_off] >> 3) & 0x07) == 6;
+	case 0x81:
+	case 0x83:
+		modrm = code[insn->modrm_off];
+		reg = (modrm >> 3) & 0x07;
+		/* add/sub with register rsp (not r12) */
+		return ((modrm & 0xc7) == 0xc4) && !(insn_rex(insn, code) & 0x01) &&
+		       ((reg == 0) || (reg == 5));
+	}
+	return false;
+}
+
+/* Returns size of instruction relative operand (if any) and its offset */
+static int insn_rel_operand(const struct x86_insn *insn, const uint8_t *code,
+			    uint8_t *off)
+{
+	if (insn->rip_rel) {
+		*off = insn->disp_off;
+		return insn->disp_size;
+	}
+
+	*off = insn->imm_off;
+	if (insn->map == 1)
+		return ((insn->opcode & 0xf0) == 0x80) ? insn->imm_size : 0;
+	if (insn->map)
+		return 0;
+
+	switch (insn->opcode) {
+	case X86_CALL_REL32:
+	case X86_JMP_REL32:
+	case X86_JMP_REL8:
+	case 0x70 ... 0x7f:
+	case 0xe0 ... 0xe3:
+		return insn->imm_size;
+	case 0xc7:
+		/* xbegin */
+		return (code[insn->modrm_off] == 0xf8) ? insn->imm_size : 0;
+	}
+	return 0;
+}
+
+/*
+ * Code, copied from "from" to "to", keeps relative references inside it.
+ * References outside are fixed for the new location.
+ */
+static int fix_rel_operand(const char *name, uint8_t *code, size_t code_size,
+			   uint64_t from, uint64_t to, uint64_t off,
+			   const struct x86_insn *insn)
+{
+	uint64_t next_ip = from + off + insn->length;
+	uint64_t end = from + code_size;
+	uint64_t tgt;
+	int64_t rel;
+	int32_t rel32;
+	uint8_t field;
+	int size;
+
+	size = insn_rel_operand(insn, code + off, &field);
+	switch (size) {
+	case 0:
+		return 0;
+	case 1:
+		rel = (int8_t)code[off + field];
+		break;
+	case 4:
+		memcpy(&rel32, code + off + field, sizeof(rel32));
+		rel = rel32;
+		break;
+	default:
+		pr_debug("    \"%s\": %d bytes offset at %#lx\n",
+				name, size, off);
+		return -ENOTSUP;
+	}
+
+	tgt = next_ip + rel;
+	if ((tgt >= from) && (tgt < end))
+		return 0;
+
+	if (size != sizeof(rel32)) {
+		pr_debug("    \"%s\": short jump out of body at %#lx\n",
+				name, off);
+		return -ENOTSUP;
+	}
+
+	rel = tgt - (to + off + insn->length);
+	if ((rel < INT32_MIN) || (rel > INT32_MAX)) {
+		pr_debug("    \"%s\": %#lx is out of reach at %#lx\n",
+				name, tgt, off);
+		return -ENOTSUP;
+	}
+
+	rel32 = rel;
+	memcpy(code + off + field, &rel32, sizeof(rel32));
+	return 0;
+}
+
+int relocate_code(const char *name, uint8_t *code, size_t size,
+		  uint64_t from, uint64_t to)
+{
+	struct x86_insn insn;
+	uint64_t off;
+	int len, err;
+
+	for (off = 0; off < size; off += len) {
+		len = x86_insn_decode(code + off, size - off, &insn);
+		if (len < 0) {
+			pr_debug("    \"%s\": failed to decode at %#lx\n",
+					name, off);
+			return -ENOTSUP;
+		}
+
+		err = fix_rel_operand(name, code, size, from, to, off, &insn);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1, if any relative reference of the code (located at "addr") leads
+ * to the range.
+ */
+int code_refers_range(const char *name, const uint8_t *code, size_t size,
+		      uint64_t addr, uint64_t start, uint64_t end)
+{
+	struct x86_insn insn;
+	uint64_t off, tgt;
+	int32_t rel32;
+	uint8_t field;
+	int len;
+
+	for (off = 0; off < size; off += len) {
+		len = x86_insn_decode(code + off, size - off, &insn);
+		if (len < 0) {
+			pr_debug("    \"%s\": failed to decode at %#lx\n",
+					name, off);
+			return -ENOTSUP;
+		}
+
+		switch (insn_rel_operand(&insn, code + off, &field)) {
+		case 1:
+			tgt = addr + off + len + (int8_t)code[off + field];
+			break;
+		case 4:
+			memcpy(&rel32, code + off + field, sizeof(rel32));
+			tgt = addr + off + len + rel32;
+			break;
+		default:
+			continue;
+		}
+
+		if ((tgt >= start) && (tgt < end)) {
+			pr_debug("    \"%s\": reference to %#lx at %#lx\n",
+					name, tgt, off);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int build_inplace_code(const struct process_ctx_s *ctx,
+			      struct func_jump_s *fj)
+{
+	struct x86_insn insn;
+	uint8_t *code;
+	uint64_t off;
+	int len, err;
+
+	code = xmalloc(fj->patch_size);
+	if (!code)
+		return -ENOMEM;
+
+	err = process_read_data(ctx, fj->patch_addr, code, fj->patch_size);
+	if (err)
+		goto free_code;
+
+	for (off = 0; off < fj->patch_size; off += len) {
+		len = x86_insn_decode(code + off, fj->patch_size - off, &insn);
+		if (len < 0) {
+			pr_debug("    \"%s\": failed to decode at %#lx\n",
+					fj->name, off);
+			err = -ENOTSUP;
+			goto free_code;
+		}
+
+		if (insn_is_branch_out(&insn, code + off)) {
+			pr_debug("    \"%s\": call or indirect jump at %#lx\n",
+					fj->name, off);
+			err = -ENOTSUP;
+			goto free_code;
+		}
+
+		if (insn_changes_frame(&insn, code + off)) {
+			pr_debug("    \"%s\": stack frame change at %#lx\n",
+					fj->name, off);
+			err = -ENOTSUP;
+			goto free_code;
+		}
+	}
+
+	err = relocate_code(fj->name, code, fj->patch_size,
+			    fj->patch_addr, fj->func_addr);
+	if (err)
+		goto free_code;
+
+	fj->inplace_code = code;
+	return 0;
+
+free_code:
+	free(code);
+	return err;
+}
+
+int func_inplace_code(const struct process_ctx_s *ctx, struct func_jump_s *fj)
+{
+	int err;
+
+	if (fj->inplace)
+		return fj->inplace > 0;
+
+	fj->inplace = -1;
+	if (!fj->patch_size || (fj->patch_size > fj->func_size))
+		return 0;
+
+	err = build_inplace_code(ctx, fj);
+	if (err)
+		return (err == -ENOTSUP) ? 0 : err;
+
+	fj->inplace = 1;
+	return 1;
+}
+
+int func_inplace_applied(const struct process_ctx_s *ctx,
+			 struct func_jump_s *fj)
+{
+	uint8_t *code;
+	int ret;
+
+	if (!fj->func_addr)
+		return 0;
+
+	ret = func_inplace_code(ctx, fj);
+	if (ret <= 0)
+		return ret;
+
+	code = xmalloc(fj->patch_size);
+	if (!code)
+		return -ENOMEM;
+
+	ret = process_read_data(ctx, fj->func_addr, code, fj->patch_size);
+	if (!ret)
+		ret = !memcmp(code, fj->inplace_code, fj->patch_size);
+
+	free(code);
+	return ret;
+}
+
+/*
+ * Process is written by words: the last one is read first to keep the bytes
+ * after the code.
+ */
+int process_write_code(const struct process_ctx_s *ctx, uint64_t addr,
+		       const uint8_t *code, size_t size)
+{
+	size_t aligned = round_up(size, sizeof(uint64_t));
+	uint8_t *buf;
+	int err;
+
+	buf = xmalloc(aligned);
+	if (!buf)
+		return -ENOMEM;
+
+	err = process_read_data(ctx, addr + aligned - sizeof(uint64_t),
+				buf + aligned - sizeof(uint64_t),
+				sizeof(uint64_t));
+	if (err)
+		goto free_buf;
+
+	memcpy(buf, code, size);
+	err = process_write_data(ctx, addr, buf, aligned);
+
+free_buf:
+	free(buf);
+	return err;
+}
+
+int write_func_inplace(const struct process_ctx_s *ctx,
+		       const struct func_jump_s *fj)
+{
+	pr_info("  - Function \"%s\":\n", fj->name);
+	pr_info("      in place: %#lx <--- %#lx (%u bytes)\n", fj->func_addr,
+			fj->patch_addr, fj->patch_size);
+
+	if (ctx->dry_run)
+		return 0;
+
+	return process_write_code(ctx, fj->func_addr, fj->inplace_code,
+				  fj->patch_size);
+}
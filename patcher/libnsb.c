@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <compel/compel.h>
+
+#include "include/nsb.h"
+#include "include/patch.h"
+#include "include/plan.h"
+#include "include/elf.h"
+#include "include/list.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/* Stub for compel */
+int compel_main(void *arg_p, unsigned int arg_s) { return 0; }
+
+struct nsb_session {
+	pid_t			pid;
+	unsigned int		flags;
+	struct patch_opts	opts;
+	struct list_head	patches;
+};
+
+struct nsb_patch {
+	struct list_head	list;
+	char			*path;
+	char			*bid;
+	struct apply_plan_s	*plan;
+};
+
+#define DRY_RUN(s)		(!!((s)->flags & NSB_DRY_RUN))
+#define NO_PLUGIN(s)		(!!((s)->flags & NSB_NO_PLUGIN))
+
+int nsb_open(pid_t pid, unsigned int flags, struct nsb_session **session)
+{
+	struct nsb_session *s;
+
+	if (elf_library_status())
+		return -EFAULT;
+
+	if (kill(pid, 0)) {
+		pr_perror("failed to find process %d", pid);
+		return -errno;
+	}
+
+	s = xzalloc(sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->pid = pid;
+	s->flags = flags;
+	s->opts.rewrite_calls = !!(flags & NSB_REWRITE_CALLS);
+	s->opts.redirect_got = !!(flags & NSB_REDIRECT_GOT);
+	s->opts.redirect_pointers = !!(flags & NSB_REDIRECT_POINTERS);
+	s->opts.in_place = !!(flags & NSB_IN_PLACE);
+	s->opts.relax_got = !!(flags & NSB_RELAX_GOT);
+	s->opts.map_service = !!(flags & NSB_MAP_SERVICE);
+	s->opts.precompute = !!(flags & NSB_PRECOMPUTE);
+	INIT_LIST_HEAD(&s->patches);
+
+	compel_log_init(__print_on_level, LOG_ERROR);
+
+	/* Parsed ELF files are shared by the sessions */
+	elf_cache_init();
+
+	*session = s;
+	return 0;
+}
+
+static void nsb_destroy_patch(struct nsb_patch *p)
+{
+	if (p->plan)
+		plan_destroy(p->plan);
+	free(p->bid);
+	free(p->path);
+	free(p);
+}
+
+void nsb_close(struct nsb_session *s)
+{
+	struct nsb_patch *p, *tmp;
+
+	list_for_each_entry_safe(p, tmp, &s->patches, list) {
+		list_del(&p->list);
+		nsb_destroy_patch(p);
+	}
+	free(s);
+
+	elf_cache_fini();
+}
+
+int nsb_load_patch(struct nsb_session *s, const char *path,
+		   struct nsb_patch **patch)
+{
+	struct nsb_patch *p;
+	int err, is_patch;
+
+	p = xzalloc(sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+
+	p->path = realpath(path, NULL);
+	if (!p->path) {
+		pr_perror("failed to resolve patch path %s", path);
+		err = -errno;
+		goto destroy_patch;
+	}
+
+	err = elf_peek(p->path, &p->bid, &is_patch);
+	if (err) {
+		pr_err("failed to read patch %s\n", path);
+		goto destroy_patch;
+	}
+
+	if (!is_patch || !p->bid) {
+		pr_err("%s is not a patch\n", path);
+		err = -EINVAL;
+		goto destroy_patch;
+	}
+
+	list_add_tail(&p->list, &s->patches);
+	*patch = p;
+	return 0;
+
+destroy_patch:
+	nsb_destroy_patch(p);
+	return err;
+}
+
+const char *nsb_patch_build_id(const struct nsb_patch *p)
+{
+	return p->bid;
+}
+
+int nsb_plan(struct nsb_session *s, struct nsb_patch *p)
+{
+	struct apply_plan_s *plan;
+	int err;
+
+	err = compute_plan_process(s->pid, p->path, &plan);
+	if (err)
+		return err;
+
+	if (p->plan)
+		plan_destroy(p->plan);
+	p->plan = plan;
+	return 0;
+}
+
+int nsb_apply(struct nsb_session *s, struct nsb_patch *p)
+{
+	int err;
+
+	if (!p->plan)
+		return patch_process(s->pid, p->path, DRY_RUN(s), NO_PLUGIN(s),
+				     &s->opts);
+
+	/* Plan is valid for one attempt only: process can be changed */
+	err = execute_plan_process(s->pid, p->path, p->plan, DRY_RUN(s));
+	plan_destroy(p->plan);
+	p->plan = NULL;
+	return err;
+}
+
+int nsb_revert(struct nsb_session *s, struct nsb_patch *p)
+{
+	return unpatch_process(s->pid, p->path, DRY_RUN(s));
+}
+
+static const char **nsb_patch_paths(struct nsb_patch * const *patches, int nr)
+{
+	const char **paths;
+	int i;
+
+	paths = xmalloc(sizeof(*paths) * (nr ? : 1));
+	if (!paths)
+		return NULL;
+
+	for (i = 0; i < nr; i++)
+		paths[i] = patches[i]->path;
+	return paths;
+}
+
+int nsb_apply_set(struct nsb_session *s,
+		  struct nsb_patch * const *apply, int nr_apply,
+		  struct nsb_patch * const *revert, int nr_revert)
+{
+	const char **apply_paths, **revert_paths;
+	int err = -ENOMEM;
+
+	apply_paths = nsb_patch_paths(apply, nr_apply);
+	if (!apply_paths)
+		return -ENOMEM;
+
+	revert_paths = nsb_patch_paths(revert, nr_revert);
+	if (!revert_paths)
+		goto free_apply;
+
+	err = patch_process_set(s->pid, apply_paths, nr_apply,
+				revert_paths, nr_revert,
+				DRY_RUN(s), NO_PLUGIN(s), &s->opts);
+
+	free(revert_paths);
+free_apply:
+	free(apply_paths);
+	return err;
+}
+
+int nsb_check(struct nsb_session *s, struct nsb_patch *p)
+{
+	int err;
+
+	err = check_process(s->pid, p->path);
+	if (!err)
+		return 1;
+	if (err == ENOENT)
+		return 0;
+	return (err < 0) ? err : -EINVAL;
+}
+
+void nsb_set_log(int msgfd, int logfd, unsigned int loglevel)
+{
+	struct log_thread_s lt = {
+		.msgfd = msgfd,
+		.logfd = logfd,
+		.loglevel = loglevel,
+	};
+
+	log_set_thread(&lt);
+}
@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+#include "include/loader.h"
+#include "include/context.h"
+#include "include/process.h"
+#include "include/service.h"
+#include "include/elf.h"
+#include "include/dl_map.h"
+#include "include/vma.h"
+#include "include/compiler.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/*
+ * Service plugin can be mapped by nsb itself instead of dlopen. This way
+ * dynamic linker state (and its lock) is not touched: segments are mapped
+ * like the patch, relocations are resolved against the process libraries and
+ * written via ptrace, and constructors are called via trampoline.
+ */
+
+static const char *loader_lib_dirs[] = {
+	"/usr/local/lib64",
+	"/usr/local/lib",
+	"/usr/lib64",
+	"/usr/lib",
+	"/lib64",
+	"/lib",
+};
+
+struct loader_reloc {
+	uint64_t		offset;
+	uint64_t		value;
+	bool			relative;
+};
+
+struct loader_relocs {
+	struct process_ctx_s	*ctx;
+	struct loader_reloc	*relocs;
+	size_t			nr_relocs;
+};
+
+static int loader_try_dir(const char *dir, size_t len, const char *name,
+			  char *path)
+{
+	if (!len)
+		return 0;
+
+	if (snprintf(path, PATH_MAX, "%.*s/%s", (int)len, dir, name) >= PATH_MAX)
+		return 0;
+
+	return !access(path, R_OK);
+}
+
+/*
+ * Library is searched the same way, as patcher itself would find it: in
+ * LD_LIBRARY_PATH and then in standard directories.
+ */
+static int loader_find_lib(const char *name, char *path)
+{
+	const char *dirs, *end;
+	int i;
+
+	if (strchr(name, '/')) {
+		if (!realpath(name, path))
+			return -ENOENT;
+		return 0;
+	}
+
+	dirs = getenv("LD_LIBRARY_PATH");
+	while (dirs && *dirs) {
+		end = strchrnul(dirs, ':');
+		if (loader_try_dir(dirs, end - dirs, name, path))
+			return 0;
+		dirs = *end ? end + 1 : end;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(loader_lib_dirs); i++) {
+		const char *dir = loader_lib_dirs[i];
+
+		if (loader_try_dir(dir, strlen(dir), name, path))
+			return 0;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Imports are resolved like dynamic linker does: objects are searched in link
+ * map order, and required symbol version must match.
+ */
+static int64_t loader_resolve_import(struct process_ctx_s *ctx,
+				     const struct elf_dyn_reloc *r)
+{
+	const struct ctx_dep *n;
+	int64_t value = 0;
+	bool ifunc = false;
+	int err;
+
+	err = process_collect_needed(ctx);
+	if (err)
+		return err;
+
+	list_for_each_entry(n, &ctx->needed_list, list) {
+		value = elf_dyn_sym_value_version(n->dlm->ei, r->name,
+						  r->version, &ifunc);
+		if (value < 0)
+			return value;
+		if (value) {
+			value += dl_map_start(n->dlm);
+			break;
+		}
+	}
+
+	if (!value) {
+		if (r->weak)
+			return 0;
+		pr_info("  Symbol \"%s%s%s\" is not found in process %d\n",
+				r->name, r->version ? "@" : "",
+				r->version ? : "", ctx->pid);
+		return -ENOTSUP;
+	}
+
+	if (!ifunc)
+		return value;
+
+	/* Indirect function: implementation is chosen by its resolver */
+	value = process_call(ctx, value, 0, 0, 0, 0, 0, 0);
+	if (value <= 0) {
+		pr_err("failed to call resolver of \"%s\"\n", r->name);
+		return value ? value : -EFAULT;
+	}
+	return value;
+}
+
+static int loader_collect_reloc(const struct elf_dyn_reloc *r, void *data)
+{
+	struct loader_relocs *lr = data;
+	struct loader_reloc *rel;
+	int64_t value = 0;
+	bool relative;
+
+	switch (r->type) {
+		case R_X86_64_NONE:
+			return 0;
+		case R_X86_64_RELATIVE:
+			value = r->addend;
+			relative = true;
+			break;
+		case R_X86_64_GLOB_DAT:
+		case R_X86_64_JUMP_SLOT:
+		case R_X86_64_64:
+			if (r->defined && r->ifunc) {
+				pr_info("  Indirect function \"%s\" is not "
+					"supported\n", r->name);
+				return -ENOTSUP;
+			}
+
+			if (r->defined) {
+				value = r->value;
+				relative = true;
+			} else {
+				value = loader_resolve_import(lr->ctx, r);
+				if (value < 0)
+					return value;
+				relative = false;
+			}
+
+			if (r->type == R_X86_64_64)
+				value += r->addend;
+			break;
+		default:
+			pr_info("  Relocation type %d is not supported\n", r->type);
+			return -ENOTSUP;
+	}
+
+	if (xrealloc_safe(&lr->relocs, sizeof(*lr->relocs) * (lr->nr_relocs + 1)))
+		return -ENOMEM;
+
+	rel = &lr->relocs[lr->nr_relocs++];
+	rel->offset = r->offset;
+	rel->value = value;
+	rel->relative = relative;
+	return 0;
+}
+
+static int loader_add_vma(struct dl_map *dlm, uint64_t addr, size_t length,
+			  int flags, int prot, off_t offset)
+{
+	struct vma_area *vma;
+	int err;
+
+	vma = xzalloc(sizeof(*vma));
+	if (!vma)
+		return -ENOMEM;
+
+	vma->addr = addr;
+	vma->length = length;
+	vma->flags = flags;
+	vma->prot = prot;
+	vma->offset = offset;
+	INIT_LIST_HEAD(&vma->list);
+
+	err = add_dl_vma_sorted(dlm, vma);
+	if (err)
+		free(vma);
+	return err;
+}
+
+/*
+ * Segment memory, which is not backed by file (".bss"), is mapped
+ * anonymously. Only the tail of the last file page has to be zeroed.
+ */
+static int loader_create_vmas(struct dl_map *dlm, uint64_t base,
+			      const struct elf_segment *segs, ssize_t nr_segs)
+{
+	int i, err;
+
+	for (i = 0; i < nr_segs; i++) {
+		const struct elf_segment *es = &segs[i];
+		uint64_t start = round_down(es->vaddr, PAGE_SIZE);
+		uint64_t file_end = round_up(es->vaddr + es->filesz, PAGE_SIZE);
+		uint64_t mem_end = round_up(es->vaddr + es->memsz, PAGE_SIZE);
+
+		if (file_end > start) {
+			err = loader_add_vma(dlm, base + start, file_end - start,
+					     MAP_PRIVATE | MAP_FIXED, es->prot,
+					     round_down(es->offset, PAGE_SIZE));
+			if (err)
+				return err;
+		}
+
+		if (mem_end > file_end) {
+			err = loader_add_vma(dlm, base + file_end,
+					     mem_end - file_end,
+					     MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS,
+					     es->prot, 0);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+static int loader_zero_tails(struct process_ctx_s *ctx, uint64_t base,
+			     const struct elf_segment *segs, ssize_t nr_segs)
+{
+	uint8_t buf[PAGE_SIZE + 8];
+	int i, err;
+
+	for (i = 0; i < nr_segs; i++) {
+		const struct elf_segment *es = &segs[i];
+		uint64_t start = base + es->vaddr + es->filesz;
+		uint64_t end = round_up(start, PAGE_SIZE);
+		uint64_t addr = round_down(start, 8);
+
+		if ((es->memsz <= es->filesz) || (start == end))
+			continue;
+
+		/* Writes are done in words: keep the data before the tail */
+		err = process_read_data(ctx, addr, buf, 8);
+		if (err)
+			return err;
+
+		memset(buf + (start - addr), 0, end - start);
+
+		err = process_write_data(ctx, addr, buf, end - addr);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int loader_write_relocs(struct process_ctx_s *ctx, uint64_t base,
+			       const struct loader_relocs *lr)
+{
+	int i, err;
+
+	for (i = 0; i < lr->nr_relocs; i++) {
+		const struct loader_reloc *rel = &lr->relocs[i];
+		uint64_t value = rel->value;
+
+		if (rel->relative)
+			value += base;
+
+		err = process_write_data(ctx, base + rel->offset,
+					 &value, sizeof(value));
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int loader_call_array(struct process_ctx_s *ctx, uint64_t base,
+			     uint64_t array, size_t nr, bool reverse)
+{
+	uint64_t func;
+	int i, err;
+
+	for (i = 0; i < nr; i++) {
+		size_t idx = reverse ? nr - 1 - i : i;
+
+		err = process_read_data(ctx, base + array + idx * sizeof(func),
+					&func, sizeof(func));
+		if (err)
+			return err;
+
+		/* Entries can be 0 or -1 as terminators */
+		if (!func || (func == ~0UL))
+			continue;
+
+		(void)process_call(ctx, func, 0, 0, 0, 0, 0, 0);
+	}
+	return 0;
+}
+
+static int loader_init(struct process_ctx_s *ctx, struct elf_image *img)
+{
+	const struct elf_init_info *ii = &img->ii;
+	int64_t reg;
+
+	if (ii->eh_frame) {
+		/* Unwinder can't find FDEs of objects, unknown to ld.so */
+		reg = dl_get_symbol_value(&ctx->dl_maps, "__register_frame");
+		if (reg > 0) {
+			(void)process_call(ctx, reg, img->base + ii->eh_frame,
+					   0, 0, 0, 0, 0);
+			img->eh_frame = img->base + ii->eh_frame;
+		} else
+			pr_warn("failed to find __register_frame in process %d\n",
+					ctx->pid);
+	}
+
+	if (ii->init)
+		(void)process_call(ctx, img->base + ii->init, 0, 0, 0, 0, 0, 0);
+
+	return loader_call_array(ctx, img->base, ii->init_array,
+				 ii->nr_init_array, false);
+}
+
+static int loader_fini(struct process_ctx_s *ctx, struct elf_image *img)
+{
+	const struct elf_init_info *ii = &img->ii;
+	int64_t dereg;
+	int err;
+
+	err = loader_call_array(ctx, img->base, ii->fini_array,
+				ii->nr_fini_array, true);
+	if (err)
+		return err;
+
+	if (ii->fini)
+		(void)process_call(ctx, img->base + ii->fini, 0, 0, 0, 0, 0, 0);
+
+	if (img->eh_frame) {
+		dereg = dl_get_symbol_value(&ctx->dl_maps, "__deregister_frame");
+		if (dereg > 0)
+			(void)process_call(ctx, dereg, img->eh_frame,
+					   0, 0, 0, 0, 0);
+	}
+	return 0;
+}
+
+static int loader_service_mapped(const struct dl_map *dlm, void *data)
+{
+	const char *path = data;
+
+	return dlm->path && !strcmp(dlm->path, path);
+}
+
+static void loader_free_dlm(struct dl_map *dlm)
+{
+	struct vma_area *vma, *tmp;
+
+	list_for_each_entry_safe(vma, tmp, &dlm->vmas, dl) {
+		list_del(&vma->dl);
+		free(vma);
+	}
+	free(dlm);
+}
+
+static int loader_unreserve(struct process_ctx_s *ctx, const struct elf_image *img)
+{
+	struct vma_area vma = {
+		.addr = img->base,
+		.length = img->size,
+	};
+
+	return process_unmap_vma(ctx, &vma);
+}
+
+/*
+ * Returns -ENOTSUP, if the service can't be mapped by nsb, while process is
+ * not changed yet: dlopen has to be used instead.
+ */
+int load_service_elf(struct process_ctx_s *ctx, struct service *service)
+{
+	struct loader_relocs lr = {
+		.ctx = ctx,
+	};
+	struct vma_area reserve = {
+		.prot = PROT_NONE,
+		.flags = MAP_PRIVATE | MAP_ANONYMOUS,
+	};
+	struct elf_segment *segs = NULL;
+	struct elf_info_s *ei = NULL;
+	struct elf_image *img;
+	char path[PATH_MAX];
+	ssize_t nr_segs;
+	int64_t addr;
+	int err, i;
+
+	if (ctx->dry_run)
+		return -ENOTSUP;
+
+	if (loader_find_lib(service->name, path)) {
+		pr_info("  Failed to find %s\n", service->name);
+		return -ENOTSUP;
+	}
+
+	if (iterate_dl_maps(&ctx->dl_maps, path, loader_service_mapped)) {
+		pr_info("  %s is already mapped in process %d\n",
+				path, ctx->pid);
+		return -ENOTSUP;
+	}
+
+	img = xzalloc(sizeof(*img));
+	if (!img)
+		return -ENOMEM;
+
+	img->path = xstrdup(path);
+	if (!img->path) {
+		err = -ENOMEM;
+		goto free_img;
+	}
+
+	err = elf_get_info(path, &ei);
+	if (err)
+		goto free_img;
+
+	nr_segs = elf_load_segments(ei, &segs);
+	if (nr_segs < 0) {
+		err = nr_segs;
+		goto put_info;
+	}
+
+	if (segs[0].vaddr) {
+		pr_info("  %s is not position independent\n", path);
+		err = -ENOTSUP;
+		goto free_segs;
+	}
+
+	err = elf_init_info(ei, &img->ii);
+	if (err)
+		goto free_segs;
+
+	/* All the symbols are resolved before the process is changed */
+	err = elf_iterate_dyn_relocs(ei, loader_collect_reloc, &lr);
+	if (err)
+		goto free_relocs;
+
+	for (i = 0; i < nr_segs; i++)
+		img->size = max(img->size, round_up(segs[i].vaddr + segs[i].memsz,
+						    PAGE_SIZE));
+
+	/* Address is chosen by kernel, the same way as for dlopen */
+	reserve.length = img->size;
+	addr = process_map_vma(ctx, -1, &reserve);
+	if (addr < 0) {
+		err = addr;
+		goto free_relocs;
+	}
+	img->base = addr;
+
+	img->dlm = alloc_dl_map(ei, img->path);
+	if (!img->dlm) {
+		err = -ENOMEM;
+		goto unreserve;
+	}
+
+	err = loader_create_vmas(img->dlm, img->base, segs, nr_segs);
+	if (err)
+		goto unreserve;
+
+	err = process_mmap_dl_map(ctx, img->dlm);
+	if (err)
+		goto unreserve;
+
+	err = loader_zero_tails(ctx, img->base, segs, nr_segs);
+	if (err)
+		goto unreserve;
+
+	err = loader_write_relocs(ctx, img->base, &lr);
+	if (err)
+		goto unreserve;
+
+	err = process_reserve_dl_map(ctx, img->dlm);
+	if (err)
+		goto unreserve;
+
+	err = loader_init(ctx, img);
+	if (err)
+		goto unreserve;
+
+	pr_debug("  Mapped %s at %#lx (%ld relocations)\n",
+			path, img->base, lr.nr_relocs);
+
+	service->image = img;
+	service->dlm = img->dlm;
+	service->handle = img->base;
+	service->pid = ctx->pid;
+
+	free(lr.relocs);
+	free(segs);
+	return 0;
+
+unreserve:
+	(void)loader_unreserve(ctx, img);
+	if (img->dlm)
+		loader_free_dlm(img->dlm);
+free_relocs:
+	free(lr.relocs);
+free_segs:
+	free(segs);
+put_info:
+	elf_put_info(ei);
+free_img:
+	free(img->path);
+	free(img);
+	return err;
+}
+
+/*
+ * Mappings are left as is, if the service is still in use (by resident
+ * agent).
+ */
+int unload_service_elf(struct process_ctx_s *ctx, struct service *service)
+{
+	struct elf_image *img = service->image;
+	int err;
+
+	err = loader_fini(ctx, img);
+	if (err)
+		return err;
+
+	return loader_unreserve(ctx, img);
+}
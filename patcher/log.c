@@ -13,11 +13,33 @@
 static unsigned int current_loglevel = DEFAULT_LOGLEVEL;
 static int logfd = -1;
 
+/*
+ * Thread log overrides process log streams and level. It's used by daemon to
+ * send messages of a request to the client.
+ */
+static __thread struct log_thread_s thread_log = {
+	.msgfd = -1,
+	.logfd = -1,
+	.loglevel = LOG_UNSET,
+};
+
 int log_get_fd(void)
 {
+	if (thread_log.logfd >= 0)
+		return thread_log.logfd;
 	return logfd < 0 ? STDERR_FILENO : logfd;
 }
 
+void log_get_thread(struct log_thread_s *lt)
+{
+	*lt = thread_log;
+}
+
+void log_set_thread(const struct log_thread_s *lt)
+{
+	thread_log = *lt;
+}
+
 int log_init(const char *output)
 {
 	if (output && !strncmp(output, "-", 2)) {
@@ -61,6 +83,8 @@ void log_set_loglevel(unsigned int level)
 
 unsigned int log_get_loglevel(void)
 {
+	if (thread_log.loglevel != LOG_UNSET)
+		return thread_log.loglevel;
 	return current_loglevel;
 }
 
@@ -71,11 +95,11 @@ void __print_on_level(unsigned int loglevel, const char *format, va_list params)
 	char buffer[1024];
 
 	if (unlikely(loglevel == LOG_MSG)) {
-		fd = STDOUT_FILENO;
+		fd = thread_log.msgfd < 0 ? STDOUT_FILENO : thread_log.msgfd;
 	} else {
-		if (loglevel > current_loglevel)
+		if (loglevel > log_get_loglevel())
 			return;
-		fd = logfd;
+		fd = thread_log.logfd < 0 ? logfd : thread_log.logfd;
 	}
 
 	size = vsnprintf(buffer, sizeof(buffer), format, params);
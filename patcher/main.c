@@ -2,42 +2,82 @@
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <unistd.h>
 
 #include <compel/compel.h>
 
+#include "include/options.h"
 #include "include/patch.h"
+#include "include/fleet.h"
+#include "include/scan.h"
+#include "include/daemon.h"
 #include "include/log.h"
 
 /* Stub for compel */
 int compel_main(void *arg_p, unsigned int arg_s) { return 0; }
 
-struct options {
-	pid_t		 pid;
-	const char	*patch_path;
-	int		verbosity;
-	int		(*handler)(const struct options *o);
-	int		dry_run;
-	int		no_plugin;
-};
-
 void print_usage(void)
 {
 	fprintf(stderr, "\n"
 		"Usage:\n"
 		"  nsb COMMAND OPTIONS\n"
+		"  nsb probe attach|detach|report [FUNCTION] OPTIONS\n"
 		"\n");
 	fprintf(stderr, "Commands:\n"
 		"  patch           - apply patch to process\n"
+		"  stage           - load patch into process without activating it\n"
+		"  commit          - activate patch, staged in process\n"
+		"  plan            - compute patch apply plan without stopping process\n"
 		"  check           - check whether patch is applied to process\n"
 		"  list            - list all applied patches\n"
+		"  canary          - show canary counters of patch (and set its share\n"
+		"                    of calls with --canary)\n"
+		"  probe           - attach probe to function, detach it or report\n"
+		"                    latencies of probed functions\n"
 		"  revert          - revert patch in process\n"
+		"  replace         - revert and apply patches in one go\n"
+		"  scan            - report processes and patches for all ELF files in system\n"
+		"  daemon          - serve commands on control socket, keeping caches warm\n"
 		"\n");
 
 	fprintf(stderr, "Options:\n"
 		"  -p, --pid       - Process PID\n"
-		"  -f, --filename  - Patch file path\n"
+		"  -f, --filename  - Patch file path (can be repeated for \"patch\",\n"
+		"                    \"revert\" and \"replace\")\n"
+		"  -r, --revert    - Patch file to revert (\"replace\" only, can be repeated)\n"
 		"      --dry-run   - Do not perform any actual changes to process\n"
 		"      --no-plugin - Don't use plugin injection\n"
+		"      --map-service - Map plugin with nsb loader instead of dlopen\n"
+		"      --rewrite-calls - Retarget direct calls of patched functions\n"
+		"                    to the new ones (\"patch\", \"commit\" and \"replace\")\n"
+		"      --redirect-got - Set PLT slots of all objects, bound to patched\n"
+		"                    functions, to the new ones\n"
+		"      --redirect-pointers - Set function pointers in patch target data\n"
+		"                    (found by its relocations) to the new functions;\n"
+		"                    they don't compare equal to old function addresses,\n"
+		"                    and reverted patch code stays mapped\n"
+		"      --in-place  - Copy new function body over the old one, if it fits\n"
+		"      --relax-got - Access symbols, resolved for patch, directly\n"
+		"                    instead of via its GOT and PLT\n"
+		"      --canary PERCENT - Send the percent of calls to the new functions\n"
+		"                    and the rest to the old ones (\"patch\" and \"canary\")\n"
+		"      --canary-timing - Count cycles of the calls, sent by --canary;\n"
+		"                    return address of the call is replaced, which breaks\n"
+		"                    C++ exceptions, longjmp and shadow stacks through it\n"
+		"      --precompute - Compute apply plan before stopping process, without\n"
+		"                    plugin (\"patch\" only; shares patch image with --all)\n"
+		"      --resident  - Map and relocate patch via resident agent in process,\n"
+		"                    stopping it only to write function jumps (\"patch\" only)\n"
+		"      --plan      - Apply plan file (output for \"plan\", input for \"patch\")\n"
+		"      --all       - Patch all processes with patch target (\"patch\" only)\n"
+		"      --jobs      - Number of processes handled in parallel with --all,\n"
+		"                    \"scan\" and \"daemon\"\n"
+		"                    (default: number of CPUs)\n"
+		"      --max-frozen - Maximum number of processes stopped at once with --all\n"
+		"                    (default: number of jobs)\n"
+		"      --socket    - Daemon control socket: socket to listen for \"daemon\",\n"
+		"                    socket to send the command to otherwise\n"
+		"                    (default for \"daemon\": " NSBD_SOCKET_PATH ")\n"
 		"  -v, --verbosity - Log level verbosity\n"
 		"                      0 - Silent (default)\n"
 		"                      1 - Error messages only\n"
@@ -47,8 +87,24 @@ void print_usage(void)
 	       );
 }
 
+static void patch_options(const struct options *o, struct patch_opts *po)
+{
+	po->rewrite_calls = o->rewrite_calls;
+	po->redirect_got = o->redirect_got;
+	po->redirect_pointers = o->redirect_pointers;
+	po->in_place = o->in_place;
+	po->relax_got = o->relax_got;
+	po->map_service = o->map_service;
+	po->canary = o->canary;
+	po->canary_ratio = o->canary_ratio;
+	po->canary_timing = o->canary_timing;
+	po->precompute = o->precompute;
+}
+
 static int cmd_unpatch_process(const struct options *o)
 {
+	struct patch_opts po = { };
+
 	if (!o->pid) {
 		pr_msg("Error: process pid has to be provided\n");
 		return 1;
@@ -58,9 +114,41 @@ static int cmd_unpatch_process(const struct options *o)
 		pr_msg("Error: patch file has to be provided\n");
 		return 1;
 	}
+
+	patch_options(o, &po);
+
+	if (o->nr_patch_paths > 1)
+		return patch_process_set(o->pid, NULL, 0,
+					 o->patch_paths, o->nr_patch_paths,
+					 o->dry_run, o->no_plugin, &po);
 	return unpatch_process(o->pid, o->patch_path, o->dry_run);
 }
 
+static int cmd_replace_patches(const struct options *o)
+{
+	struct patch_opts po = { };
+
+	if (!o->pid) {
+		pr_msg("Error: process pid has to be provided\n");
+		return 1;
+	}
+
+	if (!o->patch_path) {
+		pr_msg("Error: patch file has to be provided\n");
+		return 1;
+	}
+
+	if (!o->nr_revert_paths) {
+		pr_msg("Error: patch file to revert has to be provided\n");
+		return 1;
+	}
+
+	patch_options(o, &po);
+	return patch_process_set(o->pid, o->patch_paths, o->nr_patch_paths,
+				 o->revert_paths, o->nr_revert_paths,
+				 o->dry_run, o->no_plugin, &po);
+}
+
 static int cmd_list_patches(const struct options *o)
 {
 	if (!o->pid) {
@@ -70,8 +158,130 @@ static int cmd_list_patches(const struct options *o)
 	return list_process_patches(o->pid);
 }
 
+static int default_jobs(void)
+{
+	long jobs;
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	return (jobs > 0) ? jobs : 1;
+}
+
+static int cmd_scan_processes(const struct options *o)
+{
+	if (o->pid) {
+		pr_msg("Error: process pid can't be used with \"scan\"\n");
+		return 1;
+	}
+
+	return scan_processes(o->patch_path, o->jobs ? : default_jobs());
+}
+
+static int run_options(struct options *o);
+
+static int cmd_daemon(const struct options *o)
+{
+	if (o->pid || o->nr_patch_paths) {
+		pr_msg("Error: process pid and patch file can't be used with "
+		       "\"daemon\"\n");
+		return 1;
+	}
+
+	return daemon_serve(o->socket_path ? : NSBD_SOCKET_PATH,
+			    o->jobs ? : default_jobs(), run_options);
+}
+
+static int cmd_patch_fleet(const struct options *o)
+{
+	int jobs = o->jobs, max_frozen = o->max_frozen;
+	struct patch_opts po = { };
+
+	if (o->pid) {
+		pr_msg("Error: process pid can't be used with --all\n");
+		return 1;
+	}
+
+	if (o->nr_patch_paths != 1) {
+		pr_msg("Error: one patch file has to be provided\n");
+		return 1;
+	}
+
+	if (o->plan_path) {
+		pr_msg("Error: plan can't be used with --all\n");
+		return 1;
+	}
+
+	if (!jobs)
+		jobs = default_jobs();
+
+	if (!max_frozen)
+		max_frozen = jobs;
+
+	patch_options(o, &po);
+	return patch_fleet(o->patch_path, jobs, max_frozen,
+			   o->dry_run, o->no_plugin, &po);
+}
+
 static int cmd_patch_process(const struct options *o)
 {
+	struct patch_opts po = { };
+
+	if (o->all)
+		return cmd_patch_fleet(o);
+
+	if (!o->pid) {
+		pr_msg("Error: process pid has to be provided\n");
+		return 1;
+	}
+
+	if (!o->patch_path) {
+		pr_msg("Error: patch file has to be provided\n");
+		return 1;
+	}
+	if (o->resident && (o->plan_path || o->no_plugin)) {
+		pr_msg("Error: --resident can't be used with plan or --no-plugin\n");
+		return 1;
+	}
+
+	patch_options(o, &po);
+	if (o->nr_patch_paths > 1) {
+		if (o->plan_path || o->resident) {
+			pr_msg("Error: plan and --resident can be used with one "
+			       "patch file only\n");
+			return 1;
+		}
+		return patch_process_set(o->pid, o->patch_paths,
+					 o->nr_patch_paths, NULL, 0,
+					 o->dry_run, o->no_plugin, &po);
+	}
+
+	if (o->plan_path)
+		return apply_plan_process(o->pid, o->patch_path, o->plan_path,
+					  o->dry_run);
+	if (o->resident)
+		return resident_patch_process(o->pid, o->patch_path,
+					      o->dry_run, &po);
+	return patch_process(o->pid, o->patch_path, o->dry_run, o->no_plugin,
+			     &po);
+}
+
+static int cmd_plan_process(const struct options *o)
+{
+	if (!o->pid) {
+		pr_msg("Error: process pid has to be provided\n");
+		return 1;
+	}
+
+	if (!o->patch_path) {
+		pr_msg("Error: patch file has to be provided\n");
+		return 1;
+	}
+	return plan_process(o->pid, o->patch_path, o->plan_path);
+}
+
+static int cmd_stage_process(const struct options *o)
+{
+	struct patch_opts po = { };
+
 	if (!o->pid) {
 		pr_msg("Error: process pid has to be provided\n");
 		return 1;
@@ -81,7 +291,28 @@ static int cmd_patch_process(const struct options *o)
 		pr_msg("Error: patch file has to be provided\n");
 		return 1;
 	}
-	return patch_process(o->pid, o->patch_path, o->dry_run, o->no_plugin);
+
+	patch_options(o, &po);
+	return stage_process(o->pid, o->patch_path, o->dry_run, o->no_plugin,
+			     &po);
+}
+
+static int cmd_commit_process(const struct options *o)
+{
+	struct patch_opts po = { };
+
+	if (!o->pid) {
+		pr_msg("Error: process pid has to be provided\n");
+		return 1;
+	}
+
+	if (!o->patch_path) {
+		pr_msg("Error: patch file has to be provided\n");
+		return 1;
+	}
+
+	patch_options(o, &po);
+	return commit_process(o->pid, o->patch_path, o->dry_run, &po);
 }
 
 static int cmd_check_process(const struct options *o)
@@ -99,34 +330,221 @@ static int cmd_check_process(const struct options *o)
 	return check_process(o->pid, o->patch_path);
 }
 
-void *cmd_handler(char **argv)
+static int cmd_canary_process(const struct options *o)
 {
-	if (!strcmp(argv[optind], "patch"))
+	if (!o->pid) {
+		pr_msg("Error: process pid has to be provided\n");
+		return 1;
+	}
+
+	if (!o->patch_path) {
+		pr_msg("Error: patch file has to be provided\n");
+		return 1;
+	}
+
+	return canary_process(o->pid, o->patch_path,
+			      o->canary ? o->canary_ratio : -1);
+}
+
+static int cmd_probe_process(const struct options *o)
+{
+	const char *action = o->probe_action;
+
+	if (!o->pid) {
+		pr_msg("Error: process pid has to be provided\n");
+		return 1;
+	}
+
+	if (!action) {
+		pr_msg("Error: probe action has to be provided\n");
+		return 1;
+	}
+
+	if (!strcmp(action, "report"))
+		return probe_report_process(o->pid, o->probe_func);
+
+	if (!o->probe_func) {
+		pr_msg("Error: function has to be provided\n");
+		return 1;
+	}
+
+	if (!strcmp(action, "attach"))
+		return probe_attach_process(o->pid, o->probe_func, o->dry_run);
+
+	if (!strcmp(action, "detach"))
+		return probe_detach_process(o->pid, o->probe_func, o->dry_run);
+
+	pr_msg("Error: invalid probe action \"%s\"\n", action);
+	return 1;
+}
+
+void *cmd_handler(const char *command)
+{
+	if (!strcmp(command, "patch"))
 		return cmd_patch_process;
 
-	if (!strcmp(argv[optind], "check"))
+	if (!strcmp(command, "stage"))
+		return cmd_stage_process;
+
+	if (!strcmp(command, "commit"))
+		return cmd_commit_process;
+
+	if (!strcmp(command, "plan"))
+		return cmd_plan_process;
+
+	if (!strcmp(command, "check"))
 		return cmd_check_process;
 
-	if (!strcmp(argv[optind], "list"))
+	if (!strcmp(command, "list"))
 		return cmd_list_patches;
 
-	if (!strcmp(argv[optind], "revert"))
+	if (!strcmp(command, "canary"))
+		return cmd_canary_process;
+
+	if (!strcmp(command, "probe"))
+		return cmd_probe_process;
+
+	if (!strcmp(command, "revert"))
 		return cmd_unpatch_process;
 
-	fprintf(stderr, "%s: invalid subcommand -- '%s'\n", argv[0], argv[optind]);
+	if (!strcmp(command, "replace"))
+		return cmd_replace_patches;
+
+	if (!strcmp(command, "scan"))
+		return cmd_scan_processes;
+
+	if (!strcmp(command, "daemon"))
+		return cmd_daemon;
+
 	return NULL;
 }
 
+static int check_options(const struct options *o)
+{
+	if ((o->nr_patch_paths > 1) &&
+	    (o->handler != cmd_patch_process) &&
+	    (o->handler != cmd_unpatch_process) &&
+	    (o->handler != cmd_replace_patches)) {
+		pr_msg("Error: only one patch file has to be provided\n");
+		return 1;
+	}
+
+	if ((o->all || o->max_frozen) && (o->handler != cmd_patch_process)) {
+		pr_msg("Error: --all and --max-frozen can be used for "
+		       "\"patch\" only\n");
+		return 1;
+	}
+
+	if (o->resident && ((o->handler != cmd_patch_process) || o->all)) {
+		pr_msg("Error: --resident can be used for \"patch\" of one "
+		       "process only\n");
+		return 1;
+	}
+
+	if (o->max_frozen && !o->all) {
+		pr_msg("Error: --max-frozen requires --all\n");
+		return 1;
+	}
+
+	if (o->jobs && !o->all && (o->handler != cmd_scan_processes) &&
+	    (o->handler != cmd_daemon)) {
+		pr_msg("Error: --jobs can be used with --all, \"scan\" or "
+		       "\"daemon\" only\n");
+		return 1;
+	}
+
+	if (o->canary && ((o->canary_ratio < 0) || (o->canary_ratio > 100))) {
+		pr_msg("Error: --canary percent has to be from 0 to 100\n");
+		return 1;
+	}
+
+	if (o->canary && (o->handler != cmd_patch_process) &&
+	    (o->handler != cmd_canary_process)) {
+		pr_msg("Error: --canary can be used for \"patch\" and \"canary\" "
+		       "only\n");
+		return 1;
+	}
+
+	if (o->canary_timing && (!o->canary ||
+				 (o->handler != cmd_patch_process))) {
+		pr_msg("Error: --canary-timing can be used for \"patch\" with "
+		       "--canary only\n");
+		return 1;
+	}
+
+	if (o->canary && (o->handler == cmd_patch_process) &&
+	    (o->all || o->resident || o->plan_path ||
+	     (o->nr_patch_paths > 1) || o->in_place || o->rewrite_calls ||
+	     o->redirect_got || o->redirect_pointers)) {
+		pr_msg("Error: --canary can't be used with --all, --resident, "
+		       "--plan, several patch files, --in-place, "
+		       "--rewrite-calls, --redirect-got and --redirect-pointers\n");
+		return 1;
+	}
+
+	if (o->precompute && ((o->handler != cmd_patch_process) ||
+			      o->resident || o->plan_path ||
+			      (o->nr_patch_paths > 1) || o->in_place ||
+			      o->canary)) {
+		pr_msg("Error: --precompute can be used for \"patch\" of one "
+		       "patch file only, and not with --resident, --plan, "
+		       "--in-place and --canary\n");
+		return 1;
+	}
+
+	if (o->nr_revert_paths && (o->handler != cmd_replace_patches)) {
+		pr_msg("Error: patch file to revert can be provided for "
+		       "\"replace\" only\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Runs command, received by daemon. Options were checked by the client, but
+ * it's not trusted.
+ */
+static int run_options(struct options *o)
+{
+	o->handler = cmd_handler(o->command);
+	if (!o->handler || (o->handler == cmd_daemon)) {
+		pr_msg("Error: invalid command \"%s\"\n", o->command);
+		return 1;
+	}
+
+	if (check_options(o))
+		return 1;
+
+	return o->handler(o);
+}
+
 static int parse_options(int argc, char **argv, struct options *o)
 {
-	static const char short_opts[] = "hp:v:f:";
+	static const char short_opts[] = "hp:v:f:r:";
 	static struct option long_opts[] = {
 		{ "help",		no_argument,		0, 'h'	},
 		{ "pid",		required_argument,	0, 'p'	},
 		{ "verbosity",		required_argument,	0, 'v'	},
 		{ "filename",		required_argument,	0, 'f'	},
+		{ "revert",		required_argument,	0, 'r'	},
 		{ "dry-run",		no_argument,		0, 1000	},
 		{ "no-plugin",		no_argument,		0, 1001	},
+		{ "plan",		required_argument,	0, 1002	},
+		{ "all",		no_argument,		0, 1003	},
+		{ "jobs",		required_argument,	0, 1004	},
+		{ "max-frozen",		required_argument,	0, 1005	},
+		{ "socket",		required_argument,	0, 1006	},
+		{ "resident",		no_argument,		0, 1007	},
+		{ "map-service",	no_argument,		0, 1008	},
+		{ "rewrite-calls",	no_argument,		0, 1009	},
+		{ "redirect-got",	no_argument,		0, 1010	},
+		{ "redirect-pointers",	no_argument,		0, 1011	},
+		{ "in-place",		no_argument,		0, 1012	},
+		{ "relax-got",		no_argument,		0, 1013	},
+		{ "canary",		required_argument,	0, 1014	},
+		{ "precompute",		no_argument,		0, 1015	},
+		{ "canary-timing",	no_argument,		0, 1016	},
 		{ },
 	};
 	int opt, idx = -1;
@@ -151,7 +569,20 @@ static int parse_options(int argc, char **argv, struct options *o)
 				goto bad_arg;
 			break;
 		case 'f':
-			o->patch_path = optarg;
+			if (o->nr_patch_paths == MAX_PATCH_FILES) {
+				pr_msg("Error: too many patch files\n");
+				return 1;
+			}
+			if (!o->patch_path)
+				o->patch_path = optarg;
+			o->patch_paths[o->nr_patch_paths++] = optarg;
+			break;
+		case 'r':
+			if (o->nr_revert_paths == MAX_PATCH_FILES) {
+				pr_msg("Error: too many patch files\n");
+				return 1;
+			}
+			o->revert_paths[o->nr_revert_paths++] = optarg;
 			break;
 		case 1000:
 			o->dry_run = 1;
@@ -159,6 +590,58 @@ static int parse_options(int argc, char **argv, struct options *o)
 		case 1001:
 			o->no_plugin = 1;
 			break;
+		case 1002:
+			o->plan_path = optarg;
+			break;
+		case 1003:
+			o->all = 1;
+			break;
+		case 1004:
+			o->jobs = atoi(optarg);
+			if (o->jobs <= 0)
+				goto bad_arg;
+			break;
+		case 1005:
+			o->max_frozen = atoi(optarg);
+			if (o->max_frozen <= 0)
+				goto bad_arg;
+			break;
+		case 1006:
+			o->socket_path = optarg;
+			break;
+		case 1007:
+			o->resident = 1;
+			break;
+		case 1008:
+			o->map_service = 1;
+			break;
+		case 1009:
+			o->rewrite_calls = 1;
+			break;
+		case 1010:
+			o->redirect_got = 1;
+			break;
+		case 1011:
+			o->redirect_pointers = 1;
+			break;
+		case 1012:
+			o->in_place = 1;
+			break;
+		case 1013:
+			o->relax_got = 1;
+			break;
+		case 1014:
+			o->canary = 1;
+			o->canary_ratio = atoi(optarg);
+			if ((o->canary_ratio < 0) || (o->canary_ratio > 100))
+				goto bad_arg;
+			break;
+		case 1015:
+			o->precompute = 1;
+			break;
+		case 1016:
+			o->canary_timing = 1;
+			break;
 		case '?':
 		default:
 			goto usage;
@@ -169,13 +652,29 @@ static int parse_options(int argc, char **argv, struct options *o)
 		pr_msg("Error: command has to be provided\n");
 		goto usage;
 	}
+
+	o->command = argv[optind];
+	o->handler = cmd_handler(o->command);
+	if (!o->handler) {
+		fprintf(stderr, "%s: invalid subcommand -- '%s'\n",
+				argv[0], o->command);
+		goto usage;
+	}
+
+	/* Probe action and function follow the command */
+	if (o->handler == cmd_probe_process) {
+		if (argc > optind + 1)
+			o->probe_action = argv[++optind];
+		if (argc > optind + 1)
+			o->probe_func = argv[++optind];
+	}
+
 	if (argc > optind + 1) {
 		pr_msg("Error: only one command has to be provided\n");
 		goto usage;
 	}
 
-	o->handler = cmd_handler(argv);
-	if (!o->handler)
+	if (check_options(o))
 		goto usage;
 
 	return 0;
@@ -209,5 +708,14 @@ int main(int argc, char *argv[])
 
 	compel_log_init(__print_on_level, LOG_ERROR);
 
+	/* Command is executed by daemon, if its socket is given */
+	if (o.socket_path && (o.handler != cmd_daemon)) {
+		if (o.handler == cmd_probe_process) {
+			pr_msg("Error: \"probe\" can't be used with --socket\n");
+			return 1;
+		}
+		return daemon_request(o.socket_path, &o);
+	}
+
 	return o.handler(&o);
 }
@@ -9,6 +9,8 @@
 #include <unistd.h>
 #include <linux/limits.h>
 #include <sys/mman.h>
+#include <semaphore.h>
+#include <elf.h>
 
 #include "include/patch.h"
 #include "include/log.h"
@@ -23,32 +25,59 @@
 #include "include/protobuf.h"
 #include "include/relocations.h"
 #include "include/dl_map.h"
+#include "include/plan.h"
+#include "include/image.h"
+#include "include/callsite.h"
+#include "include/inplace.h"
+#include "include/relax.h"
+#include "include/canary.h"
+#include "include/probe.h"
 
-struct process_ctx_s process_context = {
-	.service = {
-		.name = "libnsb_service.so",
-		.sock = -1,
-	},
-	.vmas = LIST_HEAD_INIT(process_context.vmas),
-	.dl_maps = LIST_HEAD_INIT(process_context.dl_maps),
-	.needed_list = LIST_HEAD_INIT(process_context.needed_list),
-	.threads = LIST_HEAD_INIT(process_context.threads),
-	.applied_patches = LIST_HEAD_INIT(process_context.applied_patches),
-	.remote_vma = {
-		.list = LIST_HEAD_INIT(process_context.remote_vma.list),
-		.length = 4096,
-		.flags = MAP_ANONYMOUS | MAP_PRIVATE,
-		.prot = PROT_READ | PROT_WRITE | PROT_EXEC,
-	},
-};
+static int read_func_code(const struct dl_map *target_dlm,
+			  const struct func_jump_s *fj, void *code, size_t size);
 
-static int write_func_code(struct process_ctx_s *ctx, struct func_jump_s *fj)
+/*
+ * Function body could be replaced in place by this patch (or by a reverted
+ * one, when its jump was overwritten). Then the whole body is restored.
+ */
+static int write_func_code(struct process_ctx_s *ctx, const struct patch_s *p,
+			   struct func_jump_s *fj)
 {
+	size_t size = fj->func_size;
+	uint8_t *orig, *code;
+	int err;
+
 	pr_info("  - Restoring code in \"%s\":\n", fj->name);
 	pr_info("      old address: %#lx\n", fj->func_addr);
 
-	return process_write_data(ctx, fj->func_addr,
-				  fj->code, sizeof(fj->code));
+	if (size <= sizeof(fj->code))
+		return process_write_data(ctx, fj->func_addr,
+					  fj->code, sizeof(fj->code));
+
+	orig = xmalloc(size * 2);
+	if (!orig)
+		return -ENOMEM;
+	code = orig + size;
+
+	err = read_func_code(p->target_dlm, fj, orig, size);
+	if (err)
+		goto free_orig;
+
+	err = process_read_data(ctx, fj->func_addr, code, size);
+	if (err)
+		goto free_orig;
+
+	if (memcmp(orig + sizeof(fj->code), code + sizeof(fj->code),
+		   size - sizeof(fj->code))) {
+		pr_info("      whole body: %lu bytes\n", size);
+		err = process_write_code(ctx, fj->func_addr, orig, size);
+	} else
+		err = process_write_data(ctx, fj->func_addr,
+					 fj->code, sizeof(fj->code));
+
+free_orig:
+	free(orig);
+	return err;
 }
 
 static int write_func_jump(const struct patch_s *p, struct func_jump_s *fj,
@@ -70,6 +99,21 @@ static int write_func_jump(const struct patch_s *p, struct func_jump_s *fj,
 				  fj->func_jump, sizeof(fj->func_jump));
 }
 
+static uint64_t func_jump_patch_addr(const struct patch_s *p,
+				     const struct func_jump_s *fj)
+{
+	return dlm_load_base(p->patch_dlm) + fj->patch_value;
+}
+
+static int patch_redirect_calls(struct process_ctx_s *ctx, struct patch_s *p,
+				unsigned redirects);
+
+static int find_previous_func_jump(const struct process_ctx_s *ctx,
+				   const struct patch_s *p,
+				   const struct func_jump_s *fj,
+				   const struct patch_s **prev_patch,
+				   struct func_jump_s **prev_func_jump);
+
 static int iterate_patch_function_jumps(const struct patch_s *p,
 					int (*actor)(const struct patch_s *p,
 						     struct func_jump_s *fj,
@@ -89,22 +133,108 @@ static int iterate_patch_function_jumps(const struct patch_s *p,
 	return 0;
 }
 
-static int apply_func_jumps(struct process_ctx_s *ctx)
+/*
+ * Body, replaced by a previous patch, is left as is: the previous patch
+ * restores it on revert.
+ */
+static int func_replace_in_place(struct process_ctx_s *ctx,
+				 const struct patch_s *p,
+				 struct func_jump_s *fj)
+{
+	const struct patch_s *prev_patch;
+	struct func_jump_s *prev_func_jump;
+	int err;
+
+	err = find_previous_func_jump(ctx, p, fj, &prev_patch, &prev_func_jump);
+	if (!err)
+		return 0;
+	if (err != -ENOENT)
+		return err;
+
+	return func_inplace_code(ctx, fj);
+}
+
+static int apply_func_jump(const struct patch_s *p, struct func_jump_s *fj,
+			   void *data)
+{
+	struct process_ctx_s *ctx = data;
+	int ret = 0;
+
+	if (ctx->opts.in_place) {
+		ret = func_replace_in_place(ctx, p, fj);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (ret)
+		return write_func_inplace(ctx, fj);
+	return write_func_jump(p, fj, ctx);
+}
+
+static unsigned opts_redirects(const struct process_ctx_s *ctx)
+{
+	unsigned redirects = 0;
+
+	if (ctx->opts.rewrite_calls)
+		redirects |= PATCH_REDIRECT_CALLS;
+	if (ctx->opts.redirect_got)
+		redirects |= PATCH_REDIRECT_GOT;
+	if (ctx->opts.redirect_pointers)
+		redirects |= PATCH_REDIRECT_POINTERS;
+	return redirects;
+}
+
+/*
+ * Patch, applied without the record, could redirect anything.
+ */
+static unsigned patch_redirects(const struct patch_s *p)
+{
+	if (p->redirects & PATCH_REDIRECT_RECORDED)
+		return p->redirects & PATCH_REDIRECT_ALL;
+	return PATCH_REDIRECT_ALL;
+}
+
+static int patch_apply_func_jumps(struct process_ctx_s *ctx, struct patch_s *p,
+				  unsigned redirects)
 {
 	int err;
 
+	/* Nothing is redirected until jumps are written */
+	p->redirects = PATCH_REDIRECT_RECORDED;
+
 	pr_info("= Apply function jumps:\n");
-	err = iterate_patch_function_jumps(P(ctx), write_func_jump, ctx);
-	if (err)
+	err = iterate_patch_function_jumps(p, apply_func_jump, ctx);
+	if (err) {
 		pr_err("failed to apply function jump\n");
-	return 0;
+		return err;
+	}
+	return patch_redirect_calls(ctx, p, redirects);
+}
+
+static int apply_func_jumps(struct process_ctx_s *ctx)
+{
+	return patch_apply_func_jumps(ctx, P(ctx), opts_redirects(ctx));
+}
+
+/*
+ * Reverted patch gets back the redirections it had.
+ */
+static int patch_restore_func_jumps(struct process_ctx_s *ctx,
+				    struct patch_s *p)
+{
+	unsigned redirects = opts_redirects(ctx);
+
+	if (p->redirects & PATCH_REDIRECT_RECORDED)
+		redirects = p->redirects & PATCH_REDIRECT_ALL;
+
+	return patch_apply_func_jumps(ctx, p, redirects);
 }
 
-static int read_func_jump_code(const struct dl_map *target_dlm, struct func_jump_s *fj)
+static int read_func_code(const struct dl_map *target_dlm,
+			  const struct func_jump_s *fj, void *code, size_t size)
 {
 	int fd, err = 0;
 	ssize_t ret;
-	size_t size = sizeof(fj->code);
 	off_t offset;
 	const char *map_file = target_dlm->exec_vma->map_file;
 	const struct elf_info_s *ei = target_dlm->ei;
@@ -124,7 +254,7 @@ static int read_func_jump_code(const struct dl_map *target_dlm, struct func_jump
 		goto close_fd;
 	}
 
-	ret = read(fd, fj->code, size);
+	ret = read(fd, code, size);
 	if (ret != size) {
 		if (ret == -1) {
 			pr_perror("failed to read %s", map_file);
@@ -156,31 +286,90 @@ close_fd:
  * We can then use these two addresses, to find offset from current positon to
  * target one, and write it as a part of jump command.
  */
+struct patch_funcs {
+	struct elf_func		*funcs;
+	ssize_t			nr_funcs;
+};
+
+static uint32_t patch_func_size(const struct patch_funcs *pf, uint64_t value)
+{
+	ssize_t i;
+
+	for (i = 0; i < pf->nr_funcs; i++) {
+		if (pf->funcs[i].value == value)
+			return pf->funcs[i].size;
+	}
+	return 0;
+}
+
+/*
+ * Function variant, requiring the most of CPU features, which the host has,
+ * is the best one. Like with ifunc, it's chosen once per apply.
+ */
+static void select_func_variant(struct func_jump_s *fj)
+{
+	uint64_t features = x86_cpu_features();
+	const struct func_variant_s *best = NULL;
+	int i;
+
+	for (i = 0; i < fj->n_variants; i++) {
+		const struct func_variant_s *fv = &fj->variants[i];
+
+		if ((fv->features & features) != fv->features)
+			continue;
+		if (best && (__builtin_popcountl(fv->features) <=
+			     __builtin_popcountl(best->features)))
+			continue;
+		best = fv;
+	}
+
+	if (!best)
+		return;
+
+	pr_debug("  - \"%s\": variant for CPU features %#lx (host: %#lx)\n",
+			fj->name, best->features, features);
+	fj->patch_value = best->patch_value;
+}
+
 static int tune_patch_func_jump(const struct patch_s *p, struct func_jump_s *fj,
 				void *data)
 {
-	uint64_t patch_addr;
+	const struct patch_funcs *pf = data;
 	ssize_t size;
 
+	select_func_variant(fj);
+
 	fj->func_addr = dlm_load_base(p->target_dlm) + fj->func_value;
-	patch_addr = dlm_load_base(p->patch_dlm) + fj->patch_value;
+	fj->patch_addr = dlm_load_base(p->patch_dlm) + fj->patch_value;
+	fj->patch_size = patch_func_size(pf, fj->patch_value);
 
 	size = x86_jmpq_instruction(fj->func_jump, sizeof(fj->func_jump),
-				    fj->func_addr, patch_addr);
+				    fj->func_addr, fj->patch_addr);
 	if (size < 0)
 		return size;
 
-	return read_func_jump_code(p->target_dlm, fj);
+	return read_func_code(p->target_dlm, fj, fj->code, sizeof(fj->code));
 }
 
 static int tune_patch_func_jumps(struct patch_s *p)
 {
+	struct patch_funcs pf = { };
 	int err;
 
-	err = iterate_patch_function_jumps(p, tune_patch_func_jump, NULL);
+	/* Sizes of new functions are required for in place replacement only */
+	pf.nr_funcs = elf_functions(p->ei, &pf.funcs);
+	if (pf.nr_funcs < 0) {
+		pr_debug("failed to collect functions of %s: %ld\n",
+				p->path, pf.nr_funcs);
+		pf.nr_funcs = 0;
+	}
+
+	err = iterate_patch_function_jumps(p, tune_patch_func_jump, &pf);
 	if (err)
-		pr_err("failed to tune function jump\n");
-	return 0;
+		pr_err("failed to tune function jump: %d\n", err);
+
+	free(pf.funcs);
+	return err;
 }
 
 static int print_patch_func_jump(const struct patch_s *p, struct func_jump_s *fj,
@@ -210,6 +399,12 @@ static int patch_unload(struct process_ctx_s *ctx, const struct patch_s *p)
 {
 	const struct dl_map *dlm = p->patch_dlm;
 
+	int err;
+
+	err = canary_unload(ctx, p);
+	if (err)
+		return err;
+
 	pr_info("= Unloading %s:\n", dlm->path);
 
 	return unload_elf(ctx, dlm);
@@ -225,9 +420,9 @@ static int load_patch(struct process_ctx_s *ctx)
 	int err;
 	struct dl_map *dlm;
 
-	pr_info("= Loading %s:\n", ctx->patchfile);
+	pr_info("= Loading %s:\n", P(ctx)->path);
 
-	dlm = alloc_dl_map(ctx->patch_ei, ctx->patchfile);
+	dlm = alloc_dl_map(P(ctx)->ei, P(ctx)->path);
 	if (!dlm)
 		return -ENOMEM;
 
@@ -235,16 +430,23 @@ static int load_patch(struct process_ctx_s *ctx)
 	if (err)
 		goto destroy_dlm;
 
+	err = process_reserve_dl_map(ctx, dlm);
+	if (err)
+		goto unload_elf;
+
 	list_add_tail(&P(ctx)->list, &ctx->applied_patches);
 	P(ctx)->patch_dlm = dlm;
 	return 0;
 
+unload_elf:
+	if (unload_elf(ctx, dlm))
+		pr_err("failed to unload %s\n", dlm->path);
 destroy_dlm:
 	return err;
 }
 
 static int func_jump_applied(struct process_ctx_s *ctx,
-			     const struct func_jump_s *fj)
+			     struct func_jump_s *fj)
 {
 	int err;
 	uint8_t code[8];
@@ -258,7 +460,10 @@ static int func_jump_applied(struct process_ctx_s *ctx,
 	if (err)
 		return err;
 
-	return !memcmp(code, fj->func_jump, sizeof(code));
+	if (!memcmp(code, fj->func_jump, sizeof(code)))
+		return 1;
+
+	return func_inplace_applied(ctx, fj);
 }
 
 static int find_function_jump(const struct patch_info_s *pi,
@@ -313,173 +518,498 @@ static int find_previous_func_jump(const struct process_ctx_s *ctx,
 	return -ENOENT;
 }
 
-static int do_revert_func_jump(struct process_ctx_s *ctx,
+static int find_next_func_jump(const struct process_ctx_s *ctx,
 			       const struct patch_s *p,
-			       struct func_jump_s *fj)
+			       const struct func_jump_s *fj,
+			       const struct patch_s **next_patch,
+			       struct func_jump_s **next_func_jump)
 {
+	const struct patch_s *np = p;
 	int err;
-	const struct patch_s *prev_patch;
-	struct func_jump_s *prev_func_jump;
 
-	err = find_previous_func_jump(ctx, p, fj, &prev_patch, &prev_func_jump);
-	if (err < 0) {
-		if (err != -ENOENT)
+	list_for_each_entry_continue(np, &ctx->applied_patches, list) {
+		if (np->target_dlm != p->target_dlm)
+			continue;
+
+		err = find_function_jump(&np->pi, compare_fj_addr,
+					 &fj->func_addr, next_func_jump);
+		if (err != -ENOENT) {
+			*next_patch = np;
 			return err;
-		return write_func_code(ctx, fj);
+		}
 	}
-	return write_func_jump(prev_patch, prev_func_jump, ctx);
+	return -ENOENT;
 }
 
-static int revert_func_jump(const struct patch_s *p, struct func_jump_s *fj,
-			    void *data)
+static int func_jump_committed(struct process_ctx_s *ctx,
+			       const struct patch_s *p,
+			       struct func_jump_s *fj)
 {
-	struct process_ctx_s *ctx = data;
-	int applied;
+	const struct patch_s *next_patch;
+	struct func_jump_s *next_func_jump;
+	int ret;
 
-	applied = func_jump_applied(ctx, fj);
-	if (applied <= 0)
-		return applied;
+	ret = func_jump_applied(ctx, fj);
+	if (ret)
+		return ret;
 
-	return do_revert_func_jump(ctx, p, fj);
+	/* Jump could be overwritten by a patch, applied on top of this one */
+	ret = find_next_func_jump(ctx, p, fj, &next_patch, &next_func_jump);
+	if (ret < 0)
+		return (ret == -ENOENT) ? 0 : ret;
+
+	return func_jump_applied(ctx, next_func_jump);
 }
 
-static int patch_revert_func_jumps(struct process_ctx_s *ctx, struct patch_s *p)
+/*
+ * Patch is considered as staged, if it's loaded into process address space,
+ * but none of its function jumps are written yet.
+ */
+int patch_staged(struct process_ctx_s *ctx, const struct patch_s *p)
 {
-	int err;
+	const struct patch_info_s *pi = &p->pi;
+	int i, ret;
 
-	pr_info("= Revert function jumps:\n");
-	err = iterate_patch_function_jumps(p, revert_func_jump, ctx);
-	if (err)
-		pr_err("failed to revert function jump\n");
-	return 0;
-}
+	if (!p->target_dlm || !pi->n_func_jumps)
+		return 0;
 
-static int revert_func_jumps(struct process_ctx_s *ctx)
-{
-	return patch_revert_func_jumps(ctx, P(ctx));
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		ret = func_jump_committed(ctx, p, pi->func_jumps[i]);
+		if (ret)
+			return ret < 0 ? ret : 0;
+	}
+	return 1;
 }
 
-static int write_static_ref(const struct process_ctx_s *ctx,
-			    uint64_t addr,
-			    int64_t offset, int64_t offset_size)
-{
-	char bytes[8];
-	const void *off = &offset;
-	int offset_small = offset;
+struct redirect_s {
+	struct process_ctx_s	*ctx;
+	unsigned		redirects;
+	size_t			nr_calls;
+	size_t			nr_got_slots;
+	size_t			nr_pointers;
+};
 
-	if (offset_size == 4) {
-		int err;
+static int retarget_func_calls(struct redirect_s *rd,
+			       const struct patch_s *p,
+			       const struct func_jump_s *fj,
+			       uint64_t from, uint64_t to)
+{
+	int ret;
 
-		err = process_read_data(ctx, addr, bytes, sizeof(bytes));
-		if (err)
-			return err;
+	if (rd->redirects & PATCH_REDIRECT_CALLS) {
+		ret = retarget_call_sites(rd->ctx, p, fj, from, to);
+		if (ret < 0)
+			return ret;
+		rd->nr_calls += ret;
+	}
 
-		off = &offset_small;
+	if (rd->redirects & PATCH_REDIRECT_GOT) {
+		ret = retarget_got_slots(rd->ctx, fj, from, to);
+		if (ret < 0)
+			return ret;
+		rd->nr_got_slots += ret;
 	}
 
-	memcpy(bytes, off, offset_size);
+	if (rd->redirects & PATCH_REDIRECT_POINTERS) {
+		ret = retarget_data_pointers(rd->ctx, fj, from, to);
+		if (ret < 0)
+			return ret;
+		rd->nr_pointers += ret;
+	}
+	return 0;
+}
 
-	return process_write_data(ctx, addr, bytes, sizeof(bytes));
+static int collect_redirects(struct process_ctx_s *ctx, struct patch_s *p,
+			     unsigned redirects)
+{
+	int err = 0;
+
+	if (redirects & PATCH_REDIRECT_CALLS)
+		err = patch_collect_call_sites(p);
+	if (!err && (redirects & PATCH_REDIRECT_GOT))
+		err = patch_collect_got_slots(ctx, p);
+	if (!err && (redirects & PATCH_REDIRECT_POINTERS))
+		err = patch_collect_data_pointers(p);
+	return err;
 }
 
 /*
- * How to fix a static variable reference?
- * All this commands uses relative addressation and thus we have to create
- * "offset" and place it into the right place.
- * We are provided with:
- *   - patch_size - this is size of the offset we need to write.
- *   - patch_address - this is address in patch, which has to be patched with
- *                     the offset.
- *   - target_value - some interim value.
- *
- * Offset has to be calculated by using the following formula:
- *
- *    offset = target_value + "target ELF load base" - "Patch load base"
- *
- * What is "target_value"?
- * This interim value was constructed by generator to simplify offset
- * calculation here in patcher.
- *
- * Consider relocation generated for some symbol,
- * having address Sn in new library:
- *
- * Rn = Sn + X
- *
- * where X indicates terms indepedent of address symbols (relocation offset,
- * addend, etc). If the new library should refer to symbol from old library,
- * then, by relocation definition, its value should be:
- *
- * Ro = So + X = (So - Sn) + (Sn + X) = Rn + (So - Sn)
- *
- * Note that all arithmetic here is done modulo 2**64
- *
- * Symbol address equals library load address Lx plus offset to library Dx:
- *
- * So = Lo + Do
- * Sn = Ln + Dn
- *
- * Substituting these to formula above and rearranging terms, we get
- *
- * Ro = (Rn + Do - Dn) + (Lo - Ln)
- *
- * Value in the first parens is 'target_value'
+ * Record is a byte in ELF header padding of the first patch mapping, which
+ * is always mapped from the file start. Process is written by words.
  */
-static int apply_static_ref(struct process_ctx_s *ctx,
-			    const struct static_sym_s *ss)
-{
-	uint64_t patch_ref_addr, var_addr, reloc;
-
-	patch_ref_addr = dlm_load_base(PDLM(ctx)) + ss->patch_address;
+#define PATCH_RECORD_WORD	8
 
-	reloc = ss->target_value + dlm_load_base(TDLM(ctx)) -
-		 dlm_load_base(PDLM(ctx));
+static int patch_record_addr(const struct patch_s *p, uint64_t *addr)
+{
+	const struct vma_area *vma = first_dl_vma(p->patch_dlm);
 
-	var_addr = patch_ref_addr + reloc + ss->patch_size;
+	if (!vma || vma_offset(vma))
+		return -ENOENT;
 
-	if (ss->patch_size < 8) {
-		int reloc_bit_size;
-		uint64_t reloc_sign, reloc_high_bits;
+	*addr = vma_start(vma) + PATCH_RECORD_WORD;
+	return 0;
+}
 
-		reloc_bit_size = 8 * ss->patch_size;
-		reloc_sign = (reloc >> (reloc_bit_size  - 1)) & 1;
-		reloc_high_bits = (reloc_sign ? ~reloc : reloc) >> reloc_bit_size;
+static void patch_read_record(const struct process_ctx_s *ctx,
+			      struct patch_s *p)
+{
+	uint8_t word[8];
+	uint64_t addr;
 
-		if (reloc_high_bits) {
-			pr_err("Relocation %#lx at offset %#lx overflows\n",
-					reloc, var_addr);
-			return -EINVAL;
-		}
-	}
+	if (patch_record_addr(p, &addr))
+		return;
 
-	pr_debug("  - ref: %#lx ---> %#lx (%#lx + %#lx)\n", patch_ref_addr,
-			var_addr, dlm_load_base(TDLM(ctx)),
-			var_addr - dlm_load_base(TDLM(ctx)));
+	if (process_read_data(ctx, addr, word, sizeof(word)))
+		return;
 
-	return write_static_ref(ctx, patch_ref_addr, reloc, ss->patch_size);
+	p->redirects = word[EI_PAD - PATCH_RECORD_WORD];
 }
 
-static int apply_static_refs(struct process_ctx_s *ctx)
+static int patch_read_file(const char *path, off_t offset, void *buf,
+			   size_t size)
 {
-	int i, err;
-	struct static_sym_s *ss;
-
-	pr_info("= Fix static variables references:\n");
+	ssize_t ret;
+	int fd;
 
-	for (i = 0; i < PI(ctx)->n_static_syms; i++) {
-		ss = PI(ctx)->static_syms[i];
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		pr_perror("failed to open %s", path);
+		return -errno;
+	}
 
-		err = apply_static_ref(ctx, ss);
-		if (err)
-			return err;
+	ret = pread(fd, buf, size, offset);
+	close(fd);
+	if (ret != size) {
+		pr_err("failed to read %s header\n", path);
+		return -EIO;
 	}
 	return 0;
 }
 
-static int apply_dyn_binpatch(struct process_ctx_s *ctx)
+static int patch_write_record(const struct process_ctx_s *ctx,
+			      const struct patch_s *p)
 {
+	uint8_t word[8];
+	uint64_t addr;
 	int err;
 
-	err = load_patch(ctx);
+	if (ctx->dry_run || patch_record_addr(p, &addr))
+		return 0;
+
+	/* Planned patch is not mapped yet */
+	if (plan_recording(ctx->plan))
+		err = patch_read_file(p->path, PATCH_RECORD_WORD,
+				      word, sizeof(word));
+	else
+		err = process_read_data(ctx, addr, word, sizeof(word));
+	if (err)
+		return err;
+
+	word[EI_PAD - PATCH_RECORD_WORD] = p->redirects;
+	return process_write_data(ctx, addr, word, sizeof(word));
+}
+
+static int redirect_func_calls(const struct patch_s *p, struct func_jump_s *fj,
+			       void *data)
+{
+	struct redirect_s *rd = data;
+	const struct patch_s *prev_patch;
+	struct func_jump_s *prev_func_jump;
+	uint64_t patch_addr = func_jump_patch_addr(p, fj);
+	int err;
+
+	err = retarget_func_calls(rd, p, fj, fj->func_addr, patch_addr);
+	if (err)
+		return err;
+
+	/* Calls could be already redirected by the previous patch */
+	err = find_previous_func_jump(rd->ctx, p, fj, &prev_patch, &prev_func_jump);
+	if (err < 0)
+		return (err == -ENOENT) ? 0 : err;
+
+	return retarget_func_calls(rd, p, fj,
+				   func_jump_patch_addr(prev_patch, prev_func_jump),
+				   patch_addr);
+}
+
+/*
+ * Calls, redirected to the patch function, go back to the previous patch
+ * function or to the old one.
+ */
+static int restore_func_calls(const struct patch_s *p, struct func_jump_s *fj,
+			      void *data)
+{
+	struct redirect_s *rd = data;
+	const struct patch_s *prev_patch;
+	struct func_jump_s *prev_func_jump;
+	uint64_t addr = fj->func_addr;
+	int err;
+
+	err = find_previous_func_jump(rd->ctx, p, fj, &prev_patch, &prev_func_jump);
+	if (!err)
+		addr = func_jump_patch_addr(prev_patch, prev_func_jump);
+	else if (err != -ENOENT)
+		return err;
+
+	return retarget_func_calls(rd, p, fj, func_jump_patch_addr(p, fj), addr);
+}
+
+static int patch_redirect_calls(struct process_ctx_s *ctx, struct patch_s *p,
+				unsigned redirects)
+{
+	struct redirect_s rd = {
+		.ctx = ctx,
+		.redirects = redirects,
+	};
+	struct redirect_s restore = {
+		.ctx = ctx,
+		.redirects = redirects,
+	};
+	int err;
+
+	if (!redirects)
+		return patch_write_record(ctx, p);
+
+	pr_info("= Redirect calls:\n");
+	err = collect_redirects(ctx, p, redirects);
+	if (!err)
+		err = iterate_patch_function_jumps(p, redirect_func_calls, &rd);
+	if (err) {
+		pr_err("failed to redirect calls\n");
+		/* Some of the calls could be already redirected */
+		if (iterate_patch_function_jumps(p, restore_func_calls, &restore))
+			pr_err("failed to restore redirected calls\n");
+		return err;
+	}
+
+	if (ctx->dry_run)
+		pr_msg("Would redirect %lu direct calls, %lu PLT slots and "
+		       "%lu function pointers\n",
+		       rd.nr_calls, rd.nr_got_slots, rd.nr_pointers);
+	else
+		pr_info("  Redirected %lu direct calls, %lu PLT slots and "
+			"%lu function pointers\n",
+			rd.nr_calls, rd.nr_got_slots, rd.nr_pointers);
+
+	if (rd.nr_calls)
+		p->redirects |= PATCH_REDIRECT_CALLS;
+	if (rd.nr_got_slots)
+		p->redirects |= PATCH_REDIRECT_GOT;
+	if (rd.nr_pointers)
+		p->redirects |= PATCH_REDIRECT_POINTERS;
+
+	err = patch_write_record(ctx, p);
+	if (err) {
+		pr_err("failed to record redirected calls\n");
+		if (iterate_patch_function_jumps(p, restore_func_calls, &restore))
+			pr_err("failed to restore redirected calls\n");
+	}
+	return err;
+}
+
+static int do_revert_func_jump(struct process_ctx_s *ctx,
+			       const struct patch_s *p,
+			       struct func_jump_s *fj)
+{
+	struct redirect_s rd = {
+		.ctx = ctx,
+		.redirects = patch_redirects(p),
+	};
+	int err;
+	const struct patch_s *prev_patch;
+	struct func_jump_s *prev_func_jump;
+	uint64_t addr;
+
+	err = find_previous_func_jump(ctx, p, fj, &prev_patch, &prev_func_jump);
+	if (err < 0) {
+		if (err != -ENOENT)
+			return err;
+		err = write_func_code(ctx, p, fj);
+		addr = fj->func_addr;
+	} else {
+		err = write_func_jump(prev_patch, prev_func_jump, ctx);
+		addr = func_jump_patch_addr(prev_patch, prev_func_jump);
+	}
+	if (err)
+		return err;
+
+	/*
+	 * Calls are restored regardless of the options: patch could be
+	 * applied by another nsb run. Only the recorded redirections are
+	 * restored.
+	 */
+	return retarget_func_calls(&rd, p, fj, func_jump_patch_addr(p, fj), addr);
+}
+
+static int revert_func_jump(const struct patch_s *p, struct func_jump_s *fj,
+			    void *data)
+{
+	struct process_ctx_s *ctx = data;
+	int applied;
+
+	applied = func_jump_applied(ctx, fj);
+	if (applied <= 0)
+		return applied;
+
+	return do_revert_func_jump(ctx, p, fj);
+}
+
+/*
+ * Process stack is checked against the patch mapping only on revert. But
+ * function, replaced in place, is executed at its old address.
+ */
+static int check_func_inplace(const struct patch_s *p, struct func_jump_s *fj,
+			      void *data)
+{
+	struct process_ctx_s *ctx = data;
+	int ret;
+
+	ret = func_inplace_applied(ctx, fj);
+	if (ret <= 0)
+		return ret;
+
+	return process_check_range(ctx, fj->func_addr,
+				   fj->func_addr + fj->func_size);
+}
+
+static int patch_revert_func_jumps(struct process_ctx_s *ctx, struct patch_s *p)
+{
+	int err;
+
+	pr_info("= Revert function jumps:\n");
+	err = collect_redirects(ctx, p, patch_redirects(p));
+	if (err) {
+		pr_err("failed to collect calls of patched functions\n");
+		return err;
+	}
+
+	err = iterate_patch_function_jumps(p, check_func_inplace, ctx);
+	if (err) {
+		pr_err("function, replaced in place, is in use\n");
+		return err;
+	}
+
+	err = canary_check_stack(ctx, p);
+	if (err) {
+		pr_err("canary dispatch is in use\n");
+		return err;
+	}
+
+	err = iterate_patch_function_jumps(p, revert_func_jump, ctx);
+	if (err)
+		pr_err("failed to revert function jump\n");
+	return err;
+}
+
+static int revert_func_jumps(struct process_ctx_s *ctx)
+{
+	return patch_revert_func_jumps(ctx, P(ctx));
+}
+
+/*
+ * How to fix a static variable reference?
+ * All this commands uses relative addressation and thus we have to create
+ * "offset" and place it into the right place.
+ * We are provided with:
+ *   - patch_size - this is size of the offset we need to write.
+ *   - patch_address - this is address in patch, which has to be patched with
+ *                     the offset.
+ *   - target_value - some interim value.
+ *
+ * Offset has to be calculated by using the following formula:
+ *
+ *    offset = target_value + "target ELF load base" - "Patch load base"
+ *
+ * What is "target_value"?
+ * This interim value was constructed by generator to simplify offset
+ * calculation here in patcher.
+ *
+ * Consider relocation generated for some symbol,
+ * having address Sn in new library:
+ *
+ * Rn = Sn + X
+ *
+ * where X indicates terms indepedent of address symbols (relocation offset,
+ * addend, etc). If the new library should refer to symbol from old library,
+ * then, by relocation definition, its value should be:
+ *
+ * Ro = So + X = (So - Sn) + (Sn + X) = Rn + (So - Sn)
+ *
+ * Note that all arithmetic here is done modulo 2**64
+ *
+ * Symbol address equals library load address Lx plus offset to library Dx:
+ *
+ * So = Lo + Do
+ * Sn = Ln + Dn
+ *
+ * Substituting these to formula above and rearranging terms, we get
+ *
+ * Ro = (Rn + Do - Dn) + (Lo - Ln)
+ *
+ * Value in the first parens is 'target_value'
+ */
+static int apply_static_ref(struct process_ctx_s *ctx,
+			    const struct static_sym_s *ss)
+{
+	uint64_t patch_ref_addr, var_addr, reloc;
+
+	patch_ref_addr = dlm_load_base(PDLM(ctx)) + ss->patch_address;
+
+	reloc = ss->target_value + dlm_load_base(TDLM(ctx)) -
+		 dlm_load_base(PDLM(ctx));
+
+	var_addr = patch_ref_addr + reloc + ss->patch_size;
+
+	if (ss->patch_size < 8) {
+		int reloc_bit_size;
+		uint64_t reloc_sign, reloc_high_bits;
+
+		reloc_bit_size = 8 * ss->patch_size;
+		reloc_sign = (reloc >> (reloc_bit_size  - 1)) & 1;
+		reloc_high_bits = (reloc_sign ? ~reloc : reloc) >> reloc_bit_size;
+
+		if (reloc_high_bits) {
+			pr_err("Relocation %#lx at offset %#lx overflows\n",
+					reloc, var_addr);
+			return -EINVAL;
+		}
+	}
+
+	pr_debug("  - ref: %#lx ---> %#lx (%#lx + %#lx)\n", patch_ref_addr,
+			var_addr, dlm_load_base(TDLM(ctx)),
+			var_addr - dlm_load_base(TDLM(ctx)));
+
+	return process_write_reloc(ctx, PDLM(ctx), patch_ref_addr, reloc,
+				   ss->patch_size);
+}
+
+static int apply_static_refs(struct process_ctx_s *ctx)
+{
+	int i, err;
+	struct static_sym_s *ss;
+
+	pr_info("= Fix static variables references:\n");
+
+	for (i = 0; i < PI(ctx)->n_static_syms; i++) {
+		ss = PI(ctx)->static_syms[i];
+
+		err = apply_static_ref(ctx, ss);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Staging maps the patch and binds it to the process, but doesn't make it
+ * reachable. Thus it doesn't require the process to be stopped in a safe
+ * point.
+ */
+static int stage_dyn_binpatch(struct process_ctx_s *ctx)
+{
+	int err;
+
+	err = load_patch(ctx);
 	if (err) {
 		pr_err("failed to load patch\n");
 		return err;
@@ -493,10 +1023,46 @@ static int apply_dyn_binpatch(struct process_ctx_s *ctx)
 	if (err)
 		goto unload_patch;
 
+	if (ctx->opts.relax_got) {
+		err = relax_got_refs(ctx);
+		if (err)
+			goto unload_patch;
+	}
+
+	err = process_apply_relocs(ctx);
+	if (err)
+		goto unload_patch;
+
+	err = apply_irelative_relocations(ctx);
+	if (err)
+		goto unload_patch;
+
+	return 0;
+
+unload_patch:
+	if (unload_patch(ctx))
+		pr_err("failed to unload patch\n");
+	return err;
+}
+
+static int apply_dyn_binpatch(struct process_ctx_s *ctx)
+{
+	int err;
+
+	err = stage_dyn_binpatch(ctx);
+	if (err)
+		return err;
+
 	err = tune_func_jumps(ctx);
 	if (err)
 		goto unload_patch;
 
+	if (ctx->opts.canary) {
+		err = canary_setup(ctx, P(ctx), ctx->opts.canary_ratio);
+		if (err)
+			goto unload_patch;
+	}
+
 	err = apply_func_jumps(ctx);
 	if (err)
 		goto revert_jumps;
@@ -533,10 +1099,21 @@ int create_patch_by_dlm(struct process_ctx_s *ctx, const struct dl_map *dlm,
 
 	pr_info("  %s: %s\n", dlm->path, elf_bid(dlm->ei));
 
-	p = xmalloc(sizeof(*p));
+	p = xzalloc(sizeof(*p));
 	if (!p)
 		return -ENOMEM;
 	p->patch_dlm = dlm;
+	p->path = dlm->path;
+	p->ei = dlm->ei;
+	INIT_LIST_HEAD(&p->txn);
+
+	patch_read_record(ctx, p);
+	if (p->redirects & PATCH_RETIRED) {
+		pr_info("    retired, kept mapped for redirected pointers\n");
+		free(p);
+		*patch = NULL;
+		return 0;
+	}
 
 	err = elf_info_binpatch(&p->pi, dlm->ei);
 	if (err)
@@ -548,6 +1125,8 @@ int create_patch_by_dlm(struct process_ctx_s *ctx, const struct dl_map *dlm,
 
 	if (p->target_dlm && p->patch_dlm->exec_vma) {
 		err = tune_patch_func_jumps(p);
+		if (!err)
+			err = canary_find(ctx, p);
 		if (err)
 			goto free_patch;
 	}
@@ -565,12 +1144,13 @@ free_patch:
 	return err;
 }
 
-static int create_patch(struct elf_info_s *ei, struct patch_s **patch)
+static int create_patch(struct elf_info_s *ei, const char *path,
+			struct patch_s **patch)
 {
 	int err;
 	struct patch_s *p;
 
-	p = xmalloc(sizeof(*p));
+	p = xzalloc(sizeof(*p));
 	if (!p)
 		return -ENOMEM;
 
@@ -578,8 +1158,11 @@ static int create_patch(struct elf_info_s *ei, struct patch_s **patch)
 	if (err)
 		goto free_patch;
 
+	p->path = path;
+	p->ei = ei;
 	INIT_LIST_HEAD(&p->rela_plt);
 	INIT_LIST_HEAD(&p->rela_dyn);
+	INIT_LIST_HEAD(&p->txn);
 
 	*patch = p;
 
@@ -604,38 +1187,61 @@ struct patch_s *find_patch_by_bid(struct process_ctx_s *ctx, const char *bid)
 static int process_find_patch(struct process_ctx_s *ctx)
 {
 	const char *bid = PI(ctx)->patch_bid;
+	struct patch_s *p;
 
 	pr_info("= Cheking for %s patch is applied...\n", bid);
 
-	if (find_patch_by_bid(ctx, bid)) {
+	p = find_patch_by_bid(ctx, bid);
+	if (!p)
+		return 0;
+
+	if (patch_staged(ctx, p) > 0)
+		pr_err("Patch with Build ID %s is already staged\n", bid);
+	else
 		pr_err("Patch with Build ID %s is already applied\n", bid);
-		return -EEXIST;
-	}
-	return 0;
+	return -EEXIST;
 }
 
-static int init_patch(struct process_ctx_s *ctx)
+static int init_patch(const char *patchfile, struct patch_s **patch)
 {
 	int err;
 	struct elf_info_s *ei;
 
-	err = elf_create_info(ctx->patchfile, &ei);
+	err = elf_get_info(patchfile, &ei);
 	if (err)
 		return err;
 
-	err = create_patch(ei, &ctx->patch);
+	err = create_patch(ei, patchfile, patch);
 	if (err)
 		goto destroy_elf;
 
-	ctx->patch_ei = ei;
 	return 0;
 
 destroy_elf:
-	elf_destroy_info(ei);
+	elf_put_info(ei);
 	return err;
 }
 
-int process_resume(struct process_ctx_s *ctx)
+static void freeze_limit_enter(struct process_ctx_s *ctx)
+{
+	if (!ctx->freeze_limit)
+		return;
+
+	while (sem_wait(ctx->freeze_limit) && (errno == EINTR))
+		;
+	ctx->frozen = 1;
+}
+
+static void freeze_limit_leave(struct process_ctx_s *ctx)
+{
+	if (!ctx->frozen)
+		return;
+
+	ctx->frozen = 0;
+	sem_post(ctx->freeze_limit);
+}
+
+static int __process_resume(struct process_ctx_s *ctx)
 {
 	int err;
 
@@ -651,6 +1257,15 @@ int process_resume(struct process_ctx_s *ctx)
 	return process_cure(ctx);
 }
 
+int process_resume(struct process_ctx_s *ctx)
+{
+	int err;
+
+	err = __process_resume(ctx);
+	freeze_limit_leave(ctx);
+	return err;
+}
+
 struct bt_fj_data {
 	const struct backtrace_s *bt;
 	uint64_t start;
@@ -676,6 +1291,69 @@ static int jumps_check_backtrace(const struct process_ctx_s *ctx,
 	return iterate_patch_function_jumps(P(ctx), jump_check_backtrace, &data);
 }
 
+static struct process_ctx_s *alloc_context(const struct patch_opts *opts)
+{
+	struct process_ctx_s *ctx;
+
+	ctx = xzalloc(sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	if (opts)
+		ctx->opts = *opts;
+
+	ctx->service.name = "libnsb_service.so";
+	ctx->service.sock = -1;
+	ctx->service.agent_sock = -1;
+	ctx->service.shm_fd = -1;
+
+	INIT_LIST_HEAD(&ctx->vmas);
+	INIT_LIST_HEAD(&ctx->dl_maps);
+	INIT_LIST_HEAD(&ctx->needed_list);
+	INIT_LIST_HEAD(&ctx->threads);
+	INIT_LIST_HEAD(&ctx->applied_patches);
+	INIT_LIST_HEAD(&ctx->txn_apply);
+	INIT_LIST_HEAD(&ctx->txn_revert);
+
+	INIT_LIST_HEAD(&ctx->remote_vma.list);
+	ctx->remote_vma.length = 4096;
+	ctx->remote_vma.flags = MAP_ANONYMOUS | MAP_PRIVATE;
+	ctx->remote_vma.prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+	return ctx;
+}
+
+static void destroy_context(struct process_ctx_s *ctx)
+{
+	struct ctx_dep *cd, *tmp;
+	struct patch_s *p;
+
+	if (ctx->plan)
+		plan_destroy(ctx->plan);
+
+	list_for_each_entry_safe(cd, tmp, &ctx->needed_list, list) {
+		list_del(&cd->list);
+		free(cd);
+	}
+
+	/* Infos of the patches, found in process, belong to their dl_maps */
+	if (!list_empty(&ctx->txn_apply) || !list_empty(&ctx->txn_revert)) {
+		list_for_each_entry(p, &ctx->txn_apply, txn)
+			elf_put_info(p->ei);
+		list_for_each_entry(p, &ctx->txn_revert, txn)
+			elf_put_info(p->ei);
+	} else if (ctx->patch)
+		elf_put_info(P(ctx)->ei);
+
+	service_agent_disconnect(&ctx->service);
+	free(ctx->parked);
+	free(ctx->relocs);
+
+	free_dl_maps(&ctx->dl_maps);
+	free_vmas(&ctx->vmas);
+	free(ctx);
+}
+
 static int init_context(struct process_ctx_s *ctx, pid_t pid,
 			const char *patchfile, int dry_run)
 {
@@ -686,30 +1364,45 @@ static int init_context(struct process_ctx_s *ctx, pid_t pid,
 	pr_info("  Pid        : %d\n", pid);
 
 	ctx->pid = pid;
-	ctx->patchfile = patchfile;
 	ctx->dry_run = dry_run;
 
-	if (init_patch(ctx))
+	if (init_patch(patchfile, &ctx->patch))
 		return 1;
 
-	pr_info("  Patch path    : %s\n", ctx->patchfile);
+	pr_info("  Patch path    : %s\n", P(ctx)->path);
 	pr_info("  Target BuildId: %s\n", PI(ctx)->target_bid);
 	pr_info("  Patch BuildId : %s\n", PI(ctx)->patch_bid);
 
 	return 0;
 }
 
-static int process_cease(struct process_ctx_s *ctx, const char *bid)
+static int process_freeze(struct process_ctx_s *ctx, const char *bid)
 {
 	int err, ret;
 
+	freeze_limit_enter(ctx);
+
 	err = process_suspend(ctx, bid);
-	if (err)
+	if (err) {
+		freeze_limit_leave(ctx);
 		return err;
+	}
 
 	ret = process_link(ctx);
-	if (ret)
-		goto resume;
+	if (ret) {
+		err = process_resume(ctx);
+		return ret ? ret : err;
+	}
+	return 0;
+}
+
+static int process_cease(struct process_ctx_s *ctx, const char *bid)
+{
+	int err, ret;
+
+	err = process_freeze(ctx, bid);
+	if (err)
+		return err;
 
 	ret = process_collect_vmas(ctx);
 	if (ret)
@@ -722,50 +1415,132 @@ resume:
 	return ret ? ret : err;
 }
 
-int patch_process(pid_t pid, const char *patchfile, int dry_run, int no_plugin)
+static int process_prepare_patch(struct process_ctx_s *ctx, int no_plugin)
+{
+	int err;
+
+	err = process_find_patch(ctx);
+	if (err)
+		return err;
+
+	err = process_find_target_dlm(ctx);
+	if (err)
+		return err;
+
+	if (!no_plugin) {
+		err = process_inject_service(ctx);
+		if (err)
+			return err;
+	}
+
+	err = process_collect_needed(ctx);
+	if (err)
+		return err;
+
+	err = collect_relocations(ctx);
+	if (err)
+		return err;
+
+	return resolve_relocations(ctx);
+}
+
+static int do_patch_process(struct process_ctx_s *ctx, pid_t pid,
+			    const char *patchfile, int dry_run,
+			    int no_plugin, check_backtrace_t check_backtrace,
+			    int (*apply)(struct process_ctx_s *ctx))
 {
 	int ret, err;
-	struct process_ctx_s *ctx = &process_context;
 
 	err = init_context(ctx, pid, patchfile, dry_run);
 	if (err)
 		return err;
 
-	ctx->check_backtrace = jumps_check_backtrace;
+	ctx->check_backtrace = check_backtrace;
 
 	err = process_cease(ctx, PI(ctx)->target_bid);
 	if (err)
 		return err;
 
-	ret = process_find_patch(ctx);
+	ret = process_prepare_patch(ctx, no_plugin);
 	if (ret)
 		goto resume;
 
-	ret = process_find_target_dlm(ctx);
+	ret = apply(ctx);
 	if (ret)
-		goto resume;
+		pr_err("failed to apply binary patch\n");
 
-	if (!no_plugin) {
-		ret = process_inject_service(ctx);
-		if (ret)
-			goto resume;
-	}
+resume:
+	err = process_resume(ctx);
 
-	ret = process_collect_needed(ctx);
-	if (ret)
-		goto resume;
+	pr_info("Done\n");
+	return ret ? ret : err;
+}
 
-	ret = collect_relocations(ctx);
-	if (ret)
-		goto resume;
+static int plan_dyn_binpatch(struct process_ctx_s *ctx)
+{
+	int err;
+
+	err = stage_dyn_binpatch(ctx);
+	if (err)
+		return err;
+
+	err = tune_func_jumps(ctx);
+	if (err)
+		return err;
+
+	err = plan_record_jumps(ctx, ctx->plan, P(ctx));
+	if (err)
+		return err;
+
+	/* Calls are read from the running process, and the writes are planned */
+	P(ctx)->redirects = PATCH_REDIRECT_RECORDED;
+	return patch_redirect_calls(ctx, P(ctx), opts_redirects(ctx));
+}
+
+/*
+ * Plan is computed while the process is running: mappings are read from
+ * procfs, and dependences are read from the link map with
+ * process_vm_readv() (or from resident agent, if connected). Service plugin
+ * can't be used here.
+ */
+static int process_compute_plan(struct process_ctx_s *ctx)
+{
+	int err;
+
+	ctx->plan = plan_create(P(ctx), P(ctx)->path);
+	if (!ctx->plan)
+		return -ENOMEM;
+
+	err = process_prepare_patch(ctx, 1);
+	if (err)
+		return err;
 
-	ret = resolve_relocations(ctx);
+	ctx->plan->maps_digest = plan_maps_digest(&ctx->vmas);
+
+	pr_info("= Computing apply plan:\n");
+
+	ctx->plan->recording = 1;
+	err = plan_dyn_binpatch(ctx);
+	ctx->plan->recording = 0;
+	return err;
+}
+
+static int process_apply_plan(struct process_ctx_s *ctx,
+			      const struct apply_plan_s *plan)
+{
+	int ret, err;
+
+	err = process_freeze(ctx, PI(ctx)->target_bid);
+	if (err)
+		return err;
+
+	ret = plan_validate(ctx, plan);
 	if (ret)
 		goto resume;
 
-	ret = apply_dyn_binpatch(ctx);
+	ret = plan_execute(ctx, plan);
 	if (ret)
-		pr_err("failed to apply binary patch\n");
+		pr_err("failed to execute apply plan\n");
 
 resume:
 	err = process_resume(ctx);
@@ -774,105 +1549,1321 @@ resume:
 	return ret ? ret : err;
 }
 
-int check_process(pid_t pid, const char *patchfile)
+/*
+ * Processes with the same layout share relocated patch image. If the image
+ * can't be used for the process (planned place is busy, or the process can't
+ * open the image), -EAGAIN is returned, and the process gets its own plan.
+ */
+static int process_apply_image(struct process_ctx_s *ctx,
+			       const struct apply_plan_s *image)
 {
 	int err;
-	struct process_ctx_s *ctx = &process_context;
 
-	err = init_context(ctx, pid, patchfile, 0);
+	pr_info("= Applying shared patch image:\n");
+
+	err = process_find_patch(ctx);
 	if (err)
 		return err;
 
-	err = process_collect_vmas(ctx);
+	err = process_find_target_dlm(ctx);
 	if (err)
 		return err;
 
-	return find_patch_by_bid(ctx, PI(ctx)->patch_bid) ? 0 : ENOENT;
+	err = process_apply_plan(ctx, image);
+	switch (err) {
+		case -EBUSY:
+		case -ESTALE:
+		case -EACCES:
+		case -EPERM:
+		case -ENOENT:
+			pr_info("  Shared patch image can't be used: %d\n", err);
+			return -EAGAIN;
+	}
+	return err;
 }
 
-static void list_patch(const struct patch_s *p)
+static int plan_patch_process(struct process_ctx_s *ctx, pid_t pid,
+			      const char *patchfile, int dry_run)
 {
-	pr_msg("  %s (%s) - ", p->patch_dlm->path, p->pi.patch_bid);
-	if (p->target_dlm)
-		pr_msg("%s\n", p->target_dlm->path);
+	const struct apply_plan_s *image;
+	int err;
+
+	err = init_context(ctx, pid, patchfile, dry_run);
+	if (err)
+		return err;
+
+	ctx->check_backtrace = jumps_check_backtrace;
+
+	err = process_collect_vmas(ctx);
+	if (err)
+		return err;
+
+	image = image_cache_find(plan_maps_digest(&ctx->vmas),
+				 PI(ctx)->patch_bid);
+	if (image) {
+		err = process_apply_image(ctx, image);
+		if (err != -EAGAIN)
+			return err;
+	}
+
+	err = process_compute_plan(ctx);
+	if (err)
+		return err;
+
+	if (!image) {
+		image = image_cache_add(ctx->plan);
+		if (image) {
+			err = process_apply_image(ctx, image);
+			if (err != -EAGAIN)
+				return err;
+		}
+	}
+
+	return process_apply_plan(ctx, ctx->plan);
 }
 
-int list_process_patches(pid_t pid)
+/*
+ * Patches the process, waiting on freeze_limit semaphore (if any) before
+ * stopping it. This allows to patch many processes in parallel, while keeping
+ * the number of the stopped ones bounded.
+ */
+int patch_process_limited(pid_t pid, const char *patchfile, int dry_run,
+			  int no_plugin, const struct patch_opts *opts,
+			  sem_t *freeze_limit)
 {
+	struct process_ctx_s *ctx;
 	int err;
-	struct process_ctx_s *ctx = &process_context;
-	struct patch_s *p;
 
-	if (elf_library_status())
-		return -1;
+	ctx = alloc_context(opts);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->freeze_limit = freeze_limit;
+
+	if (ctx->opts.precompute)
+		err = plan_patch_process(ctx, pid, patchfile, dry_run);
+	else
+		err = do_patch_process(ctx, pid, patchfile, dry_run, no_plugin,
+				       jumps_check_backtrace,
+				       apply_dyn_binpatch);
+
+	destroy_context(ctx);
+	return err;
+}
+
+int patch_process(pid_t pid, const char *patchfile, int dry_run, int no_plugin,
+		  const struct patch_opts *opts)
+{
+	return patch_process_limited(pid, patchfile, dry_run, no_plugin, opts,
+				     NULL);
+}
+
+static int loader_check_backtrace(const struct process_ctx_s *ctx,
+				  const struct backtrace_s *bt,
+				  uint64_t start, uint64_t end)
+{
+	return backtrace_check_range(bt, ctx->loader_start, ctx->loader_end);
+}
+
+/*
+ * Resident agent is a service thread, which stays in the process after the
+ * patcher detaches. The agent doesn't modify any code, but it's loaded via
+ * dynamic loader, which can't be entered by injected call, if any thread is
+ * stopped within it.
+ */
+static int do_start_agent(struct process_ctx_s *ctx, pid_t pid)
+{
+	int ret, err;
+
+	pr_info("= Starting resident agent in %d\n", pid);
 
 	ctx->pid = pid;
 
-	err = process_collect_vmas(ctx);
+	err = process_get_loader_range(pid, &ctx->loader_start,
+				       &ctx->loader_end);
 	if (err)
 		return err;
 
-	if (list_empty(&ctx->applied_patches))
-		return 0;
+	if (ctx->loader_start)
+		ctx->check_backtrace = loader_check_backtrace;
 
-	list_for_each_entry(p, &ctx->applied_patches, list)
-		list_patch(p);
+	err = process_freeze(ctx, NULL);
+	if (err)
+		return err;
 
-	return 0;
-}
+	ret = process_collect_vmas(ctx);
+	if (ret)
+		goto resume;
 
-static int patch_check_backtrace(const struct process_ctx_s *ctx,
-				 const struct backtrace_s *bt,
-				 uint64_t start, uint64_t end)
-{
-	return backtrace_check_range(bt, start, end);
+	ret = process_inject_service(ctx);
+	if (ret)
+		goto resume;
+
+	ret = service_start_agent(ctx, &ctx->service);
+	if (!ret)
+		ctx->service.resident = true;
+
+resume:
+	err = process_resume(ctx);
+	return ret ? ret : err;
 }
 
-static int revert_dyn_binpatch(struct process_ctx_s *ctx, struct patch_s *p)
+static int start_agent(pid_t pid, sem_t *freeze_limit)
 {
+	struct process_ctx_s *ctx;
 	int err;
 
-	if (p->target_dlm) {
-		err = patch_revert_func_jumps(ctx, p);
-		if (err)
-			return err;
-	}
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->freeze_limit = freeze_limit;
+
+	err = do_start_agent(ctx, pid);
 
-	return patch_unload(ctx, p);
+	destroy_context(ctx);
+	return err;
 }
 
-int unpatch_process(pid_t pid, const char *patchfile, int dry_run)
+static int process_connect_agent(struct process_ctx_s *ctx)
 {
-	int ret, err;
-	struct process_ctx_s *ctx = &process_context;
-	struct patch_s *p;
+	int err;
 
-	err = init_context(ctx, pid, patchfile, dry_run);
+	if (!service_agent_connect(&ctx->service, ctx->pid))
+		return 0;
+
+	err = start_agent(ctx->pid, ctx->freeze_limit);
 	if (err)
 		return err;
 
-	ctx->check_backtrace = patch_check_backtrace;
+	return service_agent_connect(&ctx->service, ctx->pid);
+}
 
-	err = process_cease(ctx, PI(ctx)->patch_bid);
+static int compare_ranges(const void *a, const void *b)
+{
+	const uint64_t *ra = a, *rb = b;
+
+	return (ra[0] > rb[0]) - (ra[0] < rb[0]);
+}
+
+/*
+ * Threads check their own stacks against patched functions in the agent,
+ * which is much faster, than remote unwinding. If it fails, all the threads
+ * are unwound via ptrace after freeze as usual. The agent can't unwind
+ * through the return hooks of timed calls (canary and probe), so threads
+ * aren't parked, if there are any.
+ */
+static void jumps_park_threads(struct process_ctx_s *ctx)
+{
+	const struct patch_info_s *pi = PI(ctx);
+	uint64_t base = dlm_load_base(TDLM(ctx));
+	uint64_t *ranges, *hooks;
+	ssize_t nr_hooks;
+	int i, err;
+
+	nr_hooks = process_timer_hooks(ctx, &hooks);
+	if (nr_hooks) {
+		if (nr_hooks > 0)
+			free(hooks);
+		pr_info("  Stack unwinding via ptrace: timed calls hooks\n");
+		return;
+	}
+
+	ranges = xmalloc(sizeof(*ranges) * 2 * (pi->n_func_jumps ? : 1));
+	if (!ranges)
+		return;
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		const struct func_jump_s *fj = pi->func_jumps[i];
+
+		ranges[2 * i] = base + fj->func_value;
+		ranges[2 * i + 1] = ranges[2 * i] + fj->func_size;
+	}
+	qsort(ranges, pi->n_func_jumps, sizeof(*ranges) * 2, compare_ranges);
+
+	err = process_park_threads(ctx, ranges, pi->n_func_jumps);
 	if (err)
+		pr_info("  Falling back to stack unwinding via ptrace: %d\n", err);
+
+	free(ranges);
+}
+
+static int process_apply_staged_plan(struct process_ctx_s *ctx,
+				     const struct apply_plan_s *plan)
+{
+	int ret, err;
+
+	jumps_park_threads(ctx);
+
+	err = process_freeze(ctx, PI(ctx)->target_bid);
+	if (err) {
+		process_release_threads(ctx);
+		plan_unstage(ctx, plan);
 		return err;
+	}
 
-	p = find_patch_by_bid(ctx, PI(ctx)->patch_bid);
-	if (!p) {
-		pr_err("failed to find target ELF with Build ID %s in process %d\n",
-				p->pi.patch_bid, pid);
-		pr_err("It was there. This is totally wrong. Aborting\n");
-		ret = -EFAULT;
+	ret = plan_validate_staged(ctx, plan);
+	if (ret)
 		goto resume;
-	}
 
-	ret = revert_dyn_binpatch(ctx, p);
+	ret = plan_commit(ctx, plan);
 	if (ret)
-		pr_err("failed to revert patch\n");
+		pr_err("failed to commit staged apply plan\n");
 
 resume:
 	err = process_resume(ctx);
 
-	pr_info("Done\n");
+	/* Agent is stopped together with the process */
+	process_release_threads(ctx);
+	if (ret)
+		plan_unstage(ctx, plan);
 	return ret ? ret : err;
 }
+
+/*
+ * The patch is mapped and relocated by resident agent while the process is
+ * running. The process is stopped only to check the stack and to write
+ * function jumps.
+ */
+static int do_resident_patch_process(struct process_ctx_s *ctx, pid_t pid,
+				     const char *patchfile, int dry_run)
+{
+	int err;
+
+	err = init_context(ctx, pid, patchfile, dry_run);
+	if (err)
+		return err;
+
+	ctx->check_backtrace = jumps_check_backtrace;
+
+	err = process_connect_agent(ctx);
+	if (err)
+		return err;
+
+	err = process_collect_vmas(ctx);
+	if (err)
+		return err;
+
+	err = process_compute_plan(ctx);
+	if (err)
+		return err;
+
+	err = plan_stage(ctx, ctx->plan);
+	if (err)
+		return err;
+
+	err = process_apply_staged_plan(ctx, ctx->plan);
+
+	pr_info("Done\n");
+	return err;
+}
+
+int resident_patch_process(pid_t pid, const char *patchfile, int dry_run,
+			   const struct patch_opts *opts)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(opts);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_resident_patch_process(ctx, pid, patchfile, dry_run);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int do_compute_plan_process(struct process_ctx_s *ctx, pid_t pid,
+				   const char *patchfile)
+{
+	int err;
+
+	err = init_context(ctx, pid, patchfile, 0);
+	if (err)
+		return err;
+
+	err = process_collect_vmas(ctx);
+	if (err)
+		return err;
+
+	return process_compute_plan(ctx);
+}
+
+static int do_plan_process(struct process_ctx_s *ctx, pid_t pid,
+			   const char *patchfile, const char *planfile)
+{
+	int err;
+
+	err = do_compute_plan_process(ctx, pid, patchfile);
+	if (err)
+		return err;
+
+	if (planfile)
+		return plan_save(ctx->plan, planfile);
+
+	plan_print(ctx->plan);
+	return 0;
+}
+
+int plan_process(pid_t pid, const char *patchfile, const char *planfile)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_plan_process(ctx, pid, patchfile, planfile);
+
+	destroy_context(ctx);
+	return err;
+}
+
+/*
+ * Computes apply plan without stopping the process. The plan is returned to
+ * the caller, which has to destroy it with plan_destroy().
+ */
+int compute_plan_process(pid_t pid, const char *patchfile,
+			 struct apply_plan_s **plan)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_compute_plan_process(ctx, pid, patchfile);
+	if (!err) {
+		*plan = ctx->plan;
+		ctx->plan = NULL;
+	}
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int process_apply_loaded_plan(struct process_ctx_s *ctx,
+				     const struct apply_plan_s *plan)
+{
+	int err;
+
+	ctx->check_backtrace = jumps_check_backtrace;
+
+	err = process_collect_vmas(ctx);
+	if (err)
+		return err;
+
+	err = process_find_patch(ctx);
+	if (err)
+		return err;
+
+	err = process_find_target_dlm(ctx);
+	if (err)
+		return err;
+
+	return process_apply_plan(ctx, plan);
+}
+
+/*
+ * Plan is valid only for the patch and the target, it was computed for.
+ */
+static int check_plan_bids(const struct process_ctx_s *ctx,
+			   const struct apply_plan_s *plan)
+{
+	if (strcmp(plan->patch_bid, PI(ctx)->patch_bid)) {
+		pr_err("Plan was computed for patch with Build ID %s\n",
+				plan->patch_bid);
+		return -EINVAL;
+	}
+
+	if (strcmp(plan->target_bid, PI(ctx)->target_bid)) {
+		pr_err("Plan was computed for target with Build ID %s\n",
+				plan->target_bid);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int do_apply_plan_process(struct process_ctx_s *ctx, pid_t pid,
+				 const char *patchfile, const char *planfile,
+				 int dry_run)
+{
+	int err;
+
+	err = init_context(ctx, pid, patchfile, dry_run);
+	if (err)
+		return err;
+
+	err = plan_load(planfile, &ctx->plan);
+	if (err)
+		return err;
+
+	err = check_plan_bids(ctx, ctx->plan);
+	if (err)
+		return err;
+
+	return process_apply_loaded_plan(ctx, ctx->plan);
+}
+
+int apply_plan_process(pid_t pid, const char *patchfile, const char *planfile,
+		       int dry_run)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_apply_plan_process(ctx, pid, patchfile, planfile, dry_run);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int do_execute_plan_process(struct process_ctx_s *ctx, pid_t pid,
+				   const char *patchfile,
+				   const struct apply_plan_s *plan, int dry_run)
+{
+	int err;
+
+	err = init_context(ctx, pid, patchfile, dry_run);
+	if (err)
+		return err;
+
+	err = check_plan_bids(ctx, plan);
+	if (err)
+		return err;
+
+	return process_apply_loaded_plan(ctx, plan);
+}
+
+int execute_plan_process(pid_t pid, const char *patchfile,
+			 const struct apply_plan_s *plan, int dry_run)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_execute_plan_process(ctx, pid, patchfile, plan, dry_run);
+
+	destroy_context(ctx);
+	return err;
+}
+
+/*
+ * Staged patch code is unreachable. So there is no need to check process
+ * stack: all we need is a short stop to map and bind the patch.
+ */
+int stage_process(pid_t pid, const char *patchfile, int dry_run, int no_plugin,
+		  const struct patch_opts *opts)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(opts);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_patch_process(ctx, pid, patchfile, dry_run, no_plugin,
+			       NULL, stage_dyn_binpatch);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int commit_dyn_binpatch(struct process_ctx_s *ctx, struct patch_s *p)
+{
+	int err;
+
+	err = patch_staged(ctx, p);
+	if (err <= 0) {
+		if (!err) {
+			pr_err("Patch with Build ID %s is already applied\n",
+					p->pi.patch_bid);
+			err = -EEXIST;
+		}
+		return err;
+	}
+
+	err = iterate_patch_function_jumps(p, print_patch_func_jump, NULL);
+	if (err)
+		return err;
+
+	err = patch_apply_func_jumps(ctx, p, opts_redirects(ctx));
+	if (err) {
+		if (patch_revert_func_jumps(ctx, p))
+			pr_err("failed to revert function jumps\n");
+	}
+	return err;
+}
+
+/*
+ * Commit makes a staged patch reachable. This requires the process to be
+ * stopped in a safe point, but only function jumps have to be written.
+ */
+static int do_commit_process(struct process_ctx_s *ctx, pid_t pid,
+			     const char *patchfile, int dry_run)
+{
+	int ret, err;
+	struct patch_s *p;
+
+	err = init_context(ctx, pid, patchfile, dry_run);
+	if (err)
+		return err;
+
+	ctx->check_backtrace = jumps_check_backtrace;
+
+	err = process_cease(ctx, PI(ctx)->target_bid);
+	if (err)
+		return err;
+
+	p = find_patch_by_bid(ctx, PI(ctx)->patch_bid);
+	if (!p) {
+		pr_err("Patch with Build ID %s is not staged in process %d\n",
+				PI(ctx)->patch_bid, pid);
+		ret = -ENOENT;
+		goto resume;
+	}
+
+	if (!p->target_dlm) {
+		pr_err("failed to find target ELF with Build ID %s in process %d\n",
+				p->pi.target_bid, pid);
+		ret = -ENOENT;
+		goto resume;
+	}
+
+	ret = commit_dyn_binpatch(ctx, p);
+	if (ret)
+		pr_err("failed to commit binary patch\n");
+
+resume:
+	err = process_resume(ctx);
+
+	pr_info("Done\n");
+	return ret ? ret : err;
+}
+
+int commit_process(pid_t pid, const char *patchfile, int dry_run,
+		   const struct patch_opts *opts)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(opts);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_commit_process(ctx, pid, patchfile, dry_run);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int do_check_process(struct process_ctx_s *ctx, pid_t pid,
+			    const char *patchfile)
+{
+	int err;
+
+	err = init_context(ctx, pid, patchfile, 0);
+	if (err)
+		return err;
+
+	err = process_collect_vmas(ctx);
+	if (err)
+		return err;
+
+	return find_patch_by_bid(ctx, PI(ctx)->patch_bid) ? 0 : ENOENT;
+}
+
+int check_process(pid_t pid, const char *patchfile)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_check_process(ctx, pid, patchfile);
+
+	destroy_context(ctx);
+	return err;
+}
+
+/*
+ * Canary counters and the share of calls are in shared memory: the process
+ * is neither stopped, nor attached.
+ */
+int canary_process(pid_t pid, const char *patchfile, int percent)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = init_context(ctx, pid, patchfile, 0);
+	if (!err)
+		err = canary_control(ctx, percent);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int do_probe_process(struct process_ctx_s *ctx, pid_t pid,
+			    const char *func, int dry_run,
+			    int (*probe)(struct process_ctx_s *ctx,
+					 const char *func))
+{
+	int ret, err;
+
+	ctx->pid = pid;
+	ctx->dry_run = dry_run;
+
+	err = process_freeze(ctx, NULL);
+	if (err)
+		return err;
+
+	ret = process_collect_vmas(ctx);
+	if (!ret)
+		ret = probe(ctx, func);
+
+	err = process_resume(ctx);
+	return ret ? ret : err;
+}
+
+/*
+ * Probes don't need a patch. Code, changed by a probe (function prologue on
+ * attach, or probe code on detach), can be in use by the process: then it's
+ * resumed and stopped again later.
+ */
+static int probe_process(pid_t pid, const char *func, int dry_run,
+			 int (*probe)(struct process_ctx_s *ctx,
+				      const char *func))
+{
+	struct process_ctx_s *ctx;
+	unsigned timeout_msec = 1;
+	int try, tries = 25, err;
+
+	for (try = 0; try < tries; try++) {
+		if (try) {
+			pr_info("  Probe code is in use.\n"
+				"  Retry in %d msec\n", timeout_msec);
+
+			usleep(timeout_msec * 1000);
+
+			timeout_msec = min(timeout_msec << 1, 1000U);
+		}
+
+		ctx = alloc_context(NULL);
+		if (!ctx)
+			return -ENOMEM;
+
+		err = do_probe_process(ctx, pid, func, dry_run, probe);
+
+		destroy_context(ctx);
+		if (err != -EAGAIN)
+			return err;
+	}
+
+	pr_err("failed to stop process out of probe code: Timeout reached\n");
+	return -ETIME;
+}
+
+int probe_attach_process(pid_t pid, const char *func, int dry_run)
+{
+	return probe_process(pid, func, dry_run, probe_attach);
+}
+
+int probe_detach_process(pid_t pid, const char *func, int dry_run)
+{
+	return probe_process(pid, func, dry_run, probe_detach);
+}
+
+/* Probe records are in shared memory: the process is not stopped */
+int probe_report_process(pid_t pid, const char *func)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->pid = pid;
+
+	err = collect_vmas(pid, &ctx->vmas);
+	if (!err)
+		err = probe_report(ctx, func);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static void list_patch(struct process_ctx_s *ctx, const struct patch_s *p)
+{
+	pr_msg("  %s (%s) - ", p->patch_dlm->path, p->pi.patch_bid);
+	if (p->target_dlm)
+		pr_msg("%s", p->target_dlm->path);
+	if (patch_staged(ctx, p) > 0)
+		pr_msg(" (staged)");
+	pr_msg("\n");
+}
+
+static int do_list_process_patches(struct process_ctx_s *ctx, pid_t pid)
+{
+	int err;
+	struct patch_s *p;
+
+	if (elf_library_status())
+		return -1;
+
+	ctx->pid = pid;
+
+	err = process_collect_vmas(ctx);
+	if (err)
+		return err;
+
+	if (list_empty(&ctx->applied_patches))
+		return 0;
+
+	list_for_each_entry(p, &ctx->applied_patches, list)
+		list_patch(ctx, p);
+
+	return 0;
+}
+
+int list_process_patches(pid_t pid)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_list_process_patches(ctx, pid);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int patch_check_backtrace(const struct process_ctx_s *ctx,
+				 const struct backtrace_s *bt,
+				 uint64_t start, uint64_t end)
+{
+	return backtrace_check_range(bt, start, end);
+}
+
+/*
+ * Function pointers, redirected to the patch, could be copied by the process
+ * while the patch was applied, and such copies can't be found. Thus patch
+ * code is never unmapped, once any pointer was redirected: the patch is only
+ * retired, and is not considered applied anymore.
+ */
+static int patch_release(struct process_ctx_s *ctx, struct patch_s *p)
+{
+	if (!(p->redirects & PATCH_REDIRECT_RECORDED) ||
+	    !(p->redirects & PATCH_REDIRECT_POINTERS))
+		return patch_unload(ctx, p);
+
+	pr_info("= Retiring %s: function pointers could be copied\n",
+			p->patch_dlm->path);
+
+	p->redirects |= PATCH_RETIRED;
+	return patch_write_record(ctx, p);
+}
+
+static int revert_dyn_binpatch(struct process_ctx_s *ctx, struct patch_s *p)
+{
+	int err;
+
+	if (p->target_dlm) {
+		err = patch_revert_func_jumps(ctx, p);
+		if (err)
+			return err;
+	}
+
+	return patch_release(ctx, p);
+}
+
+static int do_unpatch_process(struct process_ctx_s *ctx, pid_t pid,
+			      const char *patchfile, int dry_run)
+{
+	int ret, err;
+	struct patch_s *p;
+
+	err = init_context(ctx, pid, patchfile, dry_run);
+	if (err)
+		return err;
+
+	ctx->check_backtrace = patch_check_backtrace;
+
+	err = process_cease(ctx, PI(ctx)->patch_bid);
+	if (err)
+		return err;
+
+	p = find_patch_by_bid(ctx, PI(ctx)->patch_bid);
+	if (!p) {
+		pr_err("failed to find target ELF with Build ID %s in process %d\n",
+				p->pi.patch_bid, pid);
+		pr_err("It was there. This is totally wrong. Aborting\n");
+		ret = -EFAULT;
+		goto resume;
+	}
+
+	ret = revert_dyn_binpatch(ctx, p);
+	if (ret)
+		pr_err("failed to revert patch\n");
+
+resume:
+	err = process_resume(ctx);
+
+	pr_info("Done\n");
+	return ret ? ret : err;
+}
+
+int unpatch_process(pid_t pid, const char *patchfile, int dry_run)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(NULL);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_unpatch_process(ctx, pid, patchfile, dry_run);
+
+	destroy_context(ctx);
+	return err;
+}
+
+static int txn_init_patches(struct list_head *head,
+			    const char * const *patchfiles, int nr_patchfiles)
+{
+	struct patch_s *p;
+	int i, err;
+
+	for (i = 0; i < nr_patchfiles; i++) {
+		err = init_patch(patchfiles[i], &p);
+		if (err)
+			return err;
+
+		pr_info("  Patch path    : %s\n", p->path);
+		pr_info("  Target BuildId: %s\n", p->pi.target_bid);
+		pr_info("  Patch BuildId : %s\n", p->pi.patch_bid);
+
+		list_add_tail(&p->txn, head);
+	}
+	return 0;
+}
+
+static int init_txn_context(struct process_ctx_s *ctx, pid_t pid,
+			    const char * const *apply, int nr_apply,
+			    const char * const *revert, int nr_revert,
+			    int dry_run)
+{
+	int err;
+
+	if (elf_library_status())
+		return -1;
+
+	pr_info("Transaction context:\n");
+	pr_info("  Pid        : %d\n", pid);
+
+	ctx->pid = pid;
+	ctx->dry_run = dry_run;
+
+	pr_info("  Apply:\n");
+	err = txn_init_patches(&ctx->txn_apply, apply, nr_apply);
+	if (err)
+		return err;
+
+	pr_info("  Revert:\n");
+	return txn_init_patches(&ctx->txn_revert, revert, nr_revert);
+}
+
+/*
+ * All the ELF files, which code has to be checked, are already mapped. So
+ * their ranges can be collected before the process is stopped.
+ */
+static int txn_collect_stack_ranges(struct process_ctx_s *ctx)
+{
+	struct patch_s *p;
+	int err;
+
+	list_for_each_entry(p, &ctx->txn_apply, txn) {
+		err = process_get_elf_range(ctx->pid, p->pi.target_bid,
+					    &p->stack_start, &p->stack_end);
+		if (err)
+			return err;
+	}
+
+	list_for_each_entry(p, &ctx->txn_revert, txn) {
+		err = process_get_elf_range(ctx->pid, p->pi.patch_bid,
+					    &p->stack_start, &p->stack_end);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int txn_check_backtrace(const struct process_ctx_s *ctx,
+			       const struct backtrace_s *bt,
+			       uint64_t start, uint64_t end)
+{
+	const struct patch_s *p;
+	int err;
+
+	list_for_each_entry(p, &ctx->txn_apply, txn) {
+		struct bt_fj_data data = {
+			.bt = bt,
+			.start = p->stack_start,
+		};
+
+		err = iterate_patch_function_jumps(p, jump_check_backtrace, &data);
+		if (err)
+			return err;
+	}
+
+	list_for_each_entry(p, &ctx->txn_revert, txn) {
+		err = backtrace_check_range(bt, p->stack_start, p->stack_end);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static struct patch_s *txn_applied_patch(struct process_ctx_s *ctx,
+					 const struct patch_s *p)
+{
+	return find_patch_by_bid(ctx, p->pi.patch_bid);
+}
+
+/*
+ * Returns patch to revert with the same Build ID, if any.
+ */
+static struct patch_s *txn_reverted_patch(struct process_ctx_s *ctx,
+					  const struct patch_s *ap)
+{
+	struct patch_s *p;
+
+	list_for_each_entry(p, &ctx->txn_revert, txn) {
+		if (!strcmp(p->pi.patch_bid, ap->pi.patch_bid))
+			return p;
+	}
+	return NULL;
+}
+
+/*
+ * Patch can't be reverted, if a patch, applied on top of it, redirects the
+ * same function and stays.
+ */
+static int txn_check_stacked(struct process_ctx_s *ctx,
+			     const struct patch_s *ap)
+{
+	const struct patch_info_s *pi = &ap->pi;
+	const struct patch_s *np;
+	struct func_jump_s *nfj;
+	int i, err;
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		err = find_next_func_jump(ctx, ap, pi->func_jumps[i],
+					  &np, &nfj);
+		if (err == -ENOENT)
+			continue;
+		if (err)
+			return err;
+
+		if (!txn_reverted_patch(ctx, np)) {
+			pr_err("Function \"%s\" of patch %s is patched again "
+			       "by %s\n", pi->func_jumps[i]->name,
+			       ap->path, np->path);
+			return -EBUSY;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Stacked patches are reverted from the top: revert of each one restores
+ * the jumps of the patch below it.
+ */
+static void txn_sort_reverted(struct process_ctx_s *ctx)
+{
+	struct patch_s *ap, *p;
+	LIST_HEAD(sorted);
+
+	list_for_each_entry_reverse(ap, &ctx->applied_patches, list) {
+		p = txn_reverted_patch(ctx, ap);
+		if (p)
+			list_move_tail(&p->txn, &sorted);
+	}
+	list_splice(&sorted, &ctx->txn_revert);
+}
+
+static int txn_find_reverted(struct process_ctx_s *ctx)
+{
+	struct patch_s *p, *ap;
+	int err;
+
+	list_for_each_entry(p, &ctx->txn_revert, txn) {
+		ap = txn_applied_patch(ctx, p);
+		if (!ap) {
+			pr_err("Patch with Build ID %s is not applied to "
+			       "process %d\n", p->pi.patch_bid, ctx->pid);
+			return -ENOENT;
+		}
+
+		err = txn_check_stacked(ctx, ap);
+		if (err)
+			return err;
+	}
+
+	txn_sort_reverted(ctx);
+	return 0;
+}
+
+/*
+ * Service is injected and process dependences are collected only once for
+ * all the patches in the transaction.
+ */
+static int txn_prepare_patches(struct process_ctx_s *ctx, int no_plugin)
+{
+	struct patch_s *p;
+	int err;
+
+	if (list_empty(&ctx->txn_apply))
+		return 0;
+
+	list_for_each_entry(p, &ctx->txn_apply, txn) {
+		P(ctx) = p;
+
+		/* Patch can be reloaded by reverting and applying it */
+		if (!txn_reverted_patch(ctx, p)) {
+			err = process_find_patch(ctx);
+			if (err)
+				return err;
+		}
+
+		err = process_find_target_dlm(ctx);
+		if (err)
+			return err;
+	}
+
+	if (!no_plugin) {
+		err = process_inject_service(ctx);
+		if (err)
+			return err;
+	}
+
+	err = process_collect_needed(ctx);
+	if (err)
+		return err;
+
+	list_for_each_entry(p, &ctx->txn_apply, txn) {
+		P(ctx) = p;
+
+		err = collect_relocations(ctx);
+		if (err)
+			return err;
+
+		err = resolve_relocations(ctx);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static void txn_unload_staged(struct process_ctx_s *ctx)
+{
+	struct patch_s *p;
+
+	list_for_each_entry_reverse(p, &ctx->txn_apply, txn) {
+		if (patch_unload(ctx, p))
+			pr_err("failed to unload patch %s\n", p->path);
+	}
+}
+
+static int txn_stage_patches(struct process_ctx_s *ctx)
+{
+	struct patch_s *p;
+	int err;
+
+	list_for_each_entry(p, &ctx->txn_apply, txn) {
+		P(ctx) = p;
+
+		err = stage_dyn_binpatch(ctx);
+		if (err)
+			goto unload;
+
+		err = tune_func_jumps(ctx);
+		if (err) {
+			if (unload_patch(ctx))
+				pr_err("failed to unload patch\n");
+			goto unload;
+		}
+	}
+	return 0;
+
+unload:
+	list_for_each_entry_continue_reverse(p, &ctx->txn_apply, txn) {
+		if (patch_unload(ctx, p))
+			pr_err("failed to unload patch %s\n", p->path);
+	}
+	return err;
+}
+
+/*
+ * Jumps of reverted patches are removed first, and only then jumps of new
+ * patches are written. This way replacing patch can redirect the same
+ * functions. If anything fails, all the previous jumps are restored.
+ */
+static int txn_switch_jumps(struct process_ctx_s *ctx)
+{
+	struct patch_s *p;
+	int err;
+
+	list_for_each_entry(p, &ctx->txn_revert, txn) {
+		err = patch_revert_func_jumps(ctx, txn_applied_patch(ctx, p));
+		if (err)
+			goto restore_reverted;
+	}
+
+	list_for_each_entry(p, &ctx->txn_apply, txn) {
+		err = patch_apply_func_jumps(ctx, p, opts_redirects(ctx));
+		if (err)
+			goto revert_applied;
+	}
+	return 0;
+
+revert_applied:
+	if (patch_revert_func_jumps(ctx, p))
+		pr_err("failed to revert function jumps\n");
+	list_for_each_entry_continue_reverse(p, &ctx->txn_apply, txn) {
+		if (patch_revert_func_jumps(ctx, p))
+			pr_err("failed to revert function jumps\n");
+	}
+	p = list_entry(&ctx->txn_revert, struct patch_s, txn);
+	goto restore_previous;
+
+restore_reverted:
+	/* Patch could be reverted partially */
+	if (patch_restore_func_jumps(ctx, txn_applied_patch(ctx, p)))
+		pr_err("failed to restore function jumps\n");
+restore_previous:
+	list_for_each_entry_continue_reverse(p, &ctx->txn_revert, txn) {
+		if (patch_restore_func_jumps(ctx, txn_applied_patch(ctx, p)))
+			pr_err("failed to restore function jumps\n");
+	}
+	return err;
+}
+
+/*
+ * Jumps are already switched, so the transaction is rolled forward: all the
+ * reverted patches are unloaded, even if some of them fail.
+ */
+static int txn_unload_reverted(struct process_ctx_s *ctx)
+{
+	struct patch_s *p, *ap;
+	int err, ret = 0;
+
+	list_for_each_entry(p, &ctx->txn_revert, txn) {
+		ap = txn_applied_patch(ctx, p);
+
+		err = patch_release(ctx, ap);
+		if (err) {
+			pr_err("failed to unload reverted patch %s: %d\n",
+					ap->path, err);
+			ret = ret ? : err;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Applies and reverts a set of patches in a single process stop: process
+ * stack is checked once against all the affected ranges, service is injected
+ * once, and all the function jumps are switched together. If any step before
+ * the switch fails, the process is left as it was. After the switch the new
+ * patches stay applied: if a reverted patch can't be unloaded, its code stays
+ * mapped without jumps to it, and the error is reported.
+ */
+static int do_patch_process_set(struct process_ctx_s *ctx, pid_t pid,
+				const char * const *apply, int nr_apply,
+				const char * const *revert, int nr_revert,
+				int dry_run, int no_plugin)
+{
+	int ret, err;
+
+	err = init_txn_context(ctx, pid, apply, nr_apply, revert, nr_revert,
+			       dry_run);
+	if (err)
+		return err;
+
+	err = txn_collect_stack_ranges(ctx);
+	if (err)
+		return err;
+
+	ctx->check_backtrace = txn_check_backtrace;
+
+	err = process_cease(ctx, NULL);
+	if (err)
+		return err;
+
+	ret = txn_find_reverted(ctx);
+	if (ret)
+		goto resume;
+
+	ret = txn_prepare_patches(ctx, no_plugin);
+	if (ret)
+		goto resume;
+
+	ret = txn_stage_patches(ctx);
+	if (ret)
+		goto resume;
+
+	ret = txn_switch_jumps(ctx);
+	if (ret) {
+		txn_unload_staged(ctx);
+		goto resume;
+	}
+
+	ret = txn_unload_reverted(ctx);
+	if (ret)
+		pr_err("patches are switched, but some of reverted ones "
+		       "stay mapped\n");
+
+resume:
+	err = process_resume(ctx);
+
+	pr_info("Done\n");
+	return ret ? ret : err;
+}
+
+int patch_process_set(pid_t pid, const char * const *apply, int nr_apply,
+		      const char * const *revert, int nr_revert,
+		      int dry_run, int no_plugin,
+		      const struct patch_opts *opts)
+{
+	struct process_ctx_s *ctx;
+	int err;
+
+	ctx = alloc_context(opts);
+	if (!ctx)
+		return -ENOMEM;
+
+	err = do_patch_process_set(ctx, pid, apply, nr_apply, revert, nr_revert,
+				  dry_run, no_plugin);
+
+	destroy_context(ctx);
+	return err;
+}
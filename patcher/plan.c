@@ -0,0 +1,886 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "include/context.h"
+#include "include/plan.h"
+#include "include/process.h"
+#include "include/dl_map.h"
+#include "include/vma.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+#include "include/compiler.h"
+#include "include/util.h"
+
+#include <protobuf/applyplan.pb-c.h>
+
+#define FNV64_OFFSET		0xcbf29ce484222325ULL
+#define FNV64_PRIME		0x100000001b3ULL
+
+struct apply_plan_s *plan_create(const struct patch_s *p, const char *patch_path)
+{
+	struct apply_plan_s *plan;
+
+	plan = xzalloc(sizeof(*plan));
+	if (!plan)
+		return NULL;
+
+	INIT_LIST_HEAD(&plan->vmas);
+	INIT_LIST_HEAD(&plan->writes);
+	INIT_LIST_HEAD(&plan->jumps);
+
+	if (!p)
+		return plan;
+
+	/* Plan can be executed by another nsb instance */
+	plan->patch_path = realpath(patch_path, NULL);
+	if (!plan->patch_path) {
+		pr_perror("failed to resolve %s path", patch_path);
+		goto destroy_plan;
+	}
+
+	plan->target_bid = xstrdup(p->pi.target_bid);
+	plan->patch_bid = xstrdup(p->pi.patch_bid);
+	if (!plan->target_bid || !plan->patch_bid)
+		goto destroy_plan;
+
+	return plan;
+
+destroy_plan:
+	plan_destroy(plan);
+	return NULL;
+}
+
+void plan_destroy(struct apply_plan_s *plan)
+{
+	struct plan_write_s *pw, *tmp_pw;
+	struct plan_jump_s *pj, *tmp_pj;
+
+	list_for_each_entry_safe(pw, tmp_pw, &plan->writes, list) {
+		list_del(&pw->list);
+		free(pw->data);
+		free(pw);
+	}
+
+	list_for_each_entry_safe(pj, tmp_pj, &plan->jumps, list) {
+		list_del(&pj->list);
+		free(pj->name);
+		free(pj);
+	}
+
+	free_vmas(&plan->vmas);
+
+	free(plan->target_bid);
+	free(plan->patch_bid);
+	free(plan->patch_path);
+	free(plan);
+}
+
+int plan_recording(const struct apply_plan_s *plan)
+{
+	return plan && plan->recording;
+}
+
+int plan_record_write(struct apply_plan_s *plan, uint64_t addr,
+		      const void *data, size_t size)
+{
+	struct plan_write_s *pw;
+
+	pw = xzalloc(sizeof(*pw));
+	if (!pw)
+		return -ENOMEM;
+
+	pw->data = xmalloc(size);
+	if (!pw->data) {
+		free(pw);
+		return -ENOMEM;
+	}
+	memcpy(pw->data, data, size);
+
+	pw->addr = addr;
+	pw->size = size;
+	list_add_tail(&pw->list, &plan->writes);
+	return 0;
+}
+
+int plan_add_vma(struct apply_plan_s *plan, const struct vma_area *vma)
+{
+	struct vma_area *pv;
+
+	pv = xzalloc(sizeof(*pv));
+	if (!pv)
+		return -ENOMEM;
+
+	pv->addr = vma->addr;
+	pv->length = vma->length;
+	pv->flags = vma->flags;
+	pv->prot = vma->prot;
+	pv->offset = vma->offset;
+	INIT_LIST_HEAD(&pv->dl);
+
+	list_add_tail(&pv->list, &plan->vmas);
+	return 0;
+}
+
+int plan_record_dl_map(struct apply_plan_s *plan, const struct dl_map *dlm)
+{
+	const struct vma_area *vma;
+	int err;
+
+	list_for_each_entry(vma, &dlm->vmas, dl) {
+		process_print_mmap(vma);
+
+		err = plan_add_vma(plan, vma);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int plan_add_jump(struct apply_plan_s *plan, const char *name,
+		  uint64_t addr, const uint8_t *code, const uint8_t *jump)
+{
+	struct plan_jump_s *pj;
+
+	pj = xzalloc(sizeof(*pj));
+	if (!pj)
+		return -ENOMEM;
+
+	pj->name = xstrdup(name);
+	if (!pj->name) {
+		free(pj);
+		return -ENOMEM;
+	}
+
+	pj->addr = addr;
+	memcpy(pj->code, code, sizeof(pj->code));
+	memcpy(pj->jump, jump, sizeof(pj->jump));
+
+	list_add_tail(&pj->list, &plan->jumps);
+	return 0;
+}
+
+/*
+ * Expected code is read from the process rather than taken from the ELF
+ * file: function can be patched already, and then its jump is replaced.
+ */
+int plan_record_jumps(const struct process_ctx_s *ctx,
+		      struct apply_plan_s *plan, const struct patch_s *p)
+{
+	const struct patch_info_s *pi = &p->pi;
+	uint8_t code[8];
+	int i, err;
+
+	for (i = 0; i < pi->n_func_jumps; i++) {
+		const struct func_jump_s *fj = pi->func_jumps[i];
+
+		err = process_read_data(ctx, fj->func_addr, code, sizeof(code));
+		if (err) {
+			pr_err("failed to read function \"%s\" code\n",
+					fj->name);
+			return err;
+		}
+
+		err = plan_add_jump(plan, fj->name, fj->func_addr,
+				    code, fj->func_jump);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static uint64_t fnv64(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= FNV64_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Only file-backed mappings are taken into account: anonymous ones (heap,
+ * stacks, etc) are changed by running process all the time, while all the
+ * plan values depend on ELF files placement only. Place for the patch is
+ * checked separately.
+ */
+uint64_t plan_maps_digest(const struct list_head *vmas)
+{
+	const struct vma_area *vma;
+	uint64_t digest = FNV64_OFFSET;
+	uint64_t start, length, offset;
+
+	list_for_each_entry(vma, vmas, list) {
+		if (!vma->path || vma->path[0] != '/')
+			continue;
+
+		start = vma_start(vma);
+		length = vma_length(vma);
+		offset = vma_offset(vma);
+
+		digest = fnv64(digest, &start, sizeof(start));
+		digest = fnv64(digest, &length, sizeof(length));
+		digest = fnv64(digest, &offset, sizeof(offset));
+		digest = fnv64(digest, &vma->prot, sizeof(vma->prot));
+		digest = fnv64(digest, &vma->flags, sizeof(vma->flags));
+		digest = fnv64(digest, vma->path, strlen(vma->path));
+	}
+	return digest;
+}
+
+static int plan_check_place(const struct apply_plan_s *plan,
+			    const struct list_head *vmas)
+{
+	const struct vma_area *pv, *vma;
+
+	list_for_each_entry(pv, &plan->vmas, list) {
+		list_for_each_entry(vma, vmas, list) {
+			if (vma_start(pv) >= vma_end(vma))
+				continue;
+			if (vma_start(vma) >= vma_end(pv))
+				continue;
+
+			pr_err("planned mapping %#lx-%#lx intersects with "
+			       "%#lx-%#lx\n", vma_start(pv), vma_end(pv),
+			       vma_start(vma), vma_end(vma));
+			return -EBUSY;
+		}
+	}
+	return 0;
+}
+
+static int plan_check_jumps(struct process_ctx_s *ctx,
+			    const struct apply_plan_s *plan)
+{
+	const struct plan_jump_s *pj;
+	uint8_t code[8];
+	int err;
+
+	list_for_each_entry(pj, &plan->jumps, list) {
+		err = process_read_data(ctx, pj->addr, code, sizeof(code));
+		if (err)
+			return err;
+
+		if (memcmp(code, pj->code, sizeof(code))) {
+			pr_err("function \"%s\" code at %#lx doesn't match "
+			       "the plan\n", pj->name, pj->addr);
+			return -ESTALE;
+		}
+	}
+	return 0;
+}
+
+static int plan_check_maps(struct process_ctx_s *ctx,
+			   const struct apply_plan_s *plan, int check_place)
+{
+	LIST_HEAD(vmas);
+	int err;
+
+	err = collect_vmas(ctx->pid, &vmas);
+	if (err) {
+		pr_err("Can't collect mappings for %d\n", ctx->pid);
+		return err;
+	}
+
+	if (plan_maps_digest(&vmas) != plan->maps_digest) {
+		pr_err("process %d mappings were changed since plan creation\n",
+				ctx->pid);
+		err = -ESTALE;
+		goto free_vmas;
+	}
+
+	if (check_place)
+		err = plan_check_place(plan, &vmas);
+
+free_vmas:
+	free_vmas(&vmas);
+	return err;
+}
+
+/*
+ * Validation is cheap: it doesn't parse any ELF files and doesn't resolve any
+ * symbols. It only makes sure, that loaded ELF files were not moved, that
+ * planned place for the patch is still free and that all the functions to
+ * patch contain expected code.
+ */
+int plan_validate(struct process_ctx_s *ctx, const struct apply_plan_s *plan)
+{
+	int err;
+
+	pr_info("= Validating apply plan:\n");
+
+	err = plan_check_maps(ctx, plan, 1);
+	if (err)
+		return err;
+
+	return plan_check_jumps(ctx, plan);
+}
+
+/*
+ * Staged plan has the patch mapped already, and its digest covers the patch
+ * mappings.
+ */
+int plan_validate_staged(struct process_ctx_s *ctx,
+			 const struct apply_plan_s *plan)
+{
+	int err;
+
+	pr_info("= Validating staged apply plan:\n");
+
+	err = plan_check_maps(ctx, plan, 0);
+	if (err)
+		return err;
+
+	return plan_check_jumps(ctx, plan);
+}
+
+static int plan_map_vmas(struct process_ctx_s *ctx,
+			 const struct apply_plan_s *plan)
+{
+	const struct vma_area *vma;
+	int64_t addr;
+	int fd, err;
+
+	fd = process_open_file(ctx, plan->patch_path, O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	list_for_each_entry(vma, &plan->vmas, list) {
+		addr = process_map_vma(ctx, fd, vma);
+		if (addr < 0) {
+			err = addr;
+			goto unmap;
+		}
+	}
+
+	(void)process_close_file(ctx, fd);
+	return 0;
+
+unmap:
+	list_for_each_entry_continue_reverse(vma, &plan->vmas, list)
+		(void)process_unmap_vma(ctx, vma);
+	(void)process_close_file(ctx, fd);
+	return err;
+}
+
+static void plan_unmap_vmas(struct process_ctx_s *ctx,
+			    const struct apply_plan_s *plan)
+{
+	const struct vma_area *vma;
+
+	list_for_each_entry(vma, &plan->vmas, list)
+		(void)process_unmap_vma(ctx, vma);
+}
+
+/*
+ * Process memory is written by words. Thus, if write is not word aligned,
+ * the rest of the first and the last words has to be preserved.
+ * Mappings are page aligned, so aligned words never cross mapping end.
+ */
+static int plan_write(struct process_ctx_s *ctx, const struct plan_write_s *pw)
+{
+	uint64_t start = round_down(pw->addr, sizeof(uint64_t));
+	uint64_t end = round_up(pw->addr + pw->size, sizeof(uint64_t));
+	size_t size = end - start;
+	uint8_t *buf;
+	int err;
+
+	if (size == pw->size)
+		return process_write_data(ctx, pw->addr, pw->data, pw->size);
+
+	buf = xmalloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	err = process_read_data(ctx, start, buf, size);
+	if (err)
+		goto free_buf;
+
+	memcpy(buf + (pw->addr - start), pw->data, pw->size);
+
+	err = process_write_data(ctx, start, buf, size);
+
+free_buf:
+	free(buf);
+	return err;
+}
+
+static int plan_writes(struct process_ctx_s *ctx,
+		       const struct apply_plan_s *plan)
+{
+	const struct plan_write_s *pw;
+	int err;
+
+	list_for_each_entry(pw, &plan->writes, list) {
+		err = plan_write(ctx, pw);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int plan_jumps(struct process_ctx_s *ctx,
+		      const struct apply_plan_s *plan)
+{
+	const struct plan_jump_s *pj;
+	int err;
+
+	list_for_each_entry(pj, &plan->jumps, list) {
+		pr_info("  - Function \"%s\":\n", pj->name);
+		pr_info("      jump: %#lx\n", pj->addr);
+
+		err = process_write_data(ctx, pj->addr, pj->jump,
+					 sizeof(pj->jump));
+		if (err)
+			goto revert;
+	}
+	return 0;
+
+revert:
+	list_for_each_entry_continue_reverse(pj, &plan->jumps, list)
+		(void)process_write_data(ctx, pj->addr, pj->code,
+					 sizeof(pj->code));
+	return err;
+}
+
+int plan_execute(struct process_ctx_s *ctx, const struct apply_plan_s *plan)
+{
+	int err;
+
+	pr_info("= Executing apply plan:\n");
+
+	if (ctx->dry_run)
+		return 0;
+
+	err = plan_map_vmas(ctx, plan);
+	if (err)
+		return err;
+
+	err = plan_writes(ctx, plan);
+	if (err)
+		goto unmap;
+
+	err = plan_jumps(ctx, plan);
+	if (err)
+		goto unmap;
+
+	return 0;
+
+unmap:
+	plan_unmap_vmas(ctx, plan);
+	return err;
+}
+
+static const struct vma_area *plan_write_vma(const struct apply_plan_s *plan,
+					     const struct plan_write_s *pw)
+{
+	const struct vma_area *vma;
+
+	list_for_each_entry(vma, &plan->vmas, list) {
+		if ((pw->addr >= vma_start(vma)) &&
+		    (pw->addr + pw->size <= vma_end(vma)))
+			return vma;
+	}
+	return NULL;
+}
+
+/*
+ * Staging is done via resident agent while the process is running: the patch
+ * is mapped and all the writes to the patch mappings are done. Writes to the
+ * other mappings and function jumps are left for plan_commit().
+ */
+int plan_stage(struct process_ctx_s *ctx, struct apply_plan_s *plan)
+{
+	const struct plan_write_s *pw;
+	const struct vma_area *vma;
+	struct service_batch *b;
+	LIST_HEAD(vmas);
+	int fd, idx, err;
+
+	pr_info("= Staging apply plan:\n");
+
+	if (ctx->dry_run)
+		return 0;
+
+	err = plan_check_maps(ctx, plan, 1);
+	if (err)
+		return err;
+
+	fd = open(plan->patch_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		pr_perror("failed to open %s", plan->patch_path);
+		return -errno;
+	}
+
+	b = service_batch_create();
+	if (!b) {
+		err = -ENOMEM;
+		goto close_fd;
+	}
+
+	/* Mapping and all the writes go to the agent in one round trip */
+	idx = service_batch_add_mmap(b, &plan->vmas, fd);
+	if (idx < 0) {
+		err = idx;
+		goto destroy_batch;
+	}
+
+	list_for_each_entry(pw, &plan->writes, list) {
+		vma = plan_write_vma(plan, pw);
+		if (!vma)
+			continue;
+
+		err = service_batch_add_write(b, pw->addr, pw->data, pw->size,
+					      vma_prot(vma));
+		if (err < 0)
+			goto destroy_batch;
+	}
+
+	err = service_batch_submit(&ctx->service, b);
+	if (err) {
+		pr_err("resident agent failed to stage the patch: %d\n", err);
+		if (!service_batch_result(b, idx, NULL, NULL))
+			plan_unstage(ctx, plan);
+		goto destroy_batch;
+	}
+
+	err = collect_vmas(ctx->pid, &vmas);
+	if (err) {
+		plan_unstage(ctx, plan);
+		goto destroy_batch;
+	}
+
+	plan->maps_digest = plan_maps_digest(&vmas);
+	free_vmas(&vmas);
+
+destroy_batch:
+	service_batch_destroy(b);
+close_fd:
+	close(fd);
+	return err;
+}
+
+void plan_unstage(struct process_ctx_s *ctx, const struct apply_plan_s *plan)
+{
+	if (ctx->dry_run)
+		return;
+
+	(void)service_agent_munmap(&ctx->service, &plan->vmas);
+}
+
+int plan_commit(struct process_ctx_s *ctx, const struct apply_plan_s *plan)
+{
+	const struct plan_write_s *pw;
+	int err;
+
+	pr_info("= Committing staged apply plan:\n");
+
+	if (ctx->dry_run)
+		return 0;
+
+	list_for_each_entry(pw, &plan->writes, list) {
+		if (plan_write_vma(plan, pw))
+			continue;
+
+		err = plan_write(ctx, pw);
+		if (err)
+			return err;
+	}
+
+	return plan_jumps(ctx, plan);
+}
+
+static void print_bytes(const char *prefix, const uint8_t *data, size_t size)
+{
+	char buf[3 * 64 + 1];
+	size_t i, off = 0;
+
+	for (i = 0; (i < size) && (off < sizeof(buf) - 3); i++)
+		off += sprintf(buf + off, "%02x ", data[i]);
+	buf[off] = '\0';
+
+	pr_msg("%s%s%s\n", prefix, buf, (i < size) ? "..." : "");
+}
+
+void plan_print(const struct apply_plan_s *plan)
+{
+	const struct vma_area *vma;
+	const struct plan_write_s *pw;
+	const struct plan_jump_s *pj;
+	char prefix[64];
+
+	pr_msg("Apply plan:\n");
+	pr_msg("  Patch path    : %s\n", plan->patch_path);
+	pr_msg("  Target BuildId: %s\n", plan->target_bid);
+	pr_msg("  Patch BuildId : %s\n", plan->patch_bid);
+	pr_msg("  Maps digest   : %#lx\n", plan->maps_digest);
+
+	pr_msg("  Mappings:\n");
+	list_for_each_entry(vma, &plan->vmas, list)
+		pr_msg("    - %#lx-%#lx, off: %#lx, prot: %#x, flags: %#x\n",
+				vma_start(vma), vma_end(vma), vma_offset(vma),
+				vma_prot(vma), vma_flags(vma));
+
+	pr_msg("  Writes:\n");
+	list_for_each_entry(pw, &plan->writes, list) {
+		snprintf(prefix, sizeof(prefix), "    - %#lx: ", pw->addr);
+		print_bytes(prefix, pw->data, pw->size);
+	}
+
+	pr_msg("  Jumps:\n");
+	list_for_each_entry(pj, &plan->jumps, list) {
+		pr_msg("    - \"%s\":\n", pj->name);
+		snprintf(prefix, sizeof(prefix), "        %#lx: ", pj->addr);
+		print_bytes(prefix, pj->code, sizeof(pj->code));
+		print_bytes("        jump    : ", pj->jump, sizeof(pj->jump));
+	}
+}
+
+static size_t list_length(const struct list_head *head)
+{
+	const struct list_head *pos;
+	size_t nr = 0;
+
+	list_for_each(pos, head)
+		nr++;
+	return nr;
+}
+
+int plan_save(const struct apply_plan_s *plan, const char *path)
+{
+	ApplyPlan ap = APPLY_PLAN__INIT;
+	PlanVma *pvs = NULL, **pvp = NULL;
+	PlanWrite *pws = NULL, **pwp = NULL;
+	PlanJump *pjs = NULL, **pjp = NULL;
+	const struct vma_area *vma;
+	const struct plan_write_s *pw;
+	const struct plan_jump_s *pj;
+	size_t nr_vmas, nr_writes, nr_jumps, size, i;
+	uint8_t *buf = NULL;
+	int fd, err = -ENOMEM;
+	ssize_t ret;
+
+	nr_vmas = list_length(&plan->vmas);
+	nr_writes = list_length(&plan->writes);
+	nr_jumps = list_length(&plan->jumps);
+
+	pvs = xzalloc(sizeof(*pvs) * (nr_vmas + 1));
+	pvp = xzalloc(sizeof(*pvp) * (nr_vmas + 1));
+	pws = xzalloc(sizeof(*pws) * (nr_writes + 1));
+	pwp = xzalloc(sizeof(*pwp) * (nr_writes + 1));
+	pjs = xzalloc(sizeof(*pjs) * (nr_jumps + 1));
+	pjp = xzalloc(sizeof(*pjp) * (nr_jumps + 1));
+	if (!pvs || !pvp || !pws || !pwp || !pjs || !pjp)
+		goto free;
+
+	i = 0;
+	list_for_each_entry(vma, &plan->vmas, list) {
+		plan_vma__init(&pvs[i]);
+		pvs[i].addr = vma_start(vma);
+		pvs[i].length = vma_length(vma);
+		pvs[i].prot = vma_prot(vma);
+		pvs[i].flags = vma_flags(vma);
+		pvs[i].offset = vma_offset(vma);
+		pvp[i] = &pvs[i];
+		i++;
+	}
+
+	i = 0;
+	list_for_each_entry(pw, &plan->writes, list) {
+		plan_write__init(&pws[i]);
+		pws[i].addr = pw->addr;
+		pws[i].data.len = pw->size;
+		pws[i].data.data = pw->data;
+		pwp[i] = &pws[i];
+		i++;
+	}
+
+	i = 0;
+	list_for_each_entry(pj, &plan->jumps, list) {
+		plan_jump__init(&pjs[i]);
+		pjs[i].name = pj->name;
+		pjs[i].addr = pj->addr;
+		pjs[i].code.len = sizeof(pj->code);
+		pjs[i].code.data = (uint8_t *)pj->code;
+		pjs[i].jump.len = sizeof(pj->jump);
+		pjs[i].jump.data = (uint8_t *)pj->jump;
+		pjp[i] = &pjs[i];
+		i++;
+	}
+
+	ap.target_bid = plan->target_bid;
+	ap.patch_bid = plan->patch_bid;
+	ap.patch_path = plan->patch_path;
+	ap.maps_digest = plan->maps_digest;
+	ap.n_vmas = nr_vmas;
+	ap.vmas = pvp;
+	ap.n_writes = nr_writes;
+	ap.writes = pwp;
+	ap.n_jumps = nr_jumps;
+	ap.jumps = pjp;
+
+	size = apply_plan__get_packed_size(&ap);
+	buf = xmalloc(size);
+	if (!buf)
+		goto free;
+
+	apply_plan__pack(&ap, buf);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		pr_perror("failed to open %s", path);
+		err = -errno;
+		goto free;
+	}
+
+	ret = write(fd, buf, size);
+	if (ret != size) {
+		if (ret == -1) {
+			pr_perror("failed to write %s", path);
+			err = -errno;
+		} else {
+			pr_err("write to %s less than requested: %ld < %ld\n",
+					path, ret, size);
+			err = -EIO;
+		}
+	} else
+		err = 0;
+
+	close(fd);
+free:
+	free(buf);
+	free(pjp);
+	free(pjs);
+	free(pwp);
+	free(pws);
+	free(pvp);
+	free(pvs);
+	return err;
+}
+
+static int plan_set_vmas(struct apply_plan_s *plan, const ApplyPlan *ap)
+{
+	int i, err;
+
+	for (i = 0; i < ap->n_vmas; i++) {
+		const PlanVma *pv = ap->vmas[i];
+		struct vma_area vma = {
+			.addr = pv->addr,
+			.length = pv->length,
+			.prot = pv->prot,
+			.flags = pv->flags,
+			.offset = pv->offset,
+		};
+
+		err = plan_add_vma(plan, &vma);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int plan_set_writes(struct apply_plan_s *plan, const ApplyPlan *ap)
+{
+	int i, err;
+
+	for (i = 0; i < ap->n_writes; i++) {
+		const PlanWrite *pw = ap->writes[i];
+
+		err = plan_record_write(plan, pw->addr,
+					pw->data.data, pw->data.len);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int plan_set_jumps(struct apply_plan_s *plan, const ApplyPlan *ap)
+{
+	int i, err;
+
+	for (i = 0; i < ap->n_jumps; i++) {
+		const PlanJump *pj = ap->jumps[i];
+
+		if ((pj->code.len != 8) || (pj->jump.len != 8)) {
+			pr_err("invalid jump for function \"%s\"\n", pj->name);
+			return -EINVAL;
+		}
+
+		err = plan_add_jump(plan, pj->name, pj->addr,
+				    pj->code.data, pj->jump.data);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int plan_load(const char *path, struct apply_plan_s **plan)
+{
+	struct apply_plan_s *new;
+	struct stat st;
+	ApplyPlan *ap;
+	uint8_t *buf;
+	ssize_t size;
+	int err = -ENOMEM;
+
+	if (stat(path, &st)) {
+		pr_perror("failed to stat %s", path);
+		return -errno;
+	}
+
+	buf = xmalloc(st.st_size);
+	if (!buf)
+		return -ENOMEM;
+
+	size = read_file(path, buf, 0, st.st_size);
+	if (size < 0) {
+		err = size;
+		goto free_buf;
+	}
+
+	ap = apply_plan__unpack(NULL, size, buf);
+	if (!ap) {
+		pr_err("failed to unpack apply plan %s\n", path);
+		err = -EINVAL;
+		goto free_buf;
+	}
+
+	new = plan_create(NULL, NULL);
+	if (!new)
+		goto free_unpacked;
+
+	new->target_bid = xstrdup(ap->target_bid);
+	new->patch_bid = xstrdup(ap->patch_bid);
+	new->patch_path = xstrdup(ap->patch_path);
+	if (!new->target_bid || !new->patch_bid || !new->patch_path)
+		goto destroy_plan;
+
+	new->maps_digest = ap->maps_digest;
+
+	err = plan_set_vmas(new, ap);
+	if (err)
+		goto destroy_plan;
+
+	err = plan_set_writes(new, ap);
+	if (err)
+		goto destroy_plan;
+
+	err = plan_set_jumps(new, ap);
+	if (err)
+		goto destroy_plan;
+
+	*plan = new;
+	goto free_unpacked;
+
+destroy_plan:
+	plan_destroy(new);
+free_unpacked:
+	apply_plan__free_unpacked(ap, NULL);
+free_buf:
+	free(buf);
+	return err;
+}
@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+#include "include/probe.h"
+#include "include/context.h"
+#include "include/process.h"
+#include "include/dl_map.h"
+#include "include/vma.h"
+#include "include/elf.h"
+#include "include/inplace.h"
+#include "include/x86_64.h"
+#include "include/compiler.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/*
+ * Probe measures function calls without traps. Function entry jumps to the
+ * probe code, which counts the call, replaces the return address with its
+ * return hook and executes the displaced function prologue, followed by the
+ * jump back to the function. The hook puts entry and exit TSC to a ring in
+ * shared memory, which is read by "nsb probe report" without stopping the
+ * process. The code and the saved function entry are private to the process
+ * and are written with ptrace.
+ */
+
+#define X86_JMP_REL32		0xe9
+#define X86_JMP_SIZE		5
+
+#define PROBE_SIZE		(PROBE_CODE_OFFSET + PAGE_SIZE)
+
+#define PROBE_HIST_BUCKETS	64
+#define PROBE_HIST_BAR		40
+
+struct probe_func {
+	const struct dl_map	*dlm;
+	uint64_t		addr;
+	uint64_t		size;
+};
+
+static void probe_path(char *path, size_t size, pid_t pid, uint64_t func)
+{
+	snprintf(path, size, "/dev/shm/nsb-probe-%d-%lx", pid, func);
+}
+
+static bool probe_vma(const struct vma_area *vma, pid_t pid)
+{
+	char prefix[PATH_MAX];
+
+	snprintf(prefix, sizeof(prefix), "/dev/shm/nsb-probe-%d-", pid);
+	return vma->path && vma->map_file &&
+	       !strncmp(vma->path, prefix, strlen(prefix));
+}
+
+static const struct vma_area *find_probe_vma(const struct process_ctx_s *ctx,
+					     const char *path, off_t offset)
+{
+	const struct vma_area *vma;
+
+	list_for_each_entry(vma, &ctx->vmas, list) {
+		if (!vma->path || strcmp(vma->path, path))
+			continue;
+		if (vma_offset(vma) == offset)
+			return vma;
+	}
+	return NULL;
+}
+
+static int probe_find_func(const struct process_ctx_s *ctx, const char *name,
+			   struct probe_func *pf)
+{
+	const struct dl_map *dlm;
+	struct elf_func fn;
+	int ret;
+
+	list_for_each_entry(dlm, &ctx->dl_maps, list) {
+		if (!dlm->exec_vma)
+			continue;
+
+		ret = elf_find_function(dlm->ei, name, &fn);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			continue;
+
+		pf->dlm = dlm;
+		pf->addr = dlm_load_base(dlm) + fn.value;
+		pf->size = fn.size;
+
+		pr_info("  Function \"%s\": %#lx-%#lx (%s)\n", name,
+				pf->addr, pf->addr + pf->size, dlm->path);
+		return 0;
+	}
+
+	pr_err("failed to find function \"%s\" in process %d\n",
+			name, ctx->pid);
+	return -ENOENT;
+}
+
+/* Prologue consists of the whole instructions, overwritten by the jump */
+static int probe_prologue_size(const char *name, const uint8_t *code,
+			       size_t size)
+{
+	struct x86_insn insn;
+	size_t off;
+	int len;
+
+	for (off = 0; off < X86_JMP_SIZE; off += len) {
+		len = x86_insn_decode(code + off, size - off, &insn);
+		if (len < 0) {
+			pr_err("failed to decode \"%s\" prologue at %#lx\n",
+					name, off);
+			return -ENOTSUP;
+		}
+	}
+	return off;
+}
+
+/*
+ * Function is checked for branches into the displaced prologue (they would
+ * land in the middle of the jump), and the prologue is copied after the
+ * probe code.
+ */
+static int probe_build_code(const struct process_ctx_s *ctx, const char *name,
+			    const struct probe_func *pf, uint8_t *code,
+			    uint64_t addr)
+{
+	uint64_t prologue = addr + X86_64_PROBE_SIZE;
+	uint8_t *body;
+	int size, ret;
+
+	if (pf->size < X86_JMP_SIZE) {
+		pr_err("function \"%s\" is too small for probe\n", name);
+		return -ENOTSUP;
+	}
+
+	body = xmalloc(pf->size);
+	if (!body)
+		return -ENOMEM;
+
+	ret = process_read_data(ctx, pf->addr, body, pf->size);
+	if (ret)
+		goto free_body;
+
+	if (body[0] == X86_JMP_REL32) {
+		pr_err("function \"%s\" is already patched or probed\n", name);
+		ret = -EBUSY;
+		goto free_body;
+	}
+
+	size = probe_prologue_size(name, body, pf->size);
+	if (size < 0) {
+		ret = size;
+		goto free_body;
+	}
+
+	ret = code_refers_range(name, body, pf->size, pf->addr,
+				pf->addr + 1, pf->addr + size);
+	if (ret) {
+		if (ret > 0) {
+			pr_err("function \"%s\" has branches to its "
+			       "prologue\n", name);
+			ret = -ENOTSUP;
+		}
+		goto free_body;
+	}
+
+	x86_64_probe(code, offsetof(struct probe_shm, rings) - PROBE_CODE_OFFSET);
+
+	memcpy(code + X86_64_PROBE_SIZE, body, size);
+	ret = relocate_code(name, code + X86_64_PROBE_SIZE, size,
+			    pf->addr, prologue);
+	if (ret) {
+		pr_err("failed to relocate \"%s\" prologue\n", name);
+		goto free_body;
+	}
+
+	ret = x86_jmpq_instruction(code + X86_64_PROBE_SIZE + size,
+				   X86_JMP_SIZE, prologue + size,
+				   pf->addr + size);
+	if (ret < 0)
+		goto free_body;
+
+	pr_info("  Prologue of %d bytes is moved to %#lx\n", size, prologue);
+	ret = size;
+
+free_body:
+	free(body);
+	return ret;
+}
+
+static int probe_build_header(const struct process_ctx_s *ctx,
+			      const char *name, const struct probe_func *pf,
+			      struct probe_header *hdr,
+			      struct probe_saved *saved, uint64_t code,
+			      int prologue_size)
+{
+	ssize_t size;
+	int err, i;
+
+	BUILD_BUG_ON(sizeof(struct probe_header) != 0x100);
+	BUILD_BUG_ON(offsetof(struct probe_ring, calls) != 0x8);
+	BUILD_BUG_ON(offsetof(struct probe_ring, untimed) != 0x10);
+	BUILD_BUG_ON(offsetof(struct probe_ring, records) != 0x40);
+	BUILD_BUG_ON(sizeof(struct probe_ring) != 0x4040);
+	BUILD_BUG_ON(sizeof(struct probe_shm) > PROBE_SHM_SIZE);
+	BUILD_BUG_ON(PROBE_SHM_SIZE % PAGE_SIZE);
+	BUILD_BUG_ON(PROBE_SAVED_OFFSET + sizeof(struct probe_saved) >
+		     PAGE_SIZE);
+
+	hdr->magic = PROBE_MAGIC;
+	hdr->nr_rings = PROBE_NR_RINGS;
+	hdr->ring_size = PROBE_RING_SIZE;
+	hdr->func = pf->addr;
+	strncpy(hdr->name, name, sizeof(hdr->name) - 1);
+	strncpy(hdr->object, pf->dlm->path, sizeof(hdr->object) - 1);
+
+	saved->magic = PROBE_MAGIC;
+	saved->func = pf->addr;
+
+	err = process_read_data(ctx, pf->addr, saved->orig, sizeof(saved->orig));
+	if (err)
+		return err;
+
+	size = x86_jmpq_instruction(saved->jump, sizeof(saved->jump), pf->addr,
+				    code + X86_64_PROBE_ENTRY);
+	if (size < 0)
+		return size;
+
+	/* Bytes after the prologue are kept */
+	for (i = prologue_size; i < sizeof(saved->jump); i++)
+		saved->jump[i] = saved->orig[i];
+	return 0;
+}
+
+static int probe_create_file(const struct process_ctx_s *ctx,
+			     const char *path, const struct probe_header *hdr)
+{
+	int fd;
+
+	fd = process_create_shm(ctx, path, PROBE_SHM_SIZE);
+	if (fd < 0)
+		return fd;
+
+	if (pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)) {
+		pr_perror("failed to write %s", path);
+		close(fd);
+		unlink(path);
+		return -EIO;
+	}
+	return fd;
+}
+
+int probe_attach(struct process_ctx_s *ctx, const char *name)
+{
+	struct probe_header hdr = { };
+	struct probe_saved *saved;
+	struct probe_func pf;
+	char path[PATH_MAX];
+	uint8_t *code;
+	int64_t addr;
+	int fd = -1, size, err;
+
+	pr_info("= Attach probe to \"%s\":\n", name);
+
+	err = probe_find_func(ctx, name, &pf);
+	if (err)
+		return err;
+
+	probe_path(path, sizeof(path), ctx->pid, pf.addr);
+	if (find_probe_vma(ctx, path, 0)) {
+		pr_err("probe is already attached to \"%s\"\n", name);
+		return -EEXIST;
+	}
+
+	addr = process_find_place_for_elf(ctx, dl_map_jump_hint(pf.dlm),
+					  PROBE_SIZE);
+	if (addr < 0) {
+		pr_err("failed to find place for probe of size %#lx\n",
+				PROBE_SIZE);
+		return addr;
+	}
+
+	if (dl_map_check_jump_range(pf.dlm, addr) ||
+	    dl_map_check_jump_range(pf.dlm, addr + PROBE_SIZE)) {
+		pr_err("probe place %#lx-%#lx is out of jump range\n",
+				addr, addr + PROBE_SIZE);
+		return -ERANGE;
+	}
+
+	code = xzalloc(PAGE_SIZE);
+	if (!code)
+		return -ENOMEM;
+
+	size = probe_build_code(ctx, name, &pf, code, addr + PROBE_CODE_OFFSET);
+	if (size < 0) {
+		err = size;
+		goto free_code;
+	}
+
+	saved = (void *)(code + PROBE_SAVED_OFFSET);
+	err = probe_build_header(ctx, name, &pf, &hdr, saved,
+				 addr + PROBE_CODE_OFFSET, size);
+	if (err)
+		goto free_code;
+
+	/* Threads must not be stopped in the middle of the prologue */
+	err = process_check_range(ctx, pf.addr + 1, pf.addr + size);
+	if (err)
+		goto free_code;
+
+	pr_info("  shared memory: %s\n", path);
+
+	if (!ctx->dry_run) {
+		fd = probe_create_file(ctx, path, &hdr);
+		if (fd < 0) {
+			err = fd;
+			goto free_code;
+		}
+	}
+
+	err = process_mmap_shm(ctx, path, fd, addr, PROBE_SHM_SIZE,
+			       PROBE_CODE_OFFSET, PROBE_SIZE);
+	if (err) {
+		pr_err("failed to map probe into process %d\n", ctx->pid);
+		goto unlink;
+	}
+
+	if (!ctx->dry_run) {
+		err = process_write_data(ctx, addr + PROBE_CODE_OFFSET, code,
+					 PAGE_SIZE);
+		if (err)
+			goto unmap;
+	}
+
+	pr_info("  jump: %#lx ---> %#lx\n", pf.addr,
+			addr + PROBE_CODE_OFFSET + X86_64_PROBE_ENTRY);
+
+	if (!ctx->dry_run) {
+		err = process_write_data(ctx, pf.addr, saved->jump,
+					 sizeof(saved->jump));
+		if (err)
+			goto unmap;
+	}
+	goto close_fd;
+
+unmap:
+	if (process_munmap_shm(ctx, path, addr, PROBE_SIZE))
+		pr_err("failed to unmap probe\n");
+unlink:
+	if (!ctx->dry_run)
+		unlink(path);
+close_fd:
+	if (fd >= 0)
+		close(fd);
+free_code:
+	free(code);
+	return err;
+}
+
+static struct probe_shm *probe_open(const struct vma_area *vma, int prot)
+{
+	struct probe_shm *shm;
+	int fd;
+
+	fd = open(vma->map_file, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		pr_perror("failed to open %s", vma->map_file);
+		return NULL;
+	}
+
+	shm = mmap(NULL, PROBE_SHM_SIZE, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		pr_perror("failed to map %s", vma->path);
+		return NULL;
+	}
+
+	if ((shm->hdr.magic != PROBE_MAGIC) ||
+	    (shm->hdr.nr_rings != PROBE_NR_RINGS) ||
+	    (shm->hdr.ring_size != PROBE_RING_SIZE)) {
+		pr_err("%s is not a probe shared memory\n", vma->path);
+		munmap(shm, PROBE_SHM_SIZE);
+		return NULL;
+	}
+	return shm;
+}
+
+static void probe_close(struct probe_shm *shm)
+{
+	munmap(shm, PROBE_SHM_SIZE);
+}
+
+/*
+ * Probe code is the anonymous mapping at the fixed offset from the shared
+ * memory: the function entry to restore is taken from it, not from the file.
+ */
+static int probe_read_saved(const struct process_ctx_s *ctx,
+			    const struct vma_area *vma,
+			    const struct vma_area **code_vma,
+			    struct probe_saved *saved)
+{
+	uint64_t code = vma_start(vma) + PROBE_CODE_OFFSET;
+	uint8_t timer[X86_64_TIMER_SIZE];
+	const struct vma_area *cv;
+	int err;
+
+	cv = find_vma(&ctx->vmas, code);
+	if (!cv || cv->path || (vma_start(cv) != code) ||
+	    !(vma_prot(cv) & PROT_EXEC) || (vma_length(cv) < PAGE_SIZE)) {
+		pr_err("no probe code for %s\n", vma->path);
+		return -EINVAL;
+	}
+
+	err = process_read_data(ctx, code, timer, sizeof(timer));
+	if (err)
+		return err;
+
+	err = process_read_data(ctx, code + PROBE_SAVED_OFFSET, saved,
+				sizeof(*saved));
+	if (err)
+		return err;
+
+	if (!x86_64_timer_hook(timer) || (saved->magic != PROBE_MAGIC)) {
+		pr_err("%#lx is not a probe code of %s\n", code, vma->path);
+		return -EINVAL;
+	}
+
+	*code_vma = cv;
+	return 0;
+}
+
+static int probe_do_detach(struct process_ctx_s *ctx,
+			   const struct vma_area *vma)
+{
+	const struct vma_area *code_vma;
+	struct probe_saved saved;
+	uint8_t entry[sizeof(saved.jump)];
+	int err;
+
+	err = probe_read_saved(ctx, vma, &code_vma, &saved);
+	if (err)
+		return err;
+
+	/* Calls in progress return via probe code */
+	err = process_check_range(ctx, vma_start(code_vma), vma_end(code_vma));
+	if (err)
+		return err;
+
+	err = process_read_data(ctx, saved.func, entry, sizeof(entry));
+	if (err)
+		return err;
+
+	if (memcmp(entry, saved.jump, sizeof(entry))) {
+		pr_warn("function entry %#lx was changed: not restored\n",
+				saved.func);
+	} else if (!ctx->dry_run) {
+		err = process_write_data(ctx, saved.func, saved.orig,
+					 sizeof(saved.orig));
+		if (err)
+			return err;
+	}
+
+	err = process_munmap_shm(ctx, vma->path, vma_start(vma),
+				 vma_end(code_vma) - vma_start(vma));
+	if (!err && !ctx->dry_run && unlink(vma->path))
+		pr_warn("failed to remove %s: %d\n", vma->path, errno);
+	return err;
+}
+
+/* Probe is found by function name in its shared memory */
+int probe_detach(struct process_ctx_s *ctx, const char *name)
+{
+	const struct vma_area *vma;
+	struct probe_shm *shm;
+	bool match;
+
+	pr_info("= Detach probe from \"%s\":\n", name);
+
+	list_for_each_entry(vma, &ctx->vmas, list) {
+		if (!probe_vma(vma, ctx->pid) || vma_offset(vma))
+			continue;
+
+		shm = probe_open(vma, PROT_READ);
+		if (!shm)
+			return -EINVAL;
+
+		match = !strncmp(shm->hdr.name, name, sizeof(shm->hdr.name));
+		probe_close(shm);
+
+		if (match)
+			return probe_do_detach(ctx, vma);
+	}
+
+	pr_err("probe is not attached to \"%s\" in process %d\n",
+			name, ctx->pid);
+	return -ENOENT;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t *)a, lb = *(const uint64_t *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+/*
+ * Rings keep the last calls of each thread. Records are read while the
+ * process runs, so the ones being written are skipped.
+ */
+static ssize_t probe_latencies(const struct probe_shm *shm, uint64_t **lat)
+{
+	size_t nr = 0, i, j, n;
+	uint64_t *l;
+
+	l = xmalloc(sizeof(*l) * PROBE_NR_RINGS * PROBE_RING_SIZE);
+	if (!l)
+		return -ENOMEM;
+
+	for (i = 0; i < PROBE_NR_RINGS; i++) {
+		const struct probe_ring *ring = &shm->rings[i];
+
+		n = min_t(uint64_t, ring->head, PROBE_RING_SIZE);
+		for (j = 0; j < n; j++) {
+			const struct probe_record *rec = &ring->records[j];
+
+			if (rec->entry && (rec->exit > rec->entry))
+				l[nr++] = rec->exit - rec->entry;
+		}
+	}
+
+	qsort(l, nr, sizeof(*l), compare_latencies);
+	*lat = l;
+	return nr;
+}
+
+static uint64_t cycles_to_nsec(uint64_t cycles, uint64_t tsc_khz)
+{
+	return tsc_khz ? cycles * 1000000 / tsc_khz : 0;
+}
+
+static void probe_print_histogram(const uint64_t *lat, size_t nr,
+				  uint64_t tsc_khz)
+{
+	size_t hist[PROBE_HIST_BUCKETS] = { };
+	size_t i, max = 0;
+	int b, first = PROBE_HIST_BUCKETS, last = 0;
+
+	for (i = 0; i < nr; i++) {
+		b = 63 - __builtin_clzl(lat[i]);
+		hist[b]++;
+		first = min(first, b);
+		last = max(last, b);
+		max = max(max, hist[b]);
+	}
+
+	pr_msg("    %21s  %21s  %s\n", "cycles", "nsec", "calls");
+	for (b = first; b <= last; b++) {
+		uint64_t lo = 1UL << b, hi = (lo << 1) - 1;
+		char bar[PROBE_HIST_BAR + 1];
+		size_t len = hist[b] * PROBE_HIST_BAR / max;
+
+		memset(bar, '#', len);
+		bar[len] = '\0';
+
+		pr_msg("    %10lu - %-8lu  %10lu - %-8lu  %-8lu %s\n", lo, hi,
+				cycles_to_nsec(lo, tsc_khz),
+				cycles_to_nsec(hi, tsc_khz), hist[b], bar);
+	}
+}
+
+static int probe_print(const struct probe_shm *shm, uint64_t tsc_khz)
+{
+	const struct probe_header *hdr = &shm->hdr;
+	uint64_t *lat, calls = 0, untimed = 0;
+	ssize_t nr;
+	int i;
+
+	for (i = 0; i < PROBE_NR_RINGS; i++) {
+		calls += shm->rings[i].calls;
+		untimed += shm->rings[i].untimed;
+	}
+
+	pr_msg("Probe \"%.*s\" at %#lx (%.*s):\n", (int)sizeof(hdr->name),
+			hdr->name, hdr->func, (int)sizeof(hdr->object),
+			hdr->object);
+	pr_msg("  calls: %lu, not timed: %lu\n", calls, untimed);
+
+	nr = probe_latencies(shm, &lat);
+	if (nr < 0)
+		return nr;
+
+	if (nr) {
+		pr_msg("  latency of last %ld calls, cycles (nsec):\n", nr);
+		pr_msg("    min %lu (%lu), p50 %lu (%lu), p90 %lu (%lu), "
+		       "p99 %lu (%lu), max %lu (%lu)\n",
+				lat[0], cycles_to_nsec(lat[0], tsc_khz),
+				lat[nr / 2], cycles_to_nsec(lat[nr / 2], tsc_khz),
+				lat[nr * 9 / 10],
+				cycles_to_nsec(lat[nr * 9 / 10], tsc_khz),
+				lat[nr * 99 / 100],
+				cycles_to_nsec(lat[nr * 99 / 100], tsc_khz),
+				lat[nr - 1], cycles_to_nsec(lat[nr - 1], tsc_khz));
+		probe_print_histogram(lat, nr, tsc_khz);
+	}
+
+	free(lat);
+	return 0;
+}
+
+/*
+ * Reports all the probes of the process, or the one of the function. Process
+ * is neither stopped, nor attached.
+ */
+int probe_report(const struct process_ctx_s *ctx, const char *name)
+{
+	const struct vma_area *vma;
+	struct probe_shm *shm;
+	uint64_t tsc_khz = 0;
+	int err, found = 0;
+
+	list_for_each_entry(vma, &ctx->vmas, list) {
+		if (!probe_vma(vma, ctx->pid) || vma_offset(vma))
+			continue;
+
+		shm = probe_open(vma, PROT_READ);
+		if (!shm)
+			return -EINVAL;
+
+		if (name && strncmp(shm->hdr.name, name, sizeof(shm->hdr.name))) {
+			probe_close(shm);
+			continue;
+		}
+
+		if (!tsc_khz)
+			tsc_khz = x86_tsc_khz();
+
+		err = probe_print(shm, tsc_khz);
+		probe_close(shm);
+		if (err)
+			return err;
+		found++;
+	}
+
+	if (!found) {
+		if (name)
+			pr_msg("No probe of \"%s\" in process %d\n",
+					name, ctx->pid);
+		else
+			pr_msg("No probes in process %d\n", ctx->pid);
+	}
+	return 0;
+}
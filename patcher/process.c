@@ -3,6 +3,14 @@
 #include <sys/mman.h>
 #include <sys/user.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/auxv.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 #include <compel/compel.h>
 #include <compel/ptrace.h>
@@ -20,6 +28,8 @@
 #include "include/service.h"
 #include "include/dl_map.h"
 #include "include/rtld.h"
+#include "include/plan.h"
+#include "include/loader.h"
 
 struct patch_place_s {
 	struct list_head	list;
@@ -49,6 +59,9 @@ int process_write_data(const struct process_ctx_s *ctx, uint64_t addr, const voi
 	pid_t pid = ctx->pid;
 	int err;
 
+	if (plan_recording(ctx->plan))
+		return plan_record_write(ctx->plan, addr, data, size);
+
 	err = ptrace_poke_area(pid, (void *)data, (void *)addr, size);
 	if (err) {
 		if (err == -1) {
@@ -63,22 +76,122 @@ int process_write_data(const struct process_ctx_s *ctx, uint64_t addr, const voi
 	return 0;
 }
 
+static int process_queue_reloc(struct process_ctx_s *ctx,
+			       const struct dl_map *dlm,
+			       uint64_t addr, uint64_t value, uint32_t size)
+{
+	const struct vma_area *vma;
+	struct service_reloc *r;
+
+	list_for_each_entry(vma, &dlm->vmas, dl) {
+		if ((addr >= vma_start(vma)) && (addr + size <= vma_end(vma)))
+			break;
+	}
+	if (&vma->dl == &dlm->vmas) {
+		pr_err("relocation %#lx is out of %s\n", addr, dlm->path);
+		return -EINVAL;
+	}
+
+	if (xrealloc_safe(&ctx->relocs, sizeof(*r) * (ctx->nr_relocs + 1)))
+		return -ENOMEM;
+
+	r = &ctx->relocs[ctx->nr_relocs++];
+	r->addr = addr;
+	r->value = value;
+	r->size = size;
+	r->prot = vma_prot(vma);
+	return 0;
+}
+
+/*
+ * With service loaded relocations are queued and applied by the service in
+ * one go (see process_apply_relocs()). Otherwise they are written one by one.
+ */
+int process_write_reloc(struct process_ctx_s *ctx, const struct dl_map *dlm,
+			uint64_t addr, uint64_t value, uint32_t size)
+{
+	uint64_t start = round_down(addr, sizeof(uint64_t));
+	uint64_t end = round_up(addr + size, sizeof(uint64_t));
+	char bytes[16];
+	int err;
+
+	if (plan_recording(ctx->plan))
+		return plan_record_write(ctx->plan, addr, &value, size);
+
+	if (ctx->service.loaded)
+		return process_queue_reloc(ctx, dlm, addr, value, size);
+
+	/* Words are aligned, so they don't cross the end of the mapping */
+	if (end - start != size) {
+		err = process_read_data(ctx, start, bytes, end - start);
+		if (err)
+			return err;
+	}
+
+	memcpy(bytes + (addr - start), &value, size);
+
+	return process_write_data(ctx, start, bytes, end - start);
+}
+
+static int compare_relocs(const void *a, const void *b)
+{
+	const struct service_reloc *ra = a, *rb = b;
+
+	if (ra->addr < rb->addr)
+		return -1;
+	return ra->addr > rb->addr;
+}
+
+int process_apply_relocs(struct process_ctx_s *ctx)
+{
+	int err;
+
+	if (!ctx->nr_relocs)
+		return 0;
+
+	/* Service changes page protection once per run of relocations */
+	qsort(ctx->relocs, ctx->nr_relocs, sizeof(*ctx->relocs), compare_relocs);
+
+	err = service_apply_relocs(ctx, &ctx->service,
+				   ctx->relocs, ctx->nr_relocs);
+	if (err)
+		pr_err("failed to apply relocations in process %d\n", ctx->pid);
+
+	free(ctx->relocs);
+	ctx->relocs = NULL;
+	ctx->nr_relocs = 0;
+	return err;
+}
+
+/*
+ * Reading is done with process_vm_readv(), which doesn't require the process
+ * to be stopped. This allows to inspect process memory (like function jumps
+ * for "list" command) without seizing it.
+ */
 int process_read_data(const struct process_ctx_s *ctx, uint64_t addr, void *data, size_t size)
 {
 	pid_t pid = ctx->pid;
-	int err;
+	struct iovec local = {
+		.iov_base = data,
+		.iov_len = size,
+	};
+	struct iovec remote = {
+		.iov_base = (void *)addr,
+		.iov_len = size,
+	};
+	ssize_t ret;
 
-	err = ptrace_peek_area(pid, data, (void *)addr, size);
-	if (err) {
-		if (err == -1) {
-			pr_err("Failed to read range %#lx-%#lx in process %d: "
-			       "size is not aligned\n", addr, addr + size, pid);
-			return -EINVAL;
-		}
+	ret = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+	if (ret < 0) {
 		pr_perror("Failed to read range %#lx-%#lx from process %d",
 				addr, addr + size, pid);
 		return -errno;
 	}
+	if (ret != size) {
+		pr_err("Failed to read range %#lx-%#lx from process %d: "
+		       "read only %ld bytes\n", addr, addr + size, pid, ret);
+		return -EFAULT;
+	}
 	return 0;
 }
 
@@ -110,6 +223,142 @@ static const char *map_prot(unsigned prot, char *buf)
 	return buf;
 }
 
+#ifndef PTRACE_GETSIGMASK
+#define PTRACE_GETSIGMASK	0x420a
+#define PTRACE_SETSIGMASK	0x420b
+#endif
+
+#define X86_64_RED_ZONE		128
+
+/* Batch commands table must fit into remote page together with data */
+#define PROCESS_BATCH_MAX	32
+
+static uint64_t process_remote_data(const struct process_ctx_s *ctx)
+{
+	return vma_start(&ctx->remote_vma) + X86_64_TRAMPOLINE_SIZE;
+}
+
+static size_t process_remote_data_size(const struct process_ctx_s *ctx)
+{
+	return vma_length(&ctx->remote_vma) - X86_64_TRAMPOLINE_SIZE;
+}
+
+/*
+ * Runs trampoline entry with the given registers on top of the original
+ * ones. Stack is moved below the red zone, and all the signals are blocked
+ * until the trampoline hits int3. Original registers and signal mask are
+ * restored afterwards.
+ */
+static int process_run_trampoline(struct process_ctx_s *ctx, unsigned entry,
+				  const struct user_regs_struct *set,
+				  int64_t *ret)
+{
+	struct user_regs_struct orig, regs;
+	uint64_t sigmask, block = ~0ULL;
+	pid_t pid = ctx->pid;
+	int status, err = 0;
+
+	if (ptrace(PTRACE_GETREGS, pid, NULL, &orig)) {
+		pr_perror("failed to get process %d registers", pid);
+		return -errno;
+	}
+
+	if (ptrace(PTRACE_GETSIGMASK, pid, sizeof(sigmask), &sigmask)) {
+		pr_perror("failed to get process %d signal mask", pid);
+		return -errno;
+	}
+
+	if (ptrace(PTRACE_SETSIGMASK, pid, sizeof(block), &block)) {
+		pr_perror("failed to block process %d signals", pid);
+		return -errno;
+	}
+
+	regs = orig;
+	regs.rax = set->rax;
+	regs.rdi = set->rdi;
+	regs.rsi = set->rsi;
+	regs.rdx = set->rdx;
+	regs.rcx = set->rcx;
+	regs.r8 = set->r8;
+	regs.r9 = set->r9;
+	regs.r12 = set->r12;
+	regs.r13 = set->r13;
+	regs.r14 = set->r14;
+	regs.rip = vma_start(&ctx->remote_vma) + entry;
+	regs.rsp = (orig.rsp - X86_64_RED_ZONE) & ~0xfUL;
+	/* Prevent syscall restart on resume */
+	regs.orig_rax = -1;
+
+	if (ptrace(PTRACE_SETREGS, pid, NULL, &regs)) {
+		pr_perror("failed to set process %d registers", pid);
+		err = -errno;
+		goto restore_sigmask;
+	}
+
+	if (ptrace(PTRACE_CONT, pid, NULL, NULL)) {
+		pr_perror("failed to run process %d", pid);
+		err = -errno;
+		goto restore_regs;
+	}
+
+	if (waitpid(pid, &status, __WALL) != pid) {
+		pr_perror("failed to wait for process %d", pid);
+		err = -errno;
+		goto restore_regs;
+	}
+
+	if (!WIFSTOPPED(status) || (WSTOPSIG(status) != SIGTRAP)) {
+		pr_err("process %d stopped unexpectedly in trampoline: %#x\n",
+				pid, status);
+		err = -EFAULT;
+		goto restore_regs;
+	}
+
+	if (ptrace(PTRACE_GETREGS, pid, NULL, &regs)) {
+		pr_perror("failed to get process %d registers", pid);
+		err = -errno;
+		goto restore_regs;
+	}
+
+	*ret = regs.rax;
+
+restore_regs:
+	if (ptrace(PTRACE_SETREGS, pid, NULL, &orig)) {
+		pr_perror("failed to restore process %d registers", pid);
+		err = err ? : -errno;
+	}
+restore_sigmask:
+	if (ptrace(PTRACE_SETSIGMASK, pid, sizeof(sigmask), &sigmask)) {
+		pr_perror("failed to restore process %d signal mask", pid);
+		err = err ? : -errno;
+	}
+	return err;
+}
+
+static int process_install_trampoline(struct process_ctx_s *ctx)
+{
+	const void *code;
+	size_t size;
+	int err;
+
+	code = x86_64_trampoline(&size);
+
+	err = ptrace_poke_area(ctx->pid, (void *)code,
+			       (void *)vma_start(&ctx->remote_vma),
+			       round_up(size, 8));
+	if (err) {
+		pr_err("failed to install trampoline in process %d\n", ctx->pid);
+		return -EFAULT;
+	}
+
+	ctx->trampoline = 1;
+	return 0;
+}
+
+/*
+ * Syscalls are executed via trampoline once it is installed, and via compel
+ * otherwise (remote page setup and release).
+ */
 static long process_syscall(struct process_ctx_s *ctx, int nr,
 			    unsigned long arg1, unsigned long arg2,
 			    unsigned long arg3, unsigned long arg4,
@@ -118,8 +367,24 @@ static long process_syscall(struct process_ctx_s *ctx, int nr,
 	int ret;
 	long sret = -ENOSYS;
 
-	ret = compel_syscall(ctx->ctl, nr, &sret,
-			     arg1, arg2, arg3, arg4, arg5, arg6);
+	if (ctx->trampoline) {
+		struct user_regs_struct regs = {
+			.rax = nr,
+			.rdi = arg1,
+			.rsi = arg2,
+			.rdx = arg3,
+			.rcx = arg4,
+			.r8 = arg5,
+			.r9 = arg6,
+		};
+		int64_t rax;
+
+		ret = process_run_trampoline(ctx, X86_64_TRAMPOLINE_SYSCALL,
+					     &regs, &rax);
+		sret = rax;
+	} else
+		ret = compel_syscall(ctx->ctl, nr, &sret,
+				     arg1, arg2, arg3, arg4, arg5, arg6);
 	if (ret < 0) {
 		pr_err("Failed to execute syscall %d in %d\n", nr, ctx->pid);
 		return ret;
@@ -131,6 +396,73 @@ static long process_syscall(struct process_ctx_s *ctx, int nr,
 	return sret;
 }
 
+/*
+ * Executes the commands via trampoline batch entry. Commands table is placed
+ * into the remote page data area right after the data_size bytes, reserved
+ * by caller. Execution stops at the first failed syscall: results of the
+ * commands, which were not executed, are set to -ECANCELED.
+ * Returns the number of executed commands.
+ */
+static int process_run_batch(struct process_ctx_s *ctx,
+			     struct x86_64_batch_cmd *cmds, int nr_cmds,
+			     size_t data_size)
+{
+	uint64_t table = process_remote_data(ctx) + round_up(data_size, 16);
+	size_t size = sizeof(*cmds) * nr_cmds;
+	struct user_regs_struct regs = { };
+	int64_t rax;
+	int i, err;
+
+	if (!ctx->trampoline)
+		return -EINVAL;
+
+	if (round_up(data_size, 16) + size > process_remote_data_size(ctx)) {
+		pr_err("batch of %d commands doesn't fit remote page\n", nr_cmds);
+		return -E2BIG;
+	}
+
+	for (i = 0; i < nr_cmds; i++)
+		cmds[i].ret = -ECANCELED;
+
+	err = ptrace_poke_area(ctx->pid, cmds, (void *)table, size);
+	if (err) {
+		pr_err("failed to write batch to process %d\n", ctx->pid);
+		return -EFAULT;
+	}
+
+	regs.r12 = table;
+	regs.r13 = nr_cmds;
+
+	err = process_run_trampoline(ctx, X86_64_TRAMPOLINE_BATCH, &regs, &rax);
+	if (err)
+		return err;
+
+	err = process_read_data(ctx, table, cmds, size);
+	if (err)
+		return err;
+
+	for (i = 0; i < nr_cmds; i++) {
+		if (cmds[i].ret == -ECANCELED)
+			break;
+	}
+	return i;
+}
+
+static void batch_syscall(struct x86_64_batch_cmd *cmd, int nr,
+			  uint64_t arg1, uint64_t arg2, uint64_t arg3,
+			  uint64_t arg4, uint64_t arg5, uint64_t arg6)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->type = X86_64_BATCH_SYSCALL;
+	cmd->target = nr;
+	cmd->args[0] = arg1;
+	cmd->args[1] = arg2;
+	cmd->args[2] = arg3;
+	cmd->args[3] = arg4;
+	cmd->args[4] = arg5;
+	cmd->args[5] = arg6;
+}
+
 int64_t process_map_vma(struct process_ctx_s *ctx, int fd,
 			const struct vma_area *vma)
 {
@@ -169,15 +501,47 @@ static int unmap_dl_vma(struct vma_area *vma, void *data)
 	return process_unmap_vma(ctx, vma);
 }
 
+static int process_munmap_dlm_batch(struct process_ctx_s *ctx,
+				    const struct dl_map *dlm)
+{
+	struct x86_64_batch_cmd cmds[PROCESS_BATCH_MAX];
+	const struct vma_area *vma;
+	int nr = 0, ret, i;
+
+	list_for_each_entry(vma, &dlm->vmas, dl) {
+		if (nr == PROCESS_BATCH_MAX)
+			return iterate_dl_vmas(dlm, ctx, unmap_dl_vma);
+
+		process_print_munmap(vma);
+		batch_syscall(&cmds[nr++], __NR(munmap, false),
+			      vma_start(vma), vma_length(vma), 0, 0, 0, 0);
+	}
+
+	ret = process_run_batch(ctx, cmds, nr, 0);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		if (cmds[i].ret < 0) {
+			errno = -cmds[i].ret;
+			pr_perror("Failed to unmap %#lx-%#lx",
+					cmds[i].args[0],
+					cmds[i].args[0] + cmds[i].args[1]);
+			return cmds[i].ret;
+		}
+	}
+	return 0;
+}
+
 int process_munmap_dl_map(struct process_ctx_s *ctx, const struct dl_map *dlm)
 {
-	if (ctx->dry_run)
+	if (ctx->dry_run || plan_recording(ctx->plan))
 		return 0;
 
 	if (ctx->service.loaded)
 		return service_munmap_dlm(ctx, &ctx->service, dlm);
 
-	return iterate_dl_vmas(dlm, ctx, unmap_dl_vma);
+	return process_munmap_dlm_batch(ctx, dlm);
 }
 
 void process_print_mmap(const struct vma_area *vma)
@@ -194,23 +558,28 @@ void process_print_mmap(const struct vma_area *vma)
 static int process_mmap_dlm_service(struct process_ctx_s *ctx,
 				    const struct dl_map *dlm)
 {
-	int fd;
+	int fd, tfd;
 
-	fd = service_transfer_fd(ctx, &ctx->service, elf_info_fd(dlm->ei));
+	fd = elf_info_open(dlm->ei);
 	if (fd < 0)
 		return fd;
 
-	return service_mmap_dlm(ctx, &ctx->service, dlm, fd);
+	tfd = service_transfer_fd(ctx, &ctx->service, fd);
+	close(fd);
+	if (tfd < 0)
+		return tfd;
+
+	return service_mmap_dlm(ctx, &ctx->service, dlm, tfd);
 }
 
 static int process_mmap_dlm_manual(struct process_ctx_s *ctx,
-				   const struct dl_map *dlm)
+				   const struct dl_map *dlm, int flags)
 {
 	int fd;
 	int64_t addr;
 	struct vma_area *vma;
 
-	fd = process_open_file(ctx, dlm->path, O_RDONLY, 0);
+	fd = process_open_file(ctx, dlm->path, flags, 0);
 	if (fd < 0)
 		return fd;
 
@@ -227,18 +596,261 @@ static int process_mmap_dlm_manual(struct process_ctx_s *ctx,
 unmap:
 	list_for_each_entry_continue_reverse(vma, &dlm->vmas, dl)
 		(void)process_unmap_vma(ctx, vma);
+	(void)process_close_file(ctx, fd);
 	return addr;
 }
 
+/*
+ * File is opened, mapped and closed in one trampoline run: mmap calls take
+ * the file descriptor, returned by open.
+ */
+static int process_mmap_dlm_batch(struct process_ctx_s *ctx,
+				  const struct dl_map *dlm, int flags)
+{
+	struct x86_64_batch_cmd cmds[PROCESS_BATCH_MAX];
+	size_t path_size = round_up(strlen(dlm->path) + 1, 8);
+	const struct vma_area *vma;
+	int nr = 0, ret, i, err = 0;
+
+	list_for_each_entry(vma, &dlm->vmas, dl)
+		nr++;
+
+	if ((nr + 2 > PROCESS_BATCH_MAX) ||
+	    (path_size > process_remote_data_size(ctx) / 2))
+		return process_mmap_dlm_manual(ctx, dlm, flags);
+
+	err = process_write_data(ctx, process_remote_data(ctx),
+				 dlm->path, path_size);
+	if (err)
+		return err;
+
+	nr = 0;
+	batch_syscall(&cmds[nr], __NR(open, false),
+		      process_remote_data(ctx), flags, 0, 0, 0, 0);
+	cmds[nr++].flags = X86_64_BATCH_SAVE;
+
+	list_for_each_entry(vma, &dlm->vmas, dl) {
+		process_print_mmap(vma);
+		batch_syscall(&cmds[nr], __NR(mmap, false),
+			      vma_start(vma), vma_length(vma), vma_prot(vma),
+			      vma_flags(vma), 0, vma_offset(vma));
+		/* File descriptor is the fifth argument */
+		cmds[nr++].flags = 5;
+	}
+
+	batch_syscall(&cmds[nr], __NR(close, false), 0, 0, 0, 0, 0, 0);
+	cmds[nr++].flags = 1;
+
+	ret = process_run_batch(ctx, cmds, nr, path_size);
+	if (ret < 0)
+		return ret;
+
+	if (ret == nr)
+		return 0;
+
+	if (!ret) {
+		errno = -cmds[0].ret;
+		pr_perror("Failed to open %s", dlm->path);
+		return cmds[0].ret;
+	}
+
+	errno = -cmds[ret].ret;
+	pr_perror("failed to create new mapping %#lx-%#lx in process %d "
+		  "with flags %#lx, prot %#lx, offset %#lx",
+			cmds[ret].args[0], cmds[ret].args[0] + cmds[ret].args[1],
+			ctx->pid, cmds[ret].args[3], cmds[ret].args[2],
+			cmds[ret].args[5]);
+	err = cmds[ret].ret;
+
+	/* Unmap created mappings and close the file */
+	nr = 0;
+	for (i = ret - 1; i > 0; i--)
+		batch_syscall(&cmds[nr++], __NR(munmap, false),
+			      cmds[i].args[0], cmds[i].args[1], 0, 0, 0, 0);
+	batch_syscall(&cmds[nr++], __NR(close, false),
+		      cmds[0].ret, 0, 0, 0, 0, 0);
+
+	(void)process_run_batch(ctx, cmds, nr, 0);
+	return err;
+}
+
 int process_mmap_dl_map(struct process_ctx_s *ctx, const struct dl_map *dlm)
 {
+	if (plan_recording(ctx->plan))
+		return plan_record_dl_map(ctx->plan, dlm);
+
 	if (ctx->dry_run)
 		return 0;
 
 	if (ctx->service.loaded)
 		return process_mmap_dlm_service(ctx, dlm);
 
-	return process_mmap_dlm_manual(ctx, dlm);
+	return process_mmap_dlm_batch(ctx, dlm, O_RDONLY);
+}
+
+/*
+ * Maps shared file, which is not an ELF: it's opened by nsb (fd) and sent
+ * to the service or opened by path in the process for writing.
+ */
+int process_mmap_file(struct process_ctx_s *ctx, const struct dl_map *dlm,
+		      int fd)
+{
+	int rfd;
+
+	if (ctx->dry_run)
+		return 0;
+
+	if (!ctx->service.loaded)
+		return process_mmap_dlm_batch(ctx, dlm, O_RDWR);
+
+	rfd = service_transfer_fd(ctx, &ctx->service, fd);
+	if (rfd < 0)
+		return rfd;
+
+	return service_mmap_dlm(ctx, &ctx->service, dlm, rfd);
+}
+
+/*
+ * Shared memory has to be accessible for the process, if opened by it. The
+ * path is predictable: stale file is removed, and the new one is created
+ * exclusively, not following links.
+ */
+int process_create_shm(const struct process_ctx_s *ctx, const char *path,
+		       size_t size)
+{
+	char proc[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	if (unlink(path) && (errno != ENOENT)) {
+		pr_perror("failed to remove stale %s", path);
+		return -errno;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		pr_perror("failed to create %s", path);
+		return -errno;
+	}
+
+	snprintf(proc, sizeof(proc), "/proc/%d", ctx->pid);
+	if (!stat(proc, &st) && fchown(fd, st.st_uid, st.st_gid))
+		pr_debug("failed to change owner of %s: %d\n", path, errno);
+
+	if (ftruncate(fd, size)) {
+		pr_perror("failed to resize %s", path);
+		close(fd);
+		unlink(path);
+		return -errno;
+	}
+	return fd;
+}
+
+static struct vma_area *shm_vma(uint64_t addr, size_t length, int prot,
+				int flags, off_t offset)
+{
+	struct vma_area *vma;
+
+	vma = xzalloc(sizeof(*vma));
+	if (!vma)
+		return NULL;
+
+	vma->addr = addr;
+	vma->length = length;
+	vma->flags = flags | MAP_FIXED;
+	vma->prot = prot;
+	vma->offset = offset;
+	INIT_LIST_HEAD(&vma->list);
+	INIT_LIST_HEAD(&vma->dl);
+	return vma;
+}
+
+static int add_shm_vma(struct dl_map *dlm, uint64_t addr, size_t length,
+		       int prot, int flags, off_t offset)
+{
+	struct vma_area *vma;
+	int err;
+
+	vma = shm_vma(addr, length, prot, flags, offset);
+	if (!vma)
+		return -ENOMEM;
+
+	err = add_dl_vma_sorted(dlm, vma);
+	if (err)
+		free(vma);
+	return err;
+}
+
+static void free_shm_dl_map(struct dl_map *dlm)
+{
+	struct vma_area *vma, *tmp;
+
+	list_for_each_entry_safe(vma, tmp, &dlm->vmas, dl) {
+		list_del(&vma->dl);
+		free(vma);
+	}
+	free(dlm);
+}
+
+/*
+ * Shared memory file keeps only the data, read by nsb (up to shm size), and
+ * is mapped read-write. The rest is private anonymous memory: read-write up
+ * to code offset, and read-exec after it (the code is written via ptrace),
+ * so no other process can change the code.
+ */
+int process_mmap_shm(struct process_ctx_s *ctx, const char *path, int fd,
+		     uint64_t addr, size_t shm_size, size_t code_off,
+		     size_t size)
+{
+	const struct vma_area *vma;
+	struct dl_map *dlm;
+	int err;
+
+	dlm = alloc_dl_map(NULL, path);
+	if (!dlm)
+		return -ENOMEM;
+
+	err = add_shm_vma(dlm, addr, shm_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, 0);
+	if (!err && (code_off > shm_size))
+		err = add_shm_vma(dlm, addr + shm_size, code_off - shm_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, 0);
+	if (!err)
+		err = add_shm_vma(dlm, addr + code_off, size - code_off,
+				  PROT_READ | PROT_EXEC,
+				  MAP_PRIVATE | MAP_ANONYMOUS, 0);
+	if (err)
+		goto free_dlm;
+
+	list_for_each_entry(vma, &dlm->vmas, dl)
+		process_print_mmap(vma);
+
+	err = process_mmap_file(ctx, dlm, fd);
+	if (!err)
+		err = process_reserve_dl_map(ctx, dlm);
+
+free_dlm:
+	free_shm_dl_map(dlm);
+	return err;
+}
+
+int process_munmap_shm(struct process_ctx_s *ctx, const char *path,
+		       uint64_t addr, size_t size)
+{
+	struct dl_map *dlm;
+	int err;
+
+	dlm = alloc_dl_map(NULL, path);
+	if (!dlm)
+		return -ENOMEM;
+
+	err = add_shm_vma(dlm, addr, size, 0, 0, 0);
+	if (!err)
+		err = process_munmap_dl_map(ctx, dlm);
+
+	free_shm_dl_map(dlm);
+	return err;
 }
 
 int process_close_file(struct process_ctx_s *ctx, int fd)
@@ -259,13 +871,13 @@ static int process_do_open_file(struct process_ctx_s *ctx,
 {
 	int err, fd;
 
-	err = process_write_data(ctx, vma_start(&ctx->remote_vma),
+	err = process_write_data(ctx, process_remote_data(ctx),
 				 path, round_up(strlen(path) + 1, 8));
 	if (err)
 		return err;
 
 	fd = process_syscall(ctx, __NR(open, false),
-			     vma_start(&ctx->remote_vma),
+			     process_remote_data(ctx),
 			     flags, mode, 0, 0, 0);
 	if (fd < 0) {
 		pr_perror("Failed to open %s", path);
@@ -327,6 +939,9 @@ int process_unlink(struct process_ctx_s *ctx)
 
 	pr_debug("= Cleanup %d\n", ctx->pid);
 
+	/* Trampoline can't unmap itself */
+	ctx->trampoline = 0;
+
 	err = process_unmap_vma(ctx, &ctx->remote_vma);
 	if (err)
 		return err;
@@ -363,8 +978,13 @@ int process_link(struct process_ctx_s *ctx)
 
 	ctx->remote_vma.addr = addr;
 
+	if (process_install_trampoline(ctx))
+		goto unmap;
+
 	return 0;
 
+unmap:
+	(void)process_unmap_vma(ctx, &ctx->remote_vma);
 cure:
 	if (compel_cure(ctx->ctl))
 		pr_err("failed to cure process %d\n", ctx->pid);
@@ -502,15 +1122,72 @@ int process_unmap_vma(struct process_ctx_s *ctx, const struct vma_area *vma)
 	return 0;
 }
 
+static int process_thread_parked(const struct process_ctx_s *ctx, pid_t tid)
+{
+	int i;
+
+	for (i = 0; i < ctx->nr_parked; i++)
+		if (ctx->parked[i] == tid)
+			return 1;
+	return 0;
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Return hooks of timed calls (canary and probe) start private anonymous code
+ * mappings, and are recognised by the code itself.
+ */
+ssize_t process_timer_hooks(const struct process_ctx_s *ctx, uint64_t **hooks)
+{
+	uint8_t code[X86_64_TIMER_SIZE];
+	const struct vma_area *vma;
+	uint64_t *h = NULL;
+	ssize_t nr = 0;
+
+	list_for_each_entry(vma, &ctx->vmas, list) {
+		if (vma->path || !(vma_prot(vma) & PROT_EXEC) ||
+		    (vma_length(vma) < sizeof(code)))
+			continue;
+
+		if (process_read_data(ctx, vma_start(vma), code, sizeof(code)))
+			continue;
+
+		if (!x86_64_timer_hook(code))
+			continue;
+
+		if (xrealloc_safe(&h, sizeof(*h) * (nr + 1))) {
+			free(h);
+			return -ENOMEM;
+		}
+		h[nr++] = vma_start(vma);
+	}
+
+	*hooks = h;
+	return nr;
+}
+
 static int task_check_stack(const struct process_ctx_s *ctx, const struct thread_s *t,
-			    uint64_t start, uint64_t end)
+			    const uint64_t *hooks, size_t nr_hooks,
+			    check_backtrace_t check, uint64_t start, uint64_t end)
 {
 	int err;
 	struct backtrace_s *bt;
 
+	if (process_thread_parked(ctx, t->pid)) {
+		pr_info("  %d: parked by agent\n", t->pid);
+		return 0;
+	}
+
 	pr_info("  %d:\n", t->pid);
 
-	err = pid_backtrace(t->pid, &bt);
+	err = pid_backtrace(t->pid, hooks, nr_hooks, &bt);
 	if (err) {
 		if (err != -EAGAIN)
 			pr_err("failed to unwind task %d stack\n", t->pid);
@@ -520,7 +1197,7 @@ static int task_check_stack(const struct process_ctx_s *ctx, const struct thread
 		return err;
 	}
 
-	err = ctx->check_backtrace(ctx, bt, start, end);
+	err = check(ctx, bt, start, end);
 
 	destroy_backtrace(bt);
 	return err;
@@ -530,21 +1207,76 @@ static int process_check_stack(const struct process_ctx_s *ctx,
 			       uint64_t start, uint64_t end)
 {
 	struct thread_s *t;
-	int err;
+	uint64_t begin, *hooks;
+	ssize_t nr_hooks;
+	int err = 0;
+
+	if (!ctx->check_backtrace) {
+		pr_info("= Skipping %d stack check\n", ctx->pid);
+		return 0;
+	}
 
 	pr_info("= Checking %d stack...\n", ctx->pid);
+	begin = now_usec();
+
+	nr_hooks = process_timer_hooks(ctx, &hooks);
+	if (nr_hooks < 0)
+		return nr_hooks;
+
 	list_for_each_entry(t, &ctx->threads, list) {
-		err = task_check_stack(ctx, t, start, end);
+		err = task_check_stack(ctx, t, hooks, nr_hooks,
+				       ctx->check_backtrace, start, end);
 		if (err)
-			return err;
+			goto free_hooks;
 	}
-	return 0;
+	pr_info("  Stack checked in %lu usec\n", now_usec() - begin);
+
+free_hooks:
+	free(hooks);
+	return err;
+}
+
+static int range_check_backtrace(const struct process_ctx_s *ctx,
+				 const struct backtrace_s *bt,
+				 uint64_t start, uint64_t end)
+{
+	return backtrace_check_range(bt, start, end);
+}
+
+/*
+ * Checks stacks of the stopped process against the range, which is known
+ * only after the stop (i.e. code of the found patches).
+ */
+int process_check_range(const struct process_ctx_s *ctx,
+			uint64_t start, uint64_t end)
+{
+	struct thread_s *t;
+	uint64_t *hooks;
+	ssize_t nr_hooks;
+	int err = 0;
+
+	pr_info("= Checking %d stack for %#lx-%#lx...\n", ctx->pid, start, end);
+
+	nr_hooks = process_timer_hooks(ctx, &hooks);
+	if (nr_hooks < 0)
+		return nr_hooks;
+
+	list_for_each_entry(t, &ctx->threads, list) {
+		err = task_check_stack(ctx, t, hooks, nr_hooks,
+				       range_check_backtrace, start, end);
+		if (err)
+			break;
+	}
+
+	free(hooks);
+	return err;
 }
 
 struct target_info {
 	const char		*bid;
 	uint64_t		start;
 	uint64_t		end;
+	char			path[PATH_MAX];
 };
 
 static int compare_target_bid(pid_t pid, const struct vma_area *vma, void *data)
@@ -567,7 +1299,7 @@ static int compare_target_bid(pid_t pid, const struct vma_area *vma, void *data)
 	if (!is_elf_file(map_file))
 		return 0;
 
-	ret = elf_create_info(map_file, &ei);
+	ret = elf_get_info(map_file, &ei);
 	if (ret)
 		return ret;
 
@@ -579,10 +1311,11 @@ static int compare_target_bid(pid_t pid, const struct vma_area *vma, void *data)
 
 	ti->start = elf_type_dyn(ei) ? vma_start(vma) : 0;
 	ti->end = elf_type_dyn(ei) ? vma_end(vma) : 0;
+	snprintf(ti->path, sizeof(ti->path), "%s", vma->path);
 	ret = 1;
 
 destroy_ei:
-	elf_destroy_info(ei);
+	elf_put_info(ei);
 	return ret;
 }
 
@@ -605,6 +1338,141 @@ int process_get_target_info(pid_t pid, struct target_info *ti)
 	return 0;
 }
 
+/*
+ * Returns 1, if process maps ELF with the Build ID, and 0 otherwise.
+ */
+int process_maps_bid(pid_t pid, const char *bid)
+{
+	struct target_info ti = {
+		.bid = bid,
+	};
+
+	return iter_map_files(pid, compare_target_bid, &ti);
+}
+
+static int process_extend_range(pid_t pid, const char *path,
+				uint64_t *start, uint64_t *end)
+{
+	const struct vma_area *vma;
+	LIST_HEAD(vmas);
+	int err;
+
+	err = collect_vmas_by_path(pid, &vmas, path);
+	if (err)
+		return err;
+
+	list_for_each_entry(vma, &vmas, list) {
+		if (vma_start(vma) < *start)
+			*start = vma_start(vma);
+		if (vma_end(vma) > *end)
+			*end = vma_end(vma);
+	}
+
+	free_vmas(&vmas);
+	return 0;
+}
+
+/*
+ * Range covers all the mappings of the ELF file, not only the one, which was
+ * matched by Build ID.
+ */
+int process_get_elf_range(pid_t pid, const char *bid,
+			  uint64_t *start, uint64_t *end)
+{
+	struct target_info ti = {
+		.bid = bid,
+	};
+	int err;
+
+	err = process_get_target_info(pid, &ti);
+	if (err)
+		return err;
+
+	*start = ti.start;
+	*end = ti.end;
+	if (!ti.start)
+		return 0;
+
+	return process_extend_range(pid, ti.path, start, end);
+}
+
+static int process_read_auxv(pid_t pid, uint64_t type, uint64_t *val)
+{
+	char path[PATH_MAX];
+	uint64_t av[2];
+	int fd, err = -ENOENT;
+
+	snprintf(path, sizeof(path), "/proc/%d/auxv", pid);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_perror("failed to open %s", path);
+		return -errno;
+	}
+
+	while (read(fd, av, sizeof(av)) == sizeof(av)) {
+		if (av[0] == AT_NULL)
+			break;
+		if (av[0] == type) {
+			*val = av[1];
+			err = 0;
+			break;
+		}
+	}
+
+	close(fd);
+	return err;
+}
+
+/*
+ * Dynamic loader is found by its load base from auxiliary vector. Range is
+ * empty for static executables.
+ */
+int process_get_loader_range(pid_t pid, uint64_t *start, uint64_t *end)
+{
+	const struct vma_area *vma;
+	uint64_t base = 0;
+	char path[PATH_MAX];
+	LIST_HEAD(vmas);
+	int err;
+
+	*start = *end = 0;
+
+	err = process_read_auxv(pid, AT_BASE, &base);
+	if (err && (err != -ENOENT))
+		return err;
+	if (!base)
+		return 0;
+
+	err = collect_vmas(pid, &vmas);
+	if (err)
+		return err;
+
+	err = -ENOENT;
+	list_for_each_entry(vma, &vmas, list) {
+		if ((vma_start(vma) == base) && vma->path) {
+			snprintf(path, sizeof(path), "%s", vma->path);
+			*start = vma_start(vma);
+			*end = vma_end(vma);
+			err = 0;
+			break;
+		}
+	}
+	free_vmas(&vmas);
+
+	if (err) {
+		pr_err("failed to find dynamic loader at %#lx in process %d\n",
+				base, pid);
+		return err;
+	}
+
+	return process_extend_range(pid, path, start, end);
+}
+
+/*
+ * Target Build ID can be omitted, if check_backtrace callback knows ranges
+ * to check by itself (like in case of multi-patch transaction).
+ */
 static int process_catch(struct process_ctx_s *ctx, const char *target_bid)
 {
 	int ret, err;
@@ -616,9 +1484,11 @@ static int process_catch(struct process_ctx_s *ctx, const char *target_bid)
 	if (err)
 		return err;
 
-	ret = process_get_target_info(ctx->pid, &ti);
-	if (ret)
-		goto cure;
+	if (target_bid) {
+		ret = process_get_target_info(ctx->pid, &ti);
+		if (ret)
+			goto cure;
+	}
 
 	ret = process_check_stack(ctx, ti.start, ti.end);
 	if (ret)
@@ -640,26 +1510,36 @@ static unsigned increase_timeout(unsigned current_msec)
 	return current_msec;
 }
 
-int64_t process_exec_code(struct process_ctx_s *ctx, uint64_t addr,
-		void *code, size_t code_size)
+/*
+ * Calls the function in process via trampoline: no code is written.
+ */
+int64_t process_call(struct process_ctx_s *ctx, uint64_t func,
+		     uint64_t arg0, uint64_t arg1, uint64_t arg2,
+		     uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
-	int err;
+	struct user_regs_struct regs = {
+		.rax = func,
+		.rdi = arg0,
+		.rsi = arg1,
+		.rdx = arg2,
+		.rcx = arg3,
+		.r8 = arg4,
+		.r9 = arg5,
+	};
 	int64_t ret;
-	user_regs_struct_t regs;
+	int err;
 
-	err = process_write_data(ctx, addr, code, round_up(code_size, 8));
-	if (err) {
-		pr_err("failed to write code\n");
-		return err;
+	if (!ctx->trampoline) {
+		pr_err("trampoline is not installed in process %d\n", ctx->pid);
+		return -EINVAL;
 	}
 
-	err = compel_run_at(ctx->ctl, addr, &regs);
+	err = process_run_trampoline(ctx, X86_64_TRAMPOLINE_CALL, &regs, &ret);
 	if (err) {
-		pr_err("failed to call code at %#lx: %d\n", addr, err);
+		pr_err("failed to call %#lx: %d\n", func, err);
 		return err;
 	}
 
-	ret = get_user_reg(&regs, ax);
 	if (ret < 0)
 		pr_err("code execution returned error: %ld\n", ret);
 	return ret;
@@ -689,6 +1569,60 @@ int process_suspend(struct process_ctx_s *ctx, const char *target_bid)
 	return -ETIME;
 }
 
+/*
+ * Parked threads have checked their stacks by themselves, and are waiting
+ * in the resident agent. Thus their stacks are not unwound after freeze.
+ * Threads, created after parking, are still checked via ptrace.
+ */
+int process_park_threads(struct process_ctx_s *ctx,
+			 const uint64_t *ranges, size_t nr_ranges)
+{
+	int try = 0, tries = 25;
+	unsigned timeout_msec = 1;
+	uint64_t begin;
+	ssize_t ret;
+
+	do {
+		if (try) {
+			pr_info("  Some threads run patched code.\n"
+				"  Retry in %d msec\n", timeout_msec);
+
+			usleep(timeout_msec * 1000);
+
+			timeout_msec = increase_timeout(timeout_msec);
+		}
+
+		pr_info("= Parking %d threads by agent...\n", ctx->pid);
+		begin = now_usec();
+
+		ret = service_agent_park(&ctx->service, ranges, nr_ranges,
+					 100, &ctx->parked);
+		if (ret >= 0) {
+			ctx->nr_parked = ret;
+			pr_info("  %ld threads parked in %lu usec\n",
+					ret, now_usec() - begin);
+			return 0;
+		}
+		if (ret != -EAGAIN)
+			return ret;
+	} while (++try < tries);
+
+	pr_err("failed to park threads: Timeout reached\n");
+	return -ETIME;
+}
+
+void process_release_threads(struct process_ctx_s *ctx)
+{
+	if (!ctx->parked)
+		return;
+
+	(void)service_agent_release(&ctx->service);
+
+	free(ctx->parked);
+	ctx->parked = NULL;
+	ctx->nr_parked = 0;
+}
+
 static int process_find_sym(struct process_ctx_s *ctx,
 			    const char *name, uint64_t *addr)
 {
@@ -716,20 +1650,9 @@ static int process_find_dlclose(struct process_ctx_s *ctx, uint64_t *addr)
 static int64_t process_call_dlopen(struct process_ctx_s *ctx,
 				   uint64_t dlopen_addr, const char *soname)
 {
-	void *dlopen_code;
-	ssize_t size;
-	uint64_t code_addr = vma_start(&ctx->remote_vma);
-	uint64_t name_addr = round_up(code_addr + X86_64_CALL_MAX_SIZE, 8);
+	uint64_t name_addr = process_remote_data(ctx);
 	int err;
 
-	size = x86_64_dlopen(dlopen_addr, name_addr,
-			     code_addr,
-			     &dlopen_code);
-	if (size < 0) {
-		pr_err("failed to construct dlopen call\n");
-		return size;
-	}
-
 	err = process_write_data(ctx, name_addr,
 				 soname, round_up(strlen(soname) + 1, 8));
 	if (err) {
@@ -737,18 +1660,15 @@ static int64_t process_call_dlopen(struct process_ctx_s *ctx,
 		return err;
 	}
 
-	return process_exec_code(ctx, code_addr, dlopen_code, size);
+	return process_call(ctx, dlopen_addr, name_addr, 1, 0, 0, 0, 0);
 }
 
-static int __process_do_inject_service(struct process_ctx_s *ctx)
+static int process_dlopen_service(struct process_ctx_s *ctx)
 {
 	int err;
 	uint64_t dlopen_addr = 0;
 	int64_t handle;
 
-	pr_debug("= Injecting service \"%s\" into %d\n",
-			ctx->service.name, ctx->pid);
-
 	err = process_find_dlopen(ctx, &dlopen_addr);
 	if (err)
 		return err;
@@ -763,6 +1683,38 @@ static int __process_do_inject_service(struct process_ctx_s *ctx)
 
 	ctx->service.handle = handle;
 	ctx->service.pid = ctx->pid;
+	return 0;
+}
+
+static int __process_do_inject_service(struct process_ctx_s *ctx)
+{
+	uint64_t begin = now_usec();
+	int err = -ENOTSUP;
+
+	pr_debug("= Injecting service \"%s\" into %d\n",
+			ctx->service.name, ctx->pid);
+
+	err = service_discover(ctx, &ctx->service);
+	if (err < 0)
+		return err;
+	if (err) {
+		pr_info("  Using preloaded service\n");
+		return service_start(ctx, &ctx->service);
+	}
+	err = -ENOTSUP;
+
+	if (ctx->opts.map_service) {
+		err = load_service_elf(ctx, &ctx->service);
+		if (err == -ENOTSUP)
+			pr_info("  Service can't be mapped, using dlopen\n");
+	}
+
+	if (err == -ENOTSUP)
+		err = process_dlopen_service(ctx);
+	if (err)
+		return err;
+
+	pr_info("  Service injected in %lu usec\n", now_usec() - begin);
 
 	err = service_start(ctx, &ctx->service);
 	if (err)
@@ -779,19 +1731,7 @@ int process_inject_service(struct process_ctx_s *ctx)
 static int64_t process_call_dlclose(struct process_ctx_s *ctx,
 				    uint64_t dlclose_addr, uint64_t handle)
 {
-	void *dlclose_code;
-	ssize_t size;
-	uint64_t code_addr = vma_start(&ctx->remote_vma);
-
-	size = x86_64_dlclose(dlclose_addr, handle,
-			      code_addr,
-			      &dlclose_code);
-	if (size < 0) {
-		pr_err("failed to construct dlclose call\n");
-		return size;
-	}
-
-	return process_exec_code(ctx, code_addr, dlclose_code, size);
+	return process_call(ctx, dlclose_addr, handle, 0, 0, 0, 0, 0);
 }
 
 int process_shutdown_service(struct process_ctx_s *ctx)
@@ -809,6 +1749,22 @@ int process_shutdown_service(struct process_ctx_s *ctx)
 	if (err)
 		return err;
 
+	/* Resident agent thread runs library code */
+	if (ctx->service.resident || ctx->service.preloaded) {
+		ctx->service.handle = 0;
+		return 0;
+	}
+
+	if (ctx->service.image) {
+		err = unload_service_elf(ctx, &ctx->service);
+		if (err) {
+			pr_err("failed to unload nsb service\n");
+			return err;
+		}
+		ctx->service.handle = 0;
+		return 0;
+	}
+
 	err = process_find_dlclose(ctx, &dlclose_addr);
 	if (err)
 		return err;
@@ -848,6 +1804,9 @@ static ssize_t process_needed_list(struct process_ctx_s *ctx, uint64_t **needed_
 	if (ctx->service.loaded)
 		return service_needed_array(ctx, &ctx->service, needed_array);
 
+	if (ctx->service.agent_sock >= 0)
+		return service_agent_needed_array(&ctx->service, needed_array);
+
 	err = process_find_sym(ctx, "_r_debug", &_r_debug_addr);
 	if (err)
 		return err;
@@ -861,6 +1820,10 @@ int process_collect_needed(struct process_ctx_s *ctx)
 	ssize_t nr, i;
 	uint64_t *needed_array;
 
+	/* Loader may need the list before the service is injected */
+	if (!list_empty(&ctx->needed_list))
+		return 0;
+
 	pr_debug("= Process soname search list:\n");
 
 	nr = process_needed_list(ctx, &needed_array);
@@ -923,6 +1886,10 @@ static int check_vzpatch(const struct dl_map *dlm, void *data)
 	if (err)
 		return err;
 
+	/* Retired patch is kept mapped, but it's not applied */
+	if (!patch)
+		return 0;
+
 	list_add_tail(&patch->list, &ctx->applied_patches);
 	return 0;
 }
@@ -995,6 +1962,37 @@ static int find_hole(struct vma_area *vma, void *data)
 	return (vma_start(next_vma(vma)) - hole->address) >= hole->size;
 }
 
+/*
+ * New ELF mappings have to be taken into account, when the next one is
+ * placed.
+ */
+int process_reserve_dl_map(struct process_ctx_s *ctx, const struct dl_map *dlm)
+{
+	const struct vma_area *vma;
+	struct vma_area *rv;
+	int err;
+
+	list_for_each_entry(vma, &dlm->vmas, dl) {
+		rv = xzalloc(sizeof(*rv));
+		if (!rv)
+			return -ENOMEM;
+
+		rv->addr = vma->addr;
+		rv->length = vma->length;
+		rv->flags = vma->flags;
+		rv->prot = vma->prot;
+		rv->offset = vma->offset;
+		INIT_LIST_HEAD(&rv->dl);
+
+		err = add_vma_sorted(&ctx->vmas, rv);
+		if (err) {
+			free(rv);
+			return err;
+		}
+	}
+	return 0;
+}
+
 int64_t process_find_place_for_elf(struct process_ctx_s *ctx,
 				   uint64_t hint, size_t size)
 {
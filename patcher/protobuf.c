@@ -23,13 +23,38 @@ static struct func_jump_s *create_funcjump(const FuncJump *fj)
 
 	func_jump->name = strdup(fj->name);
 	if (!func_jump->name)
-		return NULL;
+		goto free_func_jump;
 
 	func_jump->func_value = fj->func_value;
 	func_jump->func_size = fj->func_size;
 	func_jump->patch_value = fj->patch_value;
 	func_jump->shndx = fj->shndx;
+
+	if (fj->n_variants) {
+		size_t i;
+
+		func_jump->variants = xmalloc(sizeof(*func_jump->variants) *
+					      (fj->n_variants + 1));
+		if (!func_jump->variants)
+			goto free_name;
+
+		func_jump->variants[0].patch_value = fj->patch_value;
+		func_jump->variants[0].features = 0;
+		for (i = 0; i < fj->n_variants; i++) {
+			func_jump->variants[i + 1].patch_value =
+						fj->variants[i]->patch_value;
+			func_jump->variants[i + 1].features =
+						fj->variants[i]->features;
+		}
+		func_jump->n_variants = fj->n_variants + 1;
+	}
 	return func_jump;
+
+free_name:
+	free(func_jump->name);
+free_func_jump:
+	free(func_jump);
+	return NULL;
 }
 
 static int set_patch_func_jumps(struct patch_info_s *patch_info, BinPatch *bp)
@@ -197,3 +222,42 @@ free_target_bid:
 	free(patch_info->target_bid);
 	goto free_unpacked;
 }
+
+static void free_funcjump(struct func_jump_s *fj)
+{
+	free(fj->name);
+	free(fj->variants);
+	free(fj->inplace_code);
+	free(fj->call_sites);
+	free(fj->got_slots);
+	free(fj->data_ptrs);
+	free(fj);
+}
+
+static void free_ptr_array(void **array, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		free(array[i]);
+	free(array);
+}
+
+void free_protobuf_binpatch(struct patch_info_s *patch_info)
+{
+	size_t i;
+
+	for (i = 0; i < patch_info->n_func_jumps; i++)
+		free_funcjump(patch_info->func_jumps[i]);
+	free(patch_info->func_jumps);
+
+	free_ptr_array((void **)patch_info->manual_syms,
+		       patch_info->n_manual_syms);
+	free_ptr_array((void **)patch_info->global_syms,
+		       patch_info->n_global_syms);
+	free_ptr_array((void **)patch_info->static_syms,
+		       patch_info->n_static_syms);
+
+	free(patch_info->patch_bid);
+	free(patch_info->target_bid);
+}
@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+
+#include "include/relax.h"
+#include "include/context.h"
+#include "include/process.h"
+#include "include/dl_map.h"
+#include "include/elf.h"
+#include "include/x86_64.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+
+/*
+ * Patch code reaches target symbols via GOT (loads) and PLT (calls). When the
+ * symbols are resolved and the patch is placed, the references are relaxed
+ * the same way, as static linker does for GOTPCRELX relocations:
+ *
+ *   mov foo@GOTPCREL(%rip), %reg  --->  lea foo(%rip), %reg
+ *   call *foo@GOTPCREL(%rip)      --->  addr32 call foo
+ *   jmp *foo@GOTPCREL(%rip)       --->  jmp foo; nop
+ *   call foo@plt                  --->  call foo
+ *
+ * Instructions are found by linear sweep of the patch functions in the patch
+ * file, so GOT and PLT themselves stay valid for anything else.
+ */
+struct relax_slot {
+	uint64_t		slot;
+	uint64_t		value;
+};
+
+struct relax_section {
+	uint64_t		addr;
+	const uint8_t		*code;
+	size_t			size;
+};
+
+struct relax_scan {
+	struct process_ctx_s	*ctx;
+	uint64_t		base;
+
+	struct relax_slot	*slots;
+	size_t			nr_slots;
+
+	struct relax_section	*secs;
+	size_t			nr_secs;
+
+	size_t			nr_loads;
+	size_t			nr_calls;
+};
+
+#define X86_JMP_REL32		0xe9
+#define X86_LEA			0x8d
+#define X86_MOV_LOAD		0x8b
+#define X86_ADDR32		0x67
+#define X86_NOP			0x90
+#define X86_ENDBR64		"\xf3\x0f\x1e\xfa"
+
+/* Relaxed instructions are 6 bytes long from the opcode */
+#define RELAX_INSN_SIZE		6
+
+static int compare_slots(const void *a, const void *b)
+{
+	const struct relax_slot *sa = a, *sb = b;
+
+	return (sa->slot > sb->slot) - (sa->slot < sb->slot);
+}
+
+static int add_relax_slots(struct relax_scan *rs, const struct list_head *head,
+			   uint32_t type)
+{
+	struct process_ctx_s *ctx = rs->ctx;
+	struct extern_symbol *es;
+
+	list_for_each_entry(es, head, list) {
+		const struct dl_map *dlm = es->dlm ? es->dlm : PDLM(ctx);
+
+		if (es_r_type(es) != type)
+			continue;
+
+		if (xrealloc_safe(&rs->slots, sizeof(*rs->slots) * (rs->nr_slots + 1)))
+			return -ENOMEM;
+
+		rs->slots[rs->nr_slots].slot = es_r_offset(es);
+		rs->slots[rs->nr_slots].value = dlm_load_base(dlm) + es->address;
+		rs->nr_slots++;
+	}
+	return 0;
+}
+
+static const struct relax_slot *find_relax_slot(const struct relax_scan *rs,
+						uint64_t slot)
+{
+	const struct relax_slot key = {
+		.slot = slot,
+	};
+
+	return bsearch(&key, rs->slots, rs->nr_slots, sizeof(*rs->slots),
+		       compare_slots);
+}
+
+static int add_relax_section(uint64_t addr, const uint8_t *code, size_t size,
+			     void *data)
+{
+	struct relax_scan *rs = data;
+
+	if (xrealloc_safe(&rs->secs, sizeof(*rs->secs) * (rs->nr_secs + 1)))
+		return -ENOMEM;
+
+	rs->secs[rs->nr_secs].addr = addr;
+	rs->secs[rs->nr_secs].code = code;
+	rs->secs[rs->nr_secs].size = size;
+	rs->nr_secs++;
+	return 0;
+}
+
+static const struct relax_section *find_relax_section(const struct relax_scan *rs,
+						      uint64_t addr)
+{
+	size_t i;
+
+	for (i = 0; i < rs->nr_secs; i++) {
+		const struct relax_section *sec = &rs->secs[i];
+
+		if ((addr >= sec->addr) && (addr < sec->addr + sec->size))
+			return sec;
+	}
+	return NULL;
+}
+
+static int32_t insn_rel32(const uint8_t *code, uint8_t off)
+{
+	int32_t rel;
+
+	memcpy(&rel, code + off, sizeof(rel));
+	return rel;
+}
+
+static bool rel32_reachable(uint64_t next_ip, uint64_t tgt, int32_t *rel)
+{
+	int64_t delta = tgt - next_ip;
+
+	if ((delta < INT32_MIN) || (delta > INT32_MAX))
+		return false;
+
+	*rel = delta;
+	return true;
+}
+
+/* PLT entry starts with "jmp *slot(%rip)", optionally after endbr64 */
+static const struct relax_slot *plt_relax_slot(const struct relax_scan *rs,
+					       uint64_t addr)
+{
+	const struct relax_section *sec;
+	struct x86_insn insn;
+	const uint8_t *code;
+	int len;
+
+	sec = find_relax_section(rs, addr);
+	if (!sec)
+		return NULL;
+
+	code = sec->code + (addr - sec->addr);
+	if ((sec->addr + sec->size - addr > 4) &&
+	    !memcmp(code, X86_ENDBR64, 4)) {
+		code += 4;
+		addr += 4;
+	}
+
+	len = x86_insn_decode(code, sec->addr + sec->size - addr, &insn);
+	if ((len < 0) || insn.map || (insn.opcode != 0xff) || !insn.rip_rel ||
+	    (((code[insn.modrm_off] >> 3) & 0x07) != 4))
+		return NULL;
+
+	return find_relax_slot(rs, addr + len + insn_rel32(code, insn.disp_off));
+}
+
+/*
+ * Instruction is written by two overlapping halves: relocations are 4 or 8
+ * bytes long, and the bytes after the instruction can be relocated too.
+ */
+static int relax_write(struct relax_scan *rs, uint64_t addr, const uint8_t *insn)
+{
+	struct process_ctx_s *ctx = rs->ctx;
+	uint32_t value;
+	int err;
+
+	memcpy(&value, insn, sizeof(value));
+	err = process_write_reloc(ctx, PDLM(ctx), rs->base + addr, value,
+				  sizeof(value));
+	if (err)
+		return err;
+
+	memcpy(&value, insn + RELAX_INSN_SIZE - sizeof(value), sizeof(value));
+	return process_write_reloc(ctx, PDLM(ctx),
+				   rs->base + addr + RELAX_INSN_SIZE - sizeof(value),
+				   value, sizeof(value));
+}
+
+static int relax_got_ref(struct relax_scan *rs, uint64_t ip, const uint8_t *code,
+			 const struct x86_insn *insn)
+{
+	const struct relax_slot *rsl;
+	uint8_t chunk[RELAX_INSN_SIZE];
+	uint64_t next_ip = ip + insn->length;
+	uint64_t op = ip + insn->opcode_off;
+	uint8_t reg = (code[insn->modrm_off] >> 3) & 0x07;
+	bool rex = insn->opcode_off && ((code[insn->opcode_off - 1] & 0xf0) == 0x40);
+	int32_t rel;
+
+	rsl = find_relax_slot(rs, next_ip + insn_rel32(code, insn->disp_off));
+	if (!rsl)
+		return 0;
+
+	if (insn->length - insn->opcode_off != RELAX_INSN_SIZE)
+		return 0;
+	memcpy(chunk, code + insn->opcode_off, sizeof(chunk));
+
+	switch (insn->opcode) {
+	case X86_MOV_LOAD:
+		/* Only 64 bit loads of the address */
+		if (!rex || !(code[insn->opcode_off - 1] & 0x08))
+			return 0;
+		if (!rel32_reachable(rs->base + next_ip, rsl->value, &rel))
+			return 0;
+		chunk[0] = X86_LEA;
+		memcpy(chunk + insn->disp_off - insn->opcode_off, &rel, sizeof(rel));
+		rs->nr_loads++;
+		break;
+	case 0xff:
+		if (rex || ((reg != 2) && (reg != 4)))
+			return 0;
+		if (reg == 2) {
+			if (!rel32_reachable(rs->base + next_ip, rsl->value, &rel))
+				return 0;
+			chunk[0] = X86_ADDR32;
+			chunk[1] = X86_CALL_REL32;
+			memcpy(chunk + 2, &rel, sizeof(rel));
+		} else {
+			if (!rel32_reachable(rs->base + op + 5, rsl->value, &rel))
+				return 0;
+			chunk[0] = X86_JMP_REL32;
+			memcpy(chunk + 1, &rel, sizeof(rel));
+			chunk[5] = X86_NOP;
+		}
+		rs->nr_calls++;
+		break;
+	default:
+		return 0;
+	}
+
+	pr_debug("    %#lx: GOT slot %#lx ---> %#lx\n", rs->base + ip,
+			rs->base + rsl->slot, rsl->value);
+	return relax_write(rs, op, chunk);
+}
+
+static int relax_plt_call(struct relax_scan *rs, uint64_t ip, const uint8_t *code,
+			  const struct x86_insn *insn)
+{
+	const struct relax_slot *rsl;
+	uint64_t next_ip = ip + insn->length;
+	uint64_t field = ip + insn->imm_off;
+	int32_t rel;
+
+	rsl = plt_relax_slot(rs, next_ip + insn_rel32(code, insn->imm_off));
+	if (!rsl)
+		return 0;
+
+	if (!rel32_reachable(rs->base + next_ip, rsl->value, &rel))
+		return 0;
+
+	pr_debug("    %#lx: PLT slot %#lx ---> %#lx\n", rs->base + ip,
+			rs->base + rsl->slot, rsl->value);
+	rs->nr_calls++;
+
+	return process_write_reloc(rs->ctx, PDLM(rs->ctx), rs->base + field,
+				   (uint32_t)rel, sizeof(rel));
+}
+
+static int relax_function(struct relax_scan *rs, const struct elf_func *fn)
+{
+	const struct relax_section *sec;
+	const uint8_t *code;
+	struct x86_insn insn;
+	uint64_t ip, end;
+	int len, err;
+
+	sec = find_relax_section(rs, fn->value);
+	if (!sec)
+		return 0;
+
+	end = fn->value + fn->size;
+	if (end > sec->addr + sec->size)
+		end = sec->addr + sec->size;
+
+	for (ip = fn->value; ip < end; ip += len) {
+		code = sec->code + (ip - sec->addr);
+
+		len = x86_insn_decode(code, end - ip, &insn);
+		if (len < 0) {
+			pr_debug("    failed to decode %#lx: skipping the rest "
+				 "of function\n", ip);
+			return 0;
+		}
+
+		if (insn.map)
+			continue;
+
+		if (insn.rip_rel)
+			err = relax_got_ref(rs, ip, code, &insn);
+		else if ((insn.opcode == X86_CALL_REL32) ||
+			 (insn.opcode == X86_JMP_REL32))
+			err = relax_plt_call(rs, ip, code, &insn);
+		else
+			err = 0;
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int relax_got_refs(struct process_ctx_s *ctx)
+{
+	struct relax_scan rs = {
+		.ctx = ctx,
+		.base = dlm_load_base(PDLM(ctx)),
+	};
+	struct elf_func *funcs = NULL;
+	ssize_t nr_funcs, i;
+	int err;
+
+	pr_info("= Relax GOT and PLT references:\n");
+
+	err = add_relax_slots(&rs, &P(ctx)->rela_dyn, R_X86_64_GLOB_DAT);
+	if (!err)
+		err = add_relax_slots(&rs, &P(ctx)->rela_plt, R_X86_64_JUMP_SLOT);
+	if (err)
+		goto free;
+
+	if (!rs.nr_slots)
+		goto free;
+	qsort(rs.slots, rs.nr_slots, sizeof(*rs.slots), compare_slots);
+
+	err = elf_iterate_exec_sections(P(ctx)->ei, add_relax_section, &rs);
+	if (err)
+		goto free;
+
+	nr_funcs = elf_functions(P(ctx)->ei, &funcs);
+	if (nr_funcs < 0) {
+		pr_warn("failed to collect functions of %s: not relaxed\n",
+				P(ctx)->path);
+		goto free;
+	}
+
+	for (i = 0; i < nr_funcs; i++) {
+		err = relax_function(&rs, &funcs[i]);
+		if (err)
+			goto free;
+	}
+
+	pr_info("  Relaxed %lu loads and %lu calls\n", rs.nr_loads, rs.nr_calls);
+
+free:
+	free(funcs);
+	free(rs.secs);
+	free(rs.slots);
+	return err;
+}
@@ -1,3 +1,7 @@
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+
 #include "include/relocations.h"
 #include "include/list.h"
 #include "include/log.h"
@@ -6,6 +10,10 @@
 #include "include/context.h"
 #include "include/vma.h"
 #include "include/dl_map.h"
+#include "include/service.h"
+#include "include/xmalloc.h"
+#include "include/compiler.h"
+#include "include/plan.h"
 
 static void print_relocation(const struct list_head *head, const char *name)
 {
@@ -30,11 +38,11 @@ int collect_relocations(struct process_ctx_s *ctx)
 
 	pr_debug("= Collect relocations:\n");
 
-	err = elf_rela_plt(ctx->patch_ei, &P(ctx)->rela_plt);
+	err = elf_rela_plt(P(ctx)->ei, &P(ctx)->rela_plt);
 	if (!err)
 		print_relocation(&P(ctx)->rela_plt, ".rela.plt");
 
-	err = elf_rela_dyn(ctx->patch_ei, &P(ctx)->rela_dyn);
+	err = elf_rela_dyn(P(ctx)->ei, &P(ctx)->rela_dyn);
 	if (!err)
 		print_relocation(&P(ctx)->rela_plt, ".rela.plt");
 
@@ -117,8 +125,8 @@ static int target_is_executable(const struct process_ctx_s *ctx)
 				       typeof(struct ctx_dep), list)->dlm;
 }
 
-static int64_t find_dyn_sym(const struct process_ctx_s *ctx,
-			    struct extern_symbol *es)
+static int64_t find_marked_sym(const struct process_ctx_s *ctx,
+			       struct extern_symbol *es)
 {
 	int64_t value;
 
@@ -126,11 +134,20 @@ static int64_t find_dyn_sym(const struct process_ctx_s *ctx,
 	if (value)
 		return value;
 
-	if (target_is_executable(ctx)) {
-		value = check_global_symbols(ctx, es);
-		if (value)
-			return value;
-	}
+	if (target_is_executable(ctx))
+		return check_global_symbols(ctx, es);
+
+	return 0;
+}
+
+static int64_t find_dyn_sym(const struct process_ctx_s *ctx,
+			    struct extern_symbol *es)
+{
+	int64_t value;
+
+	value = find_marked_sym(ctx, es);
+	if (value)
+		return value;
 
 	value = __find_dym_sym(&ctx->needed_list, TDLM(ctx), es, es_s_value(es));
 	if (value != -ENOENT)
@@ -139,17 +156,123 @@ static int64_t find_dyn_sym(const struct process_ctx_s *ctx,
 	return __find_dym_sym(&ctx->needed_list, NULL, es, es_s_value(es));
 }
 
-static int resolve_symbol(const struct process_ctx_s *ctx, struct extern_symbol *es)
+struct ifunc_search {
+	const struct process_ctx_s	*ctx;
+	const struct dl_map		*dlm;
+	const struct dl_map		*def_dlm;
+	const char			*name;
+	const char			*version;
+	uint64_t			resolver;
+	uint64_t			value;
+};
+
+static int find_ifunc_slot(const struct elf_dyn_reloc *r, void *data)
 {
+	struct ifunc_search *is = data;
+	uint64_t base = dlm_load_base(is->dlm);
+	uint64_t value;
 	int err;
-	int64_t value;
 
-	value = find_dyn_sym(ctx, es);
-	if (value < 0) {
-		pr_err("failed to find dynamic symbol %s\n", es->name);
-		return value;
+	switch (r->type) {
+		case R_X86_64_IRELATIVE:
+			if ((is->dlm != is->def_dlm) || (r->addend != is->resolver))
+				return 0;
+			break;
+		case R_X86_64_JUMP_SLOT:
+			/* Can be not bound yet */
+			if (is->dlm == is->def_dlm)
+				return 0;
+			/* fall through */
+		case R_X86_64_GLOB_DAT:
+		case R_X86_64_64:
+			if (!r->name || strcmp(r->name, is->name))
+				return 0;
+			if (is->version && r->version &&
+			    strcmp(r->version, is->version))
+				return 0;
+			break;
+		default:
+			return 0;
 	}
 
+	err = process_read_data(is->ctx, base + r->offset, &value, sizeof(value));
+	if (err)
+		return err;
+
+	if (r->type == R_X86_64_64)
+		value -= r->addend;
+
+	/* Not bound lazy slots and interposed symbols point elsewhere */
+	if ((value < dl_map_start(is->def_dlm)) ||
+	    (value >= dl_map_end(is->def_dlm)))
+		return 0;
+
+	if (value == dlm_load_base(is->def_dlm) + is->resolver)
+		return 0;
+
+	is->value = value;
+	return 1;
+}
+
+/*
+ * Indirect function is bound to the implementation, chosen by its resolver.
+ * The one, the process already uses, is read from the slots, relocated by
+ * dynamic linker: IRELATIVE ones of the defining object, or the ones of any
+ * object, referring the symbol by name and version. If there are no such
+ * slots, the resolver is called in the process (the process has to be
+ * stopped).
+ */
+static int resolve_ifunc(struct process_ctx_s *ctx,
+			 const struct extern_symbol *es, const char *version,
+			 int64_t *value)
+{
+	struct ifunc_search is = {
+		.ctx = ctx,
+		.def_dlm = es->dlm,
+		.name = es->name,
+		.version = version,
+		.resolver = *value,
+	};
+	uint64_t base = dlm_load_base(es->dlm);
+	const struct ctx_dep *n;
+	int64_t addr;
+	int err;
+
+	list_for_each_entry(n, &ctx->needed_list, list) {
+		is.dlm = n->dlm;
+
+		err = elf_iterate_dyn_relocs(n->dlm->ei, find_ifunc_slot, &is);
+		if (err < 0)
+			return err;
+		if (err) {
+			pr_debug("    indirect %s: %#lx (bound in %s)\n",
+					es->name, is.value, n->dlm->path);
+			*value = is.value - base;
+			return 0;
+		}
+	}
+
+	if (!ctx->trampoline) {
+		pr_err("indirect function %s is not bound in process %d\n",
+				es->name, ctx->pid);
+		return -ENOTSUP;
+	}
+
+	addr = process_call(ctx, base + is.resolver, 0, 0, 0, 0, 0, 0);
+	if (addr <= 0) {
+		pr_err("failed to call resolver of \"%s\"\n", es->name);
+		return addr ? addr : -EFAULT;
+	}
+
+	pr_debug("    indirect %s: %#lx (resolver call)\n", es->name, addr);
+	*value = addr - base;
+	return 0;
+}
+
+static int relocate_symbol(struct extern_symbol *es, int64_t value)
+{
+	int err;
+
 	err = elf_reloc_sym(es, value);
 	if (err < 0) {
 		pr_err("failed to relocate dynamic symbol %s\n", es->name);
@@ -159,6 +282,59 @@ static int resolve_symbol(const struct process_ctx_s *ctx, struct extern_symbol
 	return 0;
 }
 
+/*
+ * Versioned symbol can have several resolvers in the defining object: the
+ * one of the required version is used.
+ */
+static int symbol_ifunc(const struct extern_symbol *es, const char *version,
+			int64_t *value)
+{
+	bool ifunc = false;
+	int64_t resolver;
+
+	if (!version)
+		return elf_dyn_sym_ifunc(es->dlm->ei, es->name);
+
+	resolver = elf_dyn_sym_value_version(es->dlm->ei, es->name, version,
+					     &ifunc);
+	if (resolver < 0)
+		return resolver;
+	if (!resolver)
+		return elf_dyn_sym_ifunc(es->dlm->ei, es->name);
+
+	if (ifunc)
+		*value = resolver;
+	return ifunc;
+}
+
+static int resolve_symbol(struct process_ctx_s *ctx, struct extern_symbol *es)
+{
+	const char *version;
+	int64_t value;
+	int ret;
+
+	value = find_dyn_sym(ctx, es);
+	if (value < 0) {
+		pr_err("failed to find dynamic symbol %s\n", es->name);
+		return value;
+	}
+
+	if (es->dlm) {
+		version = elf_es_version(P(ctx)->ei, es);
+
+		ret = symbol_ifunc(es, version, &value);
+		if (ret < 0)
+			return ret;
+		if (ret) {
+			ret = resolve_ifunc(ctx, es, version, &value);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return relocate_symbol(es, value);
+}
+
 static void print_resolution(struct process_ctx_s *ctx,
 			     const struct list_head *head, const char *name)
 {
@@ -178,7 +354,7 @@ static void print_resolution(struct process_ctx_s *ctx,
 				((es->dlm) ? es->dlm->path : TDLM(ctx)->path));
 }
 
-static int resolve_es(const struct process_ctx_s *ctx, struct extern_symbol *es)
+static int resolve_es(struct process_ctx_s *ctx, struct extern_symbol *es)
 {
 	int err;
 
@@ -195,6 +371,123 @@ static int resolve_es(const struct process_ctx_s *ctx, struct extern_symbol *es)
 	return 0;
 }
 
+static int needed_index(const struct process_ctx_s *ctx,
+			const struct dl_map *dlm)
+{
+	const struct ctx_dep *n;
+	int idx = 0;
+
+	list_for_each_entry(n, &ctx->needed_list, list) {
+		if (n->dlm == dlm)
+			return idx;
+		idx++;
+	}
+	return -1;
+}
+
+static const struct dl_map *needed_dlm(const struct process_ctx_s *ctx, int idx)
+{
+	const struct ctx_dep *n;
+
+	list_for_each_entry(n, &ctx->needed_list, list) {
+		if (!idx--)
+			return n->dlm;
+	}
+	return NULL;
+}
+
+static int set_service_resolution(const struct process_ctx_s *ctx,
+				  struct extern_symbol *es,
+				  const struct service_sym *sym)
+{
+	int64_t value;
+
+	switch (sym->ret) {
+		case 0:
+			es->dlm = needed_dlm(ctx, sym->idx);
+			if (!es->dlm) {
+				pr_err("symbol %s is found in unknown object %d\n",
+						es->name, sym->idx);
+				return -EINVAL;
+			}
+			value = sym->value;
+			break;
+		case 1:
+			/* Target library is reached: symbol is in the patch */
+			es->dlm = NULL;
+			value = es_s_value(es);
+			break;
+		default:
+			pr_err("failed to find dynamic symbol %s\n", es->name);
+			return sym->ret;
+	}
+
+	return relocate_symbol(es, value);
+}
+
+/*
+ * With service loaded symbols are looked up in the process by the service in
+ * one go, instead of parsing the dependences symbol tables.
+ */
+static int resolve_relocations_service(struct process_ctx_s *ctx)
+{
+	struct list_head *lists[] = { &P(ctx)->rela_plt, &P(ctx)->rela_dyn };
+	struct extern_symbol **ess = NULL, *es, *tmp;
+	struct service_sym *syms = NULL;
+	size_t nr = 0, i;
+	int64_t value;
+	int l, err = 0;
+
+	for (l = 0; l < ARRAY_SIZE(lists); l++) {
+		list_for_each_entry_safe(es, tmp, lists[l], list) {
+			if (elf_weak_sym(es) && (es_s_value(es) == 0)) {
+				list_del(&es->list);
+				continue;
+			}
+
+			value = find_marked_sym(ctx, es);
+			if (value) {
+				err = relocate_symbol(es, value);
+				if (err)
+					goto free;
+				continue;
+			}
+
+			if (xrealloc_safe(&syms, sizeof(*syms) * (nr + 1)) ||
+			    xrealloc_safe(&ess, sizeof(*ess) * (nr + 1))) {
+				err = -ENOMEM;
+				goto free;
+			}
+
+			ess[nr] = es;
+			syms[nr].name = es->name;
+			syms[nr].version = elf_es_version(P(ctx)->ei, es);
+			syms[nr].stop = !!es_s_value(es);
+			nr++;
+		}
+	}
+
+	if (nr) {
+		err = service_resolve_syms(ctx, &ctx->service,
+					   needed_index(ctx, TDLM(ctx)), syms, nr);
+		if (err)
+			goto free;
+	}
+
+	for (i = 0; i < nr; i++) {
+		err = set_service_resolution(ctx, ess[i], &syms[i]);
+		if (err) {
+			pr_err("failed to resolve %s symbol\n", ess[i]->name);
+			goto free;
+		}
+	}
+
+free:
+	free(syms);
+	free(ess);
+	return err;
+}
+
 int resolve_relocations(struct process_ctx_s *ctx)
 {
 	int err;
@@ -202,6 +495,13 @@ int resolve_relocations(struct process_ctx_s *ctx)
 
 	pr_debug("= Resolve relocations:\n");
 
+	if (ctx->service.loaded) {
+		err = resolve_relocations_service(ctx);
+		if (err)
+			return err;
+		goto print;
+	}
+
 	list_for_each_entry_safe(es, tmp, &P(ctx)->rela_plt, list) {
 		err = resolve_es(ctx, es);
 		if (err)
@@ -214,12 +514,13 @@ int resolve_relocations(struct process_ctx_s *ctx)
 			return err;
 	}
 
+print:
 	print_resolution(ctx, &P(ctx)->rela_plt, ".rela.plt");
 	print_resolution(ctx, &P(ctx)->rela_dyn, ".rela.dyn");
 	return 0;
 }
 
-static int apply_es(const struct process_ctx_s *ctx, struct extern_symbol *es)
+static int apply_es(struct process_ctx_s *ctx, struct extern_symbol *es)
 {
 	int err;
 	uint64_t plt_addr;
@@ -236,7 +537,8 @@ static int apply_es(const struct process_ctx_s *ctx, struct extern_symbol *es)
 			((es->dlm) ? es->dlm->path : TDLM(ctx)->path),
 			es->address);
 
-	err = process_write_data(ctx, plt_addr, &func_addr, sizeof(func_addr));
+	err = process_write_reloc(ctx, PDLM(ctx), plt_addr, func_addr,
+				  sizeof(func_addr));
 	if (err) {
 		pr_err("failed to write to addr %#lx in process %d\n",
 				plt_addr, ctx->pid);
@@ -273,3 +575,46 @@ int apply_relocations(struct process_ctx_s *ctx)
 	}
 	return 0;
 }
+
+static int find_irelative(const struct elf_dyn_reloc *r, void *data)
+{
+	return r->type == R_X86_64_IRELATIVE;
+}
+
+static int apply_irelative(const struct elf_dyn_reloc *r, void *data)
+{
+	struct process_ctx_s *ctx = data;
+	uint64_t base = dlm_load_base(PDLM(ctx));
+	uint64_t slot = base + r->offset;
+	int64_t value;
+
+	if (r->type != R_X86_64_IRELATIVE)
+		return 0;
+
+	value = process_call(ctx, base + r->addend, 0, 0, 0, 0, 0, 0);
+	if (value <= 0) {
+		pr_err("failed to call resolver %#lx\n", base + r->addend);
+		return value ? value : -EFAULT;
+	}
+
+	pr_debug("      IRELATIVE:  %#012lx  %#012lx (resolver %#lx)\n",
+			slot, value, base + r->addend);
+
+	return process_write_data(ctx, slot, &value, sizeof(value));
+}
+
+/*
+ * Indirect functions of the patch are bound by calling their resolvers in
+ * the process, when the rest of the patch is relocated: resolvers can use
+ * its GOT.
+ */
+int apply_irelative_relocations(struct process_ctx_s *ctx)
+{
+	if (plan_recording(ctx->plan) &&
+	    elf_iterate_dyn_relocs(P(ctx)->ei, find_irelative, NULL)) {
+		pr_err("patch indirect functions can't be planned\n");
+		return -ENOTSUP;
+	}
+
+	return elf_iterate_dyn_relocs(P(ctx)->ei, apply_irelative, ctx);
+}
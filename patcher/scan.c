@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "include/scan.h"
+#include "include/context.h"
+#include "include/elf.h"
+#include "include/protobuf.h"
+#include "include/vma.h"
+#include "include/util.h"
+#include "include/log.h"
+#include "include/xmalloc.h"
+#include "include/compiler.h"
+
+#define SCAN_BUCKETS		4096
+
+/*
+ * Mapped file. Files are identified by device and inode from
+ * /proc/<pid>/maps, so each file is read only once, no matter how many
+ * processes map it.
+ */
+struct scan_file_s {
+	struct list_head	hash;
+	dev_t			dev;
+	ino_t			ino;
+	char			*path;
+	char			*bid;
+	char			*target_bid;
+	pid_t			*pids;
+	int			nr_pids;
+};
+
+struct scan_s {
+	const char		*target_bid;
+	struct log_thread_s	log;
+
+	pthread_mutex_t		lock;
+	struct list_head	files[SCAN_BUCKETS];
+	int			nr_files;
+
+	pid_t			*pids;
+	int			nr_pids;
+	int			next;
+};
+
+static struct list_head *scan_bucket(struct scan_s *s, dev_t dev, ino_t ino)
+{
+	return &s->files[(dev ^ ino) % SCAN_BUCKETS];
+}
+
+static struct scan_file_s *scan_lookup(struct scan_s *s, dev_t dev, ino_t ino)
+{
+	struct scan_file_s *sf;
+
+	list_for_each_entry(sf, scan_bucket(s, dev, ino), hash) {
+		if ((sf->dev == dev) && (sf->ino == ino))
+			return sf;
+	}
+	return NULL;
+}
+
+static char *patch_target_bid(const char *path)
+{
+	struct patch_info_s pi = { };
+	struct elf_info_s *ei;
+	char *bid = NULL;
+
+	if (elf_create_info(path, &ei))
+		return NULL;
+
+	if (!elf_info_binpatch(&pi, ei)) {
+		bid = pi.target_bid;
+		pi.target_bid = NULL;
+		free_protobuf_binpatch(&pi);
+	}
+
+	elf_destroy_info(ei);
+	return bid;
+}
+
+/*
+ * File is read without the lock held. If another worker has read the same
+ * file in the meantime, the new one is dropped.
+ */
+static struct scan_file_s *scan_read_file(pid_t pid, const struct vma_area *vma)
+{
+	struct scan_file_s *sf;
+	char map_file[PATH_MAX];
+	const char *path;
+	int patch = 0;
+
+	sf = xzalloc(sizeof(*sf));
+	if (!sf)
+		return NULL;
+
+	sf->dev = vma->dev;
+	sf->ino = vma->ino;
+	sf->path = xstrdup(vma->path);
+	if (!sf->path)
+		goto free_sf;
+
+	snprintf(map_file, sizeof(map_file), "/proc/%d/map_files/%lx-%lx",
+			pid, vma_start(vma), vma_end(vma));
+	path = access(map_file, F_OK) ? vma->path : map_file;
+
+	/* Not an ELF file, or not accessible: remembered without Build ID */
+	if (elf_peek(path, &sf->bid, &patch))
+		return sf;
+
+	if (patch && sf->bid)
+		sf->target_bid = patch_target_bid(path);
+
+	return sf;
+
+free_sf:
+	free(sf);
+	return NULL;
+}
+
+static void scan_free_file(struct scan_file_s *sf)
+{
+	free(sf->pids);
+	free(sf->target_bid);
+	free(sf->bid);
+	free(sf->path);
+	free(sf);
+}
+
+static int scan_add_pid(struct scan_file_s *sf, pid_t pid)
+{
+	/* Files are scanned process by process */
+	if (sf->nr_pids && (sf->pids[sf->nr_pids - 1] == pid))
+		return 0;
+
+	if (xrealloc_safe(&sf->pids, sizeof(*sf->pids) * (sf->nr_pids + 1)))
+		return -ENOMEM;
+
+	sf->pids[sf->nr_pids++] = pid;
+	return 0;
+}
+
+static int scan_vma(pid_t pid, const struct vma_area *vma, void *data)
+{
+	struct scan_s *s = data;
+	struct scan_file_s *sf, *new;
+	int err;
+
+	if (!vma->path || (vma->path[0] != '/') || !vma->ino)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+	sf = scan_lookup(s, vma->dev, vma->ino);
+	if (sf) {
+		err = scan_add_pid(sf, pid);
+		pthread_mutex_unlock(&s->lock);
+		return err;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	new = scan_read_file(pid, vma);
+	if (!new)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&s->lock);
+	sf = scan_lookup(s, vma->dev, vma->ino);
+	if (!sf) {
+		sf = new;
+		list_add(&sf->hash, scan_bucket(s, sf->dev, sf->ino));
+		s->nr_files++;
+		new = NULL;
+	}
+	err = scan_add_pid(sf, pid);
+	pthread_mutex_unlock(&s->lock);
+
+	if (new)
+		scan_free_file(new);
+	return err;
+}
+
+static int scan_add_pid_dentry(const char *dentry, void *data)
+{
+	struct scan_s *s = data;
+	char *end;
+	pid_t pid;
+
+	pid = strtol(dentry, &end, 10);
+	if (*end || (pid <= 0))
+		return 0;
+
+	if (xrealloc_safe(&s->pids, sizeof(*s->pids) * (s->nr_pids + 1)))
+		return -ENOMEM;
+
+	s->pids[s->nr_pids++] = pid;
+	return 0;
+}
+
+static void *scan_worker(void *data)
+{
+	struct scan_s *s = data;
+	long err = 0;
+	pid_t pid;
+
+	log_set_thread(&s->log);
+
+	while (!err) {
+		pthread_mutex_lock(&s->lock);
+		pid = (s->next < s->nr_pids) ? s->pids[s->next++] : 0;
+		pthread_mutex_unlock(&s->lock);
+
+		if (!pid)
+			break;
+
+		/* Process could have already exited */
+		if (iter_map_files(pid, scan_vma, s) == -ENOMEM)
+			err = -ENOMEM;
+	}
+	return (void *)err;
+}
+
+static int scan_run(struct scan_s *s, int jobs)
+{
+	pthread_t *workers;
+	void *ret;
+	int i, err;
+
+	workers = xmalloc(sizeof(*workers) * jobs);
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&workers[i], NULL, scan_worker, s);
+		if (err) {
+			pr_err("failed to create worker: %s\n", strerror(err));
+			break;
+		}
+	}
+
+	if (!i) {
+		free(workers);
+		return -err;
+	}
+
+	err = 0;
+	while (i--) {
+		pthread_join(workers[i], &ret);
+		if (ret)
+			err = (long)ret;
+	}
+
+	free(workers);
+	return err;
+}
+
+static int compare_pids(const void *a, const void *b)
+{
+	return *(const pid_t *)a - *(const pid_t *)b;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+	const struct scan_file_s *fa = *(void * const *)a;
+	const struct scan_file_s *fb = *(void * const *)b;
+
+	return strcmp(fa->bid, fb->bid);
+}
+
+static void print_json_string(const char *str)
+{
+	/* Log messages are limited, so the string is printed in chunks */
+	char buf[256];
+	size_t off = 0;
+
+	buf[off++] = '"';
+	for (; *str; str++) {
+		if (off > sizeof(buf) - 8) {
+			buf[off] = '\0';
+			pr_msg("%s", buf);
+			off = 0;
+		}
+		if ((*str == '"') || (*str == '\\'))
+			off += sprintf(buf + off, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			off += sprintf(buf + off, "\\u%04x", *str);
+		else
+			buf[off++] = *str;
+	}
+	buf[off++] = '"';
+	buf[off] = '\0';
+
+	pr_msg("%s", buf);
+}
+
+static void print_json_pids(struct scan_file_s **files, int nr_files)
+{
+	pid_t *pids = NULL, last = 0;
+	int i, nr_pids = 0;
+
+	for (i = 0; i < nr_files; i++) {
+		if (xrealloc_safe(&pids, sizeof(*pids) *
+				  (nr_pids + files[i]->nr_pids)))
+			break;
+		memcpy(pids + nr_pids, files[i]->pids,
+		       sizeof(*pids) * files[i]->nr_pids);
+		nr_pids += files[i]->nr_pids;
+	}
+
+	qsort(pids, nr_pids, sizeof(*pids), compare_pids);
+
+	pr_msg("\"pids\": [");
+	for (i = 0; i < nr_pids; i++) {
+		if (pids[i] == last)
+			continue;
+		pr_msg("%s%d", last ? ", " : "", pids[i]);
+		last = pids[i];
+	}
+	pr_msg("]");
+
+	free(pids);
+}
+
+static void print_json_paths(struct scan_file_s **files, int nr_files)
+{
+	int i;
+
+	pr_msg("\"paths\": [");
+	for (i = 0; i < nr_files; i++) {
+		if (i)
+			pr_msg(", ");
+		print_json_string(files[i]->path);
+	}
+	pr_msg("]");
+}
+
+static int group_size(struct scan_file_s **files, int nr_files)
+{
+	int n;
+
+	for (n = 1; n < nr_files; n++) {
+		if (strcmp(files[n]->bid, files[0]->bid))
+			break;
+	}
+	return n;
+}
+
+static void print_json_patches(struct scan_file_s **patches, int nr_patches,
+			       const char *target_bid)
+{
+	int i, n, first = 1;
+
+	pr_msg("\"patches\": [");
+	for (i = 0; i < nr_patches; i += n) {
+		n = group_size(patches + i, nr_patches - i);
+
+		if (strcmp(patches[i]->target_bid, target_bid))
+			continue;
+
+		pr_msg("%s\n        { \"build_id\": \"%s\", ",
+				first ? "" : ",", patches[i]->bid);
+		print_json_paths(patches + i, n);
+		pr_msg(", ");
+		print_json_pids(patches + i, n);
+		pr_msg(" }");
+		first = 0;
+	}
+	pr_msg("%s]", first ? "" : "\n      ");
+}
+
+/*
+ * Files with the same Build ID (like the same library in different
+ * containers) are reported together.
+ */
+static int scan_report(struct scan_s *s)
+{
+	struct scan_file_s **targets, **patches, *sf;
+	int nr_targets = 0, nr_patches = 0, i, n, first = 1;
+
+	targets = xmalloc(sizeof(*targets) * (s->nr_files + 1));
+	patches = xmalloc(sizeof(*patches) * (s->nr_files + 1));
+	if (!targets || !patches) {
+		free(targets);
+		free(patches);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < SCAN_BUCKETS; i++) {
+		list_for_each_entry(sf, &s->files[i], hash) {
+			if (!sf->bid)
+				continue;
+			if (sf->target_bid)
+				patches[nr_patches++] = sf;
+			else if (!s->target_bid || !strcmp(sf->bid, s->target_bid))
+				targets[nr_targets++] = sf;
+		}
+	}
+
+	qsort(targets, nr_targets, sizeof(*targets), compare_files);
+	qsort(patches, nr_patches, sizeof(*patches), compare_files);
+
+	pr_msg("{\n  \"build_ids\": [");
+	for (i = 0; i < nr_targets; i += n) {
+		n = group_size(targets + i, nr_targets - i);
+
+		pr_msg("%s\n    {\n      \"build_id\": \"%s\",\n      ",
+				first ? "" : ",", targets[i]->bid);
+		print_json_paths(targets + i, n);
+		pr_msg(",\n      ");
+		print_json_pids(targets + i, n);
+		pr_msg(",\n      ");
+		print_json_patches(patches, nr_patches, targets[i]->bid);
+		pr_msg("\n    }");
+		first = 0;
+	}
+	pr_msg("%s]\n}\n", first ? "" : "\n  ");
+
+	free(targets);
+	free(patches);
+	return 0;
+}
+
+static void scan_destroy(struct scan_s *s)
+{
+	struct scan_file_s *sf, *tmp;
+	int i;
+
+	for (i = 0; i < SCAN_BUCKETS; i++) {
+		list_for_each_entry_safe(sf, tmp, &s->files[i], hash) {
+			list_del(&sf->hash);
+			scan_free_file(sf);
+		}
+	}
+	free(s->pids);
+}
+
+/*
+ * Scans all the processes in the system and reports (in JSON) processes,
+ * mapping each ELF file with Build ID, and patches, applied to them. If
+ * patch file is given, only its target is reported.
+ */
+int scan_processes(const char *patchfile, int jobs)
+{
+	struct scan_s s = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	char *target_bid = NULL;
+	int i, err;
+
+	if (elf_library_status())
+		return -1;
+
+	if (patchfile) {
+		target_bid = patch_target_bid(patchfile);
+		if (!target_bid) {
+			pr_err("failed to read patch %s\n", patchfile);
+			return -EINVAL;
+		}
+		s.target_bid = target_bid;
+	}
+
+	for (i = 0; i < SCAN_BUCKETS; i++)
+		INIT_LIST_HEAD(&s.files[i]);
+
+	log_get_thread(&s.log);
+
+	err = iterate_dir_name("/proc", scan_add_pid_dentry, &s);
+	if (err)
+		goto destroy;
+
+	if (s.nr_pids) {
+		err = scan_run(&s, min(jobs, s.nr_pids));
+		if (err)
+			goto destroy;
+	}
+
+	err = scan_report(&s);
+
+destroy:
+	scan_destroy(&s);
+	free(target_bid);
+	return err;
+}
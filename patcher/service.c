@@ -4,6 +4,9 @@
 #include <linux/limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <linux/un.h>
 
 #include "include/util.h"
@@ -82,6 +85,7 @@ static int service_collect_vmas(struct process_ctx_s *ctx, struct service *servi
 	char path[PATH_MAX];
 	char dentry[256];
 	ssize_t res;
+	struct dl_map *dlm;
 	LIST_HEAD(service_vmas);
 
 	err = process_read_data(ctx, service->handle, &base, sizeof(base));
@@ -120,13 +124,94 @@ static int service_collect_vmas(struct process_ctx_s *ctx, struct service *servi
 		return -ENOENT;
 	}
 
-	err = create_dl_map(&service_vmas, &service->dlm);
+	err = create_dl_map(&service_vmas, &dlm);
 	if (err)
 		return err;
+	service->dlm = dlm;
 
 	return splice_vma_lists_sorted(&service_vmas, &ctx->vmas);
 }
 
+static int service_read_discovery(pid_t pid, struct nsb_service_discovery *sd)
+{
+	char path[PATH_MAX];
+	struct stat st, proc_st;
+	ssize_t size;
+	int fd, err = 0;
+
+	sprintf(path, NSB_SERVICE_DISCOVERY_PATH, pid);
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	sprintf(path, "/proc/%d", pid);
+	if (fstat(fd, &st) || stat(path, &proc_st)) {
+		err = -errno;
+		goto close_fd;
+	}
+
+	/* Record can be created by anyone: trust the process owner only */
+	if (st.st_uid && (st.st_uid != proc_st.st_uid)) {
+		pr_warn("discovery record of process %d has wrong owner %d\n",
+				pid, st.st_uid);
+		err = -EPERM;
+		goto close_fd;
+	}
+
+	size = read(fd, sd, sizeof(*sd));
+	if (size != sizeof(*sd))
+		err = (size < 0) ? -errno : -EINVAL;
+
+close_fd:
+	close(fd);
+	return err;
+}
+
+/*
+ * Service, preloaded at process start, is used as is: neither dlopen, nor
+ * nsb loader is needed. Record can be left by previous process with the same
+ * pid, so the service has to be mapped at the recorded address.
+ * Returns 1, if the service is found.
+ */
+int service_discover(struct process_ctx_s *ctx, struct service *service)
+{
+	struct nsb_service_discovery sd;
+	const struct dl_map *dlm;
+	int err;
+
+	err = service_read_discovery(ctx->pid, &sd);
+	if (err) {
+		if (err != -ENOENT)
+			pr_debug("  Can't read service discovery record in %d: %d\n",
+					ctx->pid, err);
+		return 0;
+	}
+
+	if ((sd.magic != NSB_SERVICE_DISCOVERY_MAGIC) ||
+	    (sd.version != NSB_SERVICE_DISCOVERY_VERSION) ||
+	    (sd.pid != ctx->pid)) {
+		pr_debug("  Stale service discovery record in %d\n", ctx->pid);
+		return 0;
+	}
+
+	dlm = find_dl_map_by_addr(&ctx->dl_maps, sd.base);
+	if (!dlm || (dl_map_start(dlm) != sd.base) ||
+	    (dl_map_symbol_value(dlm, "nsb_service_accept") <= 0)) {
+		pr_debug("  Service is not mapped at %#lx in %d\n",
+				sd.base, ctx->pid);
+		return 0;
+	}
+
+	pr_debug("  Found preloaded service at %#lx\n", sd.base);
+
+	service->dlm = dlm;
+	service->handle = sd.base;
+	service->pid = ctx->pid;
+	service->preloaded = true;
+	return 1;
+}
+
 static int service_disconnect(struct process_ctx_s *ctx, struct service *service)
 {
 	if (service->sock >= 0) {
@@ -186,23 +271,13 @@ static int64_t service_sym_addr(struct service *service, const char *symbol)
 
 static int service_remote_accept(struct process_ctx_s *ctx, struct service *service)
 {
-	const char *symbol = "nsb_service_accept";
 	int64_t address;
-	uint64_t code_addr = vma_start(&ctx->remote_vma);
-	ssize_t size;
-	void *code;
 
-	address = service_sym_addr(service, symbol);
+	address = service_sym_addr(service, "nsb_service_accept");
 	if (address <= 0)
 		return address;
 
-	size = x86_64_call(address, code_addr, 0, 0, 0, 0, 0, 0, &code);
-	if (size < 0) {
-		pr_err("failed to construct %s call\n", symbol);
-		return size;
-	}
-
-	return process_exec_code(ctx, code_addr, code, size);
+	return process_call(ctx, address, 0, 0, 0, 0, 0, 0);
 }
 
 static int __service_do(struct process_ctx_s *ctx, uint64_t address,
@@ -210,19 +285,7 @@ static int __service_do(struct process_ctx_s *ctx, uint64_t address,
 			uint64_t arg3, uint64_t arg4,
 			uint64_t arg5, uint64_t arg6)
 {
-	uint64_t code_addr = vma_start(&ctx->remote_vma);
-	ssize_t size;
-	void *code;
-
-	size = x86_64_call(address, code_addr,
-			   arg1, arg2, arg3, arg4, arg5, arg6,
-			   &code);
-	if (size < 0) {
-		pr_err("failed to construct service call\n");
-		return size;
-	}
-
-	return process_exec_code(ctx, code_addr, code, size);
+	return process_call(ctx, address, arg1, arg2, arg3, arg4, arg5, arg6);
 }
 
 static int service_run(struct process_ctx_s *ctx, const struct service *service)
@@ -279,9 +342,12 @@ int service_start(struct process_ctx_s *ctx, struct service *service)
 {
 	int err;
 
-	err = service_collect_vmas(ctx, service);
-	if (err)
-		return err;
+	/* Service, mapped by nsb loader, has its map already */
+	if (!service->dlm) {
+		err = service_collect_vmas(ctx, service);
+		if (err)
+			return err;
+	}
 
 	err = service_connect(ctx, service);
 	if (err)
@@ -429,6 +495,24 @@ int service_munmap_dlm(struct process_ctx_s *ctx, const struct service *service,
 	return 0;
 }
 
+static ssize_t service_copy_needed_array(const struct nsb_service_needed_list *nl,
+					 uint64_t **needed_array)
+{
+	size_t array_size;
+	uint64_t *array;
+
+	array_size = sizeof(nl->address) * nl->nr_addrs;
+
+	array = xmalloc(array_size);
+	if (!array)
+		return -ENOMEM;
+
+	memcpy(array, nl->address, array_size);
+	*needed_array = array;
+
+	return nl->nr_addrs;
+}
+
 ssize_t service_needed_array(struct process_ctx_s *ctx, const struct service *service,
 			     uint64_t **needed_array)
 {
@@ -439,8 +523,6 @@ ssize_t service_needed_array(struct process_ctx_s *ctx, const struct service *se
 	struct nsb_service_response rs;
 	struct nsb_service_needed_list *nl = (void *)rs.data;
 	int err;
-	size_t array_size;
-	uint64_t *array;
 
 	rqlen = sizeof(rq.cmd);
 
@@ -464,16 +546,7 @@ ssize_t service_needed_array(struct process_ctx_s *ctx, const struct service *se
 		return rs.ret;
 	}
 
-	array_size = sizeof(nl->address) * nl->nr_addrs;
-
-	array = xmalloc(array_size);
-	if (!array)
-		return -ENOMEM;
-
-	memcpy(array, nl->address, array_size);
-	*needed_array = array;
-
-	return nl->nr_addrs;
+	return service_copy_needed_array(nl, needed_array);
 }
 
 int service_transfer_fd(struct process_ctx_s *ctx, struct service *service,
@@ -501,3 +574,943 @@ int service_transfer_fd(struct process_ctx_s *ctx, struct service *service,
 	}
 	return tfd;
 }
+
+static int service_apply_relocs_chunk(struct process_ctx_s *ctx,
+				      const struct service *service,
+				      const struct service_reloc *relocs,
+				      size_t nr_relocs)
+{
+	struct nsb_service_request rq = {
+		.cmd = NSB_SERVICE_CMD_RELOCS,
+	};
+	struct nsb_service_relocs_request *rrq = (void *)rq.data;
+	const struct nsb_service_relocs_response *rrs;
+	struct nsb_service_response rs;
+	uint64_t hash = NSB_SERVICE_FNV64_OFFSET;
+	size_t rqlen, i;
+	ssize_t size;
+	int err;
+
+	rrq->nr_relocs = nr_relocs;
+	for (i = 0; i < nr_relocs; i++) {
+		struct nsb_service_reloc *r = &rrq->reloc[i];
+
+		r->addr = relocs[i].addr;
+		r->value = relocs[i].value;
+		r->size = relocs[i].size;
+		r->prot = relocs[i].prot;
+
+		hash = nsb_service_reloc_hash(hash, r->addr, &r->value, r->size);
+	}
+
+	rqlen = sizeof(rq.cmd) + sizeof(*rrq) + sizeof(rrq->reloc[0]) * nr_relocs;
+
+	err = nsb_service_send_request(service, &rq, rqlen);
+	if (err)
+		return err;
+
+	err = service_run(ctx, service);
+	if (err) {
+		pr_err("failed to send relocations request\n");
+		return err;
+	}
+
+	size = nsb_service_receive_response(service, &rs);
+	if (size < 0)
+		return size;
+
+	if (rs.ret < 0) {
+		errno = -rs.ret;
+		pr_perror("relocations request failed");
+		return rs.ret;
+	}
+
+	rrs = (void *)rs.data;
+	if (size < sizeof(rs.ret) + sizeof(*rrs)) {
+		pr_err("relocations response is truncated: %ld\n", size);
+		return -EINVAL;
+	}
+
+	if (rrs->checksum != hash) {
+		pr_err("relocations checksum mismatch: %#lx != %#lx\n",
+				rrs->checksum, hash);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Relocations are applied by the service in the process: each request
+ * carries as many of them, as fits into the message.
+ */
+int service_apply_relocs(struct process_ctx_s *ctx, const struct service *service,
+			 const struct service_reloc *relocs, size_t nr_relocs)
+{
+	size_t nr, done;
+	int err, requests = 0;
+
+	for (done = 0; done < nr_relocs; done += nr) {
+		nr = nr_relocs - done;
+		if (nr > NSB_SERVICE_RELOCS_MAX)
+			nr = NSB_SERVICE_RELOCS_MAX;
+
+		err = service_apply_relocs_chunk(ctx, service, relocs + done, nr);
+		if (err)
+			return err;
+		requests++;
+	}
+
+	pr_debug("  %ld relocations applied with %d requests\n",
+			nr_relocs, requests);
+	return 0;
+}
+
+static int service_add_resolve_str(struct nsb_service_request *rq,
+				   size_t *rqlen, const char *str,
+				   uint32_t *offset)
+{
+	size_t len = strlen(str) + 1;
+	size_t start = *rqlen - sizeof(rq->cmd);
+
+	if (*rqlen + len > sizeof(*rq))
+		return -E2BIG;
+
+	memcpy(rq->data + start, str, len);
+	*offset = start;
+	*rqlen += len;
+	return 0;
+}
+
+/*
+ * Request is filled with as many symbols, as fit: the symbols array goes
+ * first and is followed by the names.
+ */
+static ssize_t service_fill_resolve_request(struct nsb_service_request *rq,
+					    size_t *rqlen, int stop_idx,
+					    const struct service_sym *syms,
+					    size_t nr_syms)
+{
+	struct nsb_service_resolve_request *rrq = (void *)rq->data;
+	size_t nr, i, len;
+
+	if (nr_syms > NSB_SERVICE_RESOLVE_MAX)
+		nr_syms = NSB_SERVICE_RESOLVE_MAX;
+
+	/* Find out how many symbols with names fit into the message */
+	len = sizeof(rq->cmd) + sizeof(*rrq);
+	for (nr = 0; nr < nr_syms; nr++) {
+		size_t sym_len = sizeof(rrq->sym[0]) + strlen(syms[nr].name) + 1;
+
+		if (syms[nr].version)
+			sym_len += strlen(syms[nr].version) + 1;
+		if (len + sym_len > sizeof(*rq))
+			break;
+		len += sym_len;
+	}
+
+	if (!nr) {
+		pr_err("symbol %s is too long\n", syms[0].name);
+		return -E2BIG;
+	}
+
+	rrq->nr_syms = nr;
+	rrq->stop_idx = stop_idx;
+	*rqlen = sizeof(rq->cmd) + sizeof(*rrq) + sizeof(rrq->sym[0]) * nr;
+
+	for (i = 0; i < nr; i++) {
+		struct nsb_service_resolve_sym *rs = &rrq->sym[i];
+		int err;
+
+		rs->flags = syms[i].stop ? NSB_SERVICE_RESOLVE_STOP : 0;
+		rs->version = 0;
+
+		err = service_add_resolve_str(rq, rqlen, syms[i].name, &rs->name);
+		if (!err && syms[i].version)
+			err = service_add_resolve_str(rq, rqlen, syms[i].version,
+						      &rs->version);
+		if (err)
+			return err;
+	}
+	return nr;
+}
+
+/*
+ * Symbols are resolved by the service in the process with the lookup tables
+ * of the loaded objects. Results are indexes in the needed list and symbol
+ * values.
+ */
+int service_resolve_syms(struct process_ctx_s *ctx, const struct service *service,
+			 int stop_idx, struct service_sym *syms, size_t nr_syms)
+{
+	struct nsb_service_request rq = {
+		.cmd = NSB_SERVICE_CMD_RESOLVE,
+	};
+	const struct nsb_service_resolve_response *rrs;
+	struct nsb_service_response rs;
+	size_t rqlen, done, i;
+	ssize_t nr, size;
+	int err, requests = 0;
+
+	for (done = 0; done < nr_syms; done += nr) {
+		nr = service_fill_resolve_request(&rq, &rqlen, stop_idx,
+						  syms + done, nr_syms - done);
+		if (nr < 0)
+			return nr;
+
+		err = nsb_service_send_request(service, &rq, rqlen);
+		if (err)
+			return err;
+
+		err = service_run(ctx, service);
+		if (err) {
+			pr_err("failed to send resolve request\n");
+			return err;
+		}
+
+		size = nsb_service_receive_response(service, &rs);
+		if (size < 0)
+			return size;
+
+		if (rs.ret < 0) {
+			errno = -rs.ret;
+			pr_perror("resolve request failed");
+			return rs.ret;
+		}
+
+		rrs = (void *)rs.data;
+		if ((size < sizeof(rs.ret) + sizeof(*rrs)) || (rrs->nr_syms != nr) ||
+		    (size < sizeof(rs.ret) + sizeof(*rrs) + sizeof(rrs->result[0]) * nr)) {
+			pr_err("resolve response is truncated: %ld\n", size);
+			return -EINVAL;
+		}
+
+		for (i = 0; i < nr; i++) {
+			struct service_sym *sym = &syms[done + i];
+
+			sym->ret = rrs->result[i].ret;
+			sym->idx = rrs->result[i].idx;
+			sym->value = rrs->result[i].value;
+		}
+		requests++;
+	}
+
+	pr_debug("  %ld symbols resolved with %d requests\n", nr_syms, requests);
+	return 0;
+}
+
+int service_start_agent(struct process_ctx_s *ctx, struct service *service)
+{
+	int64_t address;
+	int err;
+
+	address = service_sym_addr(service, "nsb_service_start_agent");
+	if (address <= 0)
+		return address;
+
+	err = __service_do(ctx, address, 0, 0, 0, 0, 0, 0);
+	if (err) {
+		errno = -err;
+		pr_perror("failed to start resident agent in process %d",
+				service->pid);
+	}
+	return err;
+}
+
+int service_agent_connect(struct service *service, pid_t pid)
+{
+	struct sockaddr_un addr;
+	int sock, err;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(&addr.sun_path[1], UNIX_PATH_MAX - 1,
+		 NSB_SERVICE_AGENT_NAME, pid);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		pr_perror("failed to create packet socket");
+		return -errno;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		err = -errno;
+		pr_debug("  Resident agent \"%s\" is not available: %d\n",
+				&addr.sun_path[1], err);
+		close(sock);
+		return err;
+	}
+
+	pr_debug("  Connected to resident agent \"%s\"\n", &addr.sun_path[1]);
+	service->agent_sock = sock;
+	return 0;
+}
+
+static void service_shm_destroy(struct service *service);
+
+void service_agent_disconnect(struct service *service)
+{
+	service_shm_destroy(service);
+
+	if (service->agent_sock < 0)
+		return;
+
+	close(service->agent_sock);
+	service->agent_sock = -1;
+}
+
+/*
+ * Agent requests are served by the target while it's running: no ptrace
+ * calls are involved. File descriptor (if any) is passed along with the
+ * request.
+ */
+static int service_agent_call(const struct service *service,
+			      const struct nsb_service_request *rq,
+			      size_t rqlen, int fd,
+			      struct nsb_service_response *rs)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base = (void *)rq,
+		.iov_len = rqlen,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+	ssize_t size;
+
+	if (service->agent_sock < 0) {
+		pr_err("resident agent is not connected\n");
+		return -ENOTCONN;
+	}
+
+	if (fd >= 0) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(service->agent_sock, &msg, MSG_NOSIGNAL) < 0) {
+		pr_perror("failed to send request to resident agent");
+		return -errno;
+	}
+
+	size = recv(service->agent_sock, rs, sizeof(*rs), 0);
+	if (size < 0) {
+		pr_perror("failed to receive resident agent response");
+		return -errno;
+	}
+	if (size < sizeof(rs->ret)) {
+		pr_err("message is truncated: %ld < %ld\n", size, sizeof(rs->ret));
+		return -EINVAL;
+	}
+	if (rs->ret < 0) {
+		nsb_service_print_errors(rs, size);
+		return rs->ret;
+	}
+	return 0;
+}
+
+/*
+ * Protocol v2: commands are batched, and their payloads are passed via
+ * shared memory. Batch is sent in as few packets, as possible.
+ */
+struct service_batch_cmd {
+	unsigned		cmd;
+	int			fd;
+	size_t			offset;
+	size_t			size;
+	int			ret;
+	void			*resp;
+	size_t			resp_size;
+};
+
+struct service_batch {
+	struct service_batch_cmd	*cmds;
+	int				nr_cmds;
+	uint8_t				*payload;
+	size_t				used;
+	size_t				resp_size;
+};
+
+#define SERVICE_SHM_SIZE_MIN		(1 << 20)
+#define SERVICE_RESP_SIZE_MIN		(64 << 10)
+
+struct service_batch *service_batch_create(void)
+{
+	struct service_batch *b;
+
+	b = xzalloc(sizeof(*b));
+	if (b)
+		b->resp_size = SERVICE_RESP_SIZE_MIN;
+	return b;
+}
+
+void service_batch_destroy(struct service_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->nr_cmds; i++)
+		free(b->cmds[i].resp);
+	free(b->cmds);
+	free(b->payload);
+	free(b);
+}
+
+static int service_batch_grow(struct service_batch *b, size_t size)
+{
+	size_t used = round_up(b->used + size, 8);
+
+	if (used == b->used)
+		return 0;
+
+	if (xrealloc_safe(&b->payload, used))
+		return -ENOMEM;
+
+	memset(b->payload + b->used, 0, used - b->used);
+	b->used = used;
+	return 0;
+}
+
+/*
+ * Returns command index in the batch. Payload pointer is valid until the
+ * next command is added.
+ */
+int service_batch_add(struct service_batch *b, unsigned cmd, size_t size,
+		      int fd, void **payload)
+{
+	struct service_batch_cmd *c;
+	size_t offset = b->used;
+
+	if (xrealloc_safe(&b->cmds, sizeof(*b->cmds) * (b->nr_cmds + 1)))
+		return -ENOMEM;
+
+	if (service_batch_grow(b, size))
+		return -ENOMEM;
+
+	c = &b->cmds[b->nr_cmds];
+	memset(c, 0, sizeof(*c));
+	c->cmd = cmd;
+	c->fd = fd;
+	c->offset = offset;
+	c->size = size;
+
+	if (payload)
+		*payload = b->payload + offset;
+	return b->nr_cmds++;
+}
+
+int service_batch_result(const struct service_batch *b, int idx,
+			 const void **data, size_t *size)
+{
+	const struct service_batch_cmd *c = &b->cmds[idx];
+
+	if (data)
+		*data = c->resp;
+	if (size)
+		*size = c->resp_size;
+	return c->ret;
+}
+
+int service_batch_add_mmap(struct service_batch *b,
+			   const struct list_head *vmas, int fd)
+{
+	struct nsb_service_mmap_request *mrq;
+	struct vma_area *vma;
+	size_t nr = 0;
+	int idx;
+
+	list_for_each_entry(vma, vmas, list)
+		nr++;
+
+	idx = service_batch_add(b, NSB_SERVICE_CMD_MMAP,
+				sizeof(*mrq) + sizeof(mrq->mmap[0]) * nr,
+				fd, (void **)&mrq);
+	if (idx < 0)
+		return idx;
+
+	mrq->fd = -1;
+	list_for_each_entry(vma, vmas, list) {
+		struct nsb_service_mmap_info *mi = &mrq->mmap[mrq->nr_mmaps++];
+
+		process_print_mmap(vma);
+
+		mi->info.addr = vma_start(vma);
+		mi->info.length = vma_length(vma);
+		mi->prot = vma_prot(vma);
+		mi->flags = vma_flags(vma);
+		mi->offset = vma_offset(vma);
+
+		/* Other threads can create mappings at any moment */
+		if (mi->flags & MAP_FIXED) {
+			mi->flags &= ~MAP_FIXED;
+			mi->flags |= MAP_FIXED_NOREPLACE;
+		}
+	}
+	return idx;
+}
+
+int service_batch_add_munmap(struct service_batch *b,
+			     const struct list_head *vmas)
+{
+	struct nsb_service_munmap_request *mrq;
+	struct vma_area *vma;
+	size_t nr = 0;
+	int idx;
+
+	list_for_each_entry(vma, vmas, list)
+		nr++;
+
+	idx = service_batch_add(b, NSB_SERVICE_CMD_MUNMAP,
+				sizeof(*mrq) + sizeof(mrq->munmap[0]) * nr,
+				-1, (void **)&mrq);
+	if (idx < 0)
+		return idx;
+
+	list_for_each_entry(vma, vmas, list) {
+		struct nsb_service_map_addr_info *mai = &mrq->munmap[mrq->nr_munmaps++];
+
+		process_print_munmap(vma);
+
+		mai->addr = vma_start(vma);
+		mai->length = vma_length(vma);
+	}
+	return idx;
+}
+
+/*
+ * Consecutive writes are merged into one command.
+ */
+int service_batch_add_write(struct service_batch *b, uint64_t addr,
+			    const void *data, size_t size, int prot)
+{
+	struct service_batch_cmd *c = NULL;
+	struct nsb_service_write_request *wrq;
+	struct nsb_service_write *w;
+	size_t offset;
+	int idx;
+
+	if (b->nr_cmds)
+		c = &b->cmds[b->nr_cmds - 1];
+
+	if (!c || (c->cmd != NSB_SERVICE_CMD_WRITE)) {
+		idx = service_batch_add(b, NSB_SERVICE_CMD_WRITE,
+					sizeof(*wrq), -1, NULL);
+		if (idx < 0)
+			return idx;
+		c = &b->cmds[idx];
+	}
+	idx = c - b->cmds;
+
+	/* Last command payload is at the end of the batch payload */
+	offset = b->used;
+	if (service_batch_grow(b, NSB_SERVICE_WRITE_SIZE(size)))
+		return -ENOMEM;
+	c->size += NSB_SERVICE_WRITE_SIZE(size);
+
+	w = (void *)(b->payload + offset);
+	w->addr = addr;
+	w->size = size;
+	w->prot = prot;
+	memcpy(w->data, data, size);
+
+	wrq = (void *)(b->payload + c->offset);
+	wrq->nr_writes++;
+	return idx;
+}
+
+static void service_shm_destroy(struct service *service)
+{
+	if (service->shm) {
+		munmap(service->shm, service->shm_size);
+		service->shm = NULL;
+		service->shm_size = 0;
+	}
+	if (service->shm_fd >= 0) {
+		close(service->shm_fd);
+		service->shm_fd = -1;
+	}
+}
+
+static int service_shm_create(struct service *service, size_t size)
+{
+	size_t shm_size = SERVICE_SHM_SIZE_MIN;
+	void *addr;
+	int fd;
+
+	while (shm_size < size)
+		shm_size <<= 1;
+
+	fd = memfd_create("nsb-service", MFD_CLOEXEC);
+	if (fd < 0) {
+		pr_perror("failed to create shared memory file");
+		return -errno;
+	}
+
+	if (ftruncate(fd, shm_size)) {
+		pr_perror("failed to resize shared memory file");
+		goto close_fd;
+	}
+
+	addr = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		pr_perror("failed to map shared memory");
+		goto close_fd;
+	}
+
+	service_shm_destroy(service);
+
+	service->shm_fd = fd;
+	service->shm = addr;
+	service->shm_size = shm_size;
+	return 1;
+
+close_fd:
+	close(fd);
+	return -errno;
+}
+
+static int service_send_packet(const struct service *service,
+			       const struct nsb_service_v2_packet *pkt,
+			       size_t size, const int *fds, int nr_fds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * NSB_SERVICE_V2_FDS_MAX)];
+	struct iovec iov = {
+		.iov_base = (void *)pkt,
+		.iov_len = size,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+
+	if (nr_fds) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+	}
+
+	if (sendmsg(service->agent_sock, &msg, MSG_NOSIGNAL) < 0) {
+		pr_perror("failed to send packet to resident agent");
+		return -errno;
+	}
+	return 0;
+}
+
+static void service_print_errors(const char *msg, size_t size)
+{
+	const char *end = msg + size;
+
+	while (msg < end) {
+		pr_err("nsb_service: %.*s\n", (int)(end - msg), msg);
+		msg += strnlen(msg, end - msg) + 1;
+	}
+}
+
+/*
+ * Response must describe exactly the commands, which were sent: anything else
+ * means the agent and the patcher are out of sync.
+ */
+static int service_batch_results(struct service *service,
+				 struct service_batch *b, int first, int nr_sent,
+				 const struct nsb_service_v2_packet *pkt)
+{
+	int i, err = 0;
+
+	if (pkt->nr_cmds != nr_sent) {
+		pr_err("response has %d commands instead of %d\n",
+				pkt->nr_cmds, nr_sent);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < pkt->nr_cmds; i++) {
+		const struct nsb_service_v2_cmd *pc = &pkt->cmd[i];
+		struct service_batch_cmd *c;
+
+		if ((i == 0) && (pc->cmd == NSB_SERVICE_CMD_SHM)) {
+			if (pc->ret < 0) {
+				pr_err("resident agent failed to map shared "
+				       "memory: %d\n", pc->ret);
+				err = pc->ret;
+			}
+			continue;
+		}
+
+		c = &b->cmds[first++];
+		if (pc->cmd != c->cmd) {
+			pr_err("response command %d doesn't match request\n", i);
+			return -EINVAL;
+		}
+		c->ret = pc->ret;
+
+		if (pc->size) {
+			if ((pc->offset > service->shm_size) ||
+			    (pc->size > service->shm_size - pc->offset)) {
+				pr_err("response is out of shared memory\n");
+				return -EINVAL;
+			}
+
+			c->resp = xmalloc(pc->size);
+			if (!c->resp)
+				return -ENOMEM;
+			memcpy(c->resp, (char *)service->shm + pc->offset, pc->size);
+			c->resp_size = pc->size;
+		}
+
+		if ((c->ret < 0) && !err) {
+			if (c->ret != -ECANCELED)
+				service_print_errors(c->resp, c->resp_size);
+			err = c->ret;
+		}
+	}
+	return err;
+}
+
+/*
+ * Returns the first error. Commands after the failed one are not executed
+ * and fail with -ECANCELED.
+ */
+int service_batch_submit(struct service *service, struct service_batch *b)
+{
+	char buf[NSB_SERVICE_MESSAGE_DATA_SIZE];
+	struct nsb_service_v2_packet *pkt = (void *)buf;
+	int fds[NSB_SERVICE_V2_FDS_MAX];
+	size_t resp_offset, size;
+	int first, nr_sent, nr_fds, new_shm, err, i;
+	ssize_t ret;
+
+	if (service->agent_sock < 0) {
+		pr_err("resident agent is not connected\n");
+		return -ENOTCONN;
+	}
+
+	resp_offset = round_up(b->used, 8);
+
+	new_shm = 0;
+	if (resp_offset + b->resp_size > service->shm_size) {
+		new_shm = service_shm_create(service, resp_offset + b->resp_size);
+		if (new_shm < 0)
+			return new_shm;
+	}
+
+	if (b->used)
+		memcpy(service->shm, b->payload, b->used);
+
+	for (first = 0; first < b->nr_cmds; first += i) {
+		pkt->magic = NSB_SERVICE_V2_MAGIC;
+		pkt->nr_cmds = 0;
+		pkt->resp_offset = resp_offset;
+		pkt->resp_size = service->shm_size - resp_offset;
+		nr_fds = 0;
+
+		if (new_shm) {
+			struct nsb_service_v2_cmd *pc = &pkt->cmd[pkt->nr_cmds++];
+
+			pc->cmd = NSB_SERVICE_CMD_SHM;
+			pc->offset = 0;
+			pc->size = service->shm_size;
+			fds[nr_fds++] = service->shm_fd;
+			new_shm = 0;
+		}
+
+		for (i = 0; first + i < b->nr_cmds; i++) {
+			const struct service_batch_cmd *c = &b->cmds[first + i];
+			struct nsb_service_v2_cmd *pc;
+
+			if (pkt->nr_cmds == NSB_SERVICE_V2_CMDS_MAX)
+				break;
+			if (c->fd >= 0) {
+				if (nr_fds == NSB_SERVICE_V2_FDS_MAX)
+					break;
+				fds[nr_fds++] = c->fd;
+			}
+
+			pc = &pkt->cmd[pkt->nr_cmds++];
+			pc->cmd = c->cmd;
+			pc->ret = 0;
+			pc->offset = c->offset;
+			pc->size = c->size;
+		}
+
+		nr_sent = pkt->nr_cmds;
+		size = sizeof(*pkt) + sizeof(pkt->cmd[0]) * nr_sent;
+
+		err = service_send_packet(service, pkt, size, fds, nr_fds);
+		if (err)
+			return err;
+
+		ret = recv(service->agent_sock, buf, sizeof(buf), 0);
+		if (ret < 0) {
+			pr_perror("failed to receive resident agent response");
+			return -errno;
+		}
+		if (ret != size) {
+			pr_err("response is truncated: %ld < %ld\n", ret, size);
+			return -EINVAL;
+		}
+
+		err = service_batch_results(service, b, first, nr_sent, pkt);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int service_agent_do(struct service *service, struct service_batch *b,
+			    int idx, const char *what)
+{
+	int err;
+
+	if (idx < 0) {
+		service_batch_destroy(b);
+		return idx;
+	}
+
+	err = service_batch_submit(service, b);
+	if (err)
+		pr_err("resident agent failed to %s: %d\n", what, err);
+
+	service_batch_destroy(b);
+	return err;
+}
+
+int service_agent_mmap(struct service *service,
+		       const struct list_head *vmas, int fd)
+{
+	struct service_batch *b;
+
+	b = service_batch_create();
+	if (!b)
+		return -ENOMEM;
+
+	return service_agent_do(service, b, service_batch_add_mmap(b, vmas, fd),
+				"map the patch");
+}
+
+int service_agent_munmap(struct service *service,
+			 const struct list_head *vmas)
+{
+	struct service_batch *b;
+
+	b = service_batch_create();
+	if (!b)
+		return -ENOMEM;
+
+	return service_agent_do(service, b, service_batch_add_munmap(b, vmas),
+				"unmap the patch");
+}
+
+/*
+ * Response size is not known in advance: the request is repeated with
+ * bigger response area, until the list fits.
+ */
+ssize_t service_agent_needed_array(struct service *service,
+				   uint64_t **needed_array)
+{
+	const struct nsb_service_needed_list *nl;
+	struct service_batch *b;
+	size_t resp_size = SERVICE_RESP_SIZE_MIN;
+	ssize_t ret;
+	int idx;
+
+	do {
+		b = service_batch_create();
+		if (!b)
+			return -ENOMEM;
+
+		b->resp_size = resp_size;
+
+		idx = service_batch_add(b, NSB_SERVICE_CMD_NEEDED_LIST, 0, -1, NULL);
+		if (idx < 0) {
+			service_batch_destroy(b);
+			return idx;
+		}
+
+		ret = service_batch_submit(service, b);
+		if (!ret) {
+			(void)service_batch_result(b, idx, (const void **)&nl, NULL);
+			ret = service_copy_needed_array(nl, needed_array);
+		}
+
+		service_batch_destroy(b);
+		resp_size <<= 1;
+	} while (ret == -E2BIG);
+
+	if (ret < 0)
+		pr_err("resident agent failed to list needed maps: %ld\n", ret);
+	return ret;
+}
+
+/*
+ * Ranges are pairs of start and end addresses, sorted by start. On success
+ * all the threads are parked in the agent and their ids are returned.
+ */
+ssize_t service_agent_park(const struct service *service,
+			   const uint64_t *ranges, size_t nr_ranges,
+			   unsigned timeout_ms, pid_t **tids)
+{
+	struct nsb_service_request rq = {
+		.cmd = NSB_SERVICE_CMD_PARK,
+	};
+	struct nsb_service_park_request *prq = (void *)rq.data;
+	struct nsb_service_response rs;
+	struct nsb_service_park_response *pr = (void *)rs.data;
+	size_t i, rqlen;
+	pid_t *array;
+	int err;
+
+	if (nr_ranges > NSB_SERVICE_PARK_RANGES_MAX) {
+		pr_err("too many ranges to check: %ld (max: %ld)\n",
+				nr_ranges, NSB_SERVICE_PARK_RANGES_MAX);
+		return -E2BIG;
+	}
+
+	prq->timeout_ms = timeout_ms;
+	prq->nr_ranges = nr_ranges;
+	for (i = 0; i < nr_ranges; i++) {
+		prq->range[i].start = ranges[2 * i];
+		prq->range[i].end = ranges[2 * i + 1];
+	}
+
+	rqlen = sizeof(rq.cmd) + sizeof(*prq) + sizeof(prq->range[0]) * nr_ranges;
+
+	err = service_agent_call(service, &rq, rqlen, -1, &rs);
+	if (err)
+		return err;
+
+	array = xmalloc(sizeof(*array) * (pr->nr_tids ? : 1));
+	if (!array) {
+		(void)service_agent_release(service);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < pr->nr_tids; i++)
+		array[i] = pr->tid[i];
+
+	*tids = array;
+	return pr->nr_tids;
+}
+
+int service_agent_release(const struct service *service)
+{
+	struct nsb_service_request rq = {
+		.cmd = NSB_SERVICE_CMD_RELEASE,
+	};
+	struct nsb_service_response rs;
+	int err;
+
+	err = service_agent_call(service, &rq, sizeof(rq.cmd), -1, &rs);
+	if (err)
+		pr_err("resident agent failed to release threads: %d\n", err);
+	return err;
+}
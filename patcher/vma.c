@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -33,6 +34,8 @@ static int parse_vma(char *line, struct vma_area *vma)
 	}
 
 	vma->length = end - vma->addr;
+	vma->dev = makedev(dev_maj, dev_min);
+	vma->ino = ino;
 	vma->prot = PROT_NONE;
 	if (r == 'r')
 		vma->prot |= PROT_READ;
@@ -98,6 +101,23 @@ free_vma:
 	return ret;
 }
 
+void free_vma(struct vma_area *vma)
+{
+	free(vma->map_file);
+	free(vma->path);
+	free(vma);
+}
+
+void free_vmas(struct list_head *head)
+{
+	struct vma_area *vma, *tmp;
+
+	list_for_each_entry_safe(vma, tmp, head, list) {
+		list_del(&vma->list);
+		free_vma(vma);
+	}
+}
+
 static int add_vma(struct vma_area *vma, void *data)
 {
 	struct vma_area *new_vma = data;
@@ -288,3 +308,14 @@ const struct vma_area *next_vma(const struct vma_area *vma)
 {
 	return list_entry(vma->list.next, typeof(struct vma_area), list);
 }
+
+const struct vma_area *find_vma(const struct list_head *vmas, uint64_t addr)
+{
+	const struct vma_area *vma;
+
+	list_for_each_entry(vma, vmas, list) {
+		if ((vma_start(vma) <= addr) && (addr < vma_end(vma)))
+			return vma;
+	}
+	return NULL;
+}
@@ -1,7 +1,12 @@
 #include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <stdint.h>
 #include <limits.h>
+#include <string.h>
+#include <cpuid.h>
+#include <time.h>
+#include <x86intrin.h>
 
 #include "include/log.h"
 #include "include/x86_64.h"
@@ -21,6 +26,97 @@ uint64_t x86_jump_max_address(uint64_t address)
 	return address + X86_64_JUMP_RANGE;
 }
 
+/* XCR0 state components */
+#define X86_XCR0_SSE_AVX	0x06
+#define X86_XCR0_AVX512		0xe0
+
+static uint64_t x86_xgetbv(uint32_t index)
+{
+	uint32_t eax, edx;
+
+	asm volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (index));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+/*
+ * Patched processes run on the same host, so host CPU features are used.
+ */
+uint64_t x86_cpu_features(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	uint64_t features = 0, xcr0 = 0;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	if (ecx & bit_SSE4_2)
+		features |= X86_FEATURE_SSE4_2;
+
+	/* Vector extensions are usable, only if the kernel saves their state */
+	if (ecx & bit_OSXSAVE)
+		xcr0 = x86_xgetbv(0);
+
+	if ((ecx & bit_AVX) &&
+	    ((xcr0 & X86_XCR0_SSE_AVX) == X86_XCR0_SSE_AVX)) {
+		features |= X86_FEATURE_AVX;
+		if (ecx & bit_FMA)
+			features |= X86_FEATURE_FMA;
+	}
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return features;
+
+	if (ebx & bit_BMI2)
+		features |= X86_FEATURE_BMI2;
+
+	if (!(features & X86_FEATURE_AVX))
+		return features;
+
+	if (ebx & bit_AVX2)
+		features |= X86_FEATURE_AVX2;
+
+	if ((xcr0 & X86_XCR0_AVX512) != X86_XCR0_AVX512)
+		return features;
+
+	if (ebx & bit_AVX512F)
+		features |= X86_FEATURE_AVX512F;
+	if (ebx & bit_AVX512BW)
+		features |= X86_FEATURE_AVX512BW;
+	if (ebx & bit_AVX512VL)
+		features |= X86_FEATURE_AVX512VL;
+	return features;
+}
+
+static uint64_t monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * TSC frequency is measured against monotonic clock: probes in processes on
+ * the same host read the same (invariant) TSC.
+ */
+uint64_t x86_tsc_khz(void)
+{
+	const struct timespec delay = {
+		.tv_nsec = 10 * 1000 * 1000,
+	};
+	uint64_t tsc, nsec;
+
+	nsec = monotonic_nsec();
+	tsc = __rdtsc();
+
+	nanosleep(&delay, NULL);
+
+	tsc = __rdtsc() - tsc;
+	nsec = monotonic_nsec() - nsec;
+
+	return nsec ? tsc * 1000000 / nsec : 0;
+}
+
 static int ip_gen_offset(uint64_t next_ip, uint64_t tgt_pos,
 			 char addr_size, int *buf)
 {
@@ -69,135 +165,543 @@ int x86_jmpq_instruction(unsigned char *buf, size_t buf_size,
 	return x86_modify_instruction(buf, 1, 4, cur_pos, tgt_pos);
 }
 
-ssize_t x86_64_call(uint64_t call, uint64_t where,
-		    uint64_t arg0, uint64_t arg1, uint64_t arg2,
-		    uint64_t arg3, uint64_t arg4, uint64_t arg5,
-		    void **code)
+int x86_rel32_offset(uint64_t next_ip, uint64_t tgt_pos, int32_t *rel)
 {
-	struct mov_reg {
-		unsigned char prefix;
-		unsigned char reg;
-		unsigned char addr[8];
-	};
-	static struct x86_64_call_cmd {
-		struct mov_reg mov_r9;
-		struct mov_reg mov_r8;
-		struct mov_reg mov_rcx;
-		struct mov_reg mov_rdx;
-		struct mov_reg mov_rsi;
-		struct mov_reg mov_rdi;
-		unsigned char call[5];
-		unsigned char int3;
-	} blob = {
-		.mov_r9 = {
-			.prefix = 0x49,
-			.reg = 0xb9,
-		},
-		.mov_r8 = {
-			.prefix = 0x49,
-			.reg = 0xb8,
-		},
-		.mov_rcx = {
-			.prefix = 0x48,
-			.reg = 0xb9,
-		},
-		.mov_rdx = {
-			.prefix = 0x48,
-			.reg = 0xba,
-		},
-		.mov_rsi = {
-			.prefix = 0x48,
-			.reg = 0xbe,
-		},
-		.mov_rdi = {
-			.prefix = 0x48,
-			.reg = 0xbf,
-		},
-		.call = { 0xe8 },
-		.int3 = 0xcc,
-	};
-	ssize_t size;
-
-	memcpy(blob.mov_r9.addr, &arg5, sizeof(arg5));
-	memcpy(blob.mov_r8.addr, &arg4, sizeof(arg4));
-	memcpy(blob.mov_rcx.addr, &arg3, sizeof(arg3));
-	memcpy(blob.mov_rdx.addr, &arg2, sizeof(arg2));
-	memcpy(blob.mov_rsi.addr, &arg1, sizeof(arg1));
-	memcpy(blob.mov_rdi.addr, &arg0, sizeof(arg0));
-
-	size = x86_modify_instruction(blob.call, 1, 4, where + offsetof(struct x86_64_call_cmd, call), call);
-	if (size < 0)
-		return size;
-#if 0
-	pr_debug("where: %lx\n", where);
-	pr_debug("call : %lx\n", call);
-	pr_debug("arg0 : %lx\n", arg0);
-	pr_debug("size : %ld\n", sizeof(blob));
-	{
-		unsigned char *p;
-		int i;
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, mov_r9));
-		for (i = 0, p = (unsigned char *)&blob.mov_r9; i < sizeof(struct mov_reg); i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, mov_r8));
-		for (i = 0, p = (unsigned char *)&blob.mov_r8; i < sizeof(struct mov_reg); i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, mov_rcx));
-		for (i = 0, p = (unsigned char *)&blob.mov_rcx; i < sizeof(struct mov_reg); i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, mov_rdx));
-		for (i = 0, p = (unsigned char *)&blob.mov_rdx; i < sizeof(struct mov_reg); i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, mov_rsi));
-		for (i = 0, p = (unsigned char *)&blob.mov_rsi; i < sizeof(struct mov_reg); i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, mov_rdi));
-		for (i = 0, p = (unsigned char *)&blob.mov_rdi; i < sizeof(struct mov_reg); i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, call));
-		for (i = 0, p = (unsigned char *)&blob.call; i < 5; i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-
-		pr_msg("%lx: ", where + offsetof(struct x86_64_call_cmd, int3));
-		for (i = 0, p = (unsigned char *)&blob.int3; i < 1; i++, p++)
-			pr_msg("%02x ", *p);
-		pr_msg("\n");
-	}
-#endif
-	*code = &blob;
-	return sizeof(blob);
-}
-
-ssize_t x86_64_dlopen(uint64_t dlopen_addr, uint64_t name_addr,
-		      uint64_t where,
-		      void **code)
-{
-	return x86_64_call(dlopen_addr, where,
-			   name_addr, 1, 0,
-			   0, 0, 0,
-			   code);
-}
-
-ssize_t x86_64_dlclose(uint64_t dlopen_addr, uint64_t handle,
-		       uint64_t where,
-		       void **code)
-{
-	return x86_64_call(dlopen_addr, where,
-			   handle, 0, 0,
-			   0, 0, 0,
-			   code);
+	int offset;
+	int err;
+
+	err = ip_gen_offset(next_ip, tgt_pos, 4, &offset);
+	if (err)
+		return err;
+
+	*rel = offset;
+	return 0;
+}
+
+/*
+ * Instruction length decoder. Only the layout of the instruction is
+ * decoded (prefixes, opcode, ModRM, SIB, displacement and immediate), which
+ * is enough to sweep the code and to find RIP-relative operands.
+ */
+static bool x86_invalid_onebyte(uint8_t op)
+{
+	switch (op) {
+	case 0x06: case 0x07: case 0x0e: case 0x16: case 0x17:
+	case 0x1e: case 0x1f: case 0x27: case 0x2f: case 0x37:
+	case 0x3f: case 0x60: case 0x61: case 0x82: case 0x9a:
+	case 0xce: case 0xd4: case 0xd5: case 0xd6: case 0xea:
+		return true;
+	}
+	return false;
+}
+
+static bool x86_onebyte_modrm(uint8_t op)
+{
+	if (op < 0x40)
+		return (op & 0x07) < 4;
+
+	switch (op) {
+	case 0x63: case 0x69: case 0x6b:
+	case 0x80 ... 0x8f:
+	case 0xc0: case 0xc1: case 0xc6: case 0xc7:
+	case 0xd0 ... 0xd3:
+	case 0xd8 ... 0xdf:
+	case 0xf6: case 0xf7: case 0xfe: case 0xff:
+		return true;
+	}
+	return false;
+}
+
+static int x86_onebyte_imm(uint8_t op, uint8_t modrm, int z, bool rex_w,
+			   bool addr32)
+{
+	if (op < 0x40) {
+		if ((op & 0x07) == 4)
+			return 1;
+		if ((op & 0x07) == 5)
+			return z;
+		return 0;
+	}
+
+	switch (op) {
+	case 0x68: case 0x69: case 0x81: case 0xa9: case 0xc7:
+		return z;
+	case 0xe8: case 0xe9:
+		return 4;
+	case 0x6a: case 0x6b: case 0x80: case 0x83: case 0xa8:
+	case 0xc0: case 0xc1: case 0xc6: case 0xcd: case 0xeb:
+	case 0x70 ... 0x7f:
+	case 0xb0 ... 0xb7:
+	case 0xe0 ... 0xe7:
+		return 1;
+	case 0xc2: case 0xca:
+		return 2;
+	case 0xc8:
+		return 3;
+	case 0xa0 ... 0xa3:
+		return addr32 ? 4 : 8;
+	case 0xb8 ... 0xbf:
+		return rex_w ? 8 : z;
+	case 0xf6:
+		return ((modrm >> 3) & 0x07) < 2 ? 1 : 0;
+	case 0xf7:
+		return ((modrm >> 3) & 0x07) < 2 ? z : 0;
+	}
+	return 0;
+}
+
+static bool x86_invalid_twobyte(uint8_t op)
+{
+	switch (op) {
+	case 0x04: case 0x0a: case 0x0c:
+	case 0x24 ... 0x27:
+	case 0x36: case 0x39:
+	case 0x3b ... 0x3f:
+	case 0x7a: case 0x7b: case 0xa6: case 0xa7:
+		return true;
+	}
+	return false;
+}
+
+static bool x86_twobyte_modrm(uint8_t op)
+{
+	switch (op) {
+	case 0x05 ... 0x09: case 0x0b: case 0x0e:
+	case 0x30 ... 0x37:
+	case 0x77:
+	case 0x80 ... 0x8f:
+	case 0xa0 ... 0xa2:
+	case 0xa8 ... 0xaa:
+	case 0xc8 ... 0xcf:
+		return false;
+	}
+	return true;
+}
+
+/* Immediate size of map 1 (0x0f) instructions, VEX and EVEX included */
+static int x86_twobyte_imm(uint8_t op)
+{
+	switch (op) {
+	case 0x80 ... 0x8f:
+		return 4;
+	case 0x0f:
+	case 0x70 ... 0x73:
+	case 0xa4: case 0xac: case 0xba:
+	case 0xc2: case 0xc4 ... 0xc6:
+		return 1;
+	}
+	return 0;
+}
+
+int x86_insn_decode(const uint8_t *code, size_t size, struct x86_insn *insn)
+{
+	size_t max = (size < X86_MAX_INSN_SIZE) ? size : X86_MAX_INSN_SIZE;
+	bool opsz16 = false, addr32 = false, rex_w = false;
+	bool has_modrm;
+	uint8_t modrm = 0;
+	size_t i = 0;
+	int imm, z;
+
+	memset(insn, 0, sizeof(*insn));
+
+	for (; i < max; i++) {
+		switch (code[i]) {
+		case 0x66:
+			opsz16 = true;
+			continue;
+		case 0x67:
+			addr32 = true;
+			continue;
+		case 0xf0: case 0xf2: case 0xf3:
+		case 0x26: case 0x2e: case 0x36: case 0x3e:
+		case 0x64: case 0x65:
+			continue;
+		}
+		break;
+	}
+
+	if ((i < max) && ((code[i] & 0xf0) == 0x40))
+		rex_w = code[i++] & 0x08;
+
+	if (i >= max)
+		return -EINVAL;
+
+	z = (opsz16 && !rex_w) ? 2 : 4;
+
+	switch (code[i]) {
+	case 0xc5:
+		/* Two byte VEX */
+		insn->map = 1;
+		i += 2;
+		break;
+	case 0xc4:
+		/* Three byte VEX */
+		if (i + 1 >= max)
+			return -EINVAL;
+		insn->map = code[i + 1] & 0x1f;
+		i += 3;
+		break;
+	case 0x62:
+		/* EVEX */
+		if (i + 1 >= max)
+			return -EINVAL;
+		insn->map = code[i + 1] & 0x07;
+		i += 4;
+		break;
+	case 0x8f:
+		/* XOP, if it is not POP r/m */
+		if ((i + 1 < max) && ((code[i + 1] & 0x1f) >= 8)) {
+			insn->map = code[i + 1] & 0x1f;
+			i += 3;
+		}
+		break;
+	case 0x0f:
+		if (i + 1 >= max)
+			return -EINVAL;
+		insn->map = 1;
+		i++;
+		if ((code[i] == 0x38) || (code[i] == 0x3a)) {
+			insn->map = (code[i] == 0x38) ? 2 : 3;
+			i++;
+		}
+		break;
+	}
+
+	if (i >= max)
+		return -EINVAL;
+
+	insn->opcode_off = i;
+	insn->opcode = code[i++];
+
+	switch (insn->map) {
+	case 0:
+		if (x86_invalid_onebyte(insn->opcode))
+			return -EINVAL;
+		has_modrm = x86_onebyte_modrm(insn->opcode);
+		break;
+	case 1:
+		if (x86_invalid_twobyte(insn->opcode))
+			return -EINVAL;
+		has_modrm = x86_twobyte_modrm(insn->opcode);
+		break;
+	default:
+		has_modrm = true;
+		break;
+	}
+
+	if (has_modrm) {
+		uint8_t mod, rm;
+
+		if (i >= max)
+			return -EINVAL;
+
+		insn->modrm_off = i;
+		modrm = code[i++];
+		mod = modrm >> 6;
+		rm = modrm & 0x07;
+
+		if (mod != 3) {
+			if (rm == 4) {
+				if (i >= max)
+					return -EINVAL;
+				if ((mod == 0) && ((code[i] & 0x07) == 5))
+					insn->disp_size = 4;
+				i++;
+			} else if ((mod == 0) && (rm == 5)) {
+				insn->disp_size = 4;
+				insn->rip_rel = true;
+			}
+			if (mod == 1)
+				insn->disp_size = 1;
+			else if (mod == 2)
+				insn->disp_size = 4;
+		}
+		if (insn->disp_size) {
+			insn->disp_off = i;
+			i += insn->disp_size;
+		}
+	}
+
+	switch (insn->map) {
+	case 0:
+		imm = x86_onebyte_imm(insn->opcode, modrm, z, rex_w, addr32);
+		break;
+	case 1:
+		imm = x86_twobyte_imm(insn->opcode);
+		break;
+	case 3:
+	case 8:
+		imm = 1;
+		break;
+	case 0xa:
+		imm = 4;
+		break;
+	default:
+		imm = 0;
+		break;
+	}
+
+	if (imm) {
+		insn->imm_off = i;
+		insn->imm_size = imm;
+		i += imm;
+	}
+
+	if (i > max)
+		return -EINVAL;
+
+	insn->length = i;
+	return i;
+}
+
+static const uint8_t x86_64_trampoline_code[] = {
+	/* X86_64_TRAMPOLINE_CALL */
+	0xff, 0xd0,				/* call   *%rax			*/
+	0xcc,					/* int3				*/
+	0x0f, 0x1f, 0x44, 0x00, 0x00,		/* nopl   0x0(%rax,%rax,1)	*/
+
+	/* X86_64_TRAMPOLINE_SYSCALL */
+	0x49, 0x89, 0xca,			/* mov    %rcx,%r10		*/
+	0x0f, 0x05,				/* syscall			*/
+	0xcc,					/* int3				*/
+	0x66, 0x90,				/* xchg   %ax,%ax		*/
+
+	/* X86_64_TRAMPOLINE_BATCH */
+	0x4d, 0x85, 0xed,			/* 10: test   %r13,%r13		*/
+	0x74, 0x68,				/*     je     7d		*/
+	0x41, 0x0f, 0xb6, 0x44, 0x24, 0x0c,	/*     movzbl 0xc(%r12),%eax	*/
+	0x85, 0xc0,				/*     test   %eax,%eax		*/
+	0x74, 0x05,				/*     je     24		*/
+	0x4d, 0x89, 0x74, 0xc4, 0x08,		/*     mov    %r14,0x8(%r12,%rax,8) */
+	0x49, 0x8b, 0x7c, 0x24, 0x10,		/* 24: mov    0x10(%r12),%rdi	*/
+	0x49, 0x8b, 0x74, 0x24, 0x18,		/*     mov    0x18(%r12),%rsi	*/
+	0x49, 0x8b, 0x54, 0x24, 0x20,		/*     mov    0x20(%r12),%rdx	*/
+	0x49, 0x8b, 0x4c, 0x24, 0x28,		/*     mov    0x28(%r12),%rcx	*/
+	0x4d, 0x8b, 0x44, 0x24, 0x30,		/*     mov    0x30(%r12),%r8	*/
+	0x4d, 0x8b, 0x4c, 0x24, 0x38,		/*     mov    0x38(%r12),%r9	*/
+	0x49, 0x8b, 0x04, 0x24,			/*     mov    (%r12),%rax	*/
+	0x41, 0x83, 0x7c, 0x24, 0x08, 0x00,	/*     cmpl   $0x0,0x8(%r12)	*/
+	0x75, 0x04,				/*     jne    52		*/
+	0xff, 0xd0,				/*     call   *%rax		*/
+	0xeb, 0x0d,				/*     jmp    5f		*/
+	0x49, 0x89, 0xca,			/* 52: mov    %rcx,%r10		*/
+	0x0f, 0x05,				/*     syscall			*/
+	0x48, 0x3d, 0x01, 0xf0, 0xff, 0xff,	/*     cmp    $-4095,%rax	*/
+	0x73, 0x19,				/*     jae    78		*/
+	0x49, 0x89, 0x44, 0x24, 0x40,		/* 5f: mov    %rax,0x40(%r12)	*/
+	0x41, 0xf6, 0x44, 0x24, 0x0d, 0x01,	/*     testb  $0x1,0xd(%r12)	*/
+	0x74, 0x03,				/*     je     6f		*/
+	0x49, 0x89, 0xc6,			/*     mov    %rax,%r14		*/
+	0x49, 0x83, 0xc4, 0x50,			/* 6f: add    $0x50,%r12	*/
+	0x49, 0xff, 0xcd,			/*     dec    %r13		*/
+	0xeb, 0x98,				/*     jmp    10		*/
+	0x49, 0x89, 0x44, 0x24, 0x40,		/* 78: mov    %rax,0x40(%r12)	*/
+	0xcc,					/* 7d: int3			*/
+};
+
+static const uint8_t x86_64_timer_code[] = {
+	/* X86_64_TIMER_HOOK */
+	0x48, 0x83, 0xec, 0x08,			/* 00: sub    $0x8,%rsp		*/
+	0x50,					/*     push   %rax		*/
+	0x52,					/*     push   %rdx		*/
+	0x51,					/*     push   %rcx		*/
+	0x56,					/*     push   %rsi		*/
+	0x57,					/*     push   %rdi		*/
+	0x48, 0x8d, 0x7c, 0x24, 0x28,		/*     lea    0x28(%rsp),%rdi	*/
+	0x48, 0x89, 0xf9,			/*     mov    %rdi,%rcx		*/
+	0x48, 0xc1, 0xe9, 0x04,			/*     shr    $0x4,%rcx		*/
+	0x81, 0xe1, 0xff, 0x03, 0x00, 0x00,	/*     and    $0x3ff,%ecx	*/
+	0x48, 0xc1, 0xe1, 0x05,			/*     shl    $0x5,%rcx		*/
+	0x48, 0x8d, 0x05, 0xda, 0x7f, 0xff, 0xff, /*     lea    frames(%rip),%rax */
+	0x48, 0x01, 0xc1,			/*     add    %rax,%rcx		*/
+	0x0f, 0x31,				/*     rdtsc			*/
+	0x48, 0xc1, 0xe2, 0x20,			/*     shl    $0x20,%rdx	*/
+	0x48, 0x09, 0xc2,			/*     or     %rax,%rdx		*/
+	0x48, 0x8b, 0x41, 0x10,			/*     mov    0x10(%rcx),%rax	*/
+	0x48, 0x29, 0xc2,			/*     sub    %rax,%rdx		*/
+	0x48, 0x8b, 0x71, 0x08,			/*     mov    0x8(%rcx),%rsi	*/
+	0x48, 0x89, 0x74, 0x24, 0x28,		/*     mov    %rsi,0x28(%rsp)	*/
+	0x48, 0x8b, 0x71, 0x18,			/*     mov    0x18(%rcx),%rsi	*/
+	0x48, 0xc7, 0x01, 0x00, 0x00, 0x00, 0x00, /*     movq   $0x0,(%rcx)	*/
+	0xe8, 0x7e, 0x00, 0x00, 0x00,		/*     call   account		*/
+	0x5f,					/*     pop    %rdi		*/
+	0x5e,					/*     pop    %rsi		*/
+	0x59,					/*     pop    %rcx		*/
+	0x5a,					/*     pop    %rdx		*/
+	0x58,					/*     pop    %rax		*/
+	0xc3,					/*     ret			*/
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,	/*     int3 (padding)		*/
+	0xcc, 0xcc,
+
+	/* X86_64_TIMER_ENTER */
+	0x48, 0x8d, 0x05, 0x99, 0xff, 0xff, 0xff, /* 60: lea    00(%rip),%rax	*/
+	0x48, 0x39, 0x44, 0x24, 0x30,		/*     cmp    %rax,0x30(%rsp)	*/
+	0x74, 0x57,				/*     je     c5		*/
+	0x48, 0x8d, 0x7c, 0x24, 0x30,		/*     lea    0x30(%rsp),%rdi	*/
+	0x48, 0x89, 0xf9,			/*     mov    %rdi,%rcx		*/
+	0x48, 0xc1, 0xe9, 0x04,			/*     shr    $0x4,%rcx		*/
+	0x81, 0xe1, 0xff, 0x03, 0x00, 0x00,	/*     and    $0x3ff,%ecx	*/
+	0x48, 0xc1, 0xe1, 0x05,			/*     shl    $0x5,%rcx		*/
+	0x48, 0x8d, 0x05, 0x75, 0x7f, 0xff, 0xff, /*     lea    frames(%rip),%rax */
+	0x48, 0x01, 0xc1,			/*     add    %rax,%rcx		*/
+	0x31, 0xc0,				/*     xor    %eax,%eax		*/
+	0xf0, 0x48, 0x0f, 0xb1, 0x39,		/*     lock cmpxchg %rdi,(%rcx) */
+	0x74, 0x05,				/*     je     9c		*/
+	0x48, 0x39, 0xf8,			/*     cmp    %rdi,%rax		*/
+	0x75, 0x29,				/*     jne    c5		*/
+	0x48, 0x8b, 0x44, 0x24, 0x30,		/* 9c: mov    0x30(%rsp),%rax	*/
+	0x48, 0x89, 0x41, 0x08,			/*     mov    %rax,0x8(%rcx)	*/
+	0x48, 0x89, 0x71, 0x18,			/*     mov    %rsi,0x18(%rcx)	*/
+	0x0f, 0x31,				/*     rdtsc			*/
+	0x48, 0xc1, 0xe2, 0x20,			/*     shl    $0x20,%rdx	*/
+	0x48, 0x09, 0xc2,			/*     or     %rax,%rdx		*/
+	0x48, 0x89, 0x51, 0x10,			/*     mov    %rdx,0x10(%rcx)	*/
+	0x48, 0x8d, 0x05, 0x43, 0xff, 0xff, 0xff, /*     lea    00(%rip),%rax	*/
+	0x48, 0x89, 0x44, 0x24, 0x30,		/*     mov    %rax,0x30(%rsp)	*/
+	0x31, 0xc0,				/*     xor    %eax,%eax		*/
+	0xc3,					/*     ret			*/
+	0xb8, 0x01, 0x00, 0x00, 0x00,		/* c5: mov    $0x1,%eax		*/
+	0xc3,					/*     ret			*/
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc,		/*     int3 (padding)		*/
+};
+
+bool x86_64_timer_hook(const uint8_t *code)
+{
+	return !memcmp(code, x86_64_timer_code, sizeof(x86_64_timer_code));
+}
+
+uint64_t x86_64_timer_frame(uint64_t hook, uint64_t sp)
+{
+	uint64_t idx = (sp >> 4) & (X86_64_TIMER_NR_FRAMES - 1);
+
+	return hook - X86_64_TIMER_FRAMES_SIZE +
+	       idx * sizeof(struct x86_64_timer_frame);
+}
+
+static void x86_64_timer(uint8_t *code)
+{
+	BUILD_BUG_ON(sizeof(x86_64_timer_code) != X86_64_TIMER_SIZE);
+	BUILD_BUG_ON(X86_64_TIMER_NR_FRAMES *
+		     sizeof(struct x86_64_timer_frame) !=
+		     X86_64_TIMER_FRAMES_SIZE);
+
+	memcpy(code, x86_64_timer_code, sizeof(x86_64_timer_code));
+}
+
+/* Offsets are from the timer code start */
+static const uint8_t x86_64_canary_code[] = {
+	/* Accounting */
+	0x89, 0xf7,				/* d0: mov    %esi,%edi		*/
+	0x83, 0xe7, 0x01,			/*     and    $0x1,%edi		*/
+	0x48, 0x83, 0xe6, 0xfe,			/*     and    $-2,%rsi		*/
+	0xf0, 0x48, 0x01, 0x54, 0xfe, 0x18,	/*     lock add %rdx,0x18(%rsi,%rdi,8) */
+	0xf0, 0x48, 0xff, 0x44, 0xfe, 0x28,	/*     lock incq 0x28(%rsi,%rdi,8) */
+	0xc3,					/*     ret			*/
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,	/*     int3 (padding)		*/
+	0xcc, 0xcc, 0xcc, 0xcc,
+
+	/* X86_64_CANARY_DISPATCH */
+	0x50,					/* f0: push   %rax		*/
+	0x52,					/*     push   %rdx		*/
+	0x51,					/*     push   %rcx		*/
+	0x56,					/*     push   %rsi		*/
+	0x57,					/*     push   %rdi		*/
+	0x49, 0x8b, 0x73, 0x10,			/*     mov    0x10(%r11),%rsi	*/
+	0x0f, 0x31,				/*     rdtsc			*/
+	0x31, 0xc9,				/*     xor    %ecx,%ecx		*/
+	0x0f, 0xb7, 0xc0,			/*     movzwl %ax,%eax		*/
+	0x3b, 0x06,				/*     cmp    (%rsi),%eax	*/
+	0x0f, 0x92, 0xc1,			/*     setb   %cl		*/
+	0xf0, 0x48, 0xff, 0x44, 0xce, 0x08,	/*     lock incq 0x8(%rsi,%rcx,8) */
+	0x4d, 0x8b, 0x1c, 0xcb,			/*     mov    (%r11,%rcx,8),%r11 */
+	0x83, 0x7e, 0x04, 0x00,			/*     cmpl   $0x0,0x4(%rsi)	*/
+	0x74, 0x08,				/*     je     11d		*/
+	0x48, 0x09, 0xce,			/*     or     %rcx,%rsi		*/
+	0xe8, 0x43, 0xff, 0xff, 0xff,		/*     call   enter		*/
+	0x5f,					/* 11d: pop    %rdi		*/
+	0x5e,					/*     pop    %rsi		*/
+	0x59,					/*     pop    %rcx		*/
+	0x5a,					/*     pop    %rdx		*/
+	0x58,					/*     pop    %rax		*/
+	0x41, 0xff, 0xe3,			/*     jmp    *%r11		*/
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,	/*     int3 (padding)		*/
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc,
+};
+
+void x86_64_canary(uint8_t *code)
+{
+	BUILD_BUG_ON(X86_64_TIMER_SIZE + sizeof(x86_64_canary_code) !=
+		     X86_64_CANARY_SIZE);
+
+	x86_64_timer(code);
+	memcpy(code + X86_64_TIMER_SIZE, x86_64_canary_code,
+	       sizeof(x86_64_canary_code));
+}
+
+/* Offsets are from the timer code start */
+static const uint8_t x86_64_probe_code[] = {
+	/* Accounting */
+	0xbf, 0x01, 0x00, 0x00, 0x00,		/* d0: mov    $0x1,%edi		*/
+	0xf0, 0x48, 0x0f, 0xc1, 0x3e,		/*     lock xadd %rdi,(%rsi)	*/
+	0x81, 0xe7, 0xff, 0x03, 0x00, 0x00,	/*     and    $0x3ff,%edi	*/
+	0xc1, 0xe7, 0x04,			/*     shl    $0x4,%edi		*/
+	0x48, 0x8d, 0x7c, 0x3e, 0x40,		/*     lea    0x40(%rsi,%rdi,1),%rdi */
+	0x48, 0x89, 0x07,			/*     mov    %rax,(%rdi)	*/
+	0x48, 0x01, 0xc2,			/*     add    %rax,%rdx		*/
+	0x48, 0x89, 0x57, 0x08,			/*     mov    %rdx,0x8(%rdi)	*/
+	0xc3,					/*     ret			*/
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,	/*     int3 (padding)		*/
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,
+	0xcc,
+
+	/* X86_64_PROBE_ENTRY */
+	0x50,					/* 100: push   %rax		*/
+	0x52,					/*     push   %rdx		*/
+	0x51,					/*     push   %rcx		*/
+	0x56,					/*     push   %rsi		*/
+	0x57,					/*     push   %rdi		*/
+	0x64, 0x48, 0x8b, 0x04, 0x25, 0x00, 0x00, 0x00, 0x00, /*     mov    %fs:0x0,%rax */
+	0x48, 0xc1, 0xe8, 0x0c,			/*     shr    $0xc,%rax		*/
+	0x69, 0xc0, 0x47, 0x86, 0xc8, 0x61,	/*     imul   $0x61c88647,%eax,%eax */
+	0xc1, 0xe8, 0x1a,			/*     shr    $0x1a,%eax	*/
+	0x69, 0xc0, 0x40, 0x40, 0x00, 0x00,	/*     imul   $0x4040,%eax,%eax	*/
+	0x48, 0x8d, 0x35, 0x00, 0x00, 0x00, 0x00, /* 121: lea    rings(%rip),%rsi */
+	0x48, 0x01, 0xc6,			/*     add    %rax,%rsi		*/
+	0xf0, 0x48, 0xff, 0x46, 0x08,		/*     lock incq 0x8(%rsi)	*/
+	0xe8, 0x2b, 0xff, 0xff, 0xff,		/*     call   enter		*/
+	0x85, 0xc0,				/*     test   %eax,%eax		*/
+	0x74, 0x05,				/*     je     13e		*/
+	0xf0, 0x48, 0xff, 0x46, 0x10,		/*     lock incq 0x10(%rsi)	*/
+	0x5f,					/* 13e: pop    %rdi		*/
+	0x5e,					/*     pop    %rsi		*/
+	0x59,					/*     pop    %rcx		*/
+	0x5a,					/*     pop    %rdx		*/
+	0x58,					/*     pop    %rax		*/
+};
+
+/* Offset of rings reference (next instruction follows) */
+#define X86_64_PROBE_RINGS_REF		0x124
+
+void x86_64_probe(uint8_t *code, int64_t rings_off)
+{
+	int32_t rel;
+
+	BUILD_BUG_ON(X86_64_TIMER_SIZE + sizeof(x86_64_probe_code) !=
+		     X86_64_PROBE_SIZE);
+
+	x86_64_timer(code);
+	memcpy(code + X86_64_TIMER_SIZE, x86_64_probe_code,
+	       sizeof(x86_64_probe_code));
+
+	rel = rings_off - (X86_64_PROBE_RINGS_REF + sizeof(rel));
+	memcpy(code + X86_64_PROBE_RINGS_REF, &rel, sizeof(rel));
+}
+
+const void *x86_64_trampoline(size_t *size)
+{
+	BUILD_BUG_ON(sizeof(x86_64_trampoline_code) > X86_64_TRAMPOLINE_SIZE);
+	BUILD_BUG_ON(sizeof(struct x86_64_batch_cmd) != 0x50);
+
+	*size = sizeof(x86_64_trampoline_code);
+	return x86_64_trampoline_code;
 }
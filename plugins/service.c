@@ -14,6 +14,13 @@
 #include <fcntl.h>
 #include <link.h>
 #include <gelf.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unwind.h>
+#include <linux/futex.h>
 
 #include <compel/asm/sigframe.h>
 
@@ -25,6 +32,9 @@ static int listen_sock;
 static int cmd_sock = -1;
 static int nsb_service_stop;
 
+static int agent_sock = -1;
+static pid_t agent_pid;
+
 struct rt_sigframe emergency_sigframe;
 
 static void emergency_sigreturn(void)
@@ -70,13 +80,14 @@ static ssize_t nsb_service_receive_request(struct nsb_service_request *rq,
 
 struct nsb_response_data {
 	ssize_t	used;
+	size_t	size;
 	char	*data;
 };
 
 static void nsb_service_response_print(struct nsb_response_data *rd,
 				       const char *fmt, ...)
 {
-	size_t left = NSB_SERVICE_MESSAGE_DATA_SIZE - rd->used;
+	size_t left = rd->size - rd->used;
 	va_list ap;
 	int __errno_saved = errno;
 	ssize_t n;
@@ -86,7 +97,7 @@ static void nsb_service_response_print(struct nsb_response_data *rd,
 
 	va_start(ap, fmt);
 	n = vsnprintf(rd->data + rd->used, left, fmt, ap);
-	rd->used += n + 1;
+	rd->used += (n < left) ? n + 1 : left;
 	va_end(ap);
 
 	errno = __errno_saved;
@@ -136,12 +147,11 @@ static int nsb_service_cmd_munmap(const void *data, size_t size,
 	const struct nsb_service_munmap_request *rq = data;
 	const struct nsb_service_map_addr_info *mai;
 	int nr, err;
-	size_t max_munmaps = NSB_SERVICE_MUNMAP_DATA_SIZE_MAX / sizeof(*mai);
 
-	if (rq->nr_munmaps > max_munmaps) {
-		nsb_service_response_print(rd, "too many numap requests: %d (max: %ld)",
-				rq->nr_munmaps, max_munmaps);
-		return -E2BIG;
+	if ((size < sizeof(*rq)) ||
+	    (rq->nr_munmaps > (size - sizeof(*rq)) / sizeof(*mai))) {
+		nsb_service_response_print(rd, "munmap request is truncated");
+		return -EINVAL;
 	}
 
 	for (nr = 0, mai = rq->munmap; nr < rq->nr_munmaps; nr++, mai++) {
@@ -175,6 +185,18 @@ static int nsb_service_cmd_do_mmap(int fd,
 				mi->prot, mi->flags, mi->offset);
 		return -errno;
 	}
+	if (address != (void *)mai->addr) {
+		/*
+		 * Kernel without MAP_FIXED_NOREPLACE treats it as a hint: only
+		 * the mapping, created elsewhere, is removed, the requested
+		 * range belongs to the process.
+		 */
+		munmap(address, mai->length);
+		nsb_service_response_print(rd,
+				"address %#lx-%#lx is busy",
+				mai->addr, mai->addr + mai->length);
+		return -EBUSY;
+	}
 	return 0;
 }
 
@@ -184,15 +206,14 @@ static int nsb_service_cmd_mmap(const void *data, size_t size,
 	const struct nsb_service_mmap_request *rq = data;
 	const struct nsb_service_mmap_info *mi;
 	int nr, err;
-	size_t max_mmaps = NSB_SERVICE_MMAP_DATA_SIZE_MAX / sizeof(*mi);
 
-	if (rq->nr_mmaps > max_mmaps) {
-		nsb_service_response_print(rd, "too many map requests: %d (max: %ld)",
-				rq->nr_mmaps, max_mmaps);
-		return -E2BIG;
+	if ((size < sizeof(*rq)) ||
+	    (rq->nr_mmaps > (size - sizeof(*rq)) / sizeof(*mi))) {
+		nsb_service_response_print(rd, "mmap request is truncated");
+		return -EINVAL;
 	}
 
-	if (rq->nr_mmaps != 2) {
+	if (!rq->nr_mmaps) {
 		nsb_service_response_print(rd, "rq->nr_mmaps: %d",
 				rq->nr_mmaps);
 		return -EINVAL;
@@ -208,11 +229,250 @@ static int nsb_service_cmd_mmap(const void *data, size_t size,
 	return 0;
 
 unmap:
-	for (; nr > 0; nr--, mi--)
-		(void)nsb_service_cmd_do_munmap(&mi->info, rd);
+	/* Only the mappings, created by this request, are removed */
+	while (nr--)
+		(void)nsb_service_cmd_do_munmap(&rq->mmap[nr].info, rd);
+	return err;
+}
+
+#define NSB_SERVICE_WRITE_VMAS_MAX	8
+
+struct nsb_service_vma_prot {
+	uint64_t start;
+	uint64_t end;
+	int prot;
+};
+
+/*
+ * Collects protections of the mappings, which cover the range. Other threads
+ * can change them at any moment, but the patch mappings are not known to the
+ * process yet.
+ */
+static int nsb_service_collect_prots(uint64_t start, uint64_t end,
+				     struct nsb_service_vma_prot *vp,
+				     struct nsb_response_data *rd)
+{
+	uint64_t vm_start, vm_end, pos = start;
+	char line[512], r, w, x;
+	int nr = 0, err = -EFAULT;
+	FILE *f;
+
+	f = fopen("/proc/self/maps", "re");
+	if (!f) {
+		nsb_service_response_print(rd, "failed to open maps");
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx %c%c%c", &vm_start, &vm_end,
+			   &r, &w, &x) != 5)
+			continue;
+		if (vm_end <= pos)
+			continue;
+		if (vm_start > pos)
+			break;
+
+		if (nr == NSB_SERVICE_WRITE_VMAS_MAX) {
+			err = -E2BIG;
+			break;
+		}
+
+		vp[nr].start = pos;
+		vp[nr].end = (vm_end < end) ? vm_end : end;
+		vp[nr].prot = ((r == 'r') ? PROT_READ : 0) |
+			      ((w == 'w') ? PROT_WRITE : 0) |
+			      ((x == 'x') ? PROT_EXEC : 0);
+		pos = vp[nr++].end;
+		if (pos == end) {
+			err = nr;
+			break;
+		}
+	}
+	fclose(f);
+
+	if (err < 0)
+		nsb_service_response_print(rd,
+				"%#lx-%#lx is not covered by mappings",
+				start, end);
 	return err;
 }
 
+/*
+ * Every mapping in the range gets its own protection back.
+ */
+static int nsb_service_cmd_do_write(const struct nsb_service_write *w,
+				    struct nsb_response_data *rd)
+{
+	struct nsb_service_vma_prot vp[NSB_SERVICE_WRITE_VMAS_MAX];
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start = w->addr & ~(page - 1);
+	uint64_t end = (w->addr + w->size + page - 1) & ~(page - 1);
+	int nr, i, err = 0;
+
+	nr = nsb_service_collect_prots(start, end, vp, rd);
+	if (nr < 0)
+		return nr;
+
+	for (i = 0; i < nr; i++) {
+		if (vp[i].prot & PROT_WRITE)
+			continue;
+
+		if (mprotect((void *)vp[i].start, vp[i].end - vp[i].start,
+			     vp[i].prot | PROT_WRITE)) {
+			nsb_service_response_print(rd,
+					"failed to make %#lx-%#lx writable",
+					vp[i].start, vp[i].end);
+			err = -errno;
+			break;
+		}
+	}
+
+	if (!err)
+		memcpy((void *)w->addr, w->data, w->size);
+
+	while (i-- > 0) {
+		if (vp[i].prot & PROT_WRITE)
+			continue;
+
+		if (mprotect((void *)vp[i].start, vp[i].end - vp[i].start,
+			     vp[i].prot)) {
+			nsb_service_response_print(rd,
+					"failed to restore %#lx-%#lx protection %#x",
+					vp[i].start, vp[i].end, vp[i].prot);
+			if (!err)
+				err = -errno;
+		}
+	}
+	return err;
+}
+
+static int nsb_service_cmd_write(const void *data, size_t size,
+				 struct nsb_response_data *rd)
+{
+	const struct nsb_service_write_request *rq = data;
+	const uint8_t *pos = rq->writes;
+	const uint8_t *end = (const uint8_t *)data + size;
+	size_t nr;
+	int err;
+
+	if (size < sizeof(*rq)) {
+		nsb_service_response_print(rd, "write request is truncated");
+		return -EINVAL;
+	}
+
+	for (nr = 0; nr < rq->nr_writes; nr++) {
+		const struct nsb_service_write *w = (const void *)pos;
+
+		if ((pos + sizeof(*w) > end) ||
+		    (pos + NSB_SERVICE_WRITE_SIZE(w->size) > end)) {
+			nsb_service_response_print(rd,
+					"write %ld is truncated", nr);
+			return -EINVAL;
+		}
+
+		err = nsb_service_cmd_do_write(w, rd);
+		if (err)
+			return err;
+
+		pos += NSB_SERVICE_WRITE_SIZE(w->size);
+	}
+	return 0;
+}
+
+static int nsb_service_relocs_protect(uint64_t start, uint64_t end, int prot,
+				      struct nsb_response_data *rd)
+{
+	if (mprotect((void *)start, end - start, prot)) {
+		nsb_service_response_print(rd,
+				"failed to change %#lx-%#lx protection to %#x",
+				start, end, prot);
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Read-only pages are made writable for a run of relocations, which belong
+ * to the same pages, and their protection is restored afterwards.
+ */
+static int nsb_service_cmd_relocs(const void *data, size_t size,
+				  struct nsb_response_data *rd)
+{
+	const struct nsb_service_relocs_request *rq = data;
+	struct nsb_service_relocs_response *rs = (void *)rd->data;
+	const struct nsb_service_reloc *r;
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start = 0, end = 0, hash = NSB_SERVICE_FNV64_OFFSET;
+	int prot = 0, err = 0;
+	size_t nr;
+
+	if ((size < sizeof(*rq)) ||
+	    (rq->nr_relocs > (size - sizeof(*rq)) / sizeof(*r))) {
+		nsb_service_response_print(rd, "relocations request is truncated");
+		return -EINVAL;
+	}
+
+	if (rd->size < sizeof(*rs)) {
+		nsb_service_response_print(rd, "no space for checksum");
+		return -E2BIG;
+	}
+
+	for (nr = 0, r = rq->reloc; nr < rq->nr_relocs; nr++, r++) {
+		uint64_t r_start = r->addr & ~(page - 1);
+		uint64_t r_end = (r->addr + r->size + page - 1) & ~(page - 1);
+
+		if ((r->size != 4) && (r->size != 8)) {
+			nsb_service_response_print(rd,
+					"relocation %#lx has size %d",
+					r->addr, r->size);
+			err = -EINVAL;
+			break;
+		}
+
+		if (!(r->prot & PROT_WRITE) &&
+		    ((r_start < start) || (r_end > end) || (r->prot != prot))) {
+			if (end) {
+				err = nsb_service_relocs_protect(start, end,
+								 prot, rd);
+				if (err)
+					break;
+			}
+
+			err = nsb_service_relocs_protect(r_start, r_end,
+							 r->prot | PROT_WRITE, rd);
+			if (err) {
+				end = 0;
+				break;
+			}
+
+			start = r_start;
+			end = r_end;
+			prot = r->prot;
+		}
+
+		memcpy((void *)r->addr, &r->value, r->size);
+	}
+
+	if (end) {
+		int ret;
+
+		ret = nsb_service_relocs_protect(start, end, prot, rd);
+		if (!err)
+			err = ret;
+	}
+
+	if (err)
+		return err;
+
+	for (nr = 0, r = rq->reloc; nr < rq->nr_relocs; nr++, r++)
+		hash = nsb_service_reloc_hash(hash, r->addr,
+					      (const void *)r->addr, r->size);
+
+	rs->checksum = hash;
+	rd->used = sizeof(*rs);
+	return 0;
+}
+
 static int64_t nsb_service_dynamic_tag_val(const GElf_Dyn *l_ld, uint32_t d_tag)
 {
 	const GElf_Dyn *d;
@@ -230,14 +490,16 @@ static int nsb_service_cmd_needed_list(const void *data, size_t size,
 	struct nsb_service_needed_list *nl = (void *)rd->data;
         struct link_map *lm;
 	size_t nr = 0;
-	size_t max_base_addrs = NSB_SERVICE_NEEDED_LIST_SIZE_MAX /
+	size_t max_base_addrs = (rd->size - sizeof(nl->nr_addrs)) /
 						sizeof(nl->address);
 
-	lm = _r_debug.r_map;
-
-	do {
+	for (lm = _r_debug.r_map; lm; lm = lm->l_next) {
 		int64_t dt_symtab_addr;
 
+		/* Skip this module */
+		if (lm->l_ld == _DYNAMIC)
+			continue;
+
 		if (nr == max_base_addrs) {
 			rd->used = 0;
 			nsb_service_response_print(rd, "to many base addresses (max: %ld)",
@@ -264,42 +526,318 @@ static int nsb_service_cmd_needed_list(const void *data, size_t size,
 			rd->used += sizeof(nl->address);
 			nr++;
 		}
-		lm = lm->l_next;
-		/* Last link is this module. Skip it. */
-	} while (lm->l_next);
+	}
 
 	nl->nr_addrs = nr;
 	rd->used = sizeof(nl->nr_addrs) + sizeof(nl->address) * nr;
 	return 0;
 }
 
+struct nsb_service_dso {
+	uint64_t		base;
+	const GElf_Sym		*symtab;
+	const char		*strtab;
+	const uint32_t		*gnu_hash;
+	const uint32_t		*hash;
+	const GElf_Versym	*versym;
+	const GElf_Verdef	*verdef;
+};
+
+/*
+ * Dynamic linker relocates the pointers in the dynamic section, except
+ * for VDSO, where they remain offsets from the base.
+ */
+static const void *nsb_service_dynamic_ptr(const struct link_map *lm,
+					   uint32_t d_tag)
+{
+	int64_t val;
+
+	val = nsb_service_dynamic_tag_val(lm->l_ld, d_tag);
+	if (val == -ENOENT)
+		return NULL;
+	if (val < (int64_t)lm->l_addr)
+		val += lm->l_addr;
+	return (const void *)val;
+}
+
+static void nsb_service_dso_init(struct nsb_service_dso *dso,
+				 const struct link_map *lm)
+{
+	dso->base = lm->l_addr;
+	dso->symtab = nsb_service_dynamic_ptr(lm, DT_SYMTAB);
+	dso->strtab = nsb_service_dynamic_ptr(lm, DT_STRTAB);
+	dso->gnu_hash = nsb_service_dynamic_ptr(lm, DT_GNU_HASH);
+	dso->hash = nsb_service_dynamic_ptr(lm, DT_HASH);
+	dso->versym = nsb_service_dynamic_ptr(lm, DT_VERSYM);
+	dso->verdef = nsb_service_dynamic_ptr(lm, DT_VERDEF);
+}
+
+static uint32_t nsb_service_gnu_hash(const char *name)
+{
+	uint32_t h = 5381;
+
+	for (; *name; name++)
+		h = (h << 5) + h + (uint8_t)*name;
+	return h;
+}
+
+static uint32_t nsb_service_sysv_hash(const char *name)
+{
+	uint32_t h = 0, g;
+
+	for (; *name; name++) {
+		h = (h << 4) + (uint8_t)*name;
+		g = h & 0xf0000000;
+		if (g)
+			h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+static const char *nsb_service_dso_version(const struct nsb_service_dso *dso,
+					   uint16_t ndx)
+{
+	const GElf_Verdef *vd = dso->verdef;
+
+	while (vd) {
+		if (vd->vd_ndx == ndx) {
+			const GElf_Verdaux *vda = (const void *)vd + vd->vd_aux;
+
+			return dso->strtab + vda->vda_name;
+		}
+		if (!vd->vd_next)
+			break;
+		vd = (const void *)vd + vd->vd_next;
+	}
+	return NULL;
+}
+
+/*
+ * Returns 1 for the symbol, requested by version (or default version), 2
+ * for hidden version of unversioned symbol and 0 otherwise.
+ */
+static int nsb_service_dso_match(const struct nsb_service_dso *dso,
+				 uint32_t idx, const char *name,
+				 const char *version)
+{
+	const GElf_Sym *sym = &dso->symtab[idx];
+	const char *vname;
+	uint16_t ndx;
+
+	/* The same rules, as patcher uses for ELF files */
+	if (!sym->st_name || !sym->st_size || (sym->st_shndx == SHN_UNDEF))
+		return 0;
+
+	if (strcmp(dso->strtab + sym->st_name, name))
+		return 0;
+
+	if (!dso->versym)
+		return 1;
+
+	ndx = dso->versym[idx];
+	if (version) {
+		vname = nsb_service_dso_version(dso, ndx & 0x7fff);
+		return (vname && !strcmp(vname, version)) ? 1 : 0;
+	}
+	return (ndx & 0x8000) ? 2 : 1;
+}
+
+/*
+ * Indirect function is bound to the implementation, returned by its
+ * resolver. Patch is relocated relative to the object base, so the offset
+ * is returned.
+ */
+static int64_t nsb_service_dso_value(const struct nsb_service_dso *dso,
+				     uint32_t idx)
+{
+	const GElf_Sym *sym = &dso->symtab[idx];
+	uint64_t (*resolver)(void);
+
+	if (GELF_ST_TYPE(sym->st_info) != STT_GNU_IFUNC)
+		return sym->st_value;
+
+	resolver = (void *)(dso->base + sym->st_value);
+	return resolver() - dso->base;
+}
+
+static int64_t nsb_service_dso_lookup(const struct nsb_service_dso *dso,
+				      const char *name, const char *version)
+{
+	int64_t hidden = -ENOENT;
+	uint32_t i;
+	int ret;
+
+	if (!dso->symtab || !dso->strtab)
+		return -ENOENT;
+
+	if (dso->gnu_hash) {
+		const uint32_t *gh = dso->gnu_hash;
+		uint32_t nbuckets = gh[0], symoffset = gh[1];
+		uint32_t bloom_size = gh[2], bloom_shift = gh[3];
+		const uint64_t *bloom = (const void *)&gh[4];
+		const uint32_t *buckets = (const void *)&bloom[bloom_size];
+		const uint32_t *chain = &buckets[nbuckets];
+		uint32_t h = nsb_service_gnu_hash(name), h2;
+		uint64_t mask;
+
+		mask = (1UL << (h % 64)) | (1UL << ((h >> bloom_shift) % 64));
+		if ((bloom[(h / 64) % bloom_size] & mask) != mask)
+			return -ENOENT;
+
+		i = buckets[h % nbuckets];
+		if (i < symoffset)
+			return -ENOENT;
+
+		do {
+			h2 = chain[i - symoffset];
+			if ((h | 1) == (h2 | 1)) {
+				ret = nsb_service_dso_match(dso, i, name, version);
+				if (ret == 1)
+					return nsb_service_dso_value(dso, i);
+				if ((ret == 2) && (hidden < 0))
+					hidden = nsb_service_dso_value(dso, i);
+			}
+			i++;
+		} while (!(h2 & 1));
+	} else if (dso->hash) {
+		const uint32_t *bucket = &dso->hash[2];
+		const uint32_t *chain = &bucket[dso->hash[0]];
+
+		for (i = bucket[nsb_service_sysv_hash(name) % dso->hash[0]];
+		     i; i = chain[i]) {
+			ret = nsb_service_dso_match(dso, i, name, version);
+			if (ret == 1)
+				return nsb_service_dso_value(dso, i);
+			if ((ret == 2) && (hidden < 0))
+				hidden = nsb_service_dso_value(dso, i);
+		}
+	}
+	return hidden;
+}
+
+static int nsb_service_resolve_sym(const struct nsb_service_resolve_request *rq,
+				   const struct nsb_service_resolve_sym *rs,
+				   const char *name, const char *version,
+				   struct nsb_service_resolve_result *res)
+{
+	struct link_map *lm;
+	struct nsb_service_dso dso;
+	int64_t value;
+	int idx = 0;
+
+	/* Objects are counted the same way, as in needed list */
+	for (lm = _r_debug.r_map; lm; lm = lm->l_next) {
+		int64_t dt_symtab_addr;
+
+		if (lm->l_ld == _DYNAMIC)
+			continue;
+
+		dt_symtab_addr = nsb_service_dynamic_tag_val(lm->l_ld, DT_SYMTAB);
+		if (dt_symtab_addr >= (int64_t)lm->l_addr) {
+			nsb_service_dso_init(&dso, lm);
+
+			if ((rs->flags & NSB_SERVICE_RESOLVE_STOP) &&
+			    (idx == rq->stop_idx))
+				return 1;
+
+			value = nsb_service_dso_lookup(&dso, name, version);
+			if (value >= 0) {
+				res->idx = idx;
+				res->value = value;
+				return 0;
+			}
+			idx++;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static const char *nsb_service_resolve_str(const void *data, size_t size,
+					   uint32_t offset)
+{
+	const char *str = (const char *)data + offset;
+
+	if ((offset >= size) || !memchr(str, '\0', size - offset))
+		return NULL;
+	return str;
+}
+
+static int nsb_service_cmd_resolve(const void *data, size_t size,
+				   struct nsb_response_data *rd)
+{
+	const struct nsb_service_resolve_request *rq = data;
+	struct nsb_service_resolve_response *rs = (void *)rd->data;
+	uint32_t nr;
+
+	if ((size < sizeof(*rq)) ||
+	    (rq->nr_syms > (size - sizeof(*rq)) / sizeof(rq->sym[0]))) {
+		nsb_service_response_print(rd, "resolve request is truncated");
+		return -EINVAL;
+	}
+
+	if (rq->nr_syms > (rd->size - sizeof(*rs)) / sizeof(rs->result[0])) {
+		nsb_service_response_print(rd, "too many symbols: %d",
+				rq->nr_syms);
+		return -E2BIG;
+	}
+
+	for (nr = 0; nr < rq->nr_syms; nr++) {
+		const struct nsb_service_resolve_sym *sym = &rq->sym[nr];
+		struct nsb_service_resolve_result res = { };
+		const char *name, *version = NULL;
+
+		name = nsb_service_resolve_str(data, size, sym->name);
+		if (sym->version)
+			version = nsb_service_resolve_str(data, size,
+							  sym->version);
+		if (!name || (sym->version && !version)) {
+			rd->used = 0;
+			nsb_service_response_print(rd,
+					"symbol %d name is out of request", nr);
+			return -EINVAL;
+		}
+
+		res.ret = nsb_service_resolve_sym(rq, sym, name, version, &res);
+		rs->result[nr] = res;
+	}
+
+	rs->nr_syms = rq->nr_syms;
+	rd->used = sizeof(*rs) + sizeof(rs->result[0]) * rq->nr_syms;
+	return 0;
+}
+
 static handler_t nsb_service_cmd_handlers[] = {
 	[NSB_SERVICE_CMD_EMERG_SIGFRAME] = nsb_service_cmd_emerg_sigframe,
 	[NSB_SERVICE_CMD_STOP] = nsb_service_cmd_stop,
 	[NSB_SERVICE_CMD_NEEDED_LIST] = nsb_service_cmd_needed_list,
 	[NSB_SERVICE_CMD_MMAP] = nsb_service_cmd_mmap,
 	[NSB_SERVICE_CMD_MUNMAP] = nsb_service_cmd_munmap,
+	[NSB_SERVICE_CMD_WRITE] = nsb_service_cmd_write,
+	[NSB_SERVICE_CMD_RELOCS] = nsb_service_cmd_relocs,
+	[NSB_SERVICE_CMD_RESOLVE] = nsb_service_cmd_resolve,
 };
 
-static int nsb_do_handle_cmd(const struct nsb_service_request *rq, size_t data_size, 
-				struct nsb_response_data *rd)
+static int nsb_do_handle_cmd(unsigned cmd, const void *data, size_t data_size,
+			     struct nsb_response_data *rd)
 {
 	handler_t handler;
 
-	if (rq->cmd > NSB_SERVICE_CMD_MAX) {
+	if (cmd >= NSB_SERVICE_CMD_MAX) {
 		nsb_service_response_print(rd,
-				"unknown command: %d", rq->cmd);
+				"unknown command: %d", cmd);
 		return -EINVAL;
 	}
 
-	handler = nsb_service_cmd_handlers[rq->cmd];
+	handler = nsb_service_cmd_handlers[cmd];
 	if (!handler) {
 		 nsb_service_response_print(rd,
-				"unsupported command: %d", rq->cmd);
+				"unsupported command: %d", cmd);
 		 return -EINVAL;
 	}
 
-	return handler(rq->data, data_size, rd);
+	return handler(data, data_size, rd);
 }
 
 static int nsb_handle_command(const struct nsb_service_request *rq, size_t data_size)
@@ -307,10 +845,11 @@ static int nsb_handle_command(const struct nsb_service_request *rq, size_t data_
 	struct nsb_service_response rs = { };
 	struct nsb_response_data rd = {
 		.data = rs.data,
+		.size = sizeof(rs.data),
 	};
 	ssize_t size;
 
-	rs.ret = nsb_do_handle_cmd(rq, data_size, &rd);
+	rs.ret = nsb_do_handle_cmd(rq->cmd, rq->data, data_size, &rd);
 
 	size = nsb_service_send_response(&rs, sizeof(rs.ret) + rd.used);
 	if (size < 0)
@@ -372,18 +911,687 @@ int nsb_service_receive_fd(void)
 	return recv_fd(cmd_sock);
 }
 
+/*
+ * Threads are parked by a realtime signal. Each thread unwinds its own stack
+ * in the signal handler, reports the result and waits for the next
+ * generation, i.e. for release.
+ */
+#define NSB_AGENT_PARK_SIGNAL		(SIGRTMAX - 1)
+
+static struct {
+	struct nsb_service_range	range[NSB_SERVICE_PARK_RANGES_MAX];
+	size_t				nr_ranges;
+	int				installed;
+	int				active;
+	int				generation;
+	int				inside;
+	int				claimed;
+	int				reported;
+	int				busy;
+	int32_t				tid[NSB_SERVICE_PARK_TIDS_MAX];
+} park;
+
+static void nsb_futex_wait(int *addr, int val, const struct timespec *ts)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, ts, NULL, 0);
+}
+
+static void nsb_futex_wake(int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static int nsb_agent_in_ranges(uint64_t ip)
+{
+	size_t lo = 0, hi = park.nr_ranges;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (ip < park.range[mid].start)
+			hi = mid;
+		else if (ip >= park.range[mid].end)
+			lo = mid + 1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+static _Unwind_Reason_Code nsb_agent_unwind_frame(struct _Unwind_Context *uc,
+						  void *arg)
+{
+	int *busy = arg;
+
+	if (nsb_agent_in_ranges(_Unwind_GetIP(uc))) {
+		*busy = 1;
+		return _URC_END_OF_STACK;
+	}
+	return _URC_NO_REASON;
+}
+
+static void nsb_agent_park_handler(int sig, siginfo_t *si, void *data)
+{
+	ucontext_t *uc = data;
+	int saved_errno = errno;
+	int gen, idx, busy;
+
+	if ((si->si_code != SI_TKILL) || (si->si_pid != getpid()))
+		return;
+
+	__atomic_add_fetch(&park.inside, 1, __ATOMIC_SEQ_CST);
+
+	gen = __atomic_load_n(&park.generation, __ATOMIC_ACQUIRE);
+	if (!__atomic_load_n(&park.active, __ATOMIC_ACQUIRE))
+		goto out;
+
+	/* Interrupted instruction is checked explicitly */
+	busy = nsb_agent_in_ranges(uc->uc_mcontext.gregs[REG_RIP]);
+	if (!busy)
+		_Unwind_Backtrace(nsb_agent_unwind_frame, &busy);
+	if (busy)
+		__atomic_add_fetch(&park.busy, 1, __ATOMIC_SEQ_CST);
+
+	idx = __atomic_fetch_add(&park.claimed, 1, __ATOMIC_SEQ_CST);
+	if (idx < NSB_SERVICE_PARK_TIDS_MAX)
+		park.tid[idx] = syscall(SYS_gettid);
+
+	__atomic_add_fetch(&park.reported, 1, __ATOMIC_SEQ_CST);
+	nsb_futex_wake(&park.reported);
+
+	while (__atomic_load_n(&park.generation, __ATOMIC_ACQUIRE) == gen)
+		nsb_futex_wait(&park.generation, gen, NULL);
+
+out:
+	__atomic_sub_fetch(&park.inside, 1, __ATOMIC_SEQ_CST);
+	errno = saved_errno;
+}
+
+/*
+ * Handler is never uninstalled: signal can be still pending for a thread,
+ * which had it blocked during the check.
+ */
+static int nsb_agent_park_install(struct nsb_response_data *rd)
+{
+	struct sigaction sa = { }, old;
+
+	if (park.installed)
+		return 0;
+
+	if (sigaction(NSB_AGENT_PARK_SIGNAL, NULL, &old))
+		return -errno;
+
+	if ((old.sa_flags & SA_SIGINFO) || (old.sa_handler != SIG_DFL)) {
+		nsb_service_response_print(rd,
+				"signal %d is used by application",
+				NSB_AGENT_PARK_SIGNAL);
+		return -EBUSY;
+	}
+
+	sa.sa_sigaction = nsb_agent_park_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigfillset(&sa.sa_mask);
+
+	if (sigaction(NSB_AGENT_PARK_SIGNAL, &sa, NULL))
+		return -errno;
+
+	park.installed = 1;
+	return 0;
+}
+
+static void nsb_agent_release(void)
+{
+	if (!__atomic_load_n(&park.active, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&park.active, 0, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&park.generation, 1, __ATOMIC_SEQ_CST);
+	nsb_futex_wake(&park.generation);
+}
+
+static int nsb_agent_signal_threads(int *nr_signaled, struct nsb_response_data *rd)
+{
+	pid_t self = syscall(SYS_gettid);
+	struct dirent *de;
+	int nr = 0, err = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir)) != NULL) {
+		pid_t tid = atoi(de->d_name);
+
+		if ((tid <= 0) || (tid == self))
+			continue;
+
+		/* One slot is reserved for the agent itself */
+		if (nr == NSB_SERVICE_PARK_TIDS_MAX - 1) {
+			nsb_service_response_print(rd, "too many threads");
+			err = -E2BIG;
+			break;
+		}
+
+		if (syscall(SYS_tgkill, getpid(), tid, NSB_AGENT_PARK_SIGNAL)) {
+			if (errno == ESRCH)
+				continue;
+			err = -errno;
+			break;
+		}
+		nr++;
+	}
+	closedir(dir);
+
+	*nr_signaled = nr;
+	return err;
+}
+
+static int nsb_agent_park_wait(int nr, unsigned timeout_ms)
+{
+	struct timespec now, deadline, ts;
+	int reported;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	while ((reported = __atomic_load_n(&park.reported, __ATOMIC_ACQUIRE)) < nr) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		ts.tv_sec = deadline.tv_sec - now.tv_sec;
+		ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if (ts.tv_nsec < 0) {
+			ts.tv_sec--;
+			ts.tv_nsec += 1000000000;
+		}
+		if (ts.tv_sec < 0)
+			return -ETIMEDOUT;
+
+		nsb_futex_wait(&park.reported, reported, &ts);
+	}
+	return 0;
+}
+
+static int nsb_agent_cmd_park(const void *data, size_t size,
+			      struct nsb_response_data *rd)
+{
+	const struct nsb_service_park_request *rq = data;
+	struct nsb_service_park_response *pr = (void *)rd->data;
+	int nr = 0, err, i;
+
+	if ((size < sizeof(*rq)) || (rq->nr_ranges > NSB_SERVICE_PARK_RANGES_MAX) ||
+	    (size < sizeof(*rq) + rq->nr_ranges * sizeof(rq->range[0]))) {
+		nsb_service_response_print(rd, "park request is invalid");
+		return -EINVAL;
+	}
+
+	if (__atomic_load_n(&park.active, __ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&park.inside, __ATOMIC_ACQUIRE)) {
+		nsb_service_response_print(rd, "threads are still parked");
+		return -EBUSY;
+	}
+
+	err = nsb_agent_park_install(rd);
+	if (err)
+		return err;
+
+	memcpy(park.range, rq->range, rq->nr_ranges * sizeof(rq->range[0]));
+	park.nr_ranges = rq->nr_ranges;
+	park.claimed = 0;
+	park.reported = 0;
+	park.busy = 0;
+	__atomic_store_n(&park.active, 1, __ATOMIC_RELEASE);
+
+	err = nsb_agent_signal_threads(&nr, rd);
+	if (!err)
+		err = nsb_agent_park_wait(nr, rq->timeout_ms);
+	if (err == -ETIMEDOUT)
+		nsb_service_response_print(rd, "%d of %d threads reported",
+				park.reported, nr);
+	if (!err && park.busy) {
+		nsb_service_response_print(rd, "%d threads are in patched code",
+				park.busy);
+		err = -EAGAIN;
+	}
+	if (err) {
+		nsb_agent_release();
+		return err;
+	}
+
+	/* Agent thread doesn't run patched code either */
+	nr = park.claimed;
+	if (nr > NSB_SERVICE_PARK_TIDS_MAX - 1)
+		nr = NSB_SERVICE_PARK_TIDS_MAX - 1;
+	nr++;
+
+	if (sizeof(*pr) + nr * sizeof(pr->tid[0]) > rd->size) {
+		nsb_agent_release();
+		return -E2BIG;
+	}
+
+	for (i = 0; i < nr - 1; i++)
+		pr->tid[i] = park.tid[i];
+	pr->tid[nr - 1] = syscall(SYS_gettid);
+	pr->nr_tids = nr;
+
+	rd->used = sizeof(*pr) + nr * sizeof(pr->tid[0]);
+	return 0;
+}
+
+static int nsb_agent_cmd_release(const void *data, size_t size,
+				 struct nsb_response_data *rd)
+{
+	nsb_agent_release();
+	return 0;
+}
+
+/*
+ * Resident agent serves requests from its own thread, while the process is
+ * running. Signal frame and stop commands are meaningful for the ptrace
+ * driven service only.
+ */
+union nsb_agent_request {
+	struct nsb_service_request	v1;
+	struct nsb_service_v2_packet	v2;
+};
+
+static int nsb_agent_receive_request(int sock, union nsb_agent_request *rq,
+				     int *fds, int *nr_fds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * NSB_SERVICE_V2_FDS_MAX)];
+	struct iovec iov = {
+		.iov_base = rq,
+		.iov_len = sizeof(*rq),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t size;
+
+	*nr_fds = 0;
+
+	size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (size < 0)
+		return -errno;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) &&
+	    (cmsg->cmsg_type == SCM_RIGHTS)) {
+		*nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nr_fds);
+	}
+
+	if (size && (size < sizeof(rq->v1.cmd)))
+		return -EINVAL;
+	return size;
+}
+
+/*
+ * File descriptor is consumed by successful mmap request only: it's closed
+ * by the handler.
+ */
+static int nsb_agent_handle_cmd(unsigned cmd, void *data, size_t size,
+				int fd, struct nsb_response_data *rd)
+{
+	struct nsb_service_mmap_request *mrq = data;
+
+	switch (cmd) {
+		case NSB_SERVICE_CMD_NEEDED_LIST:
+		case NSB_SERVICE_CMD_MUNMAP:
+		case NSB_SERVICE_CMD_WRITE:
+			break;
+		case NSB_SERVICE_CMD_PARK:
+			return nsb_agent_cmd_park(data, size, rd);
+		case NSB_SERVICE_CMD_RELEASE:
+			return nsb_agent_cmd_release(data, size, rd);
+		case NSB_SERVICE_CMD_MMAP:
+			if (fd < 0) {
+				nsb_service_response_print(rd,
+						"mmap request without file");
+				return -EBADF;
+			}
+			if (size < sizeof(*mrq)) {
+				nsb_service_response_print(rd,
+						"mmap request is truncated");
+				return -EINVAL;
+			}
+			mrq->fd = fd;
+			break;
+		default:
+			nsb_service_response_print(rd,
+					"command %d is not supported by agent",
+					cmd);
+			return -EINVAL;
+	}
+
+	return nsb_do_handle_cmd(cmd, data, size, rd);
+}
+
+static int nsb_agent_serve_v1(int sock, struct nsb_service_request *rq,
+			      size_t size, int fd)
+{
+	struct nsb_service_response rs = { };
+	struct nsb_response_data rd = {
+		.data = rs.data,
+		.size = sizeof(rs.data),
+	};
+
+	rs.ret = nsb_agent_handle_cmd(rq->cmd, rq->data, size - sizeof(rq->cmd),
+				      fd, &rd);
+
+	/* Successful mmap request closes the file by itself */
+	if ((fd >= 0) && ((rq->cmd != NSB_SERVICE_CMD_MMAP) || rs.ret))
+		close(fd);
+
+	if (send(sock, &rs, sizeof(rs.ret) + rd.used, MSG_NOSIGNAL) < 0)
+		return -errno;
+	return 0;
+}
+
+static struct {
+	void		*addr;
+	size_t		size;
+} agent_shm;
+
+static int nsb_agent_shm_setup(int fd, size_t size, struct nsb_response_data *rd)
+{
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		nsb_service_response_print(rd, "failed to map %ld bytes of "
+				"shared memory", size);
+		return -errno;
+	}
+
+	if (agent_shm.addr)
+		munmap(agent_shm.addr, agent_shm.size);
+
+	agent_shm.addr = addr;
+	agent_shm.size = size;
+	return 0;
+}
+
+static int nsb_agent_v2_cmd(struct nsb_service_v2_cmd *c, int fd,
+			    struct nsb_response_data *rd)
+{
+	if (c->cmd == NSB_SERVICE_CMD_SHM) {
+		if (fd < 0)
+			return -EBADF;
+		return nsb_agent_shm_setup(fd, c->size, rd);
+	}
+
+	if (!agent_shm.addr) {
+		nsb_service_response_print(rd, "shared memory is not set up");
+		return -ENOTCONN;
+	}
+
+	if ((c->offset > agent_shm.size) ||
+	    (c->size > agent_shm.size - c->offset)) {
+		nsb_service_response_print(rd, "payload %#lx-%#lx is out of "
+				"shared memory", c->offset, c->offset + c->size);
+		return -EINVAL;
+	}
+
+	return nsb_agent_handle_cmd(c->cmd, (char *)agent_shm.addr + c->offset,
+				    c->size, fd, rd);
+}
+
+/*
+ * Response data is written right after the previous response in the
+ * response area. If shared memory is not set up yet, only the result of the
+ * command is reported.
+ */
+static int nsb_agent_serve_v2(int sock, struct nsb_service_v2_packet *pkt,
+			      size_t size, int *fds, int nr_fds)
+{
+	uint64_t resp = pkt->resp_offset, resp_end;
+	int i, fd, next_fd = 0, err = 0;
+
+	if ((pkt->nr_cmds > NSB_SERVICE_V2_CMDS_MAX) ||
+	    (size < sizeof(*pkt) + pkt->nr_cmds * sizeof(pkt->cmd[0])))
+		return -EINVAL;
+
+	for (i = 0; i < pkt->nr_cmds; i++) {
+		struct nsb_service_v2_cmd *c = &pkt->cmd[i];
+		char msg[256];
+		struct nsb_response_data rd = {
+			.data = msg,
+			.size = sizeof(msg),
+		};
+
+		if (err) {
+			c->ret = -ECANCELED;
+			c->offset = c->size = 0;
+			continue;
+		}
+
+		fd = -1;
+		if (((c->cmd == NSB_SERVICE_CMD_SHM) ||
+		     (c->cmd == NSB_SERVICE_CMD_MMAP)) && (next_fd < nr_fds))
+			fd = fds[next_fd++];
+
+		resp_end = pkt->resp_offset + pkt->resp_size;
+		if (agent_shm.addr && (resp_end <= agent_shm.size) &&
+		    (resp <= resp_end)) {
+			rd.data = (char *)agent_shm.addr + resp;
+			rd.size = resp_end - resp;
+		}
+
+		c->ret = nsb_agent_v2_cmd(c, fd, &rd);
+
+		if ((fd >= 0) && ((c->cmd == NSB_SERVICE_CMD_SHM) || c->ret))
+			close(fd);
+
+		if (rd.data == msg) {
+			c->offset = c->size = 0;
+		} else {
+			c->offset = resp;
+			c->size = rd.used;
+			resp += (rd.used + 7) & ~7UL;
+		}
+		err = c->ret;
+	}
+
+	for (; next_fd < nr_fds; next_fd++)
+		close(fds[next_fd]);
+
+	if (send(sock, pkt, size, MSG_NOSIGNAL) < 0)
+		return -errno;
+	return 0;
+}
+
+static void nsb_agent_serve(int sock)
+{
+	union nsb_agent_request rq;
+	int fds[NSB_SERVICE_V2_FDS_MAX];
+	int i, nr_fds, err;
+	ssize_t size;
+
+	while (1) {
+		size = nsb_agent_receive_request(sock, &rq, fds, &nr_fds);
+		if (size <= 0)
+			break;
+
+		if ((size >= sizeof(rq.v2)) &&
+		    (rq.v2.magic == NSB_SERVICE_V2_MAGIC)) {
+			err = nsb_agent_serve_v2(sock, &rq.v2, size,
+						 fds, nr_fds);
+		} else {
+			for (i = 1; i < nr_fds; i++)
+				close(fds[i]);
+			err = nsb_agent_serve_v1(sock, &rq.v1, size,
+						 nr_fds ? fds[0] : -1);
+		}
+		if (err)
+			break;
+	}
+
+	/* Patcher has gone: threads must not stay parked */
+	nsb_agent_release();
+	close(sock);
+}
+
+static int nsb_agent_check_peer(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return -errno;
+
+	if (cred.uid && (cred.uid != geteuid()))
+		return -EPERM;
+	return 0;
+}
+
+static void *nsb_agent_thread(void *arg)
+{
+	int sock;
+
+	while (1) {
+		sock = accept4(agent_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		if (nsb_agent_check_peer(sock)) {
+			close(sock);
+			continue;
+		}
+
+		nsb_agent_serve(sock);
+	}
+	return NULL;
+}
+
+int nsb_service_start_agent(void)
+{
+	struct sockaddr_un addr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int sock, err;
+
+	/* Forked child inherits the socket, but not the thread */
+	if (agent_sock != -1) {
+		if (agent_pid == getpid())
+			return 0;
+		close(agent_sock);
+		agent_sock = -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(&addr.sun_path[1], UNIX_PATH_MAX - 1,
+		     NSB_SERVICE_AGENT_NAME, getpid()) > UNIX_PATH_MAX - 1)
+		return -ENOMEM;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -errno;
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, 1)) {
+		err = -errno;
+		goto close_sock;
+	}
+
+	err = -pthread_attr_init(&attr);
+	if (err)
+		goto close_sock;
+
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* Application signals must not be delivered to the agent */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	agent_sock = sock;
+	err = -pthread_create(&thread, &attr, nsb_agent_thread, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (err) {
+		agent_sock = -1;
+		goto close_sock;
+	}
+
+	agent_pid = getpid();
+	return 0;
+
+close_sock:
+	close(sock);
+	return err;
+}
+
+static bool nsb_service_preloaded(void)
+{
+	const char *preload = getenv("LD_PRELOAD");
+
+	return preload && strstr(preload, "libnsb_service");
+}
+
+static int nsb_service_register(void)
+{
+	extern const ElfW(Ehdr) __ehdr_start;
+	struct nsb_service_discovery sd = {
+		.magic = NSB_SERVICE_DISCOVERY_MAGIC,
+		.version = NSB_SERVICE_DISCOVERY_VERSION,
+		.pid = getpid(),
+		.base = (uint64_t)&__ehdr_start,
+	};
+	char path[PATH_MAX];
+	int fd, err = 0;
+
+	snprintf(path, sizeof(path), NSB_SERVICE_DISCOVERY_PATH, sd.pid);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return errno;
+
+	if (write(fd, &sd, sizeof(sd)) != sizeof(sd)) {
+		err = errno ? : EIO;
+		unlink(path);
+	}
+	close(fd);
+	return err;
+}
+
+static void nsb_service_unregister(void)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), NSB_SERVICE_DISCOVERY_PATH, getpid());
+	unlink(path);
+}
+
 __attribute__((destructor))
 static int nsb_service_destructor(void)
 {
 	if (cmd_sock != -1)
 		close(cmd_sock);
 
+	if (nsb_service_preloaded())
+		nsb_service_unregister();
+
 	close(listen_sock);
 	return 0;
 }
 
-__attribute__((constructor))
-static int nsb_service_constructor(void)
+static int nsb_service_listen(void)
 {
 	int err;
 	struct sockaddr_un addr;
@@ -407,9 +1615,41 @@ static int nsb_service_constructor(void)
 		err = errno;
 		goto close_sock;
 	}
+
+	/* Record is published once the socket is ready to accept */
+	if (nsb_service_preloaded())
+		(void)nsb_service_register();
 	return 0;
 
 close_sock:
 	close(listen_sock);
 	return err;
 }
+
+/*
+ * Forked child of preloaded process gets its own socket and record, so that
+ * it can be patched without injection as well.
+ */
+static void nsb_service_atfork_child(void)
+{
+	close(listen_sock);
+	if (cmd_sock != -1) {
+		close(cmd_sock);
+		cmd_sock = -1;
+	}
+	(void)nsb_service_listen();
+}
+
+__attribute__((constructor))
+static int nsb_service_constructor(void)
+{
+	int err;
+
+	err = nsb_service_listen();
+	if (err)
+		return err;
+
+	if (nsb_service_preloaded())
+		pthread_atfork(NULL, NULL, nsb_service_atfork_child);
+	return 0;
+}
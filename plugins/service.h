@@ -2,6 +2,7 @@
 #define __NSB_PLUGINS_SERVICE__
 
 #include <limits.h>
+#include <stdint.h>
 
 typedef enum {
 	NSB_SERVICE_CMD_EMERG_SIGFRAME,
@@ -9,11 +10,41 @@ typedef enum {
 	NSB_SERVICE_CMD_NEEDED_LIST,
 	NSB_SERVICE_CMD_MMAP,
 	NSB_SERVICE_CMD_MUNMAP,
+	NSB_SERVICE_CMD_WRITE,
+	NSB_SERVICE_CMD_PARK,
+	NSB_SERVICE_CMD_RELEASE,
+	NSB_SERVICE_CMD_RELOCS,
+	NSB_SERVICE_CMD_RESOLVE,
 	NSB_SERVICE_CMD_MAX,
 } nsb_service_cmd_t;
 
 #define NSB_SERVICE_MESSAGE_DATA_SIZE		8192
 
+#define NSB_SERVICE_AGENT_NAME			"NSB-AGENT-%d"
+
+/*
+ * Service, preloaded at process start (LD_PRELOAD), registers itself in
+ * discovery record, so that patcher can connect to it without injection.
+ */
+#define NSB_SERVICE_DISCOVERY_PATH		"/dev/shm/nsb-service-%d"
+#define NSB_SERVICE_DISCOVERY_MAGIC		0x4e53425344495343ULL
+#define NSB_SERVICE_DISCOVERY_VERSION		1
+
+struct nsb_service_discovery {
+	uint64_t		magic;
+	uint32_t		version;
+	int32_t			pid;
+	uint64_t		base;
+};
+
+/*
+ * Resident agent maps the patch while the process is running. Thus it can't
+ * replace existing mappings and uses MAP_FIXED_NOREPLACE instead of MAP_FIXED.
+ */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE			0x100000
+#endif
+
 struct nsb_service_request {
 	unsigned cmd;
 	char data[NSB_SERVICE_MESSAGE_DATA_SIZE];
@@ -61,4 +92,170 @@ struct nsb_service_munmap_request {
 #define NSB_SERVICE_MUNMAP_DATA_SIZE_MAX	\
 	(NSB_SERVICE_MESSAGE_DATA_SIZE - sizeof(struct nsb_service_munmap_request))
 
+/*
+ * Write entries are variable-sized: data follows the header and is padded
+ * to 8 bytes.
+ */
+struct nsb_service_write {
+	uint64_t addr;
+	uint32_t size;
+	int32_t prot;
+	uint8_t data[0];
+};
+
+#define NSB_SERVICE_WRITE_SIZE(size)		\
+	(sizeof(struct nsb_service_write) + (((size) + 7) & ~7UL))
+
+struct nsb_service_write_request {
+	size_t nr_writes;
+	uint8_t writes[0];
+};
+
+#define NSB_SERVICE_WRITE_DATA_SIZE_MAX	\
+	(NSB_SERVICE_MESSAGE_DATA_SIZE - sizeof(struct nsb_service_write_request))
+
+/*
+ * Resolved relocations are applied by the service with plain stores. Entries
+ * are expected to be sorted by address, so pages are made writable once for
+ * a run of entries. Response contains checksum of the stored values, read
+ * back from memory.
+ */
+struct nsb_service_reloc {
+	uint64_t addr;
+	uint64_t value;
+	uint32_t size;
+	int32_t prot;
+};
+
+struct nsb_service_relocs_request {
+	uint64_t nr_relocs;
+	struct nsb_service_reloc reloc[0];
+};
+
+#define NSB_SERVICE_RELOCS_MAX	\
+	((NSB_SERVICE_MESSAGE_DATA_SIZE - sizeof(struct nsb_service_relocs_request)) / \
+	 sizeof(struct nsb_service_reloc))
+
+struct nsb_service_relocs_response {
+	uint64_t checksum;
+};
+
+#define NSB_SERVICE_FNV64_OFFSET		0xcbf29ce484222325ULL
+#define NSB_SERVICE_FNV64_PRIME			0x100000001b3ULL
+
+static inline uint64_t nsb_service_reloc_hash(uint64_t hash, uint64_t addr,
+					      const void *value, uint32_t size)
+{
+	const uint8_t *p;
+	uint32_t i;
+
+	for (i = 0, p = (const void *)&addr; i < sizeof(addr); i++)
+		hash = (hash ^ p[i]) * NSB_SERVICE_FNV64_PRIME;
+	for (i = 0, p = value; i < size; i++)
+		hash = (hash ^ p[i]) * NSB_SERVICE_FNV64_PRIME;
+	return hash;
+}
+
+/*
+ * Symbols are looked up in the objects of the process link map (in the same
+ * order, as addresses in the needed list). Lookup of a symbol with STOP flag
+ * stops at the object with stop_idx index. Names and versions are offsets of
+ * the strings, which follow the symbols array, from the request start.
+ */
+#define NSB_SERVICE_RESOLVE_STOP		0x1
+
+struct nsb_service_resolve_sym {
+	uint32_t name;
+	uint32_t version;
+	uint32_t flags;
+};
+
+struct nsb_service_resolve_request {
+	uint32_t nr_syms;
+	int32_t stop_idx;
+	struct nsb_service_resolve_sym sym[0];
+};
+
+/*
+ * Result is 0 with object index and symbol value, 1 if the lookup was
+ * stopped, or negative error.
+ */
+struct nsb_service_resolve_result {
+	int32_t ret;
+	int32_t idx;
+	uint64_t value;
+};
+
+struct nsb_service_resolve_response {
+	uint32_t nr_syms;
+	uint32_t pad;
+	struct nsb_service_resolve_result result[0];
+};
+
+#define NSB_SERVICE_RESOLVE_MAX	\
+	((NSB_SERVICE_MESSAGE_DATA_SIZE - sizeof(struct nsb_service_resolve_response)) / \
+	 sizeof(struct nsb_service_resolve_result))
+
+/*
+ * Protocol v2 (resident agent only). Packet is a list of commands, executed
+ * in order until the first failure (the rest fail with -ECANCELED). Command
+ * payloads are placed in shared memory, which is set up by SHM command with
+ * the memory file descriptor. Responses are written to the response area of
+ * shared memory, and the packet is sent back with results. File descriptors
+ * (SCM_RIGHTS) are consumed by SHM and MMAP commands in order.
+ * v1 requests are told apart by the first word, which is a command number.
+ */
+#define NSB_SERVICE_V2_MAGIC			0x3242534e	/* "NSB2" */
+#define NSB_SERVICE_V2_FDS_MAX			4
+
+#define NSB_SERVICE_CMD_SHM			0x100
+
+struct nsb_service_v2_cmd {
+	uint32_t cmd;
+	int32_t ret;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct nsb_service_v2_packet {
+	uint32_t magic;
+	uint32_t nr_cmds;
+	uint64_t resp_offset;
+	uint64_t resp_size;
+	struct nsb_service_v2_cmd cmd[0];
+};
+
+#define NSB_SERVICE_V2_CMDS_MAX	\
+	((NSB_SERVICE_MESSAGE_DATA_SIZE - sizeof(struct nsb_service_v2_packet)) / \
+	 sizeof(struct nsb_service_v2_cmd))
+
+/*
+ * Park request makes each thread check its own stack against the sorted
+ * ranges and wait in the signal handler for release command (or for the
+ * agent connection close).
+ */
+struct nsb_service_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct nsb_service_park_request {
+	uint32_t timeout_ms;
+	uint32_t nr_ranges;
+	struct nsb_service_range range[0];
+};
+
+#define NSB_SERVICE_PARK_RANGES_MAX	\
+	((NSB_SERVICE_MESSAGE_DATA_SIZE - sizeof(struct nsb_service_park_request)) / \
+	 sizeof(struct nsb_service_range))
+
+struct nsb_service_park_response {
+	uint32_t nr_tids;
+	int32_t tid[0];
+};
+
+#define NSB_SERVICE_PARK_TIDS_MAX	\
+	((NSB_SERVICE_MESSAGE_DATA_SIZE - sizeof(struct nsb_service_park_response)) / \
+	 sizeof(int32_t))
+
 #endif
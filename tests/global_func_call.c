@@ -0,0 +1,15 @@
+#include "test_types.h"
+
+extern long call_result(long result);
+
+/*
+ * Direct call in the function body: canary dispatch runs a relocated copy
+ * of the old function, so the call has to be fixed for the copy address.
+ */
+long test_global_func_call(int type)
+{
+	long result;
+
+	result = call_result(function_result(type));
+	return result;
+}
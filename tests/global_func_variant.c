@@ -0,0 +1,24 @@
+#include "test_types.h"
+
+long test_global_func_variant(int type)
+{
+	/* Increasing function size up to 8+ bytes
+	 * to overcome generator limitation */
+	asm("nop;nop;nop;nop;nop;nop;nop;nop;");
+	return function_result(type);
+}
+
+#ifdef PATCH
+/*
+ * Variant for hosts with AVX2: nsb has to jump to it instead of the patch
+ * function, and its result tells which one is called.
+ */
+long test_global_func_variant_avx2(int type)
+	__asm__("test_global_func_variant.avx2");
+
+long test_global_func_variant_avx2(int type)
+{
+	asm("nop;nop;nop;nop;nop;nop;nop;nop;");
+	return variant_result(type);
+}
+#endif
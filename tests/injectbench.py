@@ -0,0 +1,110 @@
+#!/usr/bin/env python2
+#
+# Compares service injection latency with dlopen and with nsb loader
+# (--map-service).
+#
+# Usage: python tests/injectbench.py <test name> [nr-threads] [iterations]
+# Example: python tests/injectbench.py global_func__manual__shared 4 10
+#
+import os
+import re
+import sys
+import time
+import subprocess
+
+if len(sys.argv) < 2:
+	print "Usage: %s <test name> [nr-threads] [iterations]" % sys.argv[0]
+	exit(1)
+
+test_name = os.path.basename(sys.argv[1])
+if test_name.endswith('.py'):
+	test_name = test_name[:-3]
+nr_threads = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+iterations = int(sys.argv[3]) if len(sys.argv) > 3 else 10
+
+os.environ.setdefault('NSB_GENERATOR', os.getcwd() + '/generator/nsbgen.py')
+os.environ.setdefault('NSB_PATCHER', os.getcwd() + '/nsb')
+os.environ.setdefault('NSB_TESTS', os.getcwd() + '/tests')
+os.environ['LD_LIBRARY_PATH'] = os.environ.get('LD_LIBRARY_PATH', "") + ":" + os.getcwd() + '/.libs'
+os.environ['PYTHONPATH'] = os.getcwd() + '/protobuf'
+
+sys.path.append(os.path.dirname(os.environ['NSB_GENERATOR']))
+sys.path.append(os.environ['NSB_TESTS'])
+
+import testrunner
+from nsb_test_types import NSB_TEST_TYPES
+
+test_flavour, patch_mode, test_kind = test_name.split('__', 2)
+test_type = NSB_TEST_TYPES["TEST_TYPE_" + test_flavour.upper()]
+
+if test_kind == "library":
+	lpt = testrunner.LibraryLivePatchTest("nsbtest_library", test_name + ".patch",
+					      False, test_name + ".o", test_type, patch_mode)
+elif test_kind in ("static", "shared"):
+	lpt = testrunner.ExecutableLivePatchTest("nsbtest_" + test_kind, test_name + ".patch",
+						 False, test_name + ".o", test_type, patch_mode)
+else:
+	print "Unsupported test type: \"%s\"" % test_kind
+	exit(1)
+
+
+def patch_time(patcher, target, pid, options):
+	cmd = "%s patch -v 3 -f %s -p %d %s" % (patcher, target, pid, options)
+	start = time.time()
+	p = subprocess.Popen(cmd.split(), stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+	stdout, stderr = p.communicate()
+	elapsed = time.time() - start
+	if p.returncode:
+		print stdout
+		print stderr
+		raise Exception("\"%s\" failed: %d" % (cmd, p.returncode))
+
+	output = stdout + stderr
+	inject = sum(int(t) for t in re.findall(r"Service injected in (\d+) usec", output))
+	if "using dlopen" in output:
+		print "Warning: service was injected with dlopen"
+	return elapsed, inject
+
+
+def bench(test, patch, options):
+	# First run warms up page cache
+	patch_time(patch.patcher, patch.target, test.p.pid, options)
+	if patch.revert_patch(test) != 0:
+		raise Exception("failed to revert patch")
+
+	total, inject = 0, 0
+	for i in range(iterations):
+		t, c = patch_time(patch.patcher, patch.target, test.p.pid, options)
+		total += t
+		inject += c
+		if patch.revert_patch(test) != 0:
+			raise Exception("failed to revert patch")
+	return total * 1000 / iterations, inject / iterations
+
+
+test = testrunner.Test(lpt.test_bin, lpt.test_type, nr_threads)
+if test.start() is None:
+	print "Failed to start process %s" % test.path
+	exit(1)
+
+try:
+	source = test.get_map_path(lpt.get_elf_bid(lpt.src_elf))
+	if patch_mode == "manual":
+		patch = testrunner.ManualBinPatch(source, lpt.tgt_elf, False)
+	else:
+		patch = testrunner.AutoBinPatch(source, lpt.tgt_elf, False, lpt.target_obj)
+	if patch.generate_patch() != 0:
+		raise Exception("failed to generate patch")
+
+	results = []
+	for mode, options in (("dlopen", ""), ("loader", "--map-service")):
+		results.append((mode,) + bench(test, patch, options))
+except:
+	test.kill()
+	raise
+
+test.stop()
+
+print "%d threads, %d iterations:" % (nr_threads, iterations)
+for mode, total, inject in results:
+	print "  %-8s injection: %8d usec, patch: %8.1f msec" % (mode, inject, total)
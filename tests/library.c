@@ -12,6 +12,8 @@ extern long test_global_func_p(int type);
 extern long test_global_var(int type);
 extern long test_global_var_addr(int type);
 extern long test_const_var(int type);
+extern long test_global_func_variant(int type);
+extern long test_global_func_call(int type);
 
 extern long test_static_func_manual(int type);
 extern long test_static_var_manual(int type);
@@ -25,6 +27,7 @@ extern long test_static_var_auto(int type);
 struct test_info_s {
 	test_actor_t	actor;
 	bool		match;
+	bool		variant;	/* patch has AVX2 variant */
 } tst_info[TEST_TYPE_MAX] = {
 	[TEST_TYPE_GLOBAL_FUNC] = {
 		.actor = test_global_func,
@@ -54,6 +57,15 @@ struct test_info_s {
 		.actor = test_const_var,
 		.match = false,
 	},
+	[TEST_TYPE_GLOBAL_FUNC_VARIANT] = {
+		.actor = test_global_func_variant,
+		.match = false,
+		.variant = true,
+	},
+	[TEST_TYPE_GLOBAL_FUNC_CALL] = {
+		.actor = test_global_func_call,
+		.match = false,
+	},
 	/* "Manual"-specific tests */
 	[TEST_TYPE_STATIC_FUNC_MANUAL] = {
 		.actor = test_static_func_manual,
@@ -92,6 +104,31 @@ static const struct test_info_s *get_test_info(int tt)
 	return &tst_info[tt];
 }
 
+long call_result(long result)
+{
+	return result;
+}
+
+/*
+ * While the process is being patched, the result can be either original or
+ * patched one (canary dispatch mixes them), but nothing else.
+ */
+int check_test(int tt)
+{
+	const struct test_info_s *ti = get_test_info(tt);
+	long result;
+
+	if (!ti || !ti->actor)
+		return TEST_ERROR;
+
+	result = ti->actor(tt);
+	if ((result == original_result(tt)) || (result == patched_result(tt)))
+		return 0;
+	if (ti->variant && (result == variant_result(tt)))
+		return 0;
+	return 1;
+}
+
 int run_test(int tt, int print)
 {
 	const struct test_info_s *ti = get_test_info(tt);
@@ -107,6 +144,8 @@ int run_test(int tt, int print)
 
 	if (ti->match)
 		failed = ti->actor(tt) != original_result(tt);
+	else if (ti->variant && __builtin_cpu_supports("avx2"))
+		failed = ti->actor(tt) != variant_result(tt);
 	else
 		failed = ti->actor(tt) != patched_result(tt);
 
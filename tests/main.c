@@ -8,6 +8,7 @@
 #include "test_types.h"
 
 extern int run_test(int test_type, int print);
+extern int check_test(int test_type);
 
 int test_stop;
 
@@ -24,6 +25,7 @@ static void delay_handler(int dummy)
 int call_loop(int test_type)
 {
 	long iter = 1;
+	int broken = 0;
 
 	if (signal(SIGINT, stop_handler) == SIG_ERR) {
 		perror("failed to register SIGINT handler");
@@ -41,9 +43,15 @@ int call_loop(int test_type)
 	while (!test_stop) {
 		if (!(iter % 1000000))
 			kill(getpid(), SIGUSR1);
-		(void)run_test(test_type, 0);
+		if (check_test(test_type))
+			broken = 1;
 		iter++;
 	}
+
+	if (broken) {
+		printf("Wrong result while running\n");
+		return 1;
+	}
 	return run_test(test_type, 1);
 }
 
@@ -12,6 +12,8 @@ typedef enum {
 	TEST_TYPE_GLOBAL_VAR,
 	TEST_TYPE_GLOBAL_VAR_ADDR,
 	TEST_TYPE_CONST_VAR,
+	TEST_TYPE_GLOBAL_FUNC_VARIANT,
+	TEST_TYPE_GLOBAL_FUNC_CALL,
 
 	/* "Manual"-specific tests */
 	TEST_TYPE_STATIC_FUNC_MANUAL,
@@ -31,6 +33,7 @@ typedef enum {
 
 #define original_result(type)		(RESULT_CODE + type)
 #define patched_result(type)		(original_result(type) + TEST_TYPE_MAX)
+#define variant_result(type)		(patched_result(type) + TEST_TYPE_MAX)
 
 static inline unsigned long __attribute__((always_inline)) function_result(test_type_t type)
 {
@@ -42,6 +42,9 @@ target = test_name + ".patch"
 target_obj = test_name + ".o"
 test_type = get_test_type(test_flavour)
 
+# "patch --all" reaches every test process: only these tests use it
+fleet = test_flavour == "global_func"
+
 code = """#!/usr/bin/env python2
 import os
 
@@ -74,9 +77,9 @@ import sys
 sys.path.append(os.path.dirname(os.environ['NSB_GENERATOR']))
 
 import testrunner
-exit(testrunner.%s('%s', '%s', %s, '%s', %d, '%s').run())
+exit(testrunner.%s('%s', '%s', %s, '%s', %d, '%s', %s).run())
 """ % (test_class, source, target, bool(random.getrandbits(1)),
-       target_obj, test_type, patch_mode)
+       target_obj, test_type, patch_mode, fleet)
 
 f = os.open(outfile, os.O_WRONLY | os.O_CREAT | os.O_TRUNC)
 os.write(f, code)
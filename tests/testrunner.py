@@ -1,9 +1,12 @@
 import sys
 import errno
+import fcntl
+import json
 import os
 import re
 import subprocess
 import signal
+import time
 import multiprocessing
 from collections import namedtuple
 from abc import ABCMeta, abstractmethod
@@ -12,9 +15,10 @@ import traceback
 
 
 class Test:
-	def __init__(self, path, test_type):
+	def __init__(self, path, test_type, nr_threads=2):
 		self.path = path
 		self.test_type = test_type
+		self.nr_threads = nr_threads
 		self.stdout = None
 		self.stderr = None
 		self.returncode = None
@@ -31,7 +35,7 @@ class Test:
 		os.environ['LD_LIBRARY_PATH'] = ld_library_path + ":" + library_path
 
 	def start(self):
-		cmd = "%s -t %d -n %d" % (self.path, self.test_type, 2)
+		cmd = "%s -t %d -n %d" % (self.path, self.test_type, self.nr_threads)
 		try:
 			if self.__state__ != "init":
 				print "Test is not new. State: %s" % self.__state__
@@ -164,12 +168,51 @@ class BinPatch:
 	@abstractmethod
 	def generate_patch(self): pass
 
-	def apply_patch(self, test):
+	def apply_patch(self, test, resident=False, redirect=False, in_place=False,
+			fleet=False):
+		if fleet:
+			# Patch image is shared by all the processes with the target
+			return self.exec_cmd("%s patch -v 4 -f %s --all --precompute" % (self.patcher, self.target))
 		cmd = "%s patch -v 4 -f %s -p %d" % (self.patcher, self.target, test.p.pid)
+		if resident:
+			cmd += " --resident"
+		elif self.no_plugin:
+			cmd += " --no-plugin"
+		if redirect:
+			cmd += " --rewrite-calls --redirect-got --redirect-pointers --relax-got"
+		if in_place:
+			cmd += " --in-place"
+		return self.exec_cmd(cmd)
+
+	def canary_patch(self, test, percent, timing=False):
+		cmd = "%s patch -v 4 -f %s -p %d --canary %d" % (self.patcher, self.target, test.p.pid, percent)
+		if self.no_plugin:
+			cmd += " --no-plugin"
+		if timing:
+			cmd += " --canary-timing"
+		return self.exec_cmd(cmd)
+
+	def canary_control(self, test, percent=None):
+		cmd = "%s canary -v 4 -f %s -p %d" % (self.patcher, self.target, test.p.pid)
+		if percent is not None:
+			cmd += " --canary %d" % percent
+		return self.exec_cmd(cmd)
+
+	def probe(self, test, action, func=None):
+		cmd = "%s probe %s" % (self.patcher, action)
+		if func:
+			cmd += " %s" % func
+		return self.exec_cmd(cmd + " -v 4 -p %d" % test.p.pid)
+
+	def stage_patch(self, test):
+		cmd = "%s stage -v 4 -f %s -p %d" % (self.patcher, self.target, test.p.pid)
 		if self.no_plugin:
 			cmd += " --no-plugin"
 		return self.exec_cmd(cmd)
 
+	def commit_patch(self, test):
+		return self.exec_cmd("%s commit -v 4 -f %s -p %d" % (self.patcher, self.target, test.p.pid))
+
 	def check_patch(self, test):
 		return self.exec_cmd("%s check -v 4 -f %s -p %d" % (self.patcher, self.target, test.p.pid))
 
@@ -179,6 +222,28 @@ class BinPatch:
 	def revert_patch(self, test):
 		return self.exec_cmd("%s revert -v 4 -f %s -p %d" % (self.patcher, self.target, test.p.pid))
 
+	def replace_patch(self, test):
+		return self.exec_cmd("%s replace -v 4 -f %s -r %s -p %d" % (self.patcher, self.target, self.target, test.p.pid))
+
+	def scan_patch(self, test):
+		cmd = "%s scan -f %s" % (self.patcher, self.target)
+		try:
+			p = self.__run_cmd__(cmd)
+			stdout, stderr = p.communicate()
+		except:
+			print "Unexpected error:", sys.exc_info()[0]
+			raise
+		print stdout
+		print stderr
+		if p.returncode != 0:
+			return p.returncode
+		report = json.loads(stdout)
+		for target in report["build_ids"]:
+			for patch in target["patches"]:
+				if test.p.pid in patch["pids"]:
+					return 0
+		return errno.ENOENT
+
 
 class ManualBinPatch(BinPatch):
 	def generate_patch(self):
@@ -200,7 +265,8 @@ class AutoBinPatch(BinPatch):
 class LivePatchTest:
 	__metaclass__ = ABCMeta
 
-	def __init__(self, source, target, no_plugin, target_obj, test_type, patch_mode):
+	def __init__(self, source, target, no_plugin, target_obj, test_type, patch_mode,
+		     fleet=False):
 		try:
 			self.tests_dir = os.environ['NSB_TESTS'] + '/'
 		except:
@@ -213,8 +279,31 @@ class LivePatchTest:
 		self.test_type = test_type
 		self.patch_mode = patch_mode
 		self.no_plugin = no_plugin
+		self.fleet = fleet
 
-	def __do_apply_patch_test__(self, patch, test):
+	def __do_stage_patch_test__(self, patch, test):
+		if patch.stage_patch(test) != 0:
+			print "Failed to stage binary patch\n"
+			raise
+
+		if patch.stage_patch(test) == 0:
+			print "Binary patch successfully staged twise\n"
+			raise
+
+		if patch.list_patches(test) != 0:
+			print "Failed to list staged patches\n"
+			raise
+
+		if patch.commit_patch(test) != 0:
+			print "Failed to commit binary patch\n"
+			raise
+
+		if patch.commit_patch(test) == 0:
+			print "Binary patch successfully committed twise\n"
+			raise
+
+	def __do_apply_patch_test__(self, patch, test, staged=False, resident=False,
+				    redirect=False, in_place=False, fleet=False):
 		res = patch.check_patch(test)
 		if res == 0:
 			print "Patch is considered as applied"
@@ -223,7 +312,9 @@ class LivePatchTest:
 			print "Failed to check whether patch is applied"
 			raise
 
-		if patch.apply_patch(test) != 0:
+		if staged:
+			self.__do_stage_patch_test__(patch, test)
+		elif patch.apply_patch(test, resident, redirect, in_place, fleet) != 0:
 			print "Failed to apply binary patch\n"
 			raise
 
@@ -235,6 +326,23 @@ class LivePatchTest:
 			print "Failed to list applied patches\n"
 			raise
 
+		if patch.scan_patch(test) != 0:
+			print "Applied patch wasn't found by scan\n"
+			raise
+
+	def __do_replace_patch_test__(self, patch, test):
+		if patch.replace_patch(test) != 0:
+			print "Failed to replace applied patch with itself\n"
+			raise
+
+		if patch.check_patch(test) != 0:
+			print "Replaced patch is not applied\n"
+			raise
+
+		if patch.list_patches(test) != 0:
+			print "Failed to list replaced patches\n"
+			raise
+
 	def __do_revert_patch_test__(self, patch, test):
 		res = patch.check_patch(test)
 		if res == errno.ENOENT:
@@ -253,6 +361,64 @@ class LivePatchTest:
 			raise
 
 
+	def __do_canary_patch_test__(self, patch, test, timing=False):
+		res = patch.check_patch(test)
+		if res == 0:
+			print "Patch is considered as applied"
+			raise
+		if res != errno.ENOENT:
+			print "Failed to check whether patch is applied"
+			raise
+
+		if patch.canary_patch(test, 50, timing) != 0:
+			print "Failed to apply binary patch with canary\n"
+			raise
+
+		# Both old function copy and new function are called meanwhile;
+		# the test checks every result it gets
+		time.sleep(0.5)
+		if not test.is_running():
+			print "Test process died with canary dispatch\n"
+			raise
+
+		if patch.canary_control(test) != 0:
+			print "Failed to read canary counters\n"
+			raise
+
+		if patch.canary_control(test, 100) != 0:
+			print "Failed to change canary share of calls\n"
+			raise
+
+		self.__do_revert_patch_test__(patch, test)
+
+		if patch.canary_control(test) == 0:
+			print "Canary counters found after revert\n"
+			raise
+
+	def __do_probe_test__(self, patch, test):
+		# Probed function is called by the test threads all the time
+		func = "run_test"
+
+		if patch.probe(test, "attach", func) != 0:
+			print "Failed to attach probe\n"
+			raise
+
+		if patch.probe(test, "attach", func) == 0:
+			print "Probe successfully attached twise\n"
+			raise
+
+		if patch.probe(test, "report", func) != 0:
+			print "Failed to report probe\n"
+			raise
+
+		if patch.probe(test, "detach", func) != 0:
+			print "Failed to detach probe\n"
+			raise
+
+		if patch.probe(test, "detach", func) == 0:
+			print "Probe successfully detached twise\n"
+			raise
+
 	def __do_test__(self, test):
 		try:
 			bid = self.get_elf_bid(self.src_elf)
@@ -290,9 +456,53 @@ class LivePatchTest:
 
 		self.__do_apply_patch_test__(patch, test)
 
+		self.__do_replace_patch_test__(patch, test)
+
+		self.__do_revert_patch_test__(patch, test)
+
+		if patch.replace_patch(test) == 0:
+			print "Binary patch successfully replaced, while not applied\n"
+			raise
+
+		self.__do_apply_patch_test__(patch, test, redirect=True)
+
+		self.__do_revert_patch_test__(patch, test)
+
+		self.__do_apply_patch_test__(patch, test, in_place=True)
+
+		self.__do_revert_patch_test__(patch, test)
+
+		if self.fleet:
+			self.__do_apply_patch_test__(patch, test, fleet=True)
+
+			self.__do_revert_patch_test__(patch, test)
+
+		self.__do_canary_patch_test__(patch, test)
+
+		self.__do_canary_patch_test__(patch, test, timing=True)
+
+		self.__do_probe_test__(patch, test)
+
+		if not self.no_plugin:
+			self.__do_apply_patch_test__(patch, test, resident=True)
+
+			self.__do_revert_patch_test__(patch, test)
+
+		self.__do_apply_patch_test__(patch, test, staged=True)
+
 		return
 
 	def run(self):
+		# Fleet test patches all the processes with the target, including
+		# other tests ones: it runs alone, while the others share the lock
+		lock = open(self.tests_dir + "fleet.lock", "w")
+		fcntl.flock(lock, fcntl.LOCK_EX if self.fleet else fcntl.LOCK_SH)
+		try:
+			return self.__run__()
+		finally:
+			lock.close()
+
+	def __run__(self):
 		print "Starting test %s" % self.test_bin
 		test = Test(self.test_bin, self.test_type)
 